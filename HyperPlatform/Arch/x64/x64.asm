@@ -26,6 +26,33 @@ VMX_ERROR_WITHOUT_STATUS    EQU     2
 KTRAP_FRAME_SIZE            EQU     190h
 MACHINE_FRAME_SIZE          EQU     28h
 
+; Offsets checked by static_assert in vmm.cpp and exit_profile.h
+VMM_STACK_PROCESSOR_DATA    EQU     210h    ; VmmInitialStack::processor_data
+PROCESSOR_DATA_EXIT_PROFILE EQU     28h     ; ProcessorData::exit_profile
+EXIT_PROFILE_RESUME_TSC     EQU     0h      ; ExitProfile::resume_tsc
+PROCESSOR_DATA_FAST_EXIT_REASONS EQU 30h    ; ProcessorData::fast_exit_reasons
+
+; VmmInitialStack::processor_data relative to the VMM stack pointer on VM-exit;
+; VMM_STACK_PROCESSOR_DATA - 80h - (KTRAP_FRAME_SIZE - MACHINE_FRAME_SIZE)
+VMM_ENTRY_PROCESSOR_DATA    EQU     28h
+
+; VmcsField
+VMCS_EXIT_REASON            EQU     4402h
+VMCS_EXIT_INSTRUCTION_LEN   EQU     440ch
+VMCS_GUEST_RIP              EQU     681eh
+VMCS_GUEST_RFLAGS           EQU     6820h
+
+; VmxExitReason
+EXIT_REASON_CPUID           EQU     10
+EXIT_REASON_RDTSC           EQU     16
+EXIT_REASON_VMCALL          EQU     18
+EXIT_REASON_RDTSCP          EQU     51
+EXIT_REASON_XSETBV          EQU     55
+
+HYPERCALL_PING_VMM          EQU     1       ; HypercallNumber::kPingVmm
+RFLAGS_TF_BIT               EQU     8
+RFLAGS_VMCALL_STATUS        EQU     8d5h    ; CF, PF, AF, ZF, SF and OF
+
 ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 ;
 ; macros
@@ -134,6 +161,112 @@ asmResumeVm:
     ret
 AsmInitializeVm ENDP
 
+; void __stdcall AsmVmmFastEntryPoint();
+AsmVmmFastEntryPoint PROC
+    ; Handles trivial VM-exits without saving all registers or calling
+    ; VmmVmExitHandler(), and jumps to AsmVmmEntryPoint for the others. Each
+    ; handler does what its counterpart in vmm.cpp does. Guest's registers
+    ; other than R8 and R9 stay in place, and those are restored from the stack.
+    push r9
+    push r8
+
+    ; Take the full path unless the reason is in fast_exit_reasons
+    mov r8, VMCS_EXIT_REASON
+    vmread r9, r8
+    cmp r9, 63
+    ja fullPath             ; also when the VM-entry failure bit is set
+    mov r8, [rsp + 10h + VMM_ENTRY_PROCESSOR_DATA]
+    mov r8, [r8 + PROCESSOR_DATA_FAST_EXIT_REASONS]
+    bt r8, r9
+    jnc fullPath            ; if (!(fast_exit_reasons & (1 << reason)))
+
+    ; Leave single-stepping to the full path, which injects #DB
+    mov r8, VMCS_GUEST_RFLAGS
+    vmread r8, r8           ; r8 = guest's rflags
+    bt r8, RFLAGS_TF_BIT
+    jc fullPath
+
+    cmp r9d, EXIT_REASON_CPUID
+    je handleCpuid
+    cmp r9d, EXIT_REASON_RDTSC
+    je handleRdtsc
+    cmp r9d, EXIT_REASON_RDTSCP
+    je handleRdtscp
+    cmp r9d, EXIT_REASON_XSETBV
+    je handleXsetbv
+    cmp r9d, EXIT_REASON_VMCALL
+    je handleVmcall
+    jmp fullPath            ; no fast handler for the reason
+
+handleCpuid:
+    ; Same as VmmpHandleCpuid: fake leaf 0 and hide the hypervisor bit
+    test eax, eax
+    jz cpuidLeaf0
+    cmp eax, 1
+    je cpuidLeaf1
+    cpuid
+    jmp advanceIp
+
+cpuidLeaf0:
+    mov eax, 16
+    mov ebx, 756e6547h      ; "Genu"
+    mov ecx, 6c65746eh      ; "ntel"
+    mov edx, 49656e69h      ; "ineI"
+    jmp advanceIp
+
+cpuidLeaf1:
+    cpuid
+    btr ecx, 31             ; HypervisorPresent = 0
+    jmp advanceIp
+
+handleRdtsc:
+    rdtsc
+    jmp advanceIp
+
+handleRdtscp:
+    rdtscp
+    jmp advanceIp
+
+handleXsetbv:
+    xsetbv
+    jmp advanceIp
+
+handleVmcall:
+    ; Only kPingVmm; indicate success without logging "Pong"
+    cmp rcx, HYPERCALL_PING_VMM
+    jne fullPath
+    and r8, NOT RFLAGS_VMCALL_STATUS
+    mov r9, VMCS_GUEST_RFLAGS
+    vmwrite r9, r8
+
+advanceIp:
+    mov r8, VMCS_EXIT_INSTRUCTION_LEN
+    vmread r9, r8
+    mov r8, VMCS_GUEST_RIP
+    vmread r8, r8
+    add r8, r9
+    mov r9, VMCS_GUEST_RIP
+    vmwrite r9, r8          ; guest's rip += instruction length
+    pop r8
+    pop r9
+    vmresume
+
+    ; Diagnose a critical error as AsmVmmEntryPoint does
+    pushfq
+    PUSHAQ                      ; -8 * 16
+    mov rcx, rsp                ; all_regs
+
+    sub rsp, 28h                ; 28h for alignment
+    call VmmVmxFailureHandler   ; VmmVmxFailureHandler(all_regs);
+    add rsp, 28h
+    int 3
+
+fullPath:
+    pop r8
+    pop r9
+    jmp AsmVmmEntryPoint
+AsmVmmFastEntryPoint ENDP
+
 ; void __stdcall AsmVmmEntryPoint();
 AsmVmmEntryPoint PROC FRAME
     ; In oder for Windbg to display the stack trace of the guest while the
@@ -172,6 +305,11 @@ AsmVmmEntryPoint PROC FRAME
     PUSHAQ                  ; -8 * 16
     mov rcx, rsp            ; save the "stack" parameter for VmmVmExitHandler
 
+    ; Read TSC for the VM-exit profiler as soon as RAX and RDX are saved
+    rdtsc
+    shl rdx, 32
+    or rdx, rax             ; save the "entry_tsc" parameter
+
     ; save volatile XMM registers
     sub rsp, 68h            ; 8 for alignment
     movaps xmmword ptr [rsp +  0h], xmm0
@@ -187,7 +325,8 @@ AsmVmmEntryPoint PROC FRAME
     ; by the FRAME attribute.
     .ENDPROLOG
 
-    call VmmVmExitHandler   ; bool vm_continue = VmmVmExitHandler(stack);
+    call VmmVmExitHandler   ; bool vm_continue =
+                            ;     VmmVmExitHandler(stack, entry_tsc);
     add rsp, 20h
 
     ; restore XMM registers
@@ -202,6 +341,18 @@ AsmVmmEntryPoint PROC FRAME
     test al, al
     jz exitVm               ; if (!vm_continue) jmp exitVm
 
+    ; Record TSC for the VM-exit profiler if enabled. Guest's RAX, RCX and RDX
+    ; are restored by POPAQ.
+    mov rcx, [rsp + VMM_STACK_PROCESSOR_DATA]
+    mov rcx, [rcx + PROCESSOR_DATA_EXIT_PROFILE]
+    test rcx, rcx
+    jz resumeVm             ; if (!processor_data->exit_profile) jmp resumeVm
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    mov [rcx + EXIT_PROFILE_RESUME_TSC], rax
+
+resumeVm:
     POPAQ
     vmresume
     jmp vmxError
@@ -43,6 +43,10 @@ bool __stdcall AsmInitializeVm(
 /// An entry point of VMM where gets called whenever VM-exit occurred.
 void __stdcall AsmVmmEntryPoint();
 
+/// An entry point of VMM that handles VM-exits of reasons in
+/// ProcessorData::fast_exit_reasons, and jumps to AsmVmmEntryPoint otherwise.
+void __stdcall AsmVmmFastEntryPoint();
+
 /// Executes VMCALL with the given hypercall number and a context.
 /// @param hypercall_number   A hypercall number
 /// @param context  A context parameter for VMCALL
@@ -89,6 +89,21 @@
 /// negative performance impact.
 #define HYPERPLATFORM_PERFORMANCE_ENABLE_PERFCOUNTER 0
 
+/// Selects a clock of performance monitoring
+///
+/// When set to non 0, #HYPERPLATFORM_PERFORMANCE_MEASURE_THIS_SCOPE() reads
+/// TSC if it is invariant, and KeQueryPerformanceCounter() otherwise. When set
+/// to 0, it always reads KeQueryPerformanceCounter(), which may access HPET or
+/// ACPI PM timer and costs microseconds on some platforms.
+#define HYPERPLATFORM_PERFORMANCE_USE_TSC 1
+
+/// Enable or disable the VM-exit profiler
+///
+/// Counts VM-exits and their cycles from the entry of the VMM to VMRESUME by
+/// exit reasons when set to non 0. Results are logged at unload and returned
+/// by IOCTL_HYPER_PERF_SNAPSHOT. TSC is read twice per VM-exit regardless.
+#define HYPERPLATFORM_PERFORMANCE_ENABLE_EXIT_PROFILE 0
+
 /// A pool tag
 static constexpr ULONG kHyperPlatformCommonPoolTag = 'PpyH';
 
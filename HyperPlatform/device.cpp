@@ -1,10 +1,187 @@
 #include"device.h"
 #include"window.h"
 #include"settings.h"
+#include"systemcall.h"
+#include"trace.h"
+#include"syscall_aggregate.h"
+#include"syscall_args.h"
+#include"syscall_sampling.h"
+#include"shared_ring.h"
+#include"performance.h"
+#include"vm.h"
 
 static UNICODE_STRING uDevice = RTL_CONSTANT_STRING(DEVICE_NAME);
 static UNICODE_STRING uSymbol = RTL_CONSTANT_STRING(DOS_DEVICE_NAME);
 
+static NTSTATUS HyperSyscallFilterControl(PVOID ioBuffer, ULONG inputBufferLength)
+{
+	if (!ioBuffer || inputBufferLength < sizeof(HYPER_SYSCALL_FILTER_REQUEST))
+		return STATUS_INVALID_PARAMETER;
+
+	auto request = (PHYPER_SYSCALL_FILTER_REQUEST)ioBuffer;
+	switch (request->Operation)
+	{
+		case HYPER_SYSCALL_FILTER_SELECT_ALL:
+			SyscallFilterSelectAll();
+			return STATUS_SUCCESS;
+		case HYPER_SYSCALL_FILTER_CLEAR_ALL:
+			SyscallFilterClearAll();
+			return STATUS_SUCCESS;
+		case HYPER_SYSCALL_FILTER_SELECT:
+		case HYPER_SYSCALL_FILTER_DESELECT:
+			if (request->Index >= SYSCALL_FILTER_INDEX_COUNT)
+				return STATUS_INVALID_PARAMETER;
+			SyscallFilterSelect(request->Index, request->Operation == HYPER_SYSCALL_FILTER_SELECT);
+			return STATUS_SUCCESS;
+		case HYPER_SYSCALL_FILTER_SET_PROCESS:
+			return SyscallFilterSetProcess((HANDLE)request->ProcessId);
+	}
+	return STATUS_INVALID_PARAMETER;
+}
+
+// Only SNAPSHOT is allowed unless the request came through a control code
+// requiring write access
+static NTSTATUS HyperSyscallAggregateControl(PVOID ioBuffer, ULONG inputBufferLength,
+	ULONG outputBufferLength, PULONG_PTR information, BOOLEAN writable)
+{
+	if (!ioBuffer || inputBufferLength < sizeof(HYPER_SYSCALL_AGGREGATE_REQUEST))
+		return STATUS_INVALID_PARAMETER;
+
+	auto request = (PHYPER_SYSCALL_AGGREGATE_REQUEST)ioBuffer;
+	const auto operation = request->Operation;
+	if (!writable && operation != HYPER_SYSCALL_AGGREGATE_SNAPSHOT)
+		return STATUS_ACCESS_DENIED;
+	switch (operation)
+	{
+		case HYPER_SYSCALL_AGGREGATE_SNAPSHOT:
+		case HYPER_SYSCALL_AGGREGATE_SNAPSHOT_AND_RESET:
+			*information = SyscallAggregateSnapshot(ioBuffer, outputBufferLength);
+			if (!*information)
+				return STATUS_BUFFER_TOO_SMALL;
+			if (operation == HYPER_SYSCALL_AGGREGATE_SNAPSHOT_AND_RESET)
+				SyscallAggregateReset();
+			return STATUS_SUCCESS;
+		case HYPER_SYSCALL_AGGREGATE_RESET:
+			SyscallAggregateReset();
+			return STATUS_SUCCESS;
+		case HYPER_SYSCALL_AGGREGATE_SET_MODE:
+			if (request->Mode & ~SYSCALL_MODE_MASK)
+				return STATUS_INVALID_PARAMETER;
+			SyscallMode = request->Mode;
+			return STATUS_SUCCESS;
+	}
+	return STATUS_INVALID_PARAMETER;
+}
+
+// Operations resetting statistics are allowed only when the request came
+// through a control code requiring write access
+static NTSTATUS HyperPerfControl(PVOID ioBuffer, ULONG inputBufferLength,
+	ULONG outputBufferLength, PULONG_PTR information, BOOLEAN writable)
+{
+	if (!ioBuffer || inputBufferLength < sizeof(HYPER_PERF_REQUEST))
+		return STATUS_INVALID_PARAMETER;
+
+	const auto operation = ((PHYPER_PERF_REQUEST)ioBuffer)->Operation;
+	if (!writable && (operation == HYPER_PERF_RESET ||
+		operation == HYPER_PERF_SNAPSHOT_AND_RESET ||
+		operation == HYPER_PERF_EXIT_SNAPSHOT_AND_RESET))
+		return STATUS_ACCESS_DENIED;
+	switch (operation)
+	{
+		case HYPER_PERF_SNAPSHOT:
+		case HYPER_PERF_SNAPSHOT_AND_RESET:
+			*information = PerfSnapshot(ioBuffer, outputBufferLength);
+			if (!*information)
+				return STATUS_BUFFER_TOO_SMALL;
+			if (operation == HYPER_PERF_SNAPSHOT_AND_RESET)
+				PerfReset();
+			return STATUS_SUCCESS;
+		case HYPER_PERF_EXIT_SNAPSHOT:
+		case HYPER_PERF_EXIT_SNAPSHOT_AND_RESET:
+			*information = PerfExitSnapshot(ioBuffer, outputBufferLength);
+			if (!*information)
+				return STATUS_BUFFER_TOO_SMALL;
+			if (operation == HYPER_PERF_EXIT_SNAPSHOT_AND_RESET)
+				PerfExitReset();
+			return STATUS_SUCCESS;
+		case HYPER_PERF_FOLDED_STACKS:
+			*information = PerfFoldedStacks((char*)ioBuffer, outputBufferLength);
+			return STATUS_SUCCESS;
+		case HYPER_PERF_RESET:
+			PerfReset();
+			PerfExitReset();
+			return STATUS_SUCCESS;
+	}
+	return STATUS_INVALID_PARAMETER;
+}
+
+static NTSTATUS HyperTraceSamplingControl(PVOID ioBuffer, ULONG inputBufferLength,
+	ULONG outputBufferLength, PULONG_PTR information, BOOLEAN update)
+{
+	if (!ioBuffer)
+		return STATUS_INVALID_PARAMETER;
+
+	if (update)
+	{
+		if (inputBufferLength < sizeof(SYSCALL_SAMPLING_CONFIG))
+			return STATUS_INVALID_PARAMETER;
+		auto status = SyscallSamplingSetConfig((PSYSCALL_SAMPLING_CONFIG)ioBuffer);
+		if (!NT_SUCCESS(status))
+			return status;
+	}
+	else if (inputBufferLength)
+		return STATUS_INVALID_PARAMETER;
+
+	if (outputBufferLength >= sizeof(SYSCALL_SAMPLING_CONFIG))
+	{
+		SyscallSamplingGetConfig((PSYSCALL_SAMPLING_CONFIG)ioBuffer);
+		*information = sizeof(SYSCALL_SAMPLING_CONFIG);
+	}
+	else if (!update)
+		return STATUS_BUFFER_TOO_SMALL;
+	return STATUS_SUCCESS;
+}
+
+static NTSTATUS HyperVmcsControlsControl(PVOID ioBuffer, ULONG inputBufferLength,
+	ULONG outputBufferLength, PULONG_PTR information, BOOLEAN update)
+{
+	if (!ioBuffer)
+		return STATUS_INVALID_PARAMETER;
+
+	if (update)
+	{
+		if (inputBufferLength < sizeof(HYPER_VMCS_CONTROLS_REQUEST))
+			return STATUS_INVALID_PARAMETER;
+
+		auto request = (PHYPER_VMCS_CONTROLS_REQUEST)ioBuffer;
+		VmExitingControlsUpdate controlsUpdate = {
+			{request->ProcBasedSet, request->SecondaryProcBasedSet, request->ExceptionBitmapSet},
+			{request->ProcBasedClear, request->SecondaryProcBasedClear, request->ExceptionBitmapClear}};
+		auto status = VmUpdateExitingControls(&controlsUpdate);
+		if (!NT_SUCCESS(status))
+			return status;
+	}
+	else if (inputBufferLength)
+		return STATUS_INVALID_PARAMETER;
+
+	if (outputBufferLength >= sizeof(HYPER_VMCS_CONTROLS))
+	{
+		VmExitingControls switchable = {}, current = {};
+		VmGetExitingControls(&switchable, &current);
+		auto controls = (PHYPER_VMCS_CONTROLS)ioBuffer;
+		controls->ProcBased = current.procctl;
+		controls->SecondaryProcBased = current.procctl2;
+		controls->ExceptionBitmap = current.exception_bitmap;
+		controls->SwitchableProcBased = switchable.procctl;
+		controls->SwitchableSecondaryProcBased = switchable.procctl2;
+		controls->SwitchableExceptionBitmap = switchable.exception_bitmap;
+		*information = sizeof(HYPER_VMCS_CONTROLS);
+	}
+	else if (!update)
+		return STATUS_BUFFER_TOO_SMALL;
+	return STATUS_SUCCESS;
+}
+
 NTSTATUS HyperInitDeviceAll(PDRIVER_OBJECT DriverObject)
 {
 #if 0
@@ -15,7 +192,7 @@ NTSTATUS HyperInitDeviceAll(PDRIVER_OBJECT DriverObject)
 
 	DriverObject->MajorFunction[IRP_MJ_DEVICE_CONTROL] = HyperDispatchControl;
 	DriverObject->MajorFunction[IRP_MJ_CREATE] = HyperDispatchThunk;
-	DriverObject->MajorFunction[IRP_MJ_CLEANUP] = HyperDispatchThunk;
+	DriverObject->MajorFunction[IRP_MJ_CLEANUP] = HyperDispatchCleanup;
 
 	Status = IoCreateDevice(
 		DriverObject,
@@ -88,12 +265,97 @@ NTSTATUS HyperDispatchControl(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
 			AttackWindowTable();
 #endif // HIDE_WINDOW
 			break;
+		case IOCTL_HYPER_SYSCALL_FILTER:
+			status = HyperSyscallFilterControl(ioBuffer, inputBufferLength);
+			break;
+		case IOCTL_HYPER_TRACE_READ:
+			if (ioBuffer)
+				Irp->IoStatus.Information = TraceRead(ioBuffer, outputBufferLength);
+			break;
+		case IOCTL_HYPER_SYSCALL_LATENCY:
+			if (!ioBuffer)
+				break;
+			Irp->IoStatus.Information = SyscallLatencyRead(
+				inputBufferLength >= sizeof(ULONG) ? *(PULONG)ioBuffer : 0,
+				ioBuffer, outputBufferLength);
+			break;
+		case IOCTL_HYPER_SYSCALL_AGGREGATE:
+			status = HyperSyscallAggregateControl(ioBuffer, inputBufferLength,
+				outputBufferLength, &Irp->IoStatus.Information, FALSE);
+			break;
+		case IOCTL_HYPER_SYSCALL_AGGREGATE_CONTROL:
+			status = HyperSyscallAggregateControl(ioBuffer, inputBufferLength,
+				outputBufferLength, &Irp->IoStatus.Information, TRUE);
+			break;
+		case IOCTL_HYPER_SYSCALL_ARGS:
+			if (!ioBuffer || inputBufferLength < sizeof(SYSCALL_ARG_SCHEMA_REQUEST))
+			{
+				status = STATUS_INVALID_PARAMETER;
+				break;
+			}
+			status = SyscallArgsSetSchema(((PSYSCALL_ARG_SCHEMA_REQUEST)ioBuffer)->Index,
+				&((PSYSCALL_ARG_SCHEMA_REQUEST)ioBuffer)->Schema);
+			break;
+		case IOCTL_HYPER_SYSCALL_NAMES:
+			if (!ioBuffer)
+				break;
+			Irp->IoStatus.Information = SyscallServiceRead(
+				inputBufferLength >= sizeof(ULONG) ? *(PULONG)ioBuffer : 0,
+				ioBuffer, outputBufferLength);
+			break;
+		case IOCTL_HYPER_TRACE_SAMPLING:
+			status = HyperTraceSamplingControl(ioBuffer, inputBufferLength,
+				outputBufferLength, &Irp->IoStatus.Information, TRUE);
+			break;
+		case IOCTL_HYPER_TRACE_SAMPLING_QUERY:
+			status = HyperTraceSamplingControl(ioBuffer, inputBufferLength,
+				outputBufferLength, &Irp->IoStatus.Information, FALSE);
+			break;
+		case IOCTL_HYPER_SHARED_RING_MAP:
+			if (!ioBuffer || outputBufferLength < sizeof(SharedRingMapping))
+			{
+				status = STATUS_BUFFER_TOO_SMALL;
+				break;
+			}
+			if (inputBufferLength >= sizeof(SharedRingMapRequest) &&
+				((SharedRingMapRequest*)ioBuffer)->reserved)
+			{
+				status = STATUS_INVALID_PARAMETER;
+				break;
+			}
+			status = SharedRingMap(irpStack->FileObject,
+				inputBufferLength >= sizeof(SharedRingMapRequest) ?
+					((SharedRingMapRequest*)ioBuffer)->mode : kSharedRingModeMirror,
+				(SharedRingMapping*)ioBuffer);
+			if (NT_SUCCESS(status))
+				Irp->IoStatus.Information = sizeof(SharedRingMapping);
+			break;
+		case IOCTL_HYPER_SHARED_RING_UNMAP:
+			status = SharedRingUnmap(irpStack->FileObject);
+			break;
+		case IOCTL_HYPER_PERF_SNAPSHOT:
+			status = HyperPerfControl(ioBuffer, inputBufferLength,
+				outputBufferLength, &Irp->IoStatus.Information, FALSE);
+			break;
+		case IOCTL_HYPER_PERF_CONTROL:
+			status = HyperPerfControl(ioBuffer, inputBufferLength,
+				outputBufferLength, &Irp->IoStatus.Information, TRUE);
+			break;
+		case IOCTL_HYPER_VMCS_CONTROLS:
+			status = HyperVmcsControlsControl(ioBuffer, inputBufferLength,
+				outputBufferLength, &Irp->IoStatus.Information, TRUE);
+			break;
+		case IOCTL_HYPER_VMCS_CONTROLS_QUERY:
+			status = HyperVmcsControlsControl(ioBuffer, inputBufferLength,
+				outputBufferLength, &Irp->IoStatus.Information, FALSE);
+			break;
 		
 	}
 
 
 
 
+	Irp->IoStatus.Status = status;
 	IoCompleteRequest(Irp, IO_NO_INCREMENT);
 	return status;
 }
@@ -103,4 +365,11 @@ NTSTATUS HyperDispatchThunk(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
 	Irp->IoStatus.Status = STATUS_SUCCESS;
 	IoCompleteRequest(Irp, IO_NO_INCREMENT);
 	return STATUS_SUCCESS;
+}
+
+NTSTATUS HyperDispatchCleanup(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
+{
+	// Unmap the shared ring when the handle it was mapped through is closed
+	SharedRingUnmap(IoGetCurrentIrpStackLocation(Irp)->FileObject);
+	return HyperDispatchThunk(DeviceObject, Irp);
 }
\ No newline at end of file
@@ -9,6 +9,108 @@
 
 #define IOCTL_HYPER_TOOL_TEST (ULONG)CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80E, METHOD_BUFFERED, FILE_READ_ACCESS)
 #define IOCTL_HYPER_HIDE_WINDOW (ULONG)CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80E+1, METHOD_BUFFERED, FILE_READ_ACCESS)
+//HYPER_SYSCALL_FILTER_REQUESTв޸ĹλͼĿ̣ҪдȨ
+#define IOCTL_HYPER_SYSCALL_FILTER (ULONG)CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80E+2, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+//trace¼ÿ¼TraceRecordHeaderͷ
+#define IOCTL_HYPER_TRACE_READ (ULONG)CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80E+3, METHOD_BUFFERED, FILE_READ_ACCESS)
+//ULONGʼindexÿindexULONG[SYSCALL_LATENCY_BUCKETS]
+#define IOCTL_HYPER_SYSCALL_LATENCY (ULONG)CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80E+4, METHOD_BUFFERED, FILE_READ_ACCESS)
+//HYPER_SYSCALL_AGGREGATE_REQUESTֻSNAPSHOTSYSCALL_AGGREGATE_SNAPSHOT
+#define IOCTL_HYPER_SYSCALL_AGGREGATE (ULONG)CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80E+5, METHOD_BUFFERED, FILE_READ_ACCESS)
+//SYSCALL_ARG_SCHEMA_REQUESTһindexĲ񣬻̵û̬дtraceҪдȨ
+#define IOCTL_HYPER_SYSCALL_ARGS (ULONG)CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80E+6, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+//ULONGʼSYSCALL_SERVICE_ENTRY飬SSDTShadowSSDT
+#define IOCTL_HYPER_SYSCALL_NAMES (ULONG)CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80E+7, METHOD_BUFFERED, FILE_READ_ACCESS)
+//SYSCALL_SAMPLING_CONFIGòúSYSCALL_SAMPLING_CONFIGҪдȨ
+#define IOCTL_HYPER_TRACE_SAMPLING (ULONG)CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80E+8, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+//ѡSharedRingMapRequestѡģʽ(ĬϾ)ѹӳ䵽ỵ́SharedRingMappingּshared_ring_format.h
+//־trace¼ں˵̵ַϵͳòҪдȨ
+#define IOCTL_HYPER_SHARED_RING_MAP (ULONG)CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80E+9, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+//ӳ䣬رվʱҲԶ
+#define IOCTL_HYPER_SHARED_RING_UNMAP (ULONG)CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80E+10, METHOD_BUFFERED, FILE_READ_ACCESS)
+//HYPER_PERF_REQUESTʱPerfSnapshotHeaderPerfSnapshotEntry飬ּperf_snapshot_format.h
+//ֻܲͳƵĲIOCTL_HYPER_PERF_CONTROL
+#define IOCTL_HYPER_PERF_SNAPSHOT (ULONG)CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80E+11, METHOD_BUFFERED, FILE_READ_ACCESS)
+//HYPER_VMCS_CONTROLS_REQUESTк޸VM-exitƣ޸ĺHYPER_VMCS_CONTROLSҪдȨ
+#define IOCTL_HYPER_VMCS_CONTROLS (ULONG)CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80E+12, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+//룬ǰHYPER_VMCS_CONTROLS
+#define IOCTL_HYPER_VMCS_CONTROLS_QUERY (ULONG)CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80E+13, METHOD_BUFFERED, FILE_READ_ACCESS)
+//HYPER_SYSCALL_AGGREGATE_REQUESTвRESETSET_MODEֻͨҪдȨ
+#define IOCTL_HYPER_SYSCALL_AGGREGATE_CONTROL (ULONG)CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80E+14, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+//룬ǰSYSCALL_SAMPLING_CONFIG
+#define IOCTL_HYPER_TRACE_SAMPLING_QUERY (ULONG)CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80E+15, METHOD_BUFFERED, FILE_READ_ACCESS)
+//HYPER_PERF_REQUESTвRESET*_AND_RESETֻͨҪдȨ
+#define IOCTL_HYPER_PERF_CONTROL (ULONG)CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80E+16, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+
+//
+//IOCTL_HYPER_SYSCALL_FILTERĲ
+//
+#define HYPER_SYSCALL_FILTER_SELECT_ALL 0
+#define HYPER_SYSCALL_FILTER_CLEAR_ALL 1
+#define HYPER_SYSCALL_FILTER_SELECT 2
+#define HYPER_SYSCALL_FILTER_DESELECT 3
+#define HYPER_SYSCALL_FILTER_SET_PROCESS 4
+
+typedef struct _HYPER_SYSCALL_FILTER_REQUEST
+{
+	ULONG Operation;		//HYPER_SYSCALL_FILTER_*
+	ULONG Index;			//SSDT index, 0x1000shadow ssdt
+	ULONG_PTR ProcessId;	//SET_PROCESSʱʹã0ʾн
+} HYPER_SYSCALL_FILTER_REQUEST, * PHYPER_SYSCALL_FILTER_REQUEST;
+
+//
+//IOCTL_HYPER_SYSCALL_AGGREGATEIOCTL_HYPER_SYSCALL_AGGREGATE_CONTROLĲ
+//
+#define HYPER_SYSCALL_AGGREGATE_SNAPSHOT 0
+#define HYPER_SYSCALL_AGGREGATE_RESET 1
+#define HYPER_SYSCALL_AGGREGATE_SNAPSHOT_AND_RESET 2
+#define HYPER_SYSCALL_AGGREGATE_SET_MODE 3
+
+typedef struct _HYPER_SYSCALL_AGGREGATE_REQUEST
+{
+	ULONG Operation;	//HYPER_SYSCALL_AGGREGATE_*
+	ULONG Mode;			//SET_MODEʱʹãSYSCALL_MODE_*
+} HYPER_SYSCALL_AGGREGATE_REQUEST, * PHYPER_SYSCALL_AGGREGATE_REQUEST;
+
+//
+//IOCTL_HYPER_PERF_SNAPSHOTIOCTL_HYPER_PERF_CONTROLĲ
+//
+#define HYPER_PERF_SNAPSHOT 0
+#define HYPER_PERF_RESET 1			//ͬʱVM-exitͳ
+#define HYPER_PERF_SNAPSHOT_AND_RESET 2
+#define HYPER_PERF_EXIT_SNAPSHOT 3	//PerfExitSnapshotEntry飬ҪHYPERPLATFORM_PERFORMANCE_ENABLE_EXIT_PROFILE
+#define HYPER_PERF_EXIT_SNAPSHOT_AND_RESET 4
+#define HYPER_PERF_FOLDED_STACKS 5	//flamegraph.plʹõfoldedʽı
+
+typedef struct _HYPER_PERF_REQUEST
+{
+	ULONG Operation;	//HYPER_PERF_*
+} HYPER_PERF_REQUEST, * PHYPER_PERF_REQUEST;
+
+//
+//IOCTL_HYPER_VMCS_CONTROLSIOCTL_HYPER_VMCS_CONTROLS_QUERY
+//λĶͬVMCSprimary/secondary processor-based controlsexception bitmap
+//ֻ޸Switchableеλ֧ʱSTATUS_NOT_SUPPORTED
+//
+typedef struct _HYPER_VMCS_CONTROLS_REQUEST
+{
+	ULONG ProcBasedSet;				//1λ
+	ULONG ProcBasedClear;			//0λ
+	ULONG SecondaryProcBasedSet;
+	ULONG SecondaryProcBasedClear;
+	ULONG ExceptionBitmapSet;
+	ULONG ExceptionBitmapClear;
+} HYPER_VMCS_CONTROLS_REQUEST, * PHYPER_VMCS_CONTROLS_REQUEST;
+
+typedef struct _HYPER_VMCS_CONTROLS
+{
+	ULONG ProcBased;				//ǰЧλ
+	ULONG SecondaryProcBased;
+	ULONG ExceptionBitmap;
+	ULONG SwitchableProcBased;		//޸ĵλ
+	ULONG SwitchableSecondaryProcBased;
+	ULONG SwitchableExceptionBitmap;
+} HYPER_VMCS_CONTROLS, * PHYPER_VMCS_CONTROLS;
 
 NTSTATUS HyperInitDeviceAll(PDRIVER_OBJECT DriverObject);
 
@@ -16,4 +118,6 @@ NTSTATUS HyperDispatchControl(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp);
 
 NTSTATUS HyperDestroyDeviceAll(PDRIVER_OBJECT DriverObject);
 
-NTSTATUS HyperDispatchThunk(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp);
\ No newline at end of file
+NTSTATUS HyperDispatchThunk(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp);
+
+NTSTATUS HyperDispatchCleanup(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp);
\ No newline at end of file
@@ -19,6 +19,13 @@
 #include "vm.h"
 #include "performance.h"
 #include "systemcall.h"
+#include "trace.h"
+#include "syscall_aggregate.h"
+#include "syscall_args.h"
+#include "syscall_sampling.h"
+#include "trace_file.h"
+#include "perf_file.h"
+#include "shared_ring.h"
 #include "settings.h"
 #include"include/global.hpp"
 #include"service_hook.h"
@@ -41,6 +48,7 @@ extern void DoSystemCallHook();
 extern NTSTATUS HookStatus;
 extern fpSystemCall SystemCallFake;
 extern char SystemCallRecoverCode[15];
+extern char SystemCallExitRecoverCode[15];
  
 extern "C" {
 ////////////////////////////////////////////////////////////////////////////////
@@ -69,10 +77,14 @@ static DRIVER_UNLOAD DriverpDriverUnload;
 
 _IRQL_requires_max_(PASSIVE_LEVEL) bool DriverpIsSuppoetedOS();
 
+_IRQL_requires_max_(PASSIVE_LEVEL) static void DriverpSyscallTermination(
+    _In_ PDRIVER_OBJECT driver_object);
+
 #if defined(ALLOC_PRAGMA)
 #pragma alloc_text(INIT, DriverEntry)
 #pragma alloc_text(PAGE, DriverpDriverUnload)
 #pragma alloc_text(INIT, DriverpIsSuppoetedOS)
+#pragma alloc_text(PAGE, DriverpSyscallTermination)
 #endif
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -93,8 +105,9 @@ _Use_decl_annotations_ NTSTATUS DriverEntry(PDRIVER_OBJECT driver_object,
 
   static const wchar_t kLogFilePath[] = L"\\SystemRoot\\HyperPlatform.log";
   static const auto kLogLevel =
-      (IsReleaseBuild()) ? kLogPutLevelInfo | kLogOptDisableFunctionName
-                         : kLogPutLevelDebug | kLogOptDisableFunctionName;
+      (IsReleaseBuild())
+          ? kLogPutLevelInfo | kLogOptDisableFunctionName | kLogOptDeferSafe
+          : kLogPutLevelDebug | kLogOptDisableFunctionName | kLogOptDeferSafe;
 
   auto status = STATUS_UNSUCCESSFUL;
   driver_object->DriverUnload = DriverpDriverUnload;
@@ -112,13 +125,35 @@ _Use_decl_annotations_ NTSTATUS DriverEntry(PDRIVER_OBJECT driver_object,
 
   if (!NT_SUCCESS(status))
   {
+      SyscallServiceTermination();
+      return STATUS_UNSUCCESSFUL;
+  }
+
+  status = TraceInitialization();
+  if (!NT_SUCCESS(status))
+  {
+      HyperDestroyDeviceAll(driver_object);
+      SyscallServiceTermination();
       return STATUS_UNSUCCESSFUL;
   }
 
+  //从这里开始的失败路径都要调用DriverpSyscallTermination
+
+  //失败的话trace不采样，全部记录
+  SyscallSamplingInitialization();
+
+  //失败的话只是不能映射共享环
+  SharedRingInitialization();
+
 
 #ifdef HOOK_SYSCALL 
   InitUserSystemCallHandler(SystemCallLog);
 
+  //失败的话只是不配对系统调用的返回
+  SyscallLatencyInitialization();
+  SyscallAggregateInitialization();
+  SyscallArgsInitialization();
+
   //是否要开启KiSystemCall64的hook
   DoSystemCallHook();
 
@@ -196,12 +231,14 @@ _Use_decl_annotations_ NTSTATUS DriverEntry(PDRIVER_OBJECT driver_object,
   if (status == STATUS_REINITIALIZATION_NEEDED) {
     need_reinitialization = true;
   } else if (!NT_SUCCESS(status)) {
+    DriverpSyscallTermination(driver_object);
     return status;
   }
 
   // Test if the system is supported
   if (!DriverpIsSuppoetedOS()) {
     LogTermination();
+    DriverpSyscallTermination(driver_object);
     return STATUS_CANCELLED;
   }
 
@@ -219,6 +256,7 @@ _Use_decl_annotations_ NTSTATUS DriverEntry(PDRIVER_OBJECT driver_object,
     //GlobalObjectTermination();
     _CRT_UNLOAD();
     LogTermination();
+    DriverpSyscallTermination(driver_object);
     return status;
   }
 
@@ -229,6 +267,7 @@ _Use_decl_annotations_ NTSTATUS DriverEntry(PDRIVER_OBJECT driver_object,
     //GlobalObjectTermination();
     _CRT_UNLOAD();
     LogTermination();
+    DriverpSyscallTermination(driver_object);
     return status;
   }
 
@@ -240,6 +279,7 @@ _Use_decl_annotations_ NTSTATUS DriverEntry(PDRIVER_OBJECT driver_object,
     //GlobalObjectTermination();
     _CRT_UNLOAD();
     LogTermination();
+    DriverpSyscallTermination(driver_object);
     return status;
   }
 
@@ -252,6 +292,7 @@ _Use_decl_annotations_ NTSTATUS DriverEntry(PDRIVER_OBJECT driver_object,
     //GlobalObjectTermination();
     _CRT_UNLOAD();
     LogTermination();
+    DriverpSyscallTermination(driver_object);
     return status;
   }
 
@@ -265,6 +306,7 @@ _Use_decl_annotations_ NTSTATUS DriverEntry(PDRIVER_OBJECT driver_object,
     //GlobalObjectTermination();
     _CRT_UNLOAD();
     LogTermination();
+    DriverpSyscallTermination(driver_object);
     return status;
   }
 
@@ -275,6 +317,18 @@ _Use_decl_annotations_ NTSTATUS DriverEntry(PDRIVER_OBJECT driver_object,
 
   HYPERPLATFORM_LOG_INFO("The VMM has been installed.");
 
+#ifdef TRACE_FILE
+  //失败的话trace还可以用IOCTL_HYPER_TRACE_READ读
+  static const wchar_t kTraceFilePath[] = L"\\SystemRoot\\HyperPlatform.trace";
+  TraceFileInitialization(kTraceFilePath);
+#endif
+
+#ifdef PERF_FILE
+  static const wchar_t kPerfFilePath[] = L"\\SystemRoot\\HyperPlatform.perf.csv";
+  static const auto kPerfFileIntervalMsec = 60 * 1000ul;
+  PerfFileInitialization(kPerfFilePath, kPerfFileIntervalMsec);
+#endif
+
   
 
 
@@ -296,21 +350,45 @@ _Use_decl_annotations_ static void DriverpDriverUnload(
   HotplugCallbackTermination();
   PowerCallbackTermination();
   UtilTermination();
+#ifdef PERF_FILE
+  PerfFileTermination();
+#endif
   PerfTermination();
   //GlobalObjectTermination();
   LogTermination();
+#ifdef TRACE_FILE
+  TraceFileTermination();
+#endif
+  DriverpSyscallTermination(driver_object);
+}
+
+// Undoes what DriverEntry sets up before LogInitialization(): the syscall
+// hooks and the trace, sampling and shared ring state behind them
+_Use_decl_annotations_ static void DriverpSyscallTermination(
+    PDRIVER_OBJECT driver_object) {
+  PAGED_CODE()
+
 #ifdef HOOK_SYSCALL
   auto irql = WPOFFx64();
   memcpy((PVOID)KiSystemServiceStart, SystemCallRecoverCode, sizeof(SystemCallRecoverCode));
+  memcpy((PVOID)KiSystemServiceExit, SystemCallExitRecoverCode, sizeof(SystemCallExitRecoverCode));
   WPONx64(irql);
+  SyscallLatencyTermination();
+  SyscallAggregateTermination();
+  SyscallArgsTermination();
   if (SystemCallFake.fp.PageContent)
       ExFreePool(SystemCallFake.fp.PageContent);
 #endif
+  SyscallFilterSetProcess(NULL);
 
 #ifdef SERVICE_HOOK
   RemoveServiceHook();
 #endif
 
+  SyscallServiceTermination();
+  SyscallSamplingTermination();
+  SharedRingTermination();
+  TraceTermination();
   HyperDestroyDeviceAll(driver_object);
 
 }
@@ -14,6 +14,7 @@
 #include "performance.h"
 #include "systemcall.h"
 #include "settings.h"
+#include "trace.h"
 #include"include/vector.hpp"
 #include"service_hook.h"
 
@@ -58,6 +59,9 @@ static const auto kEptpPtiShift = 12ull;
 // Use 9 bits; 0b0000_0000_0000_0000_0000_0000_0001_1111_1111
 static const auto kEptpPtxMask = 0x1ffull;
 
+// Whether EPT violations are emitted into the trace as TraceEptViolationRecord
+static const bool kEptpEnableTraceViolation = false;
+
 // How many EPT entries are preallocated. When the number exceeds it, the
 // hypervisor issues a bugcheck.
 static const auto kEptpNumberOfPreallocatedEntries = 50;
@@ -674,6 +678,18 @@ _Use_decl_annotations_ void EptHandleEptViolation(EptData *ept_data) {
           ? UtilVmRead(VmcsField::kGuestLinearAddress)
           : 0);
 
+  if (kEptpEnableTraceViolation) {
+    const auto record = reinterpret_cast<TraceEptViolationRecord *>(
+        TraceBegin(sizeof(TraceEptViolationRecord)));
+    if (record) {
+      record->guest_ip = UtilVmRead(VmcsField::kGuestRip);
+      record->physical_address = fault_pa;
+      record->linear_address = reinterpret_cast<ULONG64>(fault_va);
+      record->exit_qualification = exit_qualification.all;
+      TraceCommit(&record->header, kTraceRecordEptViolation);
+    }
+  }
+
   bool is_handled = false;
 
   //
@@ -0,0 +1,181 @@
+// Copyright (c) 2015-2019, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Declares interfaces to the VM-exit profiler.
+///
+/// The profiler measures each VM-exit from the entry of AsmVmmEntryPoint to
+/// right before VMRESUME in TSC cycles, and counts it under a key made of an
+/// exit reason and a sub-key: a CR number for kCrAccess, an MSR index for
+/// kMsrRead and kMsrWrite, and a leaf for kCpuid.
+///
+/// AsmVmmEntryPoint reads TSC on entry and passes it to VmmVmExitHandler(),
+/// which calls ExitProfileEnter(). Once the handler returns, the assembly code
+/// stores TSC to ExitProfile::resume_tsc just before VMRESUME. That exit is
+/// counted on the next ExitProfileEnter() on the processor, as no C code runs
+/// after that point.
+///
+/// @see performance.h
+
+#ifndef HYPERPLATFORM_EXIT_PROFILE_H_
+#define HYPERPLATFORM_EXIT_PROFILE_H_
+
+#include <ntddk.h>
+
+extern "C" {
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+/// A number of keys each processor can hold
+static const ULONG kExitProfileMaxEntries = 256;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+/// Data of a key on a processor
+struct ExitProfileEntry {
+  ULONG64 key;  //!< ExitProfileMakeKey(), or 0 if unused
+  ULONG64 total_execution_count;
+  ULONG64 total_elapsed_time;
+  ULONG64 min_elapsed_time;
+  ULONG64 max_elapsed_time;
+};
+
+/// Data of a processor. It is written only by its processor in VMX-root mode,
+/// and may be read by others at any time.
+///
+/// @warning
+/// resume_tsc is written by AsmVmmEntryPoint at a fixed offset.
+struct ExitProfile {
+  ULONG64 resume_tsc;   //!< TSC just before the last VMRESUME
+  ULONG64 entry_tsc;    //!< TSC at the entry of the last VM-exit
+  ULONG64 pending_key;  //!< A key of the last VM-exit, or 0 if unknown
+  volatile LONG64 dropped;  //!< VM-exits lost as the table was full
+  ExitProfileEntry entries[kExitProfileMaxEntries];
+};
+static_assert(FIELD_OFFSET(ExitProfile, resume_tsc) == 0, "Offset check");
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+/// Makes a key of a VM-exit
+/// @param reason   VmxExitReason
+/// @param sub_key  A CR number, an MSR index, a CPUID leaf or 0
+/// @return A non-zero key
+inline ULONG64 ExitProfileMakeKey(_In_ ULONG reason, _In_ ULONG sub_key) {
+  return (static_cast<ULONG64>(reason + 1) << 32) | sub_key;
+}
+
+/// Returns VmxExitReason of a key made by ExitProfileMakeKey()
+inline ULONG ExitProfileGetReason(_In_ ULONG64 key) {
+  return static_cast<ULONG>(key >> 32) - 1;
+}
+
+/// Returns a sub-key of a key made by ExitProfileMakeKey()
+inline ULONG ExitProfileGetSubKey(_In_ ULONG64 key) {
+  return static_cast<ULONG>(key);
+}
+
+/// Finds an entry of a key with open addressing, or claims a free one
+/// @param profile  A profile to search
+/// @param key  A key to find
+/// @return An entry, or nullptr if the table is full
+inline ExitProfileEntry *ExitProfileFindEntry(_Inout_ ExitProfile *profile,
+                                              _In_ ULONG64 key) {
+  // Fibonacci hashing spreads keys differing only in upper bits, ie, reasons
+  const auto hash = static_cast<ULONG>((key * 0x9E3779B97F4A7C15ull) >> 32);
+  for (auto i = 0ul; i < kExitProfileMaxEntries; ++i) {
+    auto &entry = profile->entries[(hash + i) % kExitProfileMaxEntries];
+    if (entry.key == key) {
+      return &entry;
+    }
+    if (!entry.key) {
+      entry.key = key;
+      return &entry;
+    }
+  }
+  return nullptr;
+}
+
+/// Counts the previous VM-exit and starts measuring a new one
+/// @param profile  A profile of the current processor
+/// @param entry_tsc  TSC read at the entry of AsmVmmEntryPoint
+///
+/// The previous VM-exit is not counted when it ended with VMXOFF instead of
+/// VMRESUME, as resume_tsc is left older than entry_tsc.
+inline void ExitProfileEnter(_Inout_ ExitProfile *profile,
+                             _In_ ULONG64 entry_tsc) {
+  const auto key = profile->pending_key;
+  const auto begin = profile->entry_tsc;
+  const auto end = profile->resume_tsc;
+  profile->pending_key = 0;
+  profile->entry_tsc = entry_tsc;
+  if (!key || end < begin) {
+    return;
+  }
+
+  const auto entry = ExitProfileFindEntry(profile, key);
+  if (!entry) {
+    InterlockedIncrement64(&profile->dropped);
+    return;
+  }
+  const auto elapsed = end - begin;
+  if (!entry->total_execution_count || elapsed < entry->min_elapsed_time) {
+    entry->min_elapsed_time = elapsed;
+  }
+  if (elapsed > entry->max_elapsed_time) {
+    entry->max_elapsed_time = elapsed;
+  }
+  entry->total_elapsed_time += elapsed;
+  entry->total_execution_count++;
+}
+
+/// Sets a key of the current VM-exit
+/// @param profile  A profile of the current processor
+/// @param reason   VmxExitReason
+/// @param sub_key  A CR number, an MSR index, a CPUID leaf or 0
+inline void ExitProfileSetKey(_Inout_ ExitProfile *profile, _In_ ULONG reason,
+                              _In_ ULONG sub_key) {
+  profile->pending_key = ExitProfileMakeKey(reason, sub_key);
+}
+
+/// Clears data but keeps keys of a profile
+/// @param profile  A profile to clear
+///
+/// A VM-exit being counted on the processor at the same time may be lost or
+/// counted partially.
+inline void ExitProfileReset(_Inout_ ExitProfile *profile) {
+  for (auto &entry : profile->entries) {
+    entry.total_execution_count = 0;
+    entry.total_elapsed_time = 0;
+    entry.min_elapsed_time = 0;
+    entry.max_elapsed_time = 0;
+  }
+  profile->dropped = 0;
+}
+
+}  // extern "C"
+
+#endif  // HYPERPLATFORM_EXIT_PROFILE_H_
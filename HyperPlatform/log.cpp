@@ -8,6 +8,9 @@
 
 #include <ntifs.h>
 #include "log.h"
+#include <intrin.h>
+#include "shared_ring.h"
+#include "performance.h"
 
 // Tells the CRT not to use a inline version of CRT functions, which use
 // internal functions that lead to linker errors.
@@ -33,20 +36,59 @@ extern "C" {
 // constant and macro
 //
 
-// A size for log buffer in NonPagedPool. Two buffers are allocated with this
-// size. Exceeded logs are ignored silently. Make it bigger if a buffered log
-// size often reach this size.
-static const auto kLogpBufferSizeInPages = 16ul;
+// A size for log buffer in NonPagedPool. One buffer is allocated with this
+// size for each processor. Exceeded logs are ignored silently. Make it bigger
+// if a buffered log size often reach this size. Must be a power of two.
+static const auto kLogpBufferSizeInPages = 8ul;
 
 // An actual log buffer size in bytes.
 static const auto kLogpBufferSize = PAGE_SIZE * kLogpBufferSizeInPages;
 
-// A size that is usable for logging. Minus one because the last byte is kept
-// for \0.
-static const auto kLogpBufferUsableSize = kLogpBufferSize - 1;
+// Alignment of entries in a log buffer.
+static const auto kLogpEntryAlignment = 8ul;
 
-// An interval to flush buffered log entries into a log file.
-static const auto kLogpLogFlushIntervalMsec = 50;
+// The maximum number of arguments a deferred message can hold. A message with
+// more arguments is formatted immediately instead.
+static const auto kLogpMaxDeferredArguments = 16ul;
+
+// A size of a block to coalesce log entries into before writing them to a log
+// file. Must be a multiple of a sector size.
+static const auto kLogpFileBlockSize = 64 * 1024ul;
+
+// A unit to extend allocation of a log file by ahead of writes.
+static const auto kLogpFilePreallocationSize = 1024 * 1024ll;
+
+// Whether to write a log file bypassing the file system cache. Writes are
+// then rounded to sectors, and the last partial sector is rewritten with the
+// next entries.
+static const auto kLogpEnableUnbufferedIo = false;
+
+// The number of call sites to track for rate limiting. Must be a power of two.
+// Logs from call sites that do not fit in are never limited.
+static const auto kLogpCallSiteCount = 512ul;
+
+// The number of slots to probe to find a call site.
+static const auto kLogpCallSiteProbeCount = 8ul;
+
+// A rate of messages allowed for each call site per second on average
+static const auto kLogpRateLimitPerSecond = 100ll;
+
+// The number of messages allowed for each call site in a burst
+static const auto kLogpRateLimitBurst = 200ll;
+
+// The number of characters of a string argument hashed at most to coalesce
+// messages. Longer strings do not fit in a message anyway.
+static const auto kLogpMaxHashedStringLength = 512ul;
+
+// Usage of a log buffer to wake up the log flush thread at.
+static const auto kLogpFlushWatermark = kLogpBufferSize / 2;
+
+// An interval to flush buffered log entries into a log file when no log
+// buffer reaches kLogpFlushWatermark.
+static const auto kLogpFlushIdleTimeoutMsec = 1000;
+
+// An interval to request flush while waiting for log buffers to be emptied.
+static const auto kLogpFlushWaitIntervalMsec = 100;
 
 static const ULONG kLogpPoolTag = ' gol';
 
@@ -55,24 +97,118 @@ static const ULONG kLogpPoolTag = ' gol';
 // types
 //
 
-struct LogBufferInfo {
-  // A pointer to buffer currently used. It is either log_buffer1 or
-  // log_buffer2.
-  volatile char *log_buffer_head;
+// States of an entry in a log buffer
+enum LogpEntryState : USHORT {
+  kLogpEntryInvalid = 0,  // Reserved but not written yet, or free
+  kLogpEntryPadding,      // Fills the end of a buffer
+  kLogpEntryMessage,      // A formatted message
+  kLogpEntryDeferred,     // LogpDeferredMessage to be formatted later
+};
+
+// A header of an entry in a log buffer. The state is stored last so that the
+// flush thread never sees a partially written entry.
+struct LogpEntry {
+  volatile LogpEntryState state;
+  USHORT size;     // A size of the entry including this header
+  bool printed;    // The message is already printed out with DbgPrint
+  UCHAR reserved[3];
+  ULONG64 timestamp;  // TSC when the entry was reserved
+  char message[1];
+};
 
-  // A pointer to where the next log should be written.
-  volatile char *log_buffer_tail;
+// State of a call site of logging, keyed on a format string. Messages from a
+// call site are coalesced when they repeat with the same arguments within a
+// second, and are limited by a token bucket.
+struct LogpCallSite {
+  const char *volatile format;  // nullptr while unused
+  const char *function_name;
+  ULONG level;
+  volatile LONG repeated;     // Messages coalesced into the last one
+  volatile LONG dropped;      // Messages dropped by the rate limit
+  volatile LONG64 last_hash;  // A hash of arguments of the last message
+  volatile LONG64 last_tsc;   // When the last message was logged
+  volatile LONG64 tokens;     // A message costs TSC frequency worth of tokens
+  volatile LONG64 last_refill;
+};
 
-  char *log_buffer1;
-  char *log_buffer2;
+// Information about where and when a message was logged
+struct LogpMessageContext {
+  LARGE_INTEGER system_time;
+  ULONG processor;
+  HANDLE process_id;
+  HANDLE thread_id;
+  char image_name[16];
+};
+
+// A message whose formatting is deferred to the flush thread. It is stored in
+// place of LogpEntry::message. A format string and a function name must be
+// static, and so must be strings referenced by arguments.
+struct LogpDeferredMessage {
+  const char *format;
+  const char *function_name;
+  ULONG level;
+  ULONG argument_count;
+  LogpMessageContext context;  // system_time is computed from the timestamp
+  ULONG64 arguments[1];        // argument_count words
+};
+
+// A log buffer owned by a processor. A writer reserves space by advancing head
+// with a compare-exchange, which is safe even from VMX-root. The flush thread
+// zeroes consumed entries and only then advances tail.
+struct LogpProcessorBuffer {
+  volatile LONG64 head;  // Bytes ever reserved
+  volatile LONG64 tail;  // Bytes ever released by the flush thread
+  volatile LONG dropped;  // Entries lost because the buffer was full
 
   // Holds the biggest buffer usage to determine a necessary buffer size.
-  SIZE_T log_max_usage;
+  SIZE_T max_usage;
+
+  char *buffer;
+
+  // Wakes up the log flush thread on behalf of a writer at high IRQL that
+  // cannot do it directly. Targets the owner processor.
+  KDPC flush_dpc;
+
+  // Set instead of queuing flush_dpc by a writer that may be in VMX-root. The
+  // next writer outside of it or the flush thread's timed wait consumes it.
+  volatile LONG flush_pending;
+};
+
+// A block of log entries being written to a log file
+struct LogpFileBlock {
+  char *buffer;        // kLogpFileBlockSize bytes; page aligned
+  LONG64 file_offset;  // Where the block starts in the log file
+  ULONG used;          // Bytes filled with entries
+  ULONG written;       // Bytes already requested to be written
+  HANDLE event_handle;
+  IO_STATUS_BLOCK io_status;
+  bool pending;  // A write may be still in progress
+};
+
+struct LogBufferInfo {
+  LogpProcessorBuffer *buffers;  // Indexed by a processor number
+  ULONG buffer_count;
+
+  // Converts a timestamp of a deferred message into system time.
+  ULONG64 tsc_frequency;
+  ULONG64 base_tsc;
+  LARGE_INTEGER base_system_time;
+
+  // Signaled to wake up the log flush thread.
+  KEVENT flush_event;
+
+  // Signaled by the log flush thread when everything is written.
+  KEVENT idle_event;
 
   HANDLE log_file_handle;
-  KSPIN_LOCK spin_lock;
-  ERESOURCE resource;
-  bool resource_initialized;
+
+  // While one block is being written asynchronously, the flush thread fills
+  // the other one.
+  LogpFileBlock blocks[2];
+  ULONG current_block;
+  LONG64 allocation_size;  // Bytes preallocated for the log file
+  ULONG sector_size;       // Non-zero when unbuffered I/O is used
+  volatile bool file_dirty;  // Written since the last ZwFlushBuffersFile()
   volatile bool buffer_flush_thread_should_be_alive;
   volatile bool buffer_flush_thread_started;
   HANDLE buffer_flush_thread_handle;
@@ -93,17 +229,67 @@ _IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
 _IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
     LogpInitializeLogFile(_Inout_ LogBufferInfo *info);
 
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    LogpInitializeFileBlocks(_Inout_ LogBufferInfo *info);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void LogpFinalizeFileBlocks(
+    _Inout_ LogBufferInfo *info);
+
 static DRIVER_REINITIALIZE LogpReinitializationRoutine;
 
 _IRQL_requires_max_(PASSIVE_LEVEL) static void LogpFinalizeBufferInfo(
     _In_ LogBufferInfo *info);
 
+static NTSTATUS LogpPrintV(_In_ ULONG level, _In_z_ const char *function_name,
+                           _In_z_ const char *format,
+                           _In_ ULONG argument_count, _In_ va_list args);
+
+static NTSTATUS LogpPrintf(_In_ ULONG level, _In_z_ const char *function_name,
+                           _In_z_ _Printf_format_string_ const char *format,
+                           ...);
+
+static bool LogpThrottle(_In_ ULONG level, _In_z_ const char *function_name,
+                         _In_z_ const char *format, _In_ ULONG argument_count,
+                         _In_ va_list args);
+
+static LogpCallSite *LogpFindCallSite(_In_ ULONG level,
+                                      _In_z_ const char *function_name,
+                                      _In_z_ const char *format);
+
+static bool LogpIsDeferrable(_In_ ULONG level, _In_ ULONG argument_count);
+
+static ULONG64 LogpHashArguments(_In_z_ const char *format,
+                                 _In_ ULONG argument_count, _In_ va_list args,
+                                 _In_ bool hash_strings);
+
+static ULONG64 LogpHashString(_In_ ULONG64 hash, _In_ char type,
+                              _In_ bool wide, _In_ LONG precision,
+                              _In_ ULONG64 argument);
+
+static ULONG64 LogpHashBytes(_In_ ULONG64 hash,
+                             _In_reads_bytes_(size) const void *data,
+                             _In_ SIZE_T size);
+
+static void LogpReportSuppressedMessages(_Inout_ LogpCallSite *site,
+                                         _In_ ULONG level);
+
+DECLSPEC_NOINLINE static NTSTATUS LogpPrintImmediately(
+    _In_ ULONG level, _In_z_ const char *function_name,
+    _In_z_ const char *format, _In_ va_list args);
+
 static NTSTATUS LogpMakePrefix(_In_ ULONG level,
                                _In_z_ const char *function_name,
                                _In_z_ const char *log_message,
+                               _In_ const LogpMessageContext &context,
                                _Out_ char *log_buffer,
                                _In_ SIZE_T log_buffer_length);
 
+static void LogpGetMessageContext(_Out_ LogpMessageContext *context);
+
+static void LogpGetExecutionContext(_Out_ LogpMessageContext *context);
+
+static ULONG LogpCountArguments(_In_z_ const char *format);
+
 static const char *LogpFindBaseFunctionName(_In_z_ const char *function_name);
 
 static NTSTATUS LogpPut(_In_z_ char *message, _In_ ULONG attribute);
@@ -111,13 +297,61 @@ static NTSTATUS LogpPut(_In_z_ char *message, _In_ ULONG attribute);
 _IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
     LogpFlushLogBuffer(_Inout_ LogBufferInfo *info);
 
+_IRQL_requires_max_(PASSIVE_LEVEL) static void LogpAppendToFile(
+    _Inout_ LogBufferInfo *info, _In_reads_(length) const char *message,
+    _In_ ULONG length);
+
 _IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
-    LogpWriteMessageToFile(_In_z_ const char *message,
-                           _In_ const LogBufferInfo &info);
+    LogpWriteFileBlock(_Inout_ LogBufferInfo *info,
+                       _Inout_ LogpFileBlock *block);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void LogpWaitForFileBlock(
+    _Inout_ LogpFileBlock *block);
+
+static bool LogpIsWritePending(_In_ const LogBufferInfo &info);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void LogpFlushFile(
+    _Inout_ LogBufferInfo *info);
+
+static void LogpWriteToSharedRing(_In_z_ const char *message,
+                                  _In_ ULONG processor, _In_ ULONG64 timestamp);
 
 static NTSTATUS LogpBufferMessage(_In_z_ const char *message,
+                                  _In_ bool printed, _In_ bool safe,
                                   _Inout_ LogBufferInfo *info);
 
+static NTSTATUS LogpBufferDeferredMessage(_In_ ULONG level,
+                                          _In_z_ const char *function_name,
+                                          _In_z_ const char *format,
+                                          _In_ ULONG argument_count,
+                                          _In_ va_list args,
+                                          _Inout_ LogBufferInfo *info);
+
+static NTSTATUS LogpFormatDeferredMessage(_In_ const LogBufferInfo &info,
+                                          _In_ const LogpEntry &entry,
+                                          _Out_ char *log_buffer,
+                                          _In_ SIZE_T log_buffer_length);
+
+static LogpEntry *LogpReserveEntry(_In_ ULONG size,
+                                   _Inout_ LogBufferInfo *info,
+                                   _Out_ bool *needs_flush);
+
+static void LogpCommitEntry(_Inout_ LogpEntry *entry,
+                            _In_ LogpEntryState state);
+
+static void LogpRequestFlush(_Inout_ LogBufferInfo *info, _In_ bool safe);
+
+static KDEFERRED_ROUTINE LogpFlushDpcRoutine;
+
+static LogpEntry *LogpPeekEntry(_Inout_ LogpProcessorBuffer *buffer);
+
+static void LogpReleaseEntry(_Inout_ LogpProcessorBuffer *buffer,
+                             _Inout_ LogpEntry *entry);
+
+static bool LogpIsLogBufferEmpty(_In_ const LogBufferInfo &info);
+
+static SIZE_T LogpGetMaxUsage(_In_ const LogBufferInfo &info);
+
 static void LogpDoDbgPrint(_In_z_ char *message);
 
 static bool LogpIsLogFileEnabled(_In_ const LogBufferInfo &info);
@@ -133,9 +367,14 @@ static KSTART_ROUTINE LogpBufferFlushThreadRoutine;
 _IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
     LogpSleep(_In_ LONG millisecond);
 
-static void LogpSetPrintedBit(_In_z_ char *message, _In_ bool on);
+_IRQL_requires_max_(PASSIVE_LEVEL) static void LogpInitializeTimeBase(
+    _Inout_ LogBufferInfo *info);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void LogpReportDroppedMessages(
+    _Inout_ LogBufferInfo *info);
 
-static bool LogpIsPrinted(_In_z_ char *message);
+static LARGE_INTEGER LogpTscToSystemTime(_In_ const LogBufferInfo &info,
+                                         _In_ ULONG64 tsc);
 
 static void LogpDbgBreak();
 
@@ -143,6 +382,8 @@ static void LogpDbgBreak();
 #pragma alloc_text(INIT, LogInitialization)
 #pragma alloc_text(INIT, LogpInitializeBufferInfo)
 #pragma alloc_text(PAGE, LogpInitializeLogFile)
+#pragma alloc_text(PAGE, LogpInitializeFileBlocks)
+#pragma alloc_text(PAGE, LogpFinalizeFileBlocks)
 #pragma alloc_text(INIT, LogRegisterReinitialization)
 #pragma alloc_text(PAGE, LogpReinitializationRoutine)
 #pragma alloc_text(PAGE, LogIrpShutdownHandler)
@@ -150,6 +391,7 @@ static void LogpDbgBreak();
 #pragma alloc_text(PAGE, LogpFinalizeBufferInfo)
 #pragma alloc_text(PAGE, LogpBufferFlushThreadRoutine)
 #pragma alloc_text(PAGE, LogpSleep)
+#pragma alloc_text(PAGE, LogpInitializeTimeBase)
 #endif
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -157,8 +399,9 @@ static void LogpDbgBreak();
 // variables
 //
 
-static auto g_logp_debug_flag = kLogPutLevelDisable;
+ULONG g_logp_debug_flag = kLogPutLevelDisable;
 static LogBufferInfo g_logp_log_buffer_info = {};
+static LogpCallSite g_logp_call_sites[kLogpCallSiteCount];
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -173,6 +416,9 @@ LogInitialization(ULONG flag, const wchar_t *log_file_path) {
 
   g_logp_debug_flag = flag;
 
+  // Rate limiting and deferred messages need the TSC frequency from the start.
+  LogpInitializeTimeBase(&g_logp_log_buffer_info);
+
   // Initialize a log file if a log file path is specified.
   bool need_reinitialization = false;
   if (log_file_path) {
@@ -190,10 +436,10 @@ LogInitialization(ULONG flag, const wchar_t *log_file_path) {
   if (!NT_SUCCESS(status)) {
     goto Fail;
   }
-  HYPERPLATFORM_LOG_DEBUG("Info= %p, Buffer= %p %p, File= %S",
+  HYPERPLATFORM_LOG_DEBUG("Info= %p, Buffers= %p (%lu), File= %S",
                           &g_logp_log_buffer_info,
-                          g_logp_log_buffer_info.log_buffer1,
-                          g_logp_log_buffer_info.log_buffer2, log_file_path);
+                          g_logp_log_buffer_info.buffers,
+                          g_logp_log_buffer_info.buffer_count, log_file_path);
   return (need_reinitialization ? STATUS_REINITIALIZATION_NEEDED
                                 : STATUS_SUCCESS);
 
@@ -211,8 +457,6 @@ _Use_decl_annotations_ static NTSTATUS LogpInitializeBufferInfo(
   NT_ASSERT(log_file_path);
   NT_ASSERT(info);
 
-  KeInitializeSpinLock(&info->spin_lock);
-
   auto status = RtlStringCchCopyW(
       info->log_file_path, RTL_NUMBER_OF_FIELD(LogBufferInfo, log_file_path),
       log_file_path);
@@ -220,40 +464,43 @@ _Use_decl_annotations_ static NTSTATUS LogpInitializeBufferInfo(
     return status;
   }
 
-  status = ExInitializeResourceLite(&info->resource);
-  if (!NT_SUCCESS(status)) {
-    return status;
-  }
-  info->resource_initialized = true;
-
-  // Allocate two log buffers on NonPagedPool.
-  info->log_buffer1 = static_cast<char *>(
-      ExAllocatePoolWithTag(NonPagedPool, kLogpBufferSize, kLogpPoolTag));
-  if (!info->log_buffer1) {
-    LogpFinalizeBufferInfo(info);
-    return STATUS_INSUFFICIENT_RESOURCES;
-  }
-
-  info->log_buffer2 = static_cast<char *>(
-      ExAllocatePoolWithTag(NonPagedPool, kLogpBufferSize, kLogpPoolTag));
-  if (!info->log_buffer2) {
+  // Allocate a log buffer for each processor on NonPagedPool.
+  const auto number_of_processors =
+      KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+  const auto buffers_size = sizeof(LogpProcessorBuffer) * number_of_processors;
+  info->buffers = static_cast<LogpProcessorBuffer *>(
+      ExAllocatePoolWithTag(NonPagedPool, buffers_size, kLogpPoolTag));
+  if (!info->buffers) {
     LogpFinalizeBufferInfo(info);
     return STATUS_INSUFFICIENT_RESOURCES;
   }
+  RtlZeroMemory(info->buffers, buffers_size);
+  info->buffer_count = number_of_processors;
 
-  // Initialize these buffers
-  RtlFillMemory(info->log_buffer1, kLogpBufferSize, 0xff);  // for diagnostic
-  info->log_buffer1[0] = '\0';
-  info->log_buffer1[kLogpBufferSize - 1] = '\0';  // at the end
+  KeInitializeEvent(&info->flush_event, SynchronizationEvent, FALSE);
+  KeInitializeEvent(&info->idle_event, NotificationEvent, FALSE);
 
-  RtlFillMemory(info->log_buffer2, kLogpBufferSize, 0xff);  // for diagnostic
-  info->log_buffer2[0] = '\0';
-  info->log_buffer2[kLogpBufferSize - 1] = '\0';  // at the end
+  for (auto i = 0ul; i < number_of_processors; ++i) {
+    auto &buffer = info->buffers[i];
 
-  // Buffer should be used is log_buffer1, and location should be written logs
-  // is the head of the buffer.
-  info->log_buffer_head = info->log_buffer1;
-  info->log_buffer_tail = info->log_buffer1;
+    PROCESSOR_NUMBER processor_number = {};
+    status = KeGetProcessorNumberFromIndex(i, &processor_number);
+    if (!NT_SUCCESS(status)) {
+      LogpFinalizeBufferInfo(info);
+      return status;
+    }
+    KeInitializeDpc(&buffer.flush_dpc, LogpFlushDpcRoutine, info);
+    KeSetTargetProcessorDpcEx(&buffer.flush_dpc, &processor_number);
+
+    buffer.buffer = static_cast<char *>(
+        ExAllocatePoolWithTag(NonPagedPool, kLogpBufferSize, kLogpPoolTag));
+    if (!buffer.buffer) {
+      LogpFinalizeBufferInfo(info);
+      return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    // Writers rely on that free space is zeroed.
+    RtlZeroMemory(buffer.buffer, kLogpBufferSize);
+  }
 
   status = LogpInitializeLogFile(info);
   if (status == STATUS_OBJECT_PATH_NOT_FOUND) {
@@ -283,21 +530,35 @@ _Use_decl_annotations_ static NTSTATUS LogpInitializeLogFile(
                              OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, nullptr,
                              nullptr)
 
+  // Open it for asynchronous I/O. Entries are written with explicit offsets
+  // after existing contents.
   IO_STATUS_BLOCK io_status = {};
   auto status = ZwCreateFile(
-      &info->log_file_handle, FILE_APPEND_DATA | SYNCHRONIZE, &oa, &io_status,
-      nullptr, FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ, FILE_OPEN_IF,
-      FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE, nullptr, 0);
+      &info->log_file_handle, FILE_READ_DATA | FILE_WRITE_DATA | SYNCHRONIZE,
+      &oa, &io_status, nullptr, FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ,
+      FILE_OPEN_IF,
+      FILE_NON_DIRECTORY_FILE |
+          ((kLogpEnableUnbufferedIo) ? FILE_NO_INTERMEDIATE_BUFFERING : 0),
+      nullptr, 0);
   if (!NT_SUCCESS(status)) {
     return status;
   }
 
+  status = LogpInitializeFileBlocks(info);
+  if (!NT_SUCCESS(status)) {
+    LogpFinalizeFileBlocks(info);
+    ZwClose(info->log_file_handle);
+    info->log_file_handle = nullptr;
+    return status;
+  }
+
   // Initialize a log buffer flush thread.
   info->buffer_flush_thread_should_be_alive = true;
   status = PsCreateSystemThread(&info->buffer_flush_thread_handle, GENERIC_ALL,
                                 nullptr, nullptr, nullptr,
                                 LogpBufferFlushThreadRoutine, info);
   if (!NT_SUCCESS(status)) {
+    LogpFinalizeFileBlocks(info);
     ZwClose(info->log_file_handle);
     info->log_file_handle = nullptr;
     info->buffer_flush_thread_should_be_alive = false;
@@ -311,6 +572,114 @@ _Use_decl_annotations_ static NTSTATUS LogpInitializeLogFile(
   return status;
 }
 
+// Allocates blocks to write a log file with, and determines where to write.
+_Use_decl_annotations_ static NTSTATUS LogpInitializeFileBlocks(
+    LogBufferInfo *info) {
+  PAGED_CODE()
+
+  for (auto &block : info->blocks) {
+    // It is page aligned as the size is not less than a page.
+    block.buffer = static_cast<char *>(
+        ExAllocatePoolWithTag(NonPagedPool, kLogpFileBlockSize, kLogpPoolTag));
+    if (!block.buffer) {
+      return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(block.buffer, kLogpFileBlockSize);
+
+    OBJECT_ATTRIBUTES oa = {};
+    InitializeObjectAttributes(&oa, nullptr, OBJ_KERNEL_HANDLE, nullptr,
+                               nullptr)
+    auto status = ZwCreateEvent(&block.event_handle, EVENT_ALL_ACCESS, &oa,
+                                NotificationEvent, FALSE);
+    if (!NT_SUCCESS(status)) {
+      return status;
+    }
+  }
+  info->current_block = 0;
+
+  IO_STATUS_BLOCK io_status = {};
+  FILE_STANDARD_INFORMATION standard_info = {};
+  auto status = ZwQueryInformationFile(info->log_file_handle, &io_status,
+                                       &standard_info, sizeof(standard_info),
+                                       FileStandardInformation);
+  if (!NT_SUCCESS(status)) {
+    return status;
+  }
+  info->allocation_size = standard_info.AllocationSize.QuadPart;
+
+  if (kLogpEnableUnbufferedIo) {
+    FILE_FS_SIZE_INFORMATION size_info = {};
+    status = ZwQueryVolumeInformationFile(info->log_file_handle, &io_status,
+                                          &size_info, sizeof(size_info),
+                                          FileFsSizeInformation);
+    if (!NT_SUCCESS(status)) {
+      return status;
+    }
+    if (size_info.BytesPerSector > PAGE_SIZE ||
+        kLogpFileBlockSize % size_info.BytesPerSector) {
+      return STATUS_NOT_SUPPORTED;
+    }
+    info->sector_size = size_info.BytesPerSector;
+  }
+
+  // Start from the end of the file. With unbuffered I/O, start from the last
+  // sector instead and read it back so that it is rewritten as it is.
+  auto &block = info->blocks[0];
+  const auto end_of_file = standard_info.EndOfFile.QuadPart;
+  block.file_offset =
+      (info->sector_size)
+          ? end_of_file & ~static_cast<LONG64>(info->sector_size - 1)
+          : end_of_file;
+  block.used = static_cast<ULONG>(end_of_file - block.file_offset);
+  block.written = block.used;
+  if (block.used) {
+    LARGE_INTEGER offset = {};
+    offset.QuadPart = block.file_offset;
+    status = ZwReadFile(info->log_file_handle, block.event_handle, nullptr,
+                        nullptr, &block.io_status, block.buffer,
+                        info->sector_size, &offset, nullptr);
+    if (status == STATUS_PENDING) {
+      ZwWaitForSingleObject(block.event_handle, FALSE, nullptr);
+      status = block.io_status.Status;
+    }
+    if (!NT_SUCCESS(status)) {
+      return status;
+    }
+  }
+  return STATUS_SUCCESS;
+}
+
+// Waits for writes in progress and releases blocks. With unbuffered I/O, also
+// truncates padding written after the last entry.
+_Use_decl_annotations_ static void LogpFinalizeFileBlocks(LogBufferInfo *info) {
+  PAGED_CODE()
+
+  for (auto &block : info->blocks) {
+    LogpWaitForFileBlock(&block);
+  }
+
+  if (info->sector_size) {
+    const auto &block = info->blocks[info->current_block];
+    FILE_END_OF_FILE_INFORMATION eof_info = {};
+    eof_info.EndOfFile.QuadPart = block.file_offset + block.used;
+    IO_STATUS_BLOCK io_status = {};
+    ZwSetInformationFile(info->log_file_handle, &io_status, &eof_info,
+                         sizeof(eof_info), FileEndOfFileInformation);
+  }
+
+  for (auto &block : info->blocks) {
+    if (block.event_handle) {
+      ZwClose(block.event_handle);
+      block.event_handle = nullptr;
+    }
+    if (block.buffer) {
+      ExFreePoolWithTag(block.buffer, kLogpPoolTag);
+      block.buffer = nullptr;
+    }
+  }
+  info->sector_size = 0;
+}
+
 // Registers LogpReinitializationRoutine() for re-initialization.
 _Use_decl_annotations_ void LogRegisterReinitialization(
     PDRIVER_OBJECT driver_object) {
@@ -342,15 +711,26 @@ _Use_decl_annotations_ void LogIrpShutdownHandler() {
   PAGED_CODE()
 
   HYPERPLATFORM_LOG_DEBUG("Flushing... (Max log usage = %Iu/%lu bytes)",
-                          g_logp_log_buffer_info.log_max_usage,
+                          LogpGetMaxUsage(g_logp_log_buffer_info),
                           kLogpBufferSize);
   HYPERPLATFORM_LOG_INFO("Bye!");
   g_logp_debug_flag = kLogPutLevelDisable;
 
-  // Wait until the log buffer is emptied.
+  // Wait until the log buffer is emptied and written to the file.
   auto &info = g_logp_log_buffer_info;
-  while (info.log_buffer_head[0]) {
-    LogpSleep(kLogpLogFlushIntervalMsec);
+  LARGE_INTEGER interval = {};
+  interval.QuadPart = -(10000ll * kLogpFlushWaitIntervalMsec);
+  while (!LogpIsLogBufferEmpty(info) || LogpIsWritePending(info)) {
+    KeClearEvent(&info.idle_event);
+    KeSetEvent(&info.flush_event, IO_NO_INCREMENT, FALSE);
+    KeWaitForSingleObject(&info.idle_event, Executive, KernelMode, FALSE,
+                          &interval);
+  }
+
+  // Make the last blocks reach the disk before the file system goes away. The
+  // flush thread may be flushing too, so do it regardless of file_dirty.
+  if (info.log_file_handle) {
+    LogpFlushFile(&info);
   }
 }
 
@@ -359,7 +739,7 @@ _Use_decl_annotations_ void LogTermination() {
   PAGED_CODE()
 
   HYPERPLATFORM_LOG_DEBUG("Finalizing... (Max log usage = %Iu/%lu bytes)",
-                          g_logp_log_buffer_info.log_max_usage,
+                          LogpGetMaxUsage(g_logp_log_buffer_info),
                           kLogpBufferSize);
   HYPERPLATFORM_LOG_INFO("Bye!");
   g_logp_debug_flag = kLogPutLevelDisable;
@@ -374,6 +754,7 @@ _Use_decl_annotations_ static void LogpFinalizeBufferInfo(LogBufferInfo *info) {
   // Closing the log buffer flush thread.
   if (info->buffer_flush_thread_handle) {
     info->buffer_flush_thread_should_be_alive = false;
+    KeSetEvent(&info->flush_event, IO_NO_INCREMENT, FALSE);
     auto status =
         ZwWaitForSingleObject(info->buffer_flush_thread_handle, FALSE, nullptr);
     if (!NT_SUCCESS(status)) {
@@ -385,21 +766,21 @@ _Use_decl_annotations_ static void LogpFinalizeBufferInfo(LogBufferInfo *info) {
 
   // Cleaning up other things.
   if (info->log_file_handle) {
+    LogpFinalizeFileBlocks(info);
     ZwClose(info->log_file_handle);
     info->log_file_handle = nullptr;
   }
-  if (info->log_buffer2) {
-    ExFreePoolWithTag(info->log_buffer2, kLogpPoolTag);
-    info->log_buffer2 = nullptr;
-  }
-  if (info->log_buffer1) {
-    ExFreePoolWithTag(info->log_buffer1, kLogpPoolTag);
-    info->log_buffer1 = nullptr;
-  }
-
-  if (info->resource_initialized) {
-    ExDeleteResourceLite(&info->resource);
-    info->resource_initialized = false;
+  if (info->buffers) {
+    // Make sure that no LogpFlushDpcRoutine() is running.
+    KeFlushQueuedDpcs();
+    for (auto i = 0ul; i < info->buffer_count; ++i) {
+      if (info->buffers[i].buffer) {
+        ExFreePoolWithTag(info->buffers[i].buffer, kLogpPoolTag);
+      }
+    }
+    ExFreePoolWithTag(info->buffers, kLogpPoolTag);
+    info->buffers = nullptr;
+    info->buffer_count = 0;
   }
 }
 
@@ -415,46 +796,312 @@ _Use_decl_annotations_ NTSTATUS LogpPrint(ULONG level,
 
   va_list args;
   va_start(args, format);
-  char log_message[412];
-  status = RtlStringCchVPrintfA(log_message, RTL_NUMBER_OF(log_message), format,
-                                args);
+  const auto argument_count = LogpCountArguments(format);
+  if (LogpThrottle(level, function_name, format, argument_count, args)) {
+    status = LogpPrintV(level, function_name, format, argument_count, args);
+  }
   va_end(args);
-  if (!NT_SUCCESS(status)) {
+  return status;
+}
+
+// Logs a message without rate limiting.
+_Use_decl_annotations_ static NTSTATUS LogpPrintV(ULONG level,
+                                                  const char *function_name,
+                                                  const char *format,
+                                                  ULONG argument_count,
+                                                  va_list args) {
+  // Store the format and arguments as they are if formatting of this message
+  // can be deferred. It keeps logging from VMX-root cheap in both time and
+  // stack usage.
+  auto &info = g_logp_log_buffer_info;
+  NTSTATUS status = STATUS_SUCCESS;
+  if (LogpIsDeferrable(level, argument_count)) {
+    status = LogpBufferDeferredMessage(level & 0xf0, function_name, format,
+                                       argument_count, args, &info);
+  } else {
+    status = LogpPrintImmediately(level, function_name, format, args);
+  }
+
+  // Lost messages due to a full buffer are reported in the log instead.
+  if (!NT_SUCCESS(status) && status != STATUS_BUFFER_OVERFLOW) {
     LogpDbgBreak();
+  }
+  return status;
+}
+
+// Returns true when formatting of a message is deferred to the log flush
+// thread.
+_Use_decl_annotations_ static bool LogpIsDeferrable(ULONG level,
+                                                    ULONG argument_count) {
+  return (level & kLogpLevelOptSafe) &&
+         (g_logp_debug_flag & kLogOptDeferSafe) &&
+         LogpIsLogFileEnabled(g_logp_log_buffer_info) &&
+         argument_count <= kLogpMaxDeferredArguments;
+}
+
+// Logs a message without rate limiting.
+_Use_decl_annotations_ static NTSTATUS LogpPrintf(ULONG level,
+                                                  const char *function_name,
+                                                  const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  const auto status = LogpPrintV(level, function_name, format,
+                                 LogpCountArguments(format), args);
+  va_end(args);
+  return status;
+}
+
+// Returns true when a message should be logged. Returns false when it repeats
+// the last message of the call site within a second, or when the call site
+// exceeds its rate limit. Suppressed messages are counted and reported before
+// the next message from the call site, or by the log flush thread.
+_Use_decl_annotations_ static bool LogpThrottle(ULONG level,
+                                                const char *function_name,
+                                                const char *format,
+                                                ULONG argument_count,
+                                                va_list args) {
+  // The TSC frequency is 0 only when it could not be measured.
+  const auto frequency =
+      static_cast<LONG64>(g_logp_log_buffer_info.tsc_frequency);
+  if (!frequency) {
+    return true;
+  }
+  const auto site = LogpFindCallSite(level, function_name, format);
+  if (!site) {
+    return true;
+  }
+  const auto now = static_cast<LONG64>(__rdtsc());
+
+  // Coalesce a message that has the same arguments as the last one. Strings
+  // of a deferred message are not read here, as they must stay unchanged
+  // until the flush thread formats it anyway.
+  const auto hash = static_cast<LONG64>(
+      LogpHashArguments(format, argument_count, args,
+                        !LogpIsDeferrable(level, argument_count)));
+  if (hash == site->last_hash && now - site->last_tsc < frequency) {
+    InterlockedIncrement(&site->repeated);
+    return false;
+  }
+
+  // Refill the bucket for elapsed time, and take a token from it.
+  const auto capacity = frequency * kLogpRateLimitBurst;
+  const auto last_refill = site->last_refill;
+  if (now > last_refill &&
+      InterlockedCompareExchange64(&site->last_refill, now, last_refill) ==
+          last_refill) {
+    const auto elapsed = min(now - last_refill, capacity);
+    if (InterlockedAdd64(&site->tokens, elapsed * kLogpRateLimitPerSecond) >
+        capacity) {
+      InterlockedExchange64(&site->tokens, capacity);
+    }
+  }
+  if (InterlockedAdd64(&site->tokens, -frequency) < 0) {
+    InterlockedAdd64(&site->tokens, frequency);
+    InterlockedIncrement(&site->dropped);
+    return false;
+  }
+
+  InterlockedExchange64(&site->last_hash, hash);
+  InterlockedExchange64(&site->last_tsc, now);
+  LogpReportSuppressedMessages(site, level);
+  return true;
+}
+
+// Returns a call site of a format string, registering it if needed. Returns
+// nullptr when there is no room for it.
+_Use_decl_annotations_ static LogpCallSite *LogpFindCallSite(
+    ULONG level, const char *function_name, const char *format) {
+  const auto hash =
+      (reinterpret_cast<ULONG64>(format) * 0x9e3779b97f4a7c15ull) >> 32;
+  for (auto i = 0ul; i < kLogpCallSiteProbeCount; ++i) {
+    auto &site = g_logp_call_sites[(hash + i) & (kLogpCallSiteCount - 1)];
+    if (site.format == format) {
+      return &site;
+    }
+    if (site.format) {
+      continue;
+    }
+    const auto old_format = InterlockedCompareExchangePointer(
+        reinterpret_cast<PVOID volatile *>(const_cast<char **>(&site.format)),
+        const_cast<char *>(format), nullptr);
+    if (!old_format) {
+      site.level = level & 0xf0;
+      site.function_name = function_name;
+      return &site;
+    }
+    if (old_format == format) {
+      return &site;
+    }
+  }
+  return nullptr;
+}
+
+// Returns FNV-1a hash of arguments. String arguments are hashed by their
+// contents when hash_strings is true, and by their addresses otherwise. The
+// format string is walked in the same way as LogpCountArguments() does.
+_Use_decl_annotations_ static ULONG64 LogpHashArguments(const char *format,
+                                                        ULONG argument_count,
+                                                        va_list args,
+                                                        bool hash_strings) {
+  va_list args_copy;
+  va_copy(args_copy, args);
+  auto hash = 0xcbf29ce484222325ull;
+  auto index = 0ul;
+  for (auto p = format; *p && index < argument_count; ++p) {
+    if (*p != '%') {
+      continue;
+    }
+    if (*(p + 1) == '%') {
+      ++p;
+      continue;
+    }
+    auto wide = false;
+    auto narrow = false;
+    auto in_precision = false;
+    LONG precision = -1;
+    for (++p; *p && index < argument_count; ++p) {
+      if (*p == '*') {
+        const auto argument = va_arg(args_copy, ULONG64);
+        hash = LogpHashBytes(hash, &argument, sizeof(argument));
+        ++index;
+        if (in_precision) {
+          precision = static_cast<LONG>(argument);
+        }
+        continue;
+      }
+      if (*p == '.') {
+        in_precision = true;
+        precision = 0;
+        continue;
+      }
+      if (in_precision && *p >= '0' && *p <= '9') {
+        precision = precision * 10 + (*p - '0');
+        continue;
+      }
+      in_precision = false;
+      if (*p == 'l' || *p == 'w') {
+        wide = true;
+      } else if (*p == 'h') {
+        narrow = true;
+      } else if (strchr("cCdiouxXeEfgGaAnpsSZ", *p)) {
+        const auto argument = va_arg(args_copy, ULONG64);
+        ++index;
+        if (hash_strings && argument && strchr("sSZ", *p)) {
+          // %S is a wide string unless 'h' is given, as for RtlStringCch*.
+          const auto is_wide = (*p == 'S') ? !narrow : wide;
+          hash = LogpHashString(hash, *p, is_wide, precision, argument);
+        } else {
+          hash = LogpHashBytes(hash, &argument, sizeof(argument));
+        }
+        break;
+      }
+    }
+    if (!*p) {
+      break;
+    }
+  }
+  va_end(args_copy);
+  return hash;
+}
+
+// Adds contents of a string argument of %s, %S or %Z to FNV-1a hash. Only
+// characters formatting may read are hashed.
+_Use_decl_annotations_ static ULONG64 LogpHashString(ULONG64 hash, char type,
+                                                     bool wide, LONG precision,
+                                                     ULONG64 argument) {
+  if (type == 'Z') {
+    if (wide) {
+      const auto string = reinterpret_cast<const UNICODE_STRING *>(argument);
+      return (string->Buffer)
+                 ? LogpHashBytes(hash, string->Buffer, string->Length)
+                 : hash;
+    }
+    const auto string = reinterpret_cast<const ANSI_STRING *>(argument);
+    return (string->Buffer) ? LogpHashBytes(hash, string->Buffer, string->Length)
+                            : hash;
+  }
+
+  const auto max_length =
+      (precision >= 0)
+          ? min(static_cast<ULONG>(precision), kLogpMaxHashedStringLength)
+          : kLogpMaxHashedStringLength;
+  if (wide) {
+    const auto string = reinterpret_cast<const wchar_t *>(argument);
+    return LogpHashBytes(hash, string,
+                         wcsnlen(string, max_length) * sizeof(wchar_t));
+  }
+  const auto string = reinterpret_cast<const char *>(argument);
+  return LogpHashBytes(hash, string, strnlen(string, max_length));
+}
+
+// Adds bytes to FNV-1a hash.
+_Use_decl_annotations_ static ULONG64 LogpHashBytes(ULONG64 hash,
+                                                    const void *data,
+                                                    SIZE_T size) {
+  const auto bytes = static_cast<const UCHAR *>(data);
+  for (SIZE_T i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+// Logs the numbers of messages suppressed at the call site, if any.
+_Use_decl_annotations_ static void LogpReportSuppressedMessages(
+    LogpCallSite *site, ULONG level) {
+  const auto repeated = InterlockedExchange(&site->repeated, 0);
+  if (repeated) {
+    LogpPrintf(level, site->function_name, "Repeated %ld more times: %s",
+               repeated, site->format);
+  }
+  const auto dropped = InterlockedExchange(&site->dropped, 0);
+  if (dropped) {
+    LogpPrintf(level, site->function_name,
+               "Dropped %ld messages by the rate limit: %s", dropped,
+               site->format);
+  }
+}
+
+// Formats a message and logs it.
+_Use_decl_annotations_ static NTSTATUS LogpPrintImmediately(
+    ULONG level, const char *function_name, const char *format,
+    va_list args) {
+  char log_message[412];
+  auto status = RtlStringCchVPrintfA(log_message, RTL_NUMBER_OF(log_message),
+                                     format, args);
+  if (!NT_SUCCESS(status)) {
     return status;
   }
   if (log_message[0] == '\0') {
-    LogpDbgBreak();
     return STATUS_INVALID_PARAMETER;
   }
 
   const auto pure_level = level & 0xf0;
   const auto attribute = level & 0x0f;
 
+  LogpMessageContext context = {};
+  LogpGetMessageContext(&context);
+
   // A single entry of log should not exceed 512 bytes. See
   // Reading and Filtering Debugging Messages in MSDN for details.
   char message[512];
   static_assert(RTL_NUMBER_OF(message) <= 512,
                 "One log message should not exceed 512 bytes.");
-  status = LogpMakePrefix(pure_level, function_name, log_message, message,
-                          RTL_NUMBER_OF(message));
+  status = LogpMakePrefix(pure_level, function_name, log_message, context,
+                          message, RTL_NUMBER_OF(message));
   if (!NT_SUCCESS(status)) {
-    LogpDbgBreak();
     return status;
   }
 
-  status = LogpPut(message, attribute);
-  if (!NT_SUCCESS(status)) {
-    LogpDbgBreak();
-  }
-  return status;
+  return LogpPut(message, attribute);
 }
 
 // Concatenates meta information such as the current time and a process ID to
 // user given log message.
 _Use_decl_annotations_ static NTSTATUS LogpMakePrefix(
     ULONG level, const char *function_name, const char *log_message,
-    char *log_buffer, SIZE_T log_buffer_length) {
+    const LogpMessageContext &context, char *log_buffer,
+    SIZE_T log_buffer_length) {
   char const *level_string = nullptr;
   switch (level) {
     case kLogpLevelDebug:
@@ -479,8 +1126,8 @@ _Use_decl_annotations_ static NTSTATUS LogpMakePrefix(
   if ((g_logp_debug_flag & kLogOptDisableTime) == 0) {
     // Want the current time.
     TIME_FIELDS time_fields;
-    LARGE_INTEGER system_time, local_time;
-    KeQuerySystemTime(&system_time);
+    LARGE_INTEGER local_time;
+    auto system_time = context.system_time;
     ExSystemTimeToLocalTime(&system_time, &local_time);
     RtlTimeToTimeFields(&local_time, &time_fields);
 
@@ -510,26 +1157,77 @@ _Use_decl_annotations_ static NTSTATUS LogpMakePrefix(
   if ((g_logp_debug_flag & kLogOptDisableProcessorNumber) == 0) {
     status =
         RtlStringCchPrintfA(processro_number, RTL_NUMBER_OF(processro_number),
-                            "#%lu\t", KeGetCurrentProcessorNumberEx(nullptr));
+                            "#%lu\t", context.processor);
     if (!NT_SUCCESS(status)) {
       return status;
     }
   }
 
+  status = RtlStringCchPrintfA(
+      log_buffer, log_buffer_length, "%s%s%s%5Iu\t%5Iu\t%-15s\t%s%s\r\n",
+      time_buffer, level_string, processro_number,
+      reinterpret_cast<ULONG_PTR>(context.process_id),
+      reinterpret_cast<ULONG_PTR>(context.thread_id), context.image_name,
+      function_name_buffer, log_message);
+  return status;
+}
+
+// Collects the current time and information about the current execution
+// context.
+_Use_decl_annotations_ static void LogpGetMessageContext(
+    LogpMessageContext *context) {
+  KeQuerySystemTime(&context->system_time);
+  LogpGetExecutionContext(context);
+}
+
+// Collects information about the current execution context except time.
+_Use_decl_annotations_ static void LogpGetExecutionContext(
+    LogpMessageContext *context) {
+  context->processor = KeGetCurrentProcessorNumberEx(nullptr);
+
   // It uses PsGetProcessId(PsGetCurrentProcess()) instead of
   // PsGetCurrentThreadProcessId() because the later sometimes returns
   // unwanted value, for example:
   //  PID == 4 but its image name != ntoskrnl.exe
   // The author is guessing that it is related to attaching processes but
   // not quite sure. The former way works as expected.
-  status = RtlStringCchPrintfA(
-      log_buffer, log_buffer_length, "%s%s%s%5Iu\t%5Iu\t%-15s\t%s%s\r\n",
-      time_buffer, level_string, processro_number,
-      reinterpret_cast<ULONG_PTR>(PsGetProcessId(PsGetCurrentProcess())),
-      reinterpret_cast<ULONG_PTR>(PsGetCurrentThreadId()),
-      PsGetProcessImageFileName(PsGetCurrentProcess()), function_name_buffer,
-      log_message);
-  return status;
+  const auto process = PsGetCurrentProcess();
+  context->process_id = PsGetProcessId(process);
+  context->thread_id = PsGetCurrentThreadId();
+
+  // Copy the name since the process may exit before the message is formatted.
+  // EPROCESS::ImageFileName is 15 bytes long.
+  RtlCopyMemory(context->image_name, PsGetProcessImageFileName(process),
+                RTL_NUMBER_OF(context->image_name) - 1);
+  context->image_name[RTL_NUMBER_OF(context->image_name) - 1] = '\0';
+}
+
+// Returns the number of arguments a format string consumes, including ones
+// for '*' width and precision.
+_Use_decl_annotations_ static ULONG LogpCountArguments(const char *format) {
+  ULONG count = 0;
+  for (auto p = format; *p; ++p) {
+    if (*p != '%') {
+      continue;
+    }
+    if (*(p + 1) == '%') {
+      ++p;
+      continue;
+    }
+    // Skip flags, width, precision and a size prefix until a type character
+    for (++p; *p; ++p) {
+      if (*p == '*') {
+        ++count;
+      } else if (strchr("cCdiouxXeEfgGaAnpsSZ", *p)) {
+        ++count;
+        break;
+      }
+    }
+    if (!*p) {
+      break;
+    }
+  }
+  return count;
 }
 
 // Returns the function's base name, for example,
@@ -557,28 +1255,13 @@ _Use_decl_annotations_ static NTSTATUS LogpPut(char *message, ULONG attribute) {
   auto do_DbgPrint = ((attribute & kLogpLevelOptSafe) == 0 &&
                       KeGetCurrentIrql() < CLOCK_LEVEL);
 
-  // Log the entry to a file or buffer.
+  // Buffer the entry. Only the log flush thread writes it to a file so that
+  // the caller never waits for I/O. Mark it as printed if it is printed out
+  // below.
   auto &info = g_logp_log_buffer_info;
   if (LogpIsLogFileEnabled(info)) {
-    // Can it log it to a file now?
-    if (((attribute & kLogpLevelOptSafe) == 0) &&
-        KeGetCurrentIrql() == PASSIVE_LEVEL && LogpIsLogFileActivated(info)) {
-#pragma warning(push)
-#pragma warning(disable : 28123)
-      if (!KeAreAllApcsDisabled()) {
-        // Yes, it can. Do it.
-        LogpFlushLogBuffer(&info);
-        status = LogpWriteMessageToFile(message, info);
-      }
-#pragma warning(pop)
-    } else {
-      // No, it cannot. Set the printed bit if needed, and then buffer it.
-      if (do_DbgPrint) {
-        LogpSetPrintedBit(message, true);
-      }
-      status = LogpBufferMessage(message, &info);
-      LogpSetPrintedBit(message, false);
-    }
+    status = LogpBufferMessage(message, do_DbgPrint,
+                               (attribute & kLogpLevelOptSafe) != 0, &info);
   }
 
   // Can it safely be printed?
@@ -588,124 +1271,438 @@ _Use_decl_annotations_ static NTSTATUS LogpPut(char *message, ULONG attribute) {
   return status;
 }
 
-// Switches the current log buffer, saves the contents of old buffer to the log
-// file, and prints them out as necessary. This function does not flush the log
-// file, so code should call LogpWriteMessageToFile() or ZwFlushBuffersFile()
-// later.
+// Saves all buffered entries to the log file in order of their timestamps
+// across processors, and prints them out as necessary. Entries are coalesced
+// into blocks and written asynchronously. Only the log flush thread calls this
+// function.
 _Use_decl_annotations_ static NTSTATUS LogpFlushLogBuffer(LogBufferInfo *info) {
   NT_ASSERT(info);
   NT_ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
 
-  auto status = STATUS_SUCCESS;
+  // Append the oldest entry among all processor buffers one by one. Entries
+  // in a single buffer are already in order, so it is a merge of sorted lists.
+  for (;;) {
+    LogpProcessorBuffer *oldest_buffer = nullptr;
+    LogpEntry *oldest_entry = nullptr;
+    for (auto i = 0ul; i < info->buffer_count; ++i) {
+      const auto entry = LogpPeekEntry(&info->buffers[i]);
+      if (entry &&
+          (!oldest_entry || entry->timestamp < oldest_entry->timestamp)) {
+        oldest_buffer = &info->buffers[i];
+        oldest_entry = entry;
+      }
+    }
+    if (!oldest_entry) {
+      break;
+    }
 
-  // Enter a critical section and acquire a reader lock for info in order to
-  // write a log file safely.
-  ExEnterCriticalRegionAndAcquireResourceExclusive(&info->resource);
-
-  // Acquire a spin lock for info.log_buffer(s) in order to switch its head
-  // safely.
-  KLOCK_QUEUE_HANDLE lock_handle = {};
-  KeAcquireInStackQueuedSpinLock(&info->spin_lock, &lock_handle);
-  const auto old_log_buffer = const_cast<char *>(info->log_buffer_head);
-  info->log_buffer_head = (old_log_buffer == info->log_buffer1)
-                              ? info->log_buffer2
-                              : info->log_buffer1;
-  info->log_buffer_head[0] = '\0';
-  info->log_buffer_tail = info->log_buffer_head;
-  KeReleaseInStackQueuedSpinLock(&lock_handle);
-
-  // Write all log entries in old log buffer.
-  IO_STATUS_BLOCK io_status = {};
-  for (auto current_log_entry = old_log_buffer; current_log_entry[0]; /**/) {
-    // Check the printed bit and clear it
-    const auto printed_out = LogpIsPrinted(current_log_entry);
-    LogpSetPrintedBit(current_log_entry, false);
-
-    const auto current_log_entry_length = strlen(current_log_entry);
-    status = ZwWriteFile(info->log_file_handle, nullptr, nullptr, nullptr,
-                         &io_status, current_log_entry,
-                         static_cast<ULONG>(current_log_entry_length), nullptr,
-                         nullptr);
-    if (!NT_SUCCESS(status)) {
-      // It could happen when you did not register IRP_SHUTDOWN and call
-      // LogIrpShutdownHandler() and the system tried to log to a file after
-      // a file system was unmounted.
-      LogpDbgBreak();
+    // Format a deferred message now.
+    auto message = oldest_entry->message;
+    char deferred_message[512];
+    if (oldest_entry->state == kLogpEntryDeferred) {
+      message = deferred_message;
+      if (!NT_SUCCESS(LogpFormatDeferredMessage(*info, *oldest_entry,
+                                                deferred_message,
+                                                RTL_NUMBER_OF(
+                                                    deferred_message)))) {
+        LogpReleaseEntry(oldest_buffer, oldest_entry);
+        continue;
+      }
     }
 
+    LogpAppendToFile(info, message, static_cast<ULONG>(strlen(message)));
+    LogpWriteToSharedRing(
+        message, static_cast<ULONG>(oldest_buffer - info->buffers),
+        oldest_entry->timestamp);
+
     // Print it out if requested and the message is not already printed out
-    if (!printed_out) {
-      LogpDoDbgPrint(current_log_entry);
+    if (!oldest_entry->printed) {
+      LogpDoDbgPrint(message);
     }
 
-    current_log_entry += current_log_entry_length + 1;
+    LogpReleaseEntry(oldest_buffer, oldest_entry);
   }
-  old_log_buffer[0] = '\0';
+  LogpReportDroppedMessages(info);
 
-  ExReleaseResourceAndLeaveCriticalRegion(&info->resource);
-  return status;
+  // Write what is left in the current block. It is rewritten together with
+  // following entries when the block is filled further.
+  return LogpWriteFileBlock(info, &info->blocks[info->current_block]);
 }
 
-// Logs the current log entry to and flush the log file.
-_Use_decl_annotations_ static NTSTATUS LogpWriteMessageToFile(
-    const char *message, const LogBufferInfo &info) {
-  NT_ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+// Copies an entry into the current block, and writes the block once it is
+// full.
+_Use_decl_annotations_ static void LogpAppendToFile(LogBufferInfo *info,
+                                                    const char *message,
+                                                    ULONG length) {
+  while (length) {
+    auto block = &info->blocks[info->current_block];
+
+    // The block may still be read by a write of its earlier part.
+    LogpWaitForFileBlock(block);
+
+    const auto copy_length = min(length, kLogpFileBlockSize - block->used);
+    RtlCopyMemory(block->buffer + block->used, message, copy_length);
+    block->used += copy_length;
+    message += copy_length;
+    length -= copy_length;
+    if (block->used != kLogpFileBlockSize) {
+      continue;
+    }
 
-  IO_STATUS_BLOCK io_status = {};
-  auto status =
-      ZwWriteFile(info.log_file_handle, nullptr, nullptr, nullptr, &io_status,
-                  const_cast<char *>(message),
-                  static_cast<ULONG>(strlen(message)), nullptr, nullptr);
-  if (!NT_SUCCESS(status)) {
+    // Write the full block, and switch to the other block that follows it.
+    LogpWriteFileBlock(info, block);
+    const auto next_index = info->current_block ^ 1;
+    auto &next = info->blocks[next_index];
+    LogpWaitForFileBlock(&next);
+    RtlZeroMemory(next.buffer, kLogpFileBlockSize);
+    next.file_offset = block->file_offset + kLogpFileBlockSize;
+    next.used = 0;
+    next.written = 0;
+    info->current_block = next_index;
+  }
+}
+
+// Starts writing a part of the block that is not written yet.
+_Use_decl_annotations_ static NTSTATUS LogpWriteFileBlock(
+    LogBufferInfo *info, LogpFileBlock *block) {
+  if (block->written == block->used) {
+    return STATUS_SUCCESS;
+  }
+
+  auto begin = block->written;
+  auto end = block->used;
+  if (info->sector_size) {
+    begin &= ~(info->sector_size - 1);
+    end = (end + info->sector_size - 1) & ~(info->sector_size - 1);
+  }
+
+  // Extend allocation of the file ahead so that the file system does not have
+  // to do it on every write.
+  const auto end_offset = block->file_offset + end;
+  if (end_offset > info->allocation_size) {
+    FILE_ALLOCATION_INFORMATION allocation_info = {};
+    allocation_info.AllocationSize.QuadPart =
+        (end_offset + kLogpFilePreallocationSize) &
+        ~(kLogpFilePreallocationSize - 1);
+    IO_STATUS_BLOCK io_status = {};
+    if (NT_SUCCESS(ZwSetInformationFile(
+            info->log_file_handle, &io_status, &allocation_info,
+            sizeof(allocation_info), FileAllocationInformation))) {
+      info->allocation_size = allocation_info.AllocationSize.QuadPart;
+    }
+  }
+
+  LARGE_INTEGER offset = {};
+  offset.QuadPart = block->file_offset + begin;
+  const auto status =
+      ZwWriteFile(info->log_file_handle, block->event_handle, nullptr, nullptr,
+                  &block->io_status, block->buffer + begin, end - begin,
+                  &offset, nullptr);
+  if (NT_SUCCESS(status)) {
+    block->pending = true;
+    info->file_dirty = true;
+  } else {
     // It could happen when you did not register IRP_SHUTDOWN and call
     // LogIrpShutdownHandler() and the system tried to log to a file after
     // a file system was unmounted.
     LogpDbgBreak();
   }
-  status = ZwFlushBuffersFile(info.log_file_handle, &io_status);
+  block->written = block->used;
   return status;
 }
 
-// Buffer the log entry to the log buffer.
+// Waits until a write of the block completes.
+_Use_decl_annotations_ static void LogpWaitForFileBlock(LogpFileBlock *block) {
+  if (!block->pending) {
+    return;
+  }
+  ZwWaitForSingleObject(block->event_handle, FALSE, nullptr);
+  block->pending = false;
+  if (!NT_SUCCESS(block->io_status.Status)) {
+    LogpDbgBreak();
+  }
+}
+
+// Returns true when a write of any block may be in progress.
+_Use_decl_annotations_ static bool LogpIsWritePending(
+    const LogBufferInfo &info) {
+  return info.blocks[0].pending || info.blocks[1].pending;
+}
+
+// Flushes the file system cache of the log file. Writes have to be completed
+// already.
+_Use_decl_annotations_ static void LogpFlushFile(LogBufferInfo *info) {
+  info->file_dirty = false;
+  IO_STATUS_BLOCK io_status = {};
+  if (!NT_SUCCESS(ZwFlushBuffersFile(info->log_file_handle, &io_status))) {
+    LogpDbgBreak();
+  }
+}
+
+// Copies a message into the shared ring when a consumer has it mapped. A
+// message too long for a single record is truncated.
+_Use_decl_annotations_ static void LogpWriteToSharedRing(const char *message,
+                                                         ULONG processor,
+                                                         ULONG64 timestamp) {
+  if (!SharedRingIsMapped()) {
+    return;
+  }
+
+  const auto header_size = FIELD_OFFSET(TraceLogRecord, message);
+  const auto size = static_cast<ULONG>(
+      min(header_size + strlen(message) + 1, kTraceRecordMaxSize));
+  const auto record =
+      reinterpret_cast<TraceLogRecord *>(SharedRingBegin(size));
+  if (!record) {
+    return;
+  }
+  const auto length = size - header_size - 1;
+  RtlCopyMemory(record->message, message, length);
+  record->message[length] = '\0';
+  record->header.processor = processor;
+  record->header.tsc = timestamp;
+  TraceCommit(&record->header, kTraceRecordLog);
+}
+
+// Buffer the log entry to the log buffer of the current processor.
 _Use_decl_annotations_ static NTSTATUS LogpBufferMessage(const char *message,
+                                                         bool printed,
+                                                         bool safe,
                                                          LogBufferInfo *info) {
   NT_ASSERT(info);
 
-  // Acquire a spin lock to add the log safely.
-  KLOCK_QUEUE_HANDLE lock_handle = {};
-  const auto old_irql = KeGetCurrentIrql();
-  if (old_irql < DISPATCH_LEVEL) {
-    KeAcquireInStackQueuedSpinLock(&info->spin_lock, &lock_handle);
-  } else {
-    KeAcquireInStackQueuedSpinLockAtDpcLevel(&info->spin_lock, &lock_handle);
+  const auto message_length = strlen(message) + 1;
+  bool needs_flush = false;
+  const auto entry = LogpReserveEntry(
+      static_cast<ULONG>(FIELD_OFFSET(LogpEntry, message) + message_length),
+      info, &needs_flush);
+  if (!entry) {
+    return STATUS_BUFFER_OVERFLOW;
   }
-  NT_ASSERT(KeGetCurrentIrql() >= DISPATCH_LEVEL);
 
-  // Copy the current log to the buffer.
-  SIZE_T used_buffer_size = info->log_buffer_tail - info->log_buffer_head;
-  auto status =
-      RtlStringCchCopyA(const_cast<char *>(info->log_buffer_tail),
-                        kLogpBufferUsableSize - used_buffer_size, message);
+  // Copy the current log to the buffer and publish it.
+  entry->printed = printed;
+  RtlCopyMemory(entry->message, message, message_length);
+  LogpCommitEntry(entry, kLogpEntryMessage);
+  if (needs_flush) {
+    LogpRequestFlush(info, safe);
+  }
+  return STATUS_SUCCESS;
+}
 
-  // Update info.log_max_usage if necessary.
-  if (NT_SUCCESS(status)) {
-    const auto message_length = strlen(message) + 1;
-    info->log_buffer_tail += message_length;
-    used_buffer_size += message_length;
-    if (used_buffer_size > info->log_max_usage) {
-      info->log_max_usage = used_buffer_size;  // Update
+// Buffer a format string and raw arguments to the log buffer of the current
+// processor.
+_Use_decl_annotations_ static NTSTATUS LogpBufferDeferredMessage(
+    ULONG level, const char *function_name, const char *format,
+    ULONG argument_count, va_list args, LogBufferInfo *info) {
+  NT_ASSERT(info);
+  NT_ASSERT(argument_count <= kLogpMaxDeferredArguments);
+
+  bool needs_flush = false;
+  const auto entry = LogpReserveEntry(
+      static_cast<ULONG>(FIELD_OFFSET(LogpEntry, message) +
+                         FIELD_OFFSET(LogpDeferredMessage, arguments) +
+                         sizeof(ULONG64) * argument_count),
+      info, &needs_flush);
+  if (!entry) {
+    return STATUS_BUFFER_OVERFLOW;
+  }
+
+  const auto deferred = reinterpret_cast<LogpDeferredMessage *>(entry->message);
+  deferred->format = format;
+  deferred->function_name = function_name;
+  deferred->level = level;
+  deferred->argument_count = argument_count;
+
+  // system_time is left out as it is computed from the timestamp later.
+  LogpGetExecutionContext(&deferred->context);
+
+  // On x64, every variadic argument occupies one 8-byte slot.
+  for (auto i = 0ul; i < argument_count; ++i) {
+    deferred->arguments[i] = va_arg(args, ULONG64);
+  }
+  LogpCommitEntry(entry, kLogpEntryDeferred);
+  if (needs_flush) {
+    LogpRequestFlush(info, true);
+  }
+  return STATUS_SUCCESS;
+}
+
+// Formats a deferred message in the same way as LogpPrint() does.
+_Use_decl_annotations_ static NTSTATUS LogpFormatDeferredMessage(
+    const LogBufferInfo &info, const LogpEntry &entry, char *log_buffer,
+    SIZE_T log_buffer_length) {
+  auto deferred = *reinterpret_cast<const LogpDeferredMessage *>(entry.message);
+  deferred.context.system_time = LogpTscToSystemTime(info, entry.timestamp);
+
+  // The saved slots are laid out as the caller's va_list was on x64.
+  const auto deferred_arguments =
+      reinterpret_cast<const LogpDeferredMessage *>(entry.message)->arguments;
+  char log_message[412];
+  auto status = RtlStringCchVPrintfA(
+      log_message, RTL_NUMBER_OF(log_message), deferred.format,
+      reinterpret_cast<va_list>(const_cast<ULONG64 *>(deferred_arguments)));
+  if (!NT_SUCCESS(status)) {
+    return status;
+  }
+  return LogpMakePrefix(deferred.level, deferred.function_name, log_message,
+                        deferred.context, log_buffer, log_buffer_length);
+}
+
+// Reserves an entry in the log buffer of the current processor. needs_flush is
+// set when the buffer reaches kLogpFlushWatermark with this entry, or a flush
+// requested from VMX-root is pending.
+_Use_decl_annotations_ static LogpEntry *LogpReserveEntry(
+    ULONG size, LogBufferInfo *info, bool *needs_flush) {
+  *needs_flush = false;
+  const auto processor = KeGetCurrentProcessorNumberEx(nullptr);
+  if (processor >= info->buffer_count) {
+    return nullptr;
+  }
+  auto &buffer = info->buffers[processor];
+
+  size = (size + kLogpEntryAlignment - 1) & ~(kLogpEntryAlignment - 1);
+
+  // Reserve space. A thread may be migrated to another processor after the
+  // processor number is read, and a VM-exit may interrupt a writer on the same
+  // processor, so the reservation has to be atomic even on its own buffer.
+  LONG64 head = 0;
+  ULONG offset = 0;
+  ULONG padding = 0;
+  for (;;) {
+    head = buffer.head;
+    offset = static_cast<ULONG>(head) & (kLogpBufferSize - 1);
+
+    // An entry never straddles the end of a buffer; the rest is padded instead
+    padding = (offset + size > kLogpBufferSize) ? kLogpBufferSize - offset : 0;
+    const auto used_buffer_size =
+        static_cast<SIZE_T>(head + padding + size - buffer.tail);
+    if (used_buffer_size > kLogpBufferSize) {
+      buffer.max_usage = kLogpBufferSize;  // Indicates overflow
+      InterlockedIncrement(&buffer.dropped);
+      return nullptr;
     }
-  } else {
-    info->log_max_usage = kLogpBufferSize;  // Indicates overflow
+    if (InterlockedCompareExchange64(&buffer.head, head + padding + size,
+                                     head) == head) {
+      // Update max_usage if necessary.
+      if (used_buffer_size > buffer.max_usage) {
+        buffer.max_usage = used_buffer_size;
+      }
+      *needs_flush = (static_cast<SIZE_T>(head - buffer.tail) <
+                          kLogpFlushWatermark &&
+                      used_buffer_size >= kLogpFlushWatermark) ||
+                     buffer.flush_pending;
+      break;
+    }
+  }
+
+  if (padding) {
+    const auto pad = reinterpret_cast<LogpEntry *>(buffer.buffer + offset);
+    pad->size = static_cast<USHORT>(padding);
+    pad->timestamp = 0;
+    LogpCommitEntry(pad, kLogpEntryPadding);
+    offset = 0;
+  }
+
+  const auto entry = reinterpret_cast<LogpEntry *>(buffer.buffer + offset);
+  entry->size = static_cast<USHORT>(size);
+  entry->timestamp = __rdtsc();
+  return entry;
+}
+
+// Publishes an entry reserved by LogpReserveEntry()
+_Use_decl_annotations_ static void LogpCommitEntry(LogpEntry *entry,
+                                                   LogpEntryState state) {
+  InterlockedExchange16(reinterpret_cast<volatile SHORT *>(&entry->state),
+                        state);
+}
+
+// Wakes up the log flush thread. A writer that may be in VMX-root only marks
+// the current processor's buffer, as KeInsertQueueDpc() takes the DPC queue
+// lock that the interrupted guest may hold. VMX-root always runs with
+// interrupts disabled, so any writer with RFLAGS.IF clear is treated so. A
+// writer at high IRQL otherwise queues a DPC to do it later.
+_Use_decl_annotations_ static void LogpRequestFlush(LogBufferInfo *info,
+                                                    bool safe) {
+  const auto processor = KeGetCurrentProcessorNumberEx(nullptr);
+  if (processor >= info->buffer_count) {
+    return;
+  }
+  auto &buffer = info->buffers[processor];
+  if (safe && !(__readeflags() & 0x200)) {
+    InterlockedExchange(&buffer.flush_pending, TRUE);
+    return;
   }
-  *info->log_buffer_tail = '\0';
 
-  if (old_irql < DISPATCH_LEVEL) {
-    KeReleaseInStackQueuedSpinLock(&lock_handle);
+  InterlockedExchange(&buffer.flush_pending, FALSE);
+  if (KeGetCurrentIrql() <= DISPATCH_LEVEL) {
+    KeSetEvent(&info->flush_event, IO_NO_INCREMENT, FALSE);
   } else {
-    KeReleaseInStackQueuedSpinLockFromDpcLevel(&lock_handle);
+    KeInsertQueueDpc(&buffer.flush_dpc, nullptr, nullptr);
   }
-  return status;
+}
+
+// Wakes up the log flush thread on behalf of LogpRequestFlush().
+_Use_decl_annotations_ static void LogpFlushDpcRoutine(KDPC *dpc,
+                                                       PVOID deferred_context,
+                                                       PVOID system_argument1,
+                                                       PVOID system_argument2) {
+  UNREFERENCED_PARAMETER(dpc);
+  UNREFERENCED_PARAMETER(system_argument1);
+  UNREFERENCED_PARAMETER(system_argument2);
+
+  const auto info = static_cast<LogBufferInfo *>(deferred_context);
+  KeSetEvent(&info->flush_event, IO_NO_INCREMENT, FALSE);
+}
+
+// Returns the oldest written entry in the buffer, or nullptr if none. Padding
+// entries are released on the way.
+_Use_decl_annotations_ static LogpEntry *LogpPeekEntry(
+    LogpProcessorBuffer *buffer) {
+  while (buffer->tail != buffer->head) {
+    const auto offset =
+        static_cast<ULONG>(buffer->tail) & (kLogpBufferSize - 1);
+    const auto entry = reinterpret_cast<LogpEntry *>(buffer->buffer + offset);
+    switch (entry->state) {
+      case kLogpEntryInvalid:
+        return nullptr;  // Still being written
+      case kLogpEntryPadding:
+        LogpReleaseEntry(buffer, entry);
+        break;
+      default:
+        return entry;
+    }
+  }
+  return nullptr;
+}
+
+// Zeroes the oldest entry in the buffer and makes its space reusable
+_Use_decl_annotations_ static void LogpReleaseEntry(
+    LogpProcessorBuffer *buffer, LogpEntry *entry) {
+  const auto size = entry->size;
+  RtlZeroMemory(entry, size);
+  InterlockedExchange64(&buffer->tail, buffer->tail + size);
+}
+
+// Returns true when no entry is in any log buffer.
+_Use_decl_annotations_ static bool LogpIsLogBufferEmpty(
+    const LogBufferInfo &info) {
+  for (auto i = 0ul; i < info.buffer_count; ++i) {
+    if (info.buffers[i].head != info.buffers[i].tail) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Returns the biggest usage among log buffers.
+_Use_decl_annotations_ static SIZE_T LogpGetMaxUsage(
+    const LogBufferInfo &info) {
+  SIZE_T max_usage = 0;
+  for (auto i = 0ul; i < info.buffer_count; ++i) {
+    max_usage = max(max_usage, info.buffers[i].max_usage);
+  }
+  return max_usage;
 }
 
 // Calls DbgPrintEx() while converting \r\n to \n\0
@@ -722,15 +1719,11 @@ _Use_decl_annotations_ static void LogpDoDbgPrint(char *message) {
 // Returns true when a log file is enabled.
 _Use_decl_annotations_ static bool LogpIsLogFileEnabled(
     const LogBufferInfo &info) {
-  if (info.log_buffer1) {
-    NT_ASSERT(info.log_buffer2);
-    NT_ASSERT(info.log_buffer_head);
-    NT_ASSERT(info.log_buffer_tail);
+  if (info.buffers) {
+    NT_ASSERT(info.buffer_count);
     return true;
   }
-  NT_ASSERT(!info.log_buffer2);
-  NT_ASSERT(!info.log_buffer_head);
-  NT_ASSERT(!info.log_buffer_tail);
+  NT_ASSERT(!info.buffer_count);
   return false;
 }
 
@@ -759,7 +1752,8 @@ _Use_decl_annotations_ static bool LogpIsLogNeeded(ULONG level) {
 }
 
 // A thread runs as long as info.buffer_flush_thread_should_be_alive is true and
-// flushes a log buffer to a log file every kLogpLogFlushIntervalMsec msec.
+// flushes log buffers to a log file when info.flush_event is signaled, or every
+// kLogpFlushIdleTimeoutMsec msec.
 _Use_decl_annotations_ static VOID LogpBufferFlushThreadRoutine(
     void *start_context) {
   PAGED_CODE()
@@ -769,17 +1763,48 @@ _Use_decl_annotations_ static VOID LogpBufferFlushThreadRoutine(
   HYPERPLATFORM_LOG_DEBUG("Log thread started (TID= %p).",
                           PsGetCurrentThreadId());
 
+  LARGE_INTEGER timeout = {};
+  timeout.QuadPart = -(10000ll * kLogpFlushIdleTimeoutMsec);
   while (info->buffer_flush_thread_should_be_alive) {
-    NT_ASSERT(LogpIsLogFileActivated(*info));
-    if (info->log_buffer_head[0]) {
+    KeWaitForSingleObject(&info->flush_event, Executive, KernelMode, FALSE,
+                          &timeout);
+
+    // Flushes requested from VMX-root are served by this round.
+    for (auto i = 0ul; i < info->buffer_count; ++i) {
+      InterlockedExchange(&info->buffers[i].flush_pending, FALSE);
+    }
+
+    // Report messages suppressed at call sites that have gone quiet.
+    for (auto &site : g_logp_call_sites) {
+      if (site.format && site.function_name) {
+        LogpReportSuppressedMessages(&site, site.level);
+      }
+    }
+
+    NT_ASSERT(LogpIsLogFileActivated(*info) ||
+              !info->buffer_flush_thread_should_be_alive);
+    if (!LogpIsLogBufferEmpty(*info)) {
       NT_ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
       NT_ASSERT(!KeAreAllApcsDisabled());
       status = LogpFlushLogBuffer(info);
-      // Do not flush the file for overall performance. Even a case of
-      // bug check, we should be able to recover logs by looking at both
-      // log buffers.
+      // Do not flush the file while logs keep coming for overall
+      // performance. It is flushed once the buffers become empty.
+    } else {
+      // Nothing to write. Complete writes started earlier and flush them out
+      // of the cache so that they survive a bug check or power loss.
+      for (auto &block : info->blocks) {
+        LogpWaitForFileBlock(&block);
+      }
+      if (info->file_dirty) {
+        LogpFlushFile(info);
+      }
+      KeSetEvent(&info->idle_event, IO_NO_INCREMENT, FALSE);
     }
-    LogpSleep(kLogpLogFlushIntervalMsec);
+  }
+
+  // Write entries logged while the thread was being stopped.
+  if (!LogpIsLogBufferEmpty(*info)) {
+    status = LogpFlushLogBuffer(info);
   }
   PsTerminateSystemThread(status);
 }
@@ -793,19 +1818,65 @@ _Use_decl_annotations_ static NTSTATUS LogpSleep(LONG millisecond) {
   return KeDelayExecutionThread(KernelMode, FALSE, &interval);
 }
 
-// Marks the message as it is already printed out, or clears the printed bit and
-// restores it to the original
-_Use_decl_annotations_ static void LogpSetPrintedBit(char *message, bool on) {
-  if (on) {
-    message[0] |= 0x80;
-  } else {
-    message[0] &= 0x7f;
+// Records a pair of TSC and system time, and a frequency of TSC, to convert
+// timestamps of deferred messages.
+_Use_decl_annotations_ static void LogpInitializeTimeBase(LogBufferInfo *info) {
+  PAGED_CODE()
+
+  const auto frequency = PerfGetTscFrequency();
+  KeQuerySystemTime(&info->base_system_time);
+  info->base_tsc = __rdtsc();
+  info->tsc_frequency = frequency;
+}
+
+// Writes the numbers of entries lost because log buffers were full, if any.
+_Use_decl_annotations_ static void LogpReportDroppedMessages(
+    LogBufferInfo *info) {
+  for (auto i = 0ul; i < info->buffer_count; ++i) {
+    const auto dropped = InterlockedExchange(&info->buffers[i].dropped, 0);
+    if (!dropped) {
+      continue;
+    }
+
+    char log_message[100];
+    auto status = RtlStringCchPrintfA(
+        log_message, RTL_NUMBER_OF(log_message),
+        "Dropped %ld messages as the log buffer was full.", dropped);
+    if (!NT_SUCCESS(status)) {
+      continue;
+    }
+    LogpMessageContext context = {};
+    LogpGetMessageContext(&context);
+    context.processor = i;
+    char message[512];
+    status = LogpMakePrefix(kLogpLevelWarn, __FUNCTION__, log_message, context,
+                            message, RTL_NUMBER_OF(message));
+    if (!NT_SUCCESS(status)) {
+      continue;
+    }
+    LogpAppendToFile(info, message, static_cast<ULONG>(strlen(message)));
+    LogpWriteToSharedRing(message, i, __rdtsc());
+    LogpDoDbgPrint(message);
   }
 }
 
-// Tests if the printed bit is on
-_Use_decl_annotations_ static bool LogpIsPrinted(char *message) {
-  return (message[0] & 0x80) != 0;
+// Converts a timestamp into system time. Returns the current time when the
+// TSC frequency is unknown.
+_Use_decl_annotations_ static LARGE_INTEGER LogpTscToSystemTime(
+    const LogBufferInfo &info, ULONG64 tsc) {
+  LARGE_INTEGER system_time = {};
+  if (!info.tsc_frequency) {
+    KeQuerySystemTime(&system_time);
+    return system_time;
+  }
+
+  // Split into seconds and the rest to avoid overflowing 64 bits.
+  const auto frequency = static_cast<LONG64>(info.tsc_frequency);
+  const auto delta = static_cast<LONG64>(tsc - info.base_tsc);
+  system_time.QuadPart = info.base_system_time.QuadPart +
+                         (delta / frequency) * 10000000ll +
+                         (delta % frequency) * 10000000ll / frequency;
+  return system_time;
 }
 
 // Sets a break point that works only when a debugger is present
@@ -34,20 +34,25 @@ extern "C" {
 ///
 /// A message should not exceed 512 bytes after all string construction is
 /// done; otherwise this macro fails to log and returns non STATUS_SUCCESS.
+///
+/// \a format must be a string literal and is checked against types of
+/// arguments at compile time. A log below HYPERPLATFORM_LOG_MIN_LEVEL is
+/// removed at compile time together with evaluation of its arguments, and
+/// returns STATUS_SUCCESS.
 #define HYPERPLATFORM_LOG_DEBUG(format, ...) \
-  LogpPrint(kLogpLevelDebug, __FUNCTION__, (format), __VA_ARGS__)
+  HYPERPLATFORM_LOGP_PRINT(kLogpLevelDebug, (format), __VA_ARGS__)
 
 /// @see HYPERPLATFORM_LOG_DEBUG
 #define HYPERPLATFORM_LOG_INFO(format, ...) \
-  LogpPrint(kLogpLevelInfo, __FUNCTION__, (format), __VA_ARGS__)
+  HYPERPLATFORM_LOGP_PRINT(kLogpLevelInfo, (format), __VA_ARGS__)
 
 /// @see HYPERPLATFORM_LOG_DEBUG
 #define HYPERPLATFORM_LOG_WARN(format, ...) \
-  LogpPrint(kLogpLevelWarn, __FUNCTION__, (format), __VA_ARGS__)
+  HYPERPLATFORM_LOGP_PRINT(kLogpLevelWarn, (format), __VA_ARGS__)
 
 /// @see HYPERPLATFORM_LOG_DEBUG
 #define HYPERPLATFORM_LOG_ERROR(format, ...) \
-  LogpPrint(kLogpLevelError, __FUNCTION__, (format), __VA_ARGS__)
+  HYPERPLATFORM_LOGP_PRINT(kLogpLevelError, (format), __VA_ARGS__)
 
 /// Buffers a message as respective severity
 /// @param format   A format string
@@ -57,24 +62,33 @@ extern "C" {
 /// It is strongly recommended to use it when a status of a system is not
 /// expectable in order to avoid system instability.
 /// @see HYPERPLATFORM_LOG_DEBUG
-#define HYPERPLATFORM_LOG_DEBUG_SAFE(format, ...)                        \
-  LogpPrint(kLogpLevelDebug | kLogpLevelOptSafe, __FUNCTION__, (format), \
-            __VA_ARGS__)
+#define HYPERPLATFORM_LOG_DEBUG_SAFE(format, ...)                          \
+  HYPERPLATFORM_LOGP_PRINT(kLogpLevelDebug | kLogpLevelOptSafe, (format), \
+                           __VA_ARGS__)
 
 /// @see HYPERPLATFORM_LOG_DEBUG_SAFE
-#define HYPERPLATFORM_LOG_INFO_SAFE(format, ...)                        \
-  LogpPrint(kLogpLevelInfo | kLogpLevelOptSafe, __FUNCTION__, (format), \
-            __VA_ARGS__)
+#define HYPERPLATFORM_LOG_INFO_SAFE(format, ...)                          \
+  HYPERPLATFORM_LOGP_PRINT(kLogpLevelInfo | kLogpLevelOptSafe, (format), \
+                           __VA_ARGS__)
 
 /// @see HYPERPLATFORM_LOG_DEBUG_SAFE
-#define HYPERPLATFORM_LOG_WARN_SAFE(format, ...)                        \
-  LogpPrint(kLogpLevelWarn | kLogpLevelOptSafe, __FUNCTION__, (format), \
-            __VA_ARGS__)
+#define HYPERPLATFORM_LOG_WARN_SAFE(format, ...)                          \
+  HYPERPLATFORM_LOGP_PRINT(kLogpLevelWarn | kLogpLevelOptSafe, (format), \
+                           __VA_ARGS__)
 
 /// @see HYPERPLATFORM_LOG_DEBUG_SAFE
-#define HYPERPLATFORM_LOG_ERROR_SAFE(format, ...)                        \
-  LogpPrint(kLogpLevelError | kLogpLevelOptSafe, __FUNCTION__, (format), \
-            __VA_ARGS__)
+#define HYPERPLATFORM_LOG_ERROR_SAFE(format, ...)                          \
+  HYPERPLATFORM_LOGP_PRINT(kLogpLevelError | kLogpLevelOptSafe, (format), \
+                           __VA_ARGS__)
+
+/// Implements HYPERPLATFORM_LOG_*(); checks a format at compile time, and
+/// calls LogpPrint() only when a level is compiled in and enabled.
+#define HYPERPLATFORM_LOGP_PRINT(level, format, ...)                        \
+  (static_cast<void>(sizeof(LogpFormatChecked<LogpCheckFormat(              \
+       format, decltype(LogpArgumentTypes(__VA_ARGS__))())>)),              \
+   (LogpIsLevelCompiledIn(level) && LogpIsLevelEnabled(level))              \
+       ? LogpPrint((level), __FUNCTION__, format, __VA_ARGS__)              \
+       : STATUS_SUCCESS)
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -89,6 +103,20 @@ static const auto kLogpLevelInfo = 0x20ul;   //!< Bit mask for INFO level logs
 static const auto kLogpLevelWarn = 0x40ul;   //!< Bit mask for WARN level logs
 static const auto kLogpLevelError = 0x80ul;  //!< Bit mask for ERROR level logs
 
+/// Bit mask for all levels
+static const auto kLogpLevelMask =
+    kLogpLevelError | kLogpLevelWarn | kLogpLevelInfo | kLogpLevelDebug;
+
+/// The lowest level of logs compiled in. Defaults to INFO in release builds;
+/// define it to kLogpLevel* to override.
+#if !defined(HYPERPLATFORM_LOG_MIN_LEVEL)
+#if defined(DBG)
+#define HYPERPLATFORM_LOG_MIN_LEVEL kLogpLevelDebug
+#else
+#define HYPERPLATFORM_LOG_MIN_LEVEL kLogpLevelInfo
+#endif
+#endif
+
 /// For LogInitialization(). Enables all levels of logs
 static const auto kLogPutLevelDebug =
     kLogpLevelError | kLogpLevelWarn | kLogpLevelInfo | kLogpLevelDebug;
@@ -118,6 +146,11 @@ static const auto kLogOptDisableProcessorNumber = 0x400ul;
 /// For LogInitialization(). Do not log to debug buffer
 static const auto kLogOptDisableDbgPrint = 0x800ul;
 
+/// For LogInitialization(). Defer formatting of HYPERPLATFORM_LOG_*_SAFE() to
+/// the log flush thread. String arguments of those logs must remain valid
+/// until they are flushed, for example, string literals.
+static const auto kLogOptDeferSafe = 0x1000ul;
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // types
@@ -177,13 +210,244 @@ NTSTATUS LogpPrint(_In_ ULONG level, _In_z_ const char *function_name,
 // variables
 //
 
+/// A flag given to LogInitialization(); use HYPERPLATFORM_LOG_*() macros
+/// instead.
+extern ULONG g_logp_debug_flag;
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // implementations
 //
 
+/// Tells whether a level is at or above HYPERPLATFORM_LOG_MIN_LEVEL
+constexpr bool LogpIsLevelCompiledIn(_In_ ULONG level) {
+  return (level & kLogpLevelMask) >= HYPERPLATFORM_LOG_MIN_LEVEL;
+}
+
+/// Tells whether a level is enabled by LogInitialization()
+inline bool LogpIsLevelEnabled(_In_ ULONG level) {
+  return (g_logp_debug_flag & level & kLogpLevelMask) != 0;
+}
+
 }  // extern "C"
 
+// Compile-time checking of formats of HYPERPLATFORM_LOG_*(). Each argument is
+// classified by its type, and each conversion specification by types it
+// accepts. A mismatch, or a different number of conversions and arguments,
+// calls LogpFormatDoesNotMatchArguments() during constant evaluation, which
+// fails compilation at the log. '*' in width and precision is not supported.
+// Sizes follow the data model being built: 'l' takes a long, which is 32 bits
+// on Windows, and 'I' and 'p' take a pointer-sized integer, so a format
+// passing on x64 also passes on x86 for the same types.
+
+/// Bits of argument kinds
+enum LogpArgumentKind : unsigned int {
+  kLogpArgumentUnknown = 0,
+  kLogpArgumentInteger = 0x1,    //!< 32 bits or less
+  kLogpArgumentInteger64 = 0x2,  //!< 64 bits
+  kLogpArgumentPointer = 0x4,
+  kLogpArgumentString = 0x8,       //!< char * or unsigned char *
+  kLogpArgumentWideString = 0x10,  //!< wchar_t *
+  kLogpArgumentFloat = 0x20,
+};
+
+/// Classifies an argument type. An enum is an integer of its size.
+template <typename T>
+struct LogpArgumentKindOf {
+  static constexpr unsigned int value =
+      __is_enum(T) ? (sizeof(T) > 4 ? kLogpArgumentInteger64
+                                    : kLogpArgumentInteger)
+                   : kLogpArgumentUnknown;
+};
+
+/// Classifies an integer type by its size
+template <typename T>
+struct LogpIntegerKindOf {
+  static constexpr unsigned int value =
+      (sizeof(T) > 4) ? kLogpArgumentInteger64 : kLogpArgumentInteger;
+};
+
+template <> struct LogpArgumentKindOf<bool> : LogpIntegerKindOf<bool> {};
+template <> struct LogpArgumentKindOf<char> : LogpIntegerKindOf<char> {};
+template <>
+struct LogpArgumentKindOf<signed char> : LogpIntegerKindOf<signed char> {};
+template <>
+struct LogpArgumentKindOf<unsigned char> : LogpIntegerKindOf<unsigned char> {};
+#if defined(_NATIVE_WCHAR_T_DEFINED) || !defined(_MSC_VER)
+// Otherwise wchar_t is unsigned short (/Zc:wchar_t-)
+template <> struct LogpArgumentKindOf<wchar_t> : LogpIntegerKindOf<wchar_t> {};
+#endif
+template <> struct LogpArgumentKindOf<short> : LogpIntegerKindOf<short> {};
+template <>
+struct LogpArgumentKindOf<unsigned short>
+    : LogpIntegerKindOf<unsigned short> {};
+template <> struct LogpArgumentKindOf<int> : LogpIntegerKindOf<int> {};
+template <>
+struct LogpArgumentKindOf<unsigned int> : LogpIntegerKindOf<unsigned int> {};
+template <> struct LogpArgumentKindOf<long> : LogpIntegerKindOf<long> {};
+template <>
+struct LogpArgumentKindOf<unsigned long> : LogpIntegerKindOf<unsigned long> {};
+template <>
+struct LogpArgumentKindOf<long long> : LogpIntegerKindOf<long long> {};
+template <>
+struct LogpArgumentKindOf<unsigned long long>
+    : LogpIntegerKindOf<unsigned long long> {};
+
+template <typename T>
+struct LogpArgumentKindOf<T *> {
+  static constexpr unsigned int value = kLogpArgumentPointer;
+};
+template <>
+struct LogpArgumentKindOf<decltype(nullptr)> : LogpArgumentKindOf<void *> {};
+template <> struct LogpArgumentKindOf<char *> {
+  static constexpr unsigned int value =
+      kLogpArgumentString | kLogpArgumentPointer;
+};
+template <>
+struct LogpArgumentKindOf<const char *> : LogpArgumentKindOf<char *> {};
+template <>
+struct LogpArgumentKindOf<unsigned char *> : LogpArgumentKindOf<char *> {};
+template <>
+struct LogpArgumentKindOf<const unsigned char *> : LogpArgumentKindOf<char *> {
+};
+template <> struct LogpArgumentKindOf<wchar_t *> {
+  static constexpr unsigned int value =
+      kLogpArgumentWideString | kLogpArgumentPointer;
+};
+template <>
+struct LogpArgumentKindOf<const wchar_t *> : LogpArgumentKindOf<wchar_t *> {};
+template <> struct LogpArgumentKindOf<float> {
+  static constexpr unsigned int value = kLogpArgumentFloat;
+};
+template <> struct LogpArgumentKindOf<double> : LogpArgumentKindOf<float> {};
+template <>
+struct LogpArgumentKindOf<long double> : LogpArgumentKindOf<float> {};
+
+/// A list of argument types of a log
+template <typename... Args>
+struct LogpArgumentList {};
+
+/// Returns a list of decayed argument types; only used in decltype()
+template <typename... Args>
+LogpArgumentList<Args...> LogpArgumentTypes(Args...);
+
+/// Instantiated with a result of LogpCheckFormat() to force its constant
+/// evaluation
+template <bool kMatched>
+struct LogpFormatChecked {};
+
+/// Deliberately not constexpr; see above
+void LogpFormatDoesNotMatchArguments();
+
+/// Returns a pointer after the next '%' starting a conversion, or nullptr
+constexpr const char *LogpFindConversion(const char *format) {
+  for (; *format; ++format) {
+    if (*format != '%') {
+      continue;
+    }
+    if (format[1] != '%') {
+      return format + 1;
+    }
+    ++format;
+  }
+  return nullptr;
+}
+
+/// Returns kinds of arguments a conversion specification accepts, or
+/// kLogpArgumentUnknown if it is not supported
+constexpr unsigned int LogpParseConversion(const char *spec) {
+  while (*spec == '-' || *spec == '+' || *spec == ' ' || *spec == '#' ||
+         *spec == '0') {
+    ++spec;
+  }
+  while (*spec >= '0' && *spec <= '9') {
+    ++spec;
+  }
+  if (*spec == '.') {
+    ++spec;
+    while (*spec >= '0' && *spec <= '9') {
+      ++spec;
+    }
+  }
+
+  // Sizes of integers. 'I' alone is pointer-sized.
+  const auto pointer_sized =
+      LogpIntegerKindOf<void *>::value | kLogpArgumentPointer;
+  unsigned int integer = kLogpArgumentInteger;
+  auto wide = false;
+  if (spec[0] == 'I' && spec[1] == '6' && spec[2] == '4') {
+    integer = kLogpArgumentInteger64;
+    spec += 3;
+  } else if (spec[0] == 'I' && spec[1] == '3' && spec[2] == '2') {
+    spec += 3;
+  } else if (spec[0] == 'I') {
+    integer = pointer_sized;
+    ++spec;
+  } else if (spec[0] == 'l' && spec[1] == 'l') {
+    integer = kLogpArgumentInteger64;
+    spec += 2;
+  } else if (spec[0] == 'l') {
+    integer = LogpIntegerKindOf<long>::value;
+    wide = true;
+    ++spec;
+  } else if (spec[0] == 'w') {
+    wide = true;
+    ++spec;
+  } else {
+    while (*spec == 'h') {
+      ++spec;
+    }
+  }
+
+  switch (*spec) {
+    case 'd':
+    case 'i':
+    case 'o':
+    case 'u':
+    case 'x':
+    case 'X':
+    case 'c':
+    case 'C':
+      return integer;
+    case 'p':
+      return pointer_sized;
+    case 's':
+      return wide ? kLogpArgumentWideString : kLogpArgumentString;
+    case 'S':
+      return kLogpArgumentWideString;
+    case 'Z':
+      return kLogpArgumentPointer;
+    case 'e':
+    case 'E':
+    case 'f':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+      return kLogpArgumentFloat;
+    default:
+      return kLogpArgumentUnknown;
+  }
+}
+
+/// Checks that no conversion is left for missing arguments
+constexpr bool LogpCheckFormat(const char *format, LogpArgumentList<>) {
+  return LogpFindConversion(format) ? (LogpFormatDoesNotMatchArguments(), false)
+                                    : true;
+}
+
+/// Checks a conversion against the first argument, and the rest recursively
+template <typename First, typename... Rest>
+constexpr bool LogpCheckFormat(const char *format,
+                               LogpArgumentList<First, Rest...>) {
+  return (LogpFindConversion(format) &&
+          (LogpParseConversion(LogpFindConversion(format)) &
+           LogpArgumentKindOf<First>::value))
+             ? LogpCheckFormat(LogpFindConversion(format) + 1,
+                               LogpArgumentList<Rest...>())
+             : (LogpFormatDoesNotMatchArguments(), false);
+}
+
 #if 0
 inline ULONG Log(const char *format, ...) {
   char buffer[256];
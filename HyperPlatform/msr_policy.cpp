@@ -0,0 +1,155 @@
+// Copyright (c) 2015-2019, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements the MSR policy table.
+
+#include "msr_policy.h"
+#include <limits.h>  // for CHAR_BIT
+#include "common.h"
+#include "log.h"
+#include "util.h"
+
+extern "C" {
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// The policy table. Only MSRs backed by guest-state fields of VMCS are trapped
+// by default, as the VMCS holds their guest values while the VMM runs.
+// IA32_GS_BASE is not listed since the guest reads it frequently and the MSR
+// holds the guest value anyway.
+static constexpr MsrPolicy kMsrpPolicies[] = {
+    {Msr::kIa32SysenterCs, MsrAction::kVmcs, MsrAction::kPassThrough,
+     VmcsField::kGuestSysenterCs, nullptr},
+    {Msr::kIa32SysenterEsp, MsrAction::kVmcs, MsrAction::kPassThrough,
+     VmcsField::kGuestSysenterEsp, nullptr},
+    {Msr::kIa32SysenterEip, MsrAction::kVmcs, MsrAction::kPassThrough,
+     VmcsField::kGuestSysenterEip, nullptr},
+    {Msr::kIa32Debugctl, MsrAction::kVmcs, MsrAction::kPassThrough,
+     VmcsField::kGuestIa32Debugctl, nullptr},
+    {Msr::kIa32FsBase, MsrAction::kVmcs, MsrAction::kPassThrough,
+     VmcsField::kGuestFsBase, nullptr},
+};
+
+// Tells whether every kEmulate action in the table has a routine to call.
+// VmmpHandleMsrAccess() calls it in VMX-root mode without checking it.
+constexpr bool MsrpHasEmulationRoutines() {
+  for (const auto &policy : kMsrpPolicies) {
+    if ((policy.read_action == MsrAction::kEmulate ||
+         policy.write_action == MsrAction::kEmulate) &&
+        !policy.emulation_routine) {
+      return false;
+    }
+  }
+  return true;
+}
+static_assert(MsrpHasEmulationRoutines(),
+              "A kEmulate policy has no emulation_routine");
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static bool MsrpIsReadable(_In_ Msr msr);
+
+static void MsrpSetBit(_Inout_ UCHAR *msr_bitmap, _In_ Msr msr,
+                       _In_ bool read_access);
+
+#if defined(ALLOC_PRAGMA)
+#pragma alloc_text(PAGE, MsrPolicyBuildBitmap)
+#pragma alloc_text(PAGE, MsrpIsReadable)
+#pragma alloc_text(PAGE, MsrpSetBit)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Sets bits of the MSR bitmap for MSRs the table traps
+_Use_decl_annotations_ void MsrPolicyBuildBitmap(void *msr_bitmap) {
+  PAGED_CODE()
+
+  const auto bitmap = static_cast<UCHAR *>(msr_bitmap);
+  for (const auto &policy : kMsrpPolicies) {
+    const auto trap_read = policy.read_action != MsrAction::kPassThrough;
+    const auto trap_write = policy.write_action != MsrAction::kPassThrough;
+    if (!trap_read && !trap_write) {
+      continue;
+    }
+    if (!MsrpIsReadable(policy.msr)) {
+      HYPERPLATFORM_LOG_DEBUG("MSR %08x is not supported. Not trapped.",
+                              static_cast<ULONG>(policy.msr));
+      continue;
+    }
+    if (trap_read) {
+      MsrpSetBit(bitmap, policy.msr, true);
+    }
+    if (trap_write) {
+      MsrpSetBit(bitmap, policy.msr, false);
+    }
+  }
+}
+
+// Checks if an MSR can be read without #GP
+_Use_decl_annotations_ static bool MsrpIsReadable(Msr msr) {
+  PAGED_CODE()
+
+  __try {
+    UtilReadMsr(msr);
+    return true;
+
+#pragma prefast(suppress : __WARNING_EXCEPTIONEXECUTEHANDLER, "Catch all.");
+  } __except (EXCEPTION_EXECUTE_HANDLER) {
+    return false;
+  }
+}
+
+// Sets a bit of an MSR in the MSR bitmap. MSRs outside of the ranges the bitmap
+// covers always cause VM-exit and are ignored.
+_Use_decl_annotations_ static void MsrpSetBit(UCHAR *msr_bitmap, Msr msr,
+                                              bool read_access) {
+  PAGED_CODE()
+
+  // read low, read high, write low and write high in this order; 1KB each
+  auto index = static_cast<ULONG>(msr);
+  auto offset = (read_access) ? 0ul : 2048ul;
+  if (index >= 0xc0000000 && index <= 0xc0001fff) {
+    index -= 0xc0000000;
+    offset += 1024;
+  } else if (index > 0x1fff) {
+    return;
+  }
+  msr_bitmap[offset + index / CHAR_BIT] |= 1 << (index % CHAR_BIT);
+}
+
+// Finds a policy of an MSR
+_Use_decl_annotations_ const MsrPolicy *MsrPolicyFind(Msr msr) {
+  for (const auto &policy : kMsrpPolicies) {
+    if (policy.msr == msr) {
+      return &policy;
+    }
+  }
+  return nullptr;
+}
+
+}  // extern "C"
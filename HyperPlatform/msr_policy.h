@@ -0,0 +1,103 @@
+// Copyright (c) 2015-2019, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Declares interfaces to the MSR policy table.
+///
+/// The table declares what the VMM does on RDMSR and WRMSR of each MSR, and
+/// the MSR bitmap is generated from it. MSRs not listed in the table are not
+/// trapped, so the guest accesses them directly and the processor raises #GP
+/// for unsupported ones as it would without the VMM.
+
+#ifndef HYPERPLATFORM_MSR_POLICY_H_
+#define HYPERPLATFORM_MSR_POLICY_H_
+
+#include <ntddk.h>
+#include "ia32_type.h"
+
+extern "C" {
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+/// What the VMM does on an access to an MSR
+enum class MsrAction : unsigned char {
+  kPassThrough,  //!< Not trapped; the guest accesses the MSR directly
+  kVmcs,         //!< Trapped and redirected to MsrPolicy::vmcs_field
+  kEmulate,      //!< Trapped and handled by MsrPolicy::emulation_routine,
+                 //!< which must not be nullptr
+  kLog,          //!< Trapped, logged and executed on the MSR
+};
+
+/// Emulates RDMSR or WRMSR in VMX-root mode
+/// @param msr  An MSR being accessed
+/// @param read_access  true for RDMSR, false for WRMSR
+/// @param value  A value to return for RDMSR, or a value written by WRMSR
+/// @return false to inject #GP into the guest
+using MsrEmulationRoutine = bool(_In_ Msr msr, _In_ bool read_access,
+                                 _Inout_ ULONG64 *value);
+
+/// A policy of an MSR
+struct MsrPolicy {
+  Msr msr;
+  MsrAction read_action;
+  MsrAction write_action;
+  VmcsField vmcs_field;  //!< Used for MsrAction::kVmcs
+  MsrEmulationRoutine *emulation_routine;  //!< Used for MsrAction::kEmulate
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+/// Sets bits of the MSR bitmap for MSRs the table traps
+/// @param msr_bitmap  A zeroed 4KB MSR bitmap
+///
+/// Each listed MSR is read once to check that it exists. An MSR that causes
+/// #GP is left untrapped so that the processor raises #GP natively.
+_IRQL_requires_max_(PASSIVE_LEVEL) void MsrPolicyBuildBitmap(
+    _Out_writes_bytes_(PAGE_SIZE) void *msr_bitmap);
+
+/// Finds a policy of an MSR
+/// @param msr  An MSR being accessed
+/// @return A policy of the MSR, or nullptr if not listed
+const MsrPolicy *MsrPolicyFind(_In_ Msr msr);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+/// Returns an action of a policy for an access
+/// @param policy  A policy returned by MsrPolicyFind(), or nullptr
+/// @param read_access  true for RDMSR, false for WRMSR
+/// @return An action to take
+inline MsrAction MsrPolicyGetAction(_In_opt_ const MsrPolicy *policy,
+                                    _In_ bool read_access) {
+  if (!policy) {
+    return MsrAction::kPassThrough;
+  }
+  return (read_access) ? policy->read_action : policy->write_action;
+}
+
+}  // extern "C"
+
+#endif  // HYPERPLATFORM_MSR_POLICY_H_
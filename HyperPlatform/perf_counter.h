@@ -110,8 +110,61 @@
 //
 
 /// Responsible for collecting and saving data supplied by PerfCounter.
+///
+/// Each processor has its own cache-line aligned table of entries indexed by
+/// open addressing on a location pointer, so that measurement on different
+/// processors never shares a cache line or a lock. Tables are merged only when
+/// results are reported.
+///
+/// Each entry also keeps a histogram of elapsed times in the way HDR
+/// histograms do: a value goes to a bucket of its highest set bit, which is
+/// linearly split into kHistogramSubBucketCount sub-buckets. This bounds an
+/// error of reported percentiles to 1/kHistogramSubBucketCount of a value at
+/// a fixed cost of a few instructions per measurement.
+///
+/// Scopes measured by PerfCounter are also pushed onto a stack of the current
+/// processor. When a scope ends, its elapsed time is subtracted from the
+/// exclusive time of its parent, and the exclusive time of its own is added
+/// to the call path from the outermost scope, which is reported in a
+/// flame-graph-compatible form by SnapshotPaths(). This assumes a scope is
+/// not preempted by another thread measuring on the same processor, which
+/// holds in VMX-root mode. Otherwise, times may be attributed to wrong paths.
 class PerfCollector {
  public:
+  /// log2 of a number of linear sub-buckets per power of two
+  static const ULONG kHistogramSubBucketBits = 3;
+
+  /// A number of linear sub-buckets per power of two
+  static const ULONG kHistogramSubBucketCount = 1ul
+                                                << kHistogramSubBucketBits;
+
+  /// Values of this power of two or larger are counted in the last bucket
+  static const ULONG kHistogramMaxExponent = 40;
+
+  /// A number of buckets of a histogram
+  static const ULONG kHistogramBucketCount =
+      (kHistogramMaxExponent - kHistogramSubBucketBits + 1)
+      << kHistogramSubBucketBits;
+
+  /// Summarizes performance data of a location
+  struct PerfSummary {
+    ULONG64 total_execution_count;  //!< How many times executed
+    ULONG64 total_elapsed_time;     //!< An accumulated elapsed time
+    ULONG64 min_elapsed_time;       //!< The shortest elapsed time
+    ULONG64 max_elapsed_time;       //!< The longest elapsed time
+    ULONG64 p50_elapsed_time;       //!< The 50th percentile of elapsed times
+    ULONG64 p90_elapsed_time;       //!< The 90th percentile of elapsed times
+    ULONG64 p99_elapsed_time;       //!< The 99th percentile of elapsed times
+    ULONG64 p999_elapsed_time;      //!< The 99.9th percentile of elapsed times
+    ULONG64 total_exclusive_time;   //!< total_elapsed_time minus inner scopes
+  };
+
+  /// Summarizes performance data of a call path
+  struct PathSummary {
+    ULONG64 total_execution_count;  //!< How many times the path executed
+    ULONG64 total_exclusive_time;   //!< An accumulated exclusive time
+  };
+
   /// A function type for printing out a header line of results
   using InitialOutputRoutine = void(_In_opt_ void* output_context);
 
@@ -120,15 +173,80 @@ class PerfCollector {
 
   /// A function type for printing out results
   using OutputRoutine = void(_In_ const char* location_name,
-                             _In_ ULONG64 total_execution_count,
-                             _In_ ULONG64 total_elapsed_time,
+                             _In_ const PerfSummary* summary,
                              _In_opt_ void* output_context);
 
+  /// A function type for printing out results of a call path
+  using PathOutputRoutine = void(_In_reads_(depth)
+                                     const char* const* location_names,
+                                 _In_ ULONG depth,
+                                 _In_ const PathSummary* summary,
+                                 _In_opt_ void* output_context);
+
   /// A function type for acquiring and releasing a lock
   using LockRoutine = void(_In_opt_ void* lock_context);
 
+  /// A function type for getting a current processor number
+  using ProcessorNumberRoutine = ULONG();
+
+  /// A number of entries of a table; must be a power of two
+  static const ULONG kMaxNumberOfDataEntries = 64;
+
+  /// A number of call paths of a table; must be a power of two
+  static const ULONG kMaxNumberOfPathEntries = 128;
+
+  /// A number of nested scopes attributed to call paths
+  static const ULONG kMaxScopeDepth = 16;
+
+  /// Returned by EnterScope() when a scope is not on a stack
+  static const ULONG kNoScope = MAXULONG;
+
+  /// Represents performance data for each location
+  ///
+  /// A bucket counter of a single processor wraps around after 4G times. It
+  /// is left 32-bit to keep a table small.
+  struct PerfDataEntry {
+    const char* volatile key;                //!< Identifies a location
+    volatile LONG64 total_execution_count;  //!< How many times executed
+    volatile LONG64 total_elapsed_time;     //!< An accumulated elapsed time
+    volatile LONG64 min_elapsed_time;       //!< The shortest one + 1, or 0
+    volatile LONG64 max_elapsed_time;       //!< The longest elapsed time
+    volatile LONG64 total_exclusive_time;   //!< Elapsed times minus children
+    volatile LONG histogram[kHistogramBucketCount];  //!< Elapsed times
+  };
+
+  /// Represents performance data for each call path
+  struct PerfPathEntry {
+    volatile ULONG64 id;  //!< A hash of locations on a path, or 0 if unused
+    const char* volatile key;  //!< The innermost location of a path
+    ULONG parent;  //!< An index of a path of an outer scope, or kNoScope
+    volatile LONG64 total_execution_count;  //!< How many times executed
+    volatile LONG64 total_exclusive_time;   //!< An accumulated exclusive time
+  };
+
+  /// A scope being measured
+  struct ScopeFrame {
+    const char* key;             //!< A location of a scope
+    ULONG path;                  //!< An index of a path, or kNoScope
+    ULONG64 child_elapsed_time;  //!< Elapsed times of inner scopes
+  };
+
+  /// A table of a single processor. An array of them must start at a cache
+  /// line boundary, eg, be allocated with a size of PAGE_SIZE or larger.
+  struct alignas(SYSTEM_CACHE_ALIGNMENT_SIZE) ProcessorData {
+    PerfDataEntry entries[kMaxNumberOfDataEntries];
+    PerfPathEntry paths[kMaxNumberOfPathEntries];
+    ScopeFrame frames[kMaxScopeDepth];
+    ULONG depth;              //!< A number of frames in use
+    volatile LONG64 dropped;  //!< Data lost as the table was full
+  };
+
   /// Constructor; call this only once before any other code in this module runs
   /// @param output_routine   A function pointer for printing out results
+  /// @param processors   Tables of processors
+  /// @param processor_count   A number of elements of \a processors
+  /// @param processor_number_routine   A function pointer for getting a
+  ///        current processor number, that is, an index of \a processors
   /// @param initial_output_routine A function pointer for printing a header
   ///        line of results
   /// @param final_output_routine   A function pointer for printing a footer
@@ -139,8 +257,12 @@ class PerfCollector {
   ///        \a lock_leave_routine
   /// @param output_context   An arbitrary parameter for \a output_routine,
   ///        \a initial_output_routine and \a final_output_routine.
+  ///
+  /// The lock serializes reporting only; AddData() never takes it.
   void Initialize(
-      _In_ OutputRoutine* output_routine,
+      _In_ OutputRoutine* output_routine, _In_ ProcessorData* processors,
+      _In_ ULONG processor_count,
+      _In_ ProcessorNumberRoutine* processor_number_routine,
       _In_opt_ InitialOutputRoutine* initial_output_routine = NoOutputRoutine,
       _In_opt_ FinalOutputRoutine* final_output_routine = NoOutputRoutine,
       _In_opt_ LockRoutine* lock_enter_routine = NoLockRoutine,
@@ -154,53 +276,195 @@ class PerfCollector {
     lock_leave_routine_ = lock_leave_routine;
     lock_context_ = lock_context;
     output_context_ = output_context;
-    memset(data_, 0, sizeof(data_));
+    processor_number_routine_ = processor_number_routine;
+    processors_ = processors;
+    processor_count_ = processor_count;
+    memset(processors, 0, sizeof(ProcessorData) * processor_count);
   }
 
   /// Destructor; prints out accumulated performance results.
   void Terminate() {
-    if (data_[0].key) {
-      initial_output_routine_(output_context_);
+    ScopedLock lock(lock_enter_routine_, lock_leave_routine_, lock_context_);
+
+    if (!HasData()) {
+      return;
     }
+    initial_output_routine_(output_context_);
+    Snapshot(output_routine_, output_context_);
+    final_output_routine_(output_context_);
+  }
 
-    for (auto i = 0ul; i < kMaxNumberOfDataEntries; i++) {
-      if (data_[i].key == nullptr) {
-        break;
+  /// Passes performance data of each location collected so far to a routine
+  /// @param output_routine   A function pointer called for each location
+  /// @param output_context   An arbitrary parameter for \a output_routine
+  /// @return A number of locations passed to \a output_routine
+  ///
+  /// Takes no lock and calls nothing but \a output_routine, so that it may be
+  /// called while data is being collected, including from VMX-root mode. Data
+  /// added meanwhile may be reflected only partially.
+  ULONG Snapshot(_In_ OutputRoutine* output_routine,
+                 _In_opt_ void* output_context) const {
+    auto count = 0ul;
+    for (auto i = 0ul; i < processor_count_; ++i) {
+      for (const auto& entry : processors_[i].entries) {
+        // Each location is reported once, when it is seen first
+        if (!entry.key || IsMerged(i, entry.key)) {
+          continue;
+        }
+        PerfSummary summary = {};
+        Merge(i, entry.key, &summary);
+        output_routine(entry.key, &summary, output_context);
+        ++count;
       }
+    }
+    return count;
+  }
 
-      output_routine_(data_[i].key, data_[i].total_execution_count,
-                      data_[i].total_elapsed_time, output_context_);
+  /// Clears performance data collected so far
+  ///
+  /// Locations stay in tables. Data added meanwhile may survive partially.
+  void Reset() {
+    for (auto i = 0ul; i < processor_count_; ++i) {
+      auto& data = processors_[i];
+      for (auto& entry : data.entries) {
+        entry.total_execution_count = 0;
+        entry.total_elapsed_time = 0;
+        entry.min_elapsed_time = 0;
+        entry.max_elapsed_time = 0;
+        entry.total_exclusive_time = 0;
+        for (auto& count : entry.histogram) {
+          count = 0;
+        }
+      }
+      for (auto& path : data.paths) {
+        path.total_execution_count = 0;
+        path.total_exclusive_time = 0;
+      }
+      data.dropped = 0;
     }
-    if (data_[0].key) {
-      final_output_routine_(output_context_);
+  }
+
+  /// Passes performance data of each call path collected so far to a routine
+  /// @param output_routine   A function pointer called for each path
+  /// @param output_context   An arbitrary parameter for \a output_routine
+  /// @return A number of paths passed to \a output_routine
+  ///
+  /// Like Snapshot(), takes no lock and calls nothing but \a output_routine.
+  ULONG SnapshotPaths(_In_ PathOutputRoutine* output_routine,
+                      _In_opt_ void* output_context) const {
+    auto count = 0ul;
+    for (auto i = 0ul; i < processor_count_; ++i) {
+      const auto& data = processors_[i];
+      for (auto index = 0ul; index < kMaxNumberOfPathEntries; ++index) {
+        const auto id = data.paths[index].id;
+        if (!id || !data.paths[index].key || IsPathMerged(i, id)) {
+          continue;
+        }
+        PathSummary summary = {};
+        for (auto j = i; j < processor_count_; ++j) {
+          const auto path = FindPath(&processors_[j], id);
+          if (path) {
+            summary.total_execution_count += path->total_execution_count;
+            summary.total_exclusive_time += path->total_exclusive_time;
+          }
+        }
+        if (!summary.total_execution_count) {
+          continue;
+        }
+        const char* location_names[kMaxScopeDepth] = {};
+        const auto depth = GetPathLocations(data, index, location_names);
+        output_routine(location_names, depth, &summary, output_context);
+        ++count;
+      }
     }
+    return count;
   }
 
-  /// Saves performance data taken by PerfCounter.
-  bool AddData(_In_ const char* location_name, _In_ ULONG64 elapsed_time) {
-    ScopedLock lock(lock_enter_routine_, lock_leave_routine_, lock_context_);
+  /// Pushes a scope onto a stack of the current processor
+  /// @param location_name   A location of a scope
+  /// @return A token to pass to LeaveScope()
+  ULONG EnterScope(_In_ const char* location_name) {
+    const auto processor = processor_number_routine_();
+    if (processor >= processor_count_) {
+      return kNoScope;
+    }
 
-    const auto data_index = GetPerfDataIndex(location_name);
-    if (data_index == kInvalidDataIndex) {
+    // Scopes nested too deep are measured but not attributed to paths
+    auto& data = processors_[processor];
+    const auto depth = data.depth;
+    if (depth >= kMaxScopeDepth) {
+      return kNoScope;
+    }
+
+    auto& frame = data.frames[depth];
+    const auto parent = (depth) ? data.frames[depth - 1].path : kNoScope;
+    frame.key = location_name;
+    frame.path = (depth && parent == kNoScope)
+                     ? kNoScope
+                     : ClaimPath(&data, parent, location_name);
+    frame.child_elapsed_time = 0;
+    data.depth = depth + 1;
+    return depth;
+  }
+
+  /// Pops a scope from a stack of the current processor and saves its data
+  /// @param location_name   A location of a scope
+  /// @param elapsed_time   An elapsed time of a scope
+  /// @param scope   A return value of EnterScope()
+  /// @return true if data is saved
+  bool LeaveScope(_In_ const char* location_name, _In_ ULONG64 elapsed_time,
+                  _In_ ULONG scope) {
+    const auto processor = processor_number_routine_();
+    if (processor >= processor_count_) {
       return false;
     }
 
-    data_[data_index].total_execution_count++;
-    data_[data_index].total_elapsed_time += elapsed_time;
-    return true;
+    auto& data = processors_[processor];
+    auto exclusive_time = elapsed_time;
+    if (scope < data.depth && data.frames[scope].key == location_name) {
+      // Frames above this are of scopes that never left, and are discarded
+      const auto& frame = data.frames[scope];
+      exclusive_time = (elapsed_time > frame.child_elapsed_time)
+                           ? elapsed_time - frame.child_elapsed_time
+                           : 0;
+      if (frame.path != kNoScope) {
+        // Not interlocked as only this processor updates it, like frames
+        auto& path = data.paths[frame.path];
+        path.total_execution_count++;
+        path.total_exclusive_time += exclusive_time;
+      }
+      if (scope) {
+        data.frames[scope - 1].child_elapsed_time += elapsed_time;
+      }
+      data.depth = scope;
+    }
+    return SaveData(&data, location_name, elapsed_time, exclusive_time);
   }
 
- private:
-  static const ULONG kInvalidDataIndex = MAXULONG;
-  static const ULONG kMaxNumberOfDataEntries = 200;
+  /// Saves performance data of a location not measured by PerfCounter
+  ///
+  /// Only touches a table of the current processor. Updates are interlocked
+  /// as a thread may be preempted and resumed on another processor in the
+  /// middle, but they never contend across processors.
+  bool AddData(_In_ const char* location_name, _In_ ULONG64 elapsed_time) {
+    const auto processor = processor_number_routine_();
+    if (processor >= processor_count_) {
+      return false;
+    }
+    return SaveData(&processors_[processor], location_name, elapsed_time,
+                    elapsed_time);
+  }
 
-  /// Represents performance data for each location
-  struct PerfDataEntry {
-    const char* key;                //!< Identifies a subject matter location
-    ULONG64 total_execution_count;  //!< How many times executed
-    ULONG64 total_elapsed_time;     //!< An accumulated elapsed time
-  };
+  /// Returns a number of data lost as tables were full
+  ULONG64 GetDroppedCount() const {
+    ULONG64 dropped = 0;
+    for (auto i = 0ul; i < processor_count_; ++i) {
+      dropped += processors_[i].dropped;
+    }
+    return dropped;
+  }
 
+ private:
   /// Scoped lock
   class ScopedLock {
    public:
@@ -238,29 +502,327 @@ class PerfCollector {
     UNREFERENCED_PARAMETER(lock_context);
   }
 
-  /// Returns an index of data corresponds to the location_name.
-  /// @param key   A location to get an index of corresponding data entry
-  /// @return   An index of data or kInvalidDataIndex
+  /// Saves performance data to a table
+  bool SaveData(_Inout_ ProcessorData* data, _In_ const char* location_name,
+                _In_ ULONG64 elapsed_time, _In_ ULONG64 exclusive_time) {
+    const auto entry = FindEntry(data, location_name);
+    if (!entry) {
+      InterlockedIncrement64(&data->dropped);
+      return false;
+    }
+
+    InterlockedIncrement64(&entry->total_execution_count);
+    InterlockedExchangeAdd64(&entry->total_elapsed_time,
+                             static_cast<LONG64>(elapsed_time));
+    InterlockedExchangeAdd64(&entry->total_exclusive_time,
+                             static_cast<LONG64>(exclusive_time));
+    InterlockedIncrement(&entry->histogram[GetBucketIndex(elapsed_time)]);
+
+    // Stored plus one so that zero-filled memory reads as no data
+    UpdateMin(&entry->min_elapsed_time, elapsed_time + 1);
+    UpdateMax(&entry->max_elapsed_time, elapsed_time);
+    return true;
+  }
+
+  /// Returns an identifier of a call path
+  /// @param parent_id   An identifier of a path of an outer scope, or 0
+  /// @param key   A location of the innermost scope
+  /// @return A non-zero identifier
+  static ULONG64 GetPathId(_In_ ULONG64 parent_id, _In_ const char* key) {
+    auto value = (parent_id ^ reinterpret_cast<ULONG_PTR>(key)) *
+                 0x9e3779b97f4a7c15ull;
+    value ^= value >> 29;
+    return (value) ? value : 1;
+  }
+
+  /// Returns an index of a path in a table, claiming a new entry if needed
+  /// @param data   A table to search
+  /// @param parent   An index of a path of an outer scope, or kNoScope
+  /// @param key   A location of the innermost scope
+  /// @return An index of a path, or kNoScope if there is no room
+  static ULONG ClaimPath(_Inout_ ProcessorData* data, _In_ ULONG parent,
+                         _In_ const char* key) {
+    const auto parent_id = (parent == kNoScope) ? 0 : data->paths[parent].id;
+    const auto id = GetPathId(parent_id, key);
+    const auto hash = static_cast<ULONG>(id >> 32);
+    for (auto i = 0ul; i < kMaxNumberOfPathEntries; i++) {
+      const auto index = (hash + i) & (kMaxNumberOfPathEntries - 1);
+      auto& path = data->paths[index];
+      auto current = path.id;
+      if (!current) {
+        current = static_cast<ULONG64>(InterlockedCompareExchange64(
+            reinterpret_cast<volatile LONG64*>(&path.id),
+            static_cast<LONG64>(id), 0));
+        if (!current) {
+          // Readers skip an entry until its key is set
+          path.parent = parent;
+          path.key = key;
+          return index;
+        }
+      }
+      if (current == id) {
+        return index;
+      }
+    }
+    InterlockedIncrement64(&data->dropped);
+    return kNoScope;
+  }
+
+  /// Returns a path of an identifier in a table
+  /// @param data   A table to search
+  /// @param id   An identifier of a path
+  /// @return A path, or nullptr if not found
+  static const PerfPathEntry* FindPath(_In_ const ProcessorData* data,
+                                       _In_ ULONG64 id) {
+    const auto hash = static_cast<ULONG>(id >> 32);
+    for (auto i = 0ul; i < kMaxNumberOfPathEntries; i++) {
+      const auto& path =
+          data->paths[(hash + i) & (kMaxNumberOfPathEntries - 1)];
+      if (path.id == id) {
+        return &path;
+      }
+      if (!path.id) {
+        break;
+      }
+    }
+    return nullptr;
+  }
+
+  /// Tells whether a path is in a table of a processor before \a processor
+  bool IsPathMerged(_In_ ULONG processor, _In_ ULONG64 id) const {
+    for (auto i = 0ul; i < processor; ++i) {
+      if (FindPath(&processors_[i], id)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /// Returns locations of a path from the outermost one
+  /// @param data   A table having a path
+  /// @param index   An index of a path
+  /// @param location_names   Receives locations
+  /// @return A number of locations
+  static ULONG GetPathLocations(
+      _In_ const ProcessorData& data, _In_ ULONG index,
+      _Out_writes_(kMaxScopeDepth) const char** location_names) {
+    auto depth = 0ul;
+    for (auto i = index; i != kNoScope && depth < kMaxScopeDepth;
+         i = data.paths[i].parent) {
+      ++depth;
+    }
+    auto i = index;
+    for (auto j = depth; j; --j, i = data.paths[i].parent) {
+      location_names[j - 1] = data.paths[i].key;
+    }
+    return depth;
+  }
+
+  /// Returns a preferred index of a key in a table
+  /// @param key   A location pointer
+  /// @return An index in a table
   ///
-  /// It adds a new entry when the key is not found in existing entries. Returns
-  /// kInvalidDataIndex if a corresponding entry is not found and there is no
-  /// room to add a new entry.
-  ULONG GetPerfDataIndex(_In_ const char* key) {
+  /// Location pointers are string literals and close to each other, so bits
+  /// are mixed by Fibonacci hashing.
+  static ULONG HashKey(_In_ const char* key) {
+    const auto value = static_cast<ULONG64>(reinterpret_cast<ULONG_PTR>(key));
+    return static_cast<ULONG>((value * 0x9e3779b97f4a7c15ull) >> 32) &
+           (kMaxNumberOfDataEntries - 1);
+  }
+
+  /// Returns an entry of a key in a table
+  /// @param data   A table to search
+  /// @param key   A location to get a corresponding data entry
+  /// @param claim   true to claim a new entry when the key is not found
+  /// @return   An entry, or nullptr
+  ///
+  /// Returns nullptr if the key is not found and a new entry is not claimed,
+  /// or there is no room to add a new entry.
+  static PerfDataEntry* FindEntry(_In_ ProcessorData* data,
+                                  _In_ const char* key,
+                                  _In_ bool claim = true) {
     if (!key) {
-      return kInvalidDataIndex;
+      return nullptr;
     }
 
+    const auto index = HashKey(key);
     for (auto i = 0ul; i < kMaxNumberOfDataEntries; i++) {
-      if (data_[i].key == key) {
-        return i;
+      auto& entry = data->entries[(index + i) & (kMaxNumberOfDataEntries - 1)];
+      const char* current = entry.key;
+      if (current == key) {
+        return &entry;
+      }
+      if (!current) {
+        if (!claim) {
+          return nullptr;
+        }
+        current = static_cast<const char*>(InterlockedCompareExchangePointer(
+            reinterpret_cast<void* volatile*>(const_cast<char**>(&entry.key)),
+            const_cast<char*>(key), nullptr));
+        if (!current || current == key) {
+          return &entry;
+        }
+      }
+    }
+    return nullptr;
+  }
+
+  /// Returns an index of a bucket counting a value
+  /// @param value   An elapsed time
+  /// @return An index of a histogram
+  static ULONG GetBucketIndex(_In_ ULONG64 value) {
+    if (value < kHistogramSubBucketCount) {
+      return static_cast<ULONG>(value);
+    }
+    ULONG msb = 0;
+    _BitScanReverse64(&msb, value);
+    if (msb >= kHistogramMaxExponent) {
+      return kHistogramBucketCount - 1;
+    }
+    const auto shift = msb - kHistogramSubBucketBits;
+    const auto sub_bucket =
+        static_cast<ULONG>(value >> shift) & (kHistogramSubBucketCount - 1);
+    return ((shift + 1) << kHistogramSubBucketBits) + sub_bucket;
+  }
+
+  /// Returns the largest value counted in a bucket
+  /// @param index   An index of a histogram
+  /// @return The largest value that GetBucketIndex() maps to \a index
+  static ULONG64 GetBucketHighestValue(_In_ ULONG index) {
+    const auto group = index >> kHistogramSubBucketBits;
+    if (!group) {
+      return index;
+    }
+    const auto shift = group - 1;
+    const auto sub_bucket = (index & (kHistogramSubBucketCount - 1)) +
+                            kHistogramSubBucketCount;
+    return ((static_cast<ULONG64>(sub_bucket) + 1) << shift) - 1;
+  }
+
+  /// Lowers a value to \a value if it is larger
+  static void UpdateMin(_Inout_ volatile LONG64* target, _In_ ULONG64 value) {
+    auto current = static_cast<ULONG64>(*target);
+    while (!current || value < current) {
+      const auto previous = static_cast<ULONG64>(InterlockedCompareExchange64(
+          target, static_cast<LONG64>(value), static_cast<LONG64>(current)));
+      if (previous == current) {
+        break;
+      }
+      current = previous;
+    }
+  }
+
+  /// Raises a value to \a value if it is smaller
+  static void UpdateMax(_Inout_ volatile LONG64* target, _In_ ULONG64 value) {
+    auto current = static_cast<ULONG64>(*target);
+    while (value > current) {
+      const auto previous = static_cast<ULONG64>(InterlockedCompareExchange64(
+          target, static_cast<LONG64>(value), static_cast<LONG64>(current)));
+      if (previous == current) {
+        break;
+      }
+      current = previous;
+    }
+  }
+
+  /// Tells whether any location has been measured
+  bool HasData() const {
+    for (auto i = 0ul; i < processor_count_; ++i) {
+      for (const auto& entry : processors_[i].entries) {
+        if (entry.key) {
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  /// Tells whether a key is in a table of a processor before \a processor
+  bool IsMerged(_In_ ULONG processor, _In_ const char* key) const {
+    for (auto i = 0ul; i < processor; ++i) {
+      if (FindEntry(&processors_[i], key, false)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /// Sums up a key in tables of processors from \a first_processor
+  /// @param first_processor   The first processor having \a key
+  /// @param key   A location to summarize
+  /// @param summary   Receives merged data of \a key
+  ///
+  /// A percentile is the largest value of a bucket it falls in, clamped
+  /// between the shortest and longest elapsed times. Histograms are summed up
+  /// bucket by bucket so that no buffer is needed.
+  void Merge(_In_ ULONG first_processor, _In_ const char* key,
+             _Out_ PerfSummary* summary) const {
+    for (auto i = first_processor; i < processor_count_; ++i) {
+      const auto entry = FindEntry(&processors_[i], key, false);
+      if (!entry) {
+        continue;
+      }
+      summary->total_execution_count += entry->total_execution_count;
+      summary->total_elapsed_time += entry->total_elapsed_time;
+      summary->total_exclusive_time += entry->total_exclusive_time;
+      const auto min = static_cast<ULONG64>(entry->min_elapsed_time);
+      if (min && (!summary->min_elapsed_time ||
+                  min - 1 < summary->min_elapsed_time)) {
+        summary->min_elapsed_time = min - 1;
+      }
+      const auto max = static_cast<ULONG64>(entry->max_elapsed_time);
+      if (max > summary->max_elapsed_time) {
+        summary->max_elapsed_time = max;
       }
+    }
 
-      if (data_[i].key == nullptr) {
-        data_[i].key = key;
-        return i;
+    static const ULONG kPercentiles[] = {5000, 9000, 9900, 9990};
+    ULONG64* const results[] = {
+        &summary->p50_elapsed_time, &summary->p90_elapsed_time,
+        &summary->p99_elapsed_time, &summary->p999_elapsed_time};
+    static_assert(RTL_NUMBER_OF(kPercentiles) == RTL_NUMBER_OF(results),
+                  "Size check");
+
+    auto next = 0ul;
+    ULONG64 seen = 0;
+    for (auto bucket = 0ul;
+         bucket < kHistogramBucketCount && next < RTL_NUMBER_OF(results);
+         ++bucket) {
+      for (auto i = first_processor; i < processor_count_; ++i) {
+        const auto entry = FindEntry(&processors_[i], key, false);
+        if (entry) {
+          seen += static_cast<ULONG>(entry->histogram[bucket]);
+        }
+      }
+      while (next < RTL_NUMBER_OF(results) &&
+             seen >= GetRank(summary->total_execution_count,
+                             kPercentiles[next])) {
+        *results[next++] = Clamp(GetBucketHighestValue(bucket), *summary);
       }
     }
-    return kInvalidDataIndex;
+
+    // Bucket counters wrapped around or were being updated
+    while (next < RTL_NUMBER_OF(results)) {
+      *results[next++] = summary->max_elapsed_time;
+    }
+  }
+
+  /// Returns a rank of a percentile
+  /// @param count   A number of values
+  /// @param per_ten_thousand   A percentile multiplied by 100
+  /// @return A one-based rank of the value at the percentile
+  static ULONG64 GetRank(_In_ ULONG64 count, _In_ ULONG per_ten_thousand) {
+    const auto rank = (count * per_ten_thousand + 9999) / 10000;
+    return (rank) ? rank : 1;
+  }
+
+  /// Clamps a value between the shortest and longest elapsed times
+  static ULONG64 Clamp(_In_ ULONG64 value, _In_ const PerfSummary& summary) {
+    if (value < summary.min_elapsed_time) {
+      return summary.min_elapsed_time;
+    }
+    return (value < summary.max_elapsed_time) ? value
+                                              : summary.max_elapsed_time;
   }
 
   InitialOutputRoutine* initial_output_routine_;
@@ -270,7 +832,9 @@ class PerfCollector {
   LockRoutine* lock_leave_routine_;
   void* lock_context_;
   void* output_context_;
-  PerfDataEntry data_[kMaxNumberOfDataEntries];
+  ProcessorNumberRoutine* processor_number_routine_;
+  ProcessorData* processors_;
+  ULONG processor_count_;
 };
 
 /// Measure elapsed time of the scope
@@ -291,13 +855,15 @@ class PerfCounter {
       : collector_(collector),
         query_time_routine_((query_time_routine) ? query_time_routine : RdTsc),
         location_name_(location_name),
+        scope_((collector) ? collector->EnterScope(location_name)
+                           : PerfCollector::kNoScope),
         before_time_(query_time_routine_()) {}
 
   /// Measures an elapsed time and stores it to PerfCounter::collector_.
   ~PerfCounter() {
     if (collector_) {
       const auto elapsed_time = query_time_routine_() - before_time_;
-      collector_->AddData(location_name_, elapsed_time);
+      collector_->LeaveScope(location_name_, elapsed_time, scope_);
     }
   }
 
@@ -309,6 +875,7 @@ class PerfCounter {
   PerfCollector* collector_;
   QueryTimeRoutine* query_time_routine_;
   const char* location_name_;
+  const ULONG scope_;
   const ULONG64 before_time_;
 };
 
@@ -0,0 +1,268 @@
+// Copyright (c) 2015-2019, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements the performance snapshot file writer.
+
+#include "perf_file.h"
+#include "common.h"
+#include "performance.h"
+
+// Tells the CRT not to use a inline version of CRT functions, which use
+// internal functions that lead to linker errors.
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wunused-macros"
+#define _NO_CRT_STDIO_INLINE
+#pragma clang diagnostic pop
+
+#define NTSTRSAFE_NO_CB_FUNCTIONS
+#include <ntstrsafe.h>
+
+extern "C" {
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// A number of locations a snapshot can hold
+static const ULONG kPerfFilepMaxEntries =
+    PerfCollector::kMaxNumberOfDataEntries;
+
+// A size of a buffer to take a snapshot into
+static const ULONG kPerfFilepSnapshotSize =
+    sizeof(PerfSnapshotHeader) +
+    sizeof(PerfSnapshotEntry) * kPerfFilepMaxEntries;
+
+// A size of a line of the file, which is long enough for a location and
+// eleven numbers
+static const ULONG kPerfFilepLineSize = 512;
+
+// A size of a buffer to format a snapshot into
+static const ULONG kPerfFilepTextSize =
+    kPerfFilepLineSize * (kPerfFilepMaxEntries + 1);
+
+// The first line of the file
+static const char kPerfFilepColumns[] =
+    "Time,FunctionName(Line),Execution Count,Elapsed Time,Exclusive Time,Min,"
+    "P50,P90,P99,P99.9,Max,Time Frequency\r\n";
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+struct PerfFilepInfo {
+  HANDLE file_handle;
+  HANDLE thread_handle;
+  KEVENT stop_event;
+  ULONG interval_msec;
+  void *snapshot;
+  char *text;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+static KSTART_ROUTINE PerfFilepThreadRoutine;
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void PerfFilepFinalizeInfo(
+    _Inout_ PerfFilepInfo *info);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    PerfFilepWriteSnapshot(_Inout_ PerfFilepInfo *info);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    PerfFilepWriteFile(_In_ HANDLE file_handle,
+                       _In_reads_bytes_(size) const void *data,
+                       _In_ ULONG size);
+
+#if defined(ALLOC_PRAGMA)
+#pragma alloc_text(PAGE, PerfFileInitialization)
+#pragma alloc_text(PAGE, PerfFileTermination)
+#pragma alloc_text(PAGE, PerfFilepThreadRoutine)
+#pragma alloc_text(PAGE, PerfFilepFinalizeInfo)
+#pragma alloc_text(PAGE, PerfFilepWriteSnapshot)
+#pragma alloc_text(PAGE, PerfFilepWriteFile)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+static PerfFilepInfo g_perffilep_info;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Creates a snapshot file and starts a thread writing snapshots into it
+_Use_decl_annotations_ NTSTATUS
+PerfFileInitialization(const wchar_t *perf_file_path, ULONG interval_msec) {
+  PAGED_CODE()
+
+  auto &info = g_perffilep_info;
+  info.interval_msec = interval_msec;
+  KeInitializeEvent(&info.stop_event, NotificationEvent, FALSE);
+  info.snapshot = ExAllocatePoolWithTag(PagedPool, kPerfFilepSnapshotSize,
+                                        kHyperPlatformCommonPoolTag);
+  info.text = static_cast<char *>(ExAllocatePoolWithTag(
+      PagedPool, kPerfFilepTextSize, kHyperPlatformCommonPoolTag));
+  if (!info.snapshot || !info.text) {
+    PerfFilepFinalizeInfo(&info);
+    return STATUS_INSUFFICIENT_RESOURCES;
+  }
+
+  UNICODE_STRING perf_file_path_u = {};
+  RtlInitUnicodeString(&perf_file_path_u, perf_file_path);
+
+  OBJECT_ATTRIBUTES oa = {};
+  InitializeObjectAttributes(&oa, &perf_file_path_u,
+                             OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, nullptr,
+                             nullptr)
+
+  IO_STATUS_BLOCK io_status = {};
+  auto status = ZwCreateFile(
+      &info.file_handle, FILE_APPEND_DATA | SYNCHRONIZE, &oa, &io_status,
+      nullptr, FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ, FILE_OVERWRITE_IF,
+      FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE, nullptr, 0);
+  if (!NT_SUCCESS(status)) {
+    info.file_handle = nullptr;
+    PerfFilepFinalizeInfo(&info);
+    return status;
+  }
+
+  status = PerfFilepWriteFile(info.file_handle, kPerfFilepColumns,
+                              sizeof(kPerfFilepColumns) - 1);
+  if (!NT_SUCCESS(status)) {
+    PerfFilepFinalizeInfo(&info);
+    return status;
+  }
+
+  status = PsCreateSystemThread(&info.thread_handle, GENERIC_ALL, nullptr,
+                                nullptr, nullptr, PerfFilepThreadRoutine,
+                                &info);
+  if (!NT_SUCCESS(status)) {
+    info.thread_handle = nullptr;
+    PerfFilepFinalizeInfo(&info);
+    return status;
+  }
+  return status;
+}
+
+// Writes the last snapshot, stops the thread and closes the file
+_Use_decl_annotations_ void PerfFileTermination() {
+  PAGED_CODE()
+
+  PerfFilepFinalizeInfo(&g_perffilep_info);
+}
+
+// Stops the thread and frees resources
+_Use_decl_annotations_ static void PerfFilepFinalizeInfo(PerfFilepInfo *info) {
+  PAGED_CODE()
+
+  if (info->thread_handle) {
+    KeSetEvent(&info->stop_event, IO_NO_INCREMENT, FALSE);
+    ZwWaitForSingleObject(info->thread_handle, FALSE, nullptr);
+    ZwClose(info->thread_handle);
+    info->thread_handle = nullptr;
+  }
+  if (info->file_handle) {
+    ZwClose(info->file_handle);
+    info->file_handle = nullptr;
+  }
+  if (info->text) {
+    ExFreePoolWithTag(info->text, kHyperPlatformCommonPoolTag);
+    info->text = nullptr;
+  }
+  if (info->snapshot) {
+    ExFreePoolWithTag(info->snapshot, kHyperPlatformCommonPoolTag);
+    info->snapshot = nullptr;
+  }
+}
+
+// Writes a snapshot every interval until the stop event is signaled
+_Use_decl_annotations_ static VOID PerfFilepThreadRoutine(
+    void *start_context) {
+  PAGED_CODE()
+
+  auto info = static_cast<PerfFilepInfo *>(start_context);
+  LARGE_INTEGER interval = {};
+  interval.QuadPart = -(10000ll * info->interval_msec);  // msec
+  for (;;) {
+    const auto status = KeWaitForSingleObject(
+        &info->stop_event, Executive, KernelMode, FALSE, &interval);
+    PerfFilepWriteSnapshot(info);
+    if (status != STATUS_TIMEOUT) {
+      break;
+    }
+  }
+  PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+// Takes a snapshot and appends it to the file in CSV
+_Use_decl_annotations_ static NTSTATUS PerfFilepWriteSnapshot(
+    PerfFilepInfo *info) {
+  PAGED_CODE()
+
+  if (!PerfSnapshot(info->snapshot, kPerfFilepSnapshotSize)) {
+    return STATUS_UNSUCCESSFUL;
+  }
+  const auto header = static_cast<PerfSnapshotHeader *>(info->snapshot);
+  const auto entries = reinterpret_cast<PerfSnapshotEntry *>(
+      static_cast<UCHAR *>(info->snapshot) + header->header_size);
+
+  LARGE_INTEGER system_time = {}, local_time = {};
+  KeQuerySystemTime(&system_time);
+  ExSystemTimeToLocalTime(&system_time, &local_time);
+  TIME_FIELDS time_fields = {};
+  RtlTimeToTimeFields(&local_time, &time_fields);
+
+  auto end = info->text;
+  size_t remaining = kPerfFilepTextSize;
+  for (auto i = 0ul; i < header->entry_count; ++i) {
+    const auto &entry = entries[i];
+    const auto status = RtlStringCchPrintfExA(
+        end, remaining, &end, &remaining, 0,
+        "%04hu-%02hu-%02hu %02hu:%02hu:%02hu,%s,%I64u,%I64u,%I64u,%I64u,"
+        "%I64u,%I64u,%I64u,%I64u,%I64u,%I64u\r\n",
+        time_fields.Year, time_fields.Month, time_fields.Day,
+        time_fields.Hour, time_fields.Minute, time_fields.Second,
+        entry.location, entry.total_execution_count, entry.total_elapsed_time,
+        entry.total_exclusive_time, entry.min_elapsed_time,
+        entry.p50_elapsed_time, entry.p90_elapsed_time, entry.p99_elapsed_time,
+        entry.p999_elapsed_time, entry.max_elapsed_time,
+        header->time_frequency);
+    if (!NT_SUCCESS(status)) {
+      break;
+    }
+  }
+
+  const auto size = static_cast<ULONG>(end - info->text);
+  if (!size) {
+    return STATUS_SUCCESS;
+  }
+  return PerfFilepWriteFile(info->file_handle, info->text, size);
+}
+
+// Appends data to the file
+_Use_decl_annotations_ static NTSTATUS PerfFilepWriteFile(HANDLE file_handle,
+                                                          const void *data,
+                                                          ULONG size) {
+  PAGED_CODE()
+
+  IO_STATUS_BLOCK io_status = {};
+  return ZwWriteFile(file_handle, nullptr, nullptr, nullptr, &io_status,
+                     const_cast<void *>(data), size, nullptr, nullptr);
+}
+
+}  // extern "C"
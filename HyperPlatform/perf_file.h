@@ -0,0 +1,62 @@
+// Copyright (c) 2015-2019, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Declares interfaces to the performance snapshot file writer.
+///
+/// The writer takes a snapshot with PerfSnapshot() periodically on a system
+/// thread and appends it to a CSV file, one line per location. Counters are
+/// not reset, so each snapshot holds totals since the driver was loaded or
+/// IOCTL_HYPER_PERF_CONTROL last reset them.
+
+#ifndef HYPERPLATFORM_PERF_FILE_H_
+#define HYPERPLATFORM_PERF_FILE_H_
+
+#include <ntddk.h>
+
+extern "C" {
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+/// Creates a snapshot file and starts a thread writing snapshots into it
+/// @param perf_file_path   A path to the file; overwritten if exists
+/// @param interval_msec   An interval of snapshots in milliseconds
+/// @return STATUS_SUCCESS on success
+_IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS
+    PerfFileInitialization(_In_ const wchar_t *perf_file_path,
+                           _In_ ULONG interval_msec);
+
+/// Writes the last snapshot, stops the thread and closes the file
+_IRQL_requires_max_(PASSIVE_LEVEL) void PerfFileTermination();
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+}  // extern "C"
+
+#endif  // HYPERPLATFORM_PERF_FILE_H_
@@ -0,0 +1,97 @@
+// Copyright (c) 2015-2019, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Defines the layout of a snapshot of performance data.
+///
+/// This header has no dependencies so that it is shared by the driver and
+/// user-mode tools.
+///
+/// A snapshot is returned by IOCTL_HYPER_PERF_SNAPSHOT and
+/// HypercallNumber::kGetPerfSnapshot. It starts with PerfSnapshotHeader and is
+/// followed by PerfSnapshotHeader::entry_count entries of a type
+/// PerfSnapshotHeader::kind tells, each of
+/// PerfSnapshotHeader::entry_size bytes starting at
+/// PerfSnapshotHeader::header_size. A reader should use these sizes rather
+/// than sizeof so that fields may be appended in later versions.
+///
+/// Elapsed times are in units of PerfGetTime() for kPerfSnapshotKindLocations
+/// and in TSC cycles for kPerfSnapshotKindExits; divide them by
+/// PerfSnapshotHeader::time_frequency to get seconds.
+
+#ifndef HYPERPLATFORM_PERF_SNAPSHOT_FORMAT_H_
+#define HYPERPLATFORM_PERF_SNAPSHOT_FORMAT_H_
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+/// The first bytes of a snapshot
+static const char kPerfSnapshotMagic[8] = {'H', 'P', 'P', 'E', 'R', 'F', 0, 0};
+
+/// A version of the layout. Bumped on incompatible changes.
+static const unsigned int kPerfSnapshotVersion = 1;
+
+/// A size of PerfSnapshotEntry::location including a null terminator
+static const unsigned int kPerfSnapshotLocationLength = 64;
+
+/// PerfSnapshotHeader::kind of a snapshot of PerfSnapshotEntry
+static const unsigned int kPerfSnapshotKindLocations = 0;
+
+/// PerfSnapshotHeader::kind of a snapshot of PerfExitSnapshotEntry
+static const unsigned int kPerfSnapshotKindExits = 1;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+/// The beginning of a snapshot
+struct PerfSnapshotHeader {
+  char magic[8];                       //!< kPerfSnapshotMagic
+  unsigned int version;                //!< kPerfSnapshotVersion
+  unsigned int header_size;            //!< An offset of the first entry
+  unsigned int entry_size;             //!< A size of each entry
+  unsigned int entry_count;            //!< A number of entries that follow
+  unsigned int location_count;         //!< Larger than entry_count if cut
+  unsigned int kind;                   //!< kPerfSnapshotKind*
+  unsigned long long time_frequency;   //!< Time units per second
+  unsigned long long timestamp;        //!< PerfGetTime() when taken
+  unsigned long long dropped;          //!< Data lost as tables were full
+};
+static_assert(sizeof(PerfSnapshotHeader) == 56, "Size check");
+
+/// Performance data of a location
+struct PerfSnapshotEntry {
+  char location[kPerfSnapshotLocationLength];  //!< FunctionName(Line)
+  unsigned long long total_execution_count;
+  unsigned long long total_elapsed_time;
+  unsigned long long min_elapsed_time;
+  unsigned long long max_elapsed_time;
+  unsigned long long p50_elapsed_time;
+  unsigned long long p90_elapsed_time;
+  unsigned long long p99_elapsed_time;
+  unsigned long long p999_elapsed_time;
+  unsigned long long total_exclusive_time;  //!< Less time of inner scopes
+};
+static_assert(sizeof(PerfSnapshotEntry) == 136, "Size check");
+
+/// Performance data of a kind of VM-exits
+struct PerfExitSnapshotEntry {
+  unsigned int reason;   //!< VmxExitReason
+  unsigned int sub_key;  //!< A CR number, an MSR index, a CPUID leaf or 0
+  unsigned long long total_execution_count;
+  unsigned long long total_elapsed_time;
+  unsigned long long min_elapsed_time;
+  unsigned long long max_elapsed_time;
+};
+static_assert(sizeof(PerfExitSnapshotEntry) == 40, "Size check");
+
+#endif  // HYPERPLATFORM_PERF_SNAPSHOT_FORMAT_H_
@@ -6,9 +6,20 @@
 /// Implements performance measurement functions.
 
 #include "common.h"
+#include <intrin.h>
 #include "performance.h"
 #include "log.h"
 
+// Tells the CRT not to use a inline version of CRT functions, which use
+// internal functions that lead to linker errors.
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wunused-macros"
+#define _NO_CRT_STDIO_INLINE
+#pragma clang diagnostic pop
+
+#define NTSTRSAFE_NO_CB_FUNCTIONS
+#include <ntstrsafe.h>
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // macro utilities
@@ -19,11 +30,48 @@
 // constants and macros
 //
 
+// Allocations of this size or larger are page aligned
+static_assert(sizeof(PerfCollector::ProcessorData) >= PAGE_SIZE, "Size check");
+
+// How long to compare TSC against the performance counter to calibrate it
+static const auto kPerfpTscCalibrationMsec = 50;
+
+// How many times to read TSC on all processors at once to find offsets
+static const auto kPerfpTscSyncRounds = 5;
+
+// Offsets of TSC within this many nanoseconds are regarded as noise of
+// synchronization and are not corrected
+static const auto kPerfpTscSkewToleranceNsec = 1000ull;
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // types
 //
 
+// A barrier to read TSC on all processors at once
+struct PerfpTscSyncContext {
+  volatile LONG remaining;  // Processors yet to arrive at the barrier
+  LONG64* tsc;              // TSC of each processor after the barrier
+};
+
+struct PerfpSnapshotContext {
+  PerfSnapshotHeader* header;
+  PerfSnapshotEntry* entries;
+  ULONG capacity;  // A number of entries that fit in a buffer
+};
+
+struct PerfpFoldedStacksContext {
+  char* end;         // Where the next line is written
+  size_t remaining;  // A number of characters left in a buffer
+  bool truncated;    // Whether a line did not fit
+};
+
+// The header of a snapshot of VM-exit profiles, followed by entries
+struct PerfpExitSnapshot {
+  PerfSnapshotHeader header;
+  PerfExitSnapshotEntry entries[kExitProfileMaxEntries];
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // prototypes
@@ -32,10 +80,41 @@
 static PerfCollector::InitialOutputRoutine PerfpInitialOutputRoutine;
 static PerfCollector::OutputRoutine PerfpOutputRoutine;
 static PerfCollector::FinalOutputRoutine PerfpFinalOutputRoutine;
+static PerfCollector::ProcessorNumberRoutine PerfpGetProcessorNumber;
+static PerfCollector::OutputRoutine PerfpSnapshotRoutine;
+static PerfCollector::PathOutputRoutine PerfpFoldedStacksRoutine;
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    PerfpInitializeTsc(_In_ ULONG processor_count);
+
+static bool PerfpIsTscInvariant();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static ULONG64
+    PerfpMeasureTscFrequency();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS PerfpMeasureTscOffsets(
+    _In_ ULONG processor_count, _Out_ LONG64* offsets);
+
+static KIPI_BROADCAST_WORKER PerfpReadTscOnBarrier;
+
+static ULONG64 PerfpTicksToNanoseconds(_In_ ULONG64 ticks,
+                                       _In_ ULONG64 frequency);
+
+static void PerfpMergeExitProfile(_In_ const ExitProfile* profile,
+                                  _Inout_ PerfSnapshotHeader* header,
+                                  _Inout_ PerfExitSnapshotEntry* entries,
+                                  _In_ ULONG capacity);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void PerfpLogExitProfiles();
 
 #if defined(ALLOC_PRAGMA)
 #pragma alloc_text(INIT, PerfInitialization)
+#pragma alloc_text(INIT, PerfpInitializeTsc)
+#pragma alloc_text(PAGE, PerfGetTscFrequency)
+#pragma alloc_text(PAGE, PerfpMeasureTscFrequency)
+#pragma alloc_text(INIT, PerfpMeasureTscOffsets)
 #pragma alloc_text(PAGE, PerfTermination)
+#pragma alloc_text(PAGE, PerfpLogExitProfiles)
 #endif
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -44,6 +123,22 @@ static PerfCollector::FinalOutputRoutine PerfpFinalOutputRoutine;
 //
 
 PerfCollector* g_performance_collector;
+static PerfCollector::ProcessorData* g_perfp_processors;
+static ULONG64 g_perfp_time_frequency;
+
+// A frequency of TSC, or 0 if not measured
+static ULONG64 g_perfp_tsc_frequency;
+
+// Whether PerfGetTime() reads TSC instead of the performance counter
+static bool g_perfp_use_tsc;
+
+// TSC of each processor minus that of processor 0, or nullptr when TSC is
+// synchronized across processors
+static LONG64* g_perfp_tsc_offsets;
+
+// VM-exit profiles of processors, or nullptr when the profiler is disabled
+static ExitProfile* g_perfp_exit_profiles;
+static ULONG g_perfp_exit_profile_count;
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -54,17 +149,68 @@ _Use_decl_annotations_ NTSTATUS PerfInitialization() {
   PAGED_CODE()
   auto status = STATUS_SUCCESS;
 
+  // Both are larger than a page, hence page aligned as ProcessorData requires.
   const auto perf_collector = static_cast<PerfCollector*>(ExAllocatePoolWithTag(
       NonPagedPool, sizeof(PerfCollector), kHyperPlatformCommonPoolTag));
   if (!perf_collector) {
     return STATUS_MEMORY_NOT_ALLOCATED;
   }
 
-  // No lock to avoid calling kernel APIs from VMM and race condition here is
-  // not an issue.
-  perf_collector->Initialize(PerfpOutputRoutine, PerfpInitialOutputRoutine,
+  const auto processor_count =
+      KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+  const auto processors =
+      static_cast<PerfCollector::ProcessorData*>(ExAllocatePoolWithTag(
+          NonPagedPool, sizeof(PerfCollector::ProcessorData) * processor_count,
+          kHyperPlatformCommonPoolTag));
+  if (!processors) {
+    ExFreePoolWithTag(perf_collector, kHyperPlatformCommonPoolTag);
+    return STATUS_MEMORY_NOT_ALLOCATED;
+  }
+
+  // No lock is needed as results are only reported at termination, and data is
+  // collected into per-processor tables without calling kernel APIs from VMM.
+  perf_collector->Initialize(PerfpOutputRoutine, processors, processor_count,
+                             PerfpGetProcessorNumber, PerfpInitialOutputRoutine,
                              PerfpFinalOutputRoutine);
 
+  LARGE_INTEGER frequency = {};
+  KeQueryPerformanceCounter(&frequency);
+  g_perfp_time_frequency = static_cast<ULONG64>(frequency.QuadPart);
+  const auto use_tsc =
+      HYPERPLATFORM_PERFORMANCE_USE_TSC && PerfpIsTscInvariant();
+  if (use_tsc || HYPERPLATFORM_PERFORMANCE_ENABLE_EXIT_PROFILE) {
+    PerfGetTscFrequency();
+  }
+
+  // The VM-exit profiler is left disabled if cycles cannot be converted to time
+  ExitProfile* exit_profiles = nullptr;
+  if (HYPERPLATFORM_PERFORMANCE_ENABLE_EXIT_PROFILE && g_perfp_tsc_frequency) {
+    exit_profiles = static_cast<ExitProfile*>(ExAllocatePoolWithTag(
+        NonPagedPool, sizeof(ExitProfile) * processor_count,
+        kHyperPlatformCommonPoolTag));
+    if (!exit_profiles) {
+      ExFreePoolWithTag(processors, kHyperPlatformCommonPoolTag);
+      ExFreePoolWithTag(perf_collector, kHyperPlatformCommonPoolTag);
+      return STATUS_MEMORY_NOT_ALLOCATED;
+    }
+    RtlZeroMemory(exit_profiles, sizeof(ExitProfile) * processor_count);
+  }
+
+  if (use_tsc && g_perfp_tsc_frequency) {
+    status = PerfpInitializeTsc(processor_count);
+    if (!NT_SUCCESS(status)) {
+      if (exit_profiles) {
+        ExFreePoolWithTag(exit_profiles, kHyperPlatformCommonPoolTag);
+      }
+      ExFreePoolWithTag(processors, kHyperPlatformCommonPoolTag);
+      ExFreePoolWithTag(perf_collector, kHyperPlatformCommonPoolTag);
+      return status;
+    }
+  }
+
+  g_perfp_exit_profiles = exit_profiles;
+  g_perfp_exit_profile_count = processor_count;
+  g_perfp_processors = processors;
   g_performance_collector = perf_collector;
   return status;
 }
@@ -74,32 +220,469 @@ _Use_decl_annotations_ void PerfTermination() {
 
   if (g_performance_collector) {
     g_performance_collector->Terminate();
+    const auto dropped = g_performance_collector->GetDroppedCount();
+    if (dropped) {
+      HYPERPLATFORM_LOG_WARN("Dropped %I64u data as tables were full.",
+                             dropped);
+    }
     ExFreePoolWithTag(g_performance_collector, kHyperPlatformCommonPoolTag);
+    ExFreePoolWithTag(g_perfp_processors, kHyperPlatformCommonPoolTag);
     g_performance_collector = nullptr;
+    g_perfp_processors = nullptr;
+  }
+
+  // VMM no longer writes profiles as VmTermination() precedes this function
+  if (g_perfp_exit_profiles) {
+    PerfpLogExitProfiles();
+    ExFreePoolWithTag(g_perfp_exit_profiles, kHyperPlatformCommonPoolTag);
+    g_perfp_exit_profiles = nullptr;
+  }
+
+  // PerfGetTime() stops reading offsets before they are freed
+  g_perfp_use_tsc = false;
+  if (g_perfp_tsc_offsets) {
+    const auto offsets = g_perfp_tsc_offsets;
+    g_perfp_tsc_offsets = nullptr;
+    ExFreePoolWithTag(offsets, kHyperPlatformCommonPoolTag);
+  }
+}
+
+// Calibrates TSC and makes PerfGetTime() read it
+_Use_decl_annotations_ static NTSTATUS PerfpInitializeTsc(
+    ULONG processor_count) {
+  PAGED_CODE()
+
+  const auto frequency = g_perfp_tsc_frequency;
+  const auto offsets = static_cast<LONG64*>(
+      ExAllocatePoolWithTag(NonPagedPool, sizeof(LONG64) * processor_count,
+                            kHyperPlatformCommonPoolTag));
+  if (!offsets) {
+    return STATUS_MEMORY_NOT_ALLOCATED;
+  }
+  const auto status = PerfpMeasureTscOffsets(processor_count, offsets);
+  if (!NT_SUCCESS(status)) {
+    ExFreePoolWithTag(offsets, kHyperPlatformCommonPoolTag);
+    return status;
+  }
+
+  // Corrects offsets only when any of them is beyond the noise, so that
+  // PerfGetTime() usually does not have to look up a processor number
+  const auto tolerance = frequency * kPerfpTscSkewToleranceNsec / 1000000000;
+  LONG64 max_skew = 0;
+  for (auto i = 0ul; i < processor_count; ++i) {
+    const auto skew = (offsets[i] < 0) ? -offsets[i] : offsets[i];
+    if (skew > max_skew) {
+      max_skew = skew;
+    }
+  }
+  if (static_cast<ULONG64>(max_skew) > tolerance) {
+    g_perfp_tsc_offsets = offsets;
+  } else {
+    ExFreePoolWithTag(offsets, kHyperPlatformCommonPoolTag);
+  }
+
+  g_perfp_time_frequency = frequency;
+  g_perfp_use_tsc = true;
+  HYPERPLATFORM_LOG_INFO("Measuring with TSC at %I64u Hz (skew %I64d ticks)",
+                         frequency, max_skew);
+  return STATUS_SUCCESS;
+}
+
+// Measures TSC only once for the log, trace and shared ring too
+_Use_decl_annotations_ ULONG64 PerfGetTscFrequency() {
+  PAGED_CODE()
+
+  if (!g_perfp_tsc_frequency) {
+    const auto frequency = PerfpMeasureTscFrequency();
+    InterlockedCompareExchange64(
+        reinterpret_cast<volatile LONG64*>(&g_perfp_tsc_frequency),
+        static_cast<LONG64>(frequency), 0);
   }
+  return g_perfp_tsc_frequency;
+}
+
+// Tells whether TSC runs at a constant rate in all ACPI P-, C- and T-states
+/*_Use_decl_annotations_*/ static bool PerfpIsTscInvariant() {
+  int registers[4] = {};
+  __cpuid(registers, 0x80000000);
+  if (static_cast<ULONG>(registers[0]) < 0x80000007) {
+    return false;
+  }
+  __cpuid(registers, 0x80000007);
+  return (registers[3] & (1 << 8)) != 0;  // EDX.InvariantTSC[bit 8]
+}
+
+// Estimates a frequency of TSC against the performance counter
+_Use_decl_annotations_ static ULONG64 PerfpMeasureTscFrequency() {
+  PAGED_CODE()
+
+  LARGE_INTEGER frequency = {};
+  const auto counter1 = KeQueryPerformanceCounter(&frequency);
+  const auto tsc1 = __rdtsc();
+  LARGE_INTEGER interval = {};
+  interval.QuadPart = -(10000ll * kPerfpTscCalibrationMsec);  // msec
+  KeDelayExecutionThread(KernelMode, FALSE, &interval);
+  const auto counter2 = KeQueryPerformanceCounter(nullptr);
+  const auto tsc2 = __rdtsc();
+
+  const auto elapsed = counter2.QuadPart - counter1.QuadPart;
+  if (elapsed <= 0) {
+    return 0;
+  }
+  return (tsc2 - tsc1) * frequency.QuadPart / elapsed;
+}
+
+// Finds TSC of each processor minus that of processor 0. Of several rounds,
+// an offset closest to 0 is kept, as jitter in leaving the barrier only makes
+// offsets look larger.
+_Use_decl_annotations_ static NTSTATUS PerfpMeasureTscOffsets(
+    ULONG processor_count, LONG64* offsets) {
+  PAGED_CODE()
+
+  // Written at IPI_LEVEL, hence nonpaged
+  const auto tsc = static_cast<LONG64*>(
+      ExAllocatePoolWithTag(NonPagedPool, sizeof(LONG64) * processor_count,
+                            kHyperPlatformCommonPoolTag));
+  if (!tsc) {
+    return STATUS_MEMORY_NOT_ALLOCATED;
+  }
+
+  for (auto round = 0; round < kPerfpTscSyncRounds; ++round) {
+    PerfpTscSyncContext context = {static_cast<LONG>(processor_count), tsc};
+    KeIpiGenericCall(PerfpReadTscOnBarrier,
+                     reinterpret_cast<ULONG_PTR>(&context));
+    for (auto i = 0ul; i < processor_count; ++i) {
+      const auto offset = tsc[i] - tsc[0];
+      const auto abs_offset = (offset < 0) ? -offset : offset;
+      const auto abs_best = (offsets[i] < 0) ? -offsets[i] : offsets[i];
+      if (!round || abs_offset < abs_best) {
+        offsets[i] = offset;
+      }
+    }
+  }
+
+  ExFreePoolWithTag(tsc, kHyperPlatformCommonPoolTag);
+  return STATUS_SUCCESS;
+}
+
+// Reads TSC as soon as all processors arrive here
+_Use_decl_annotations_ static ULONG_PTR PerfpReadTscOnBarrier(
+    ULONG_PTR argument) {
+  auto context = reinterpret_cast<PerfpTscSyncContext*>(argument);
+  InterlockedDecrement(&context->remaining);
+  while (context->remaining) {
+    YieldProcessor();
+  }
+  context->tsc[KeGetCurrentProcessorNumberEx(nullptr)] =
+      static_cast<LONG64>(__rdtsc());
+  return 0;
 }
 
 /*_Use_decl_annotations_*/ ULONG64 PerfGetTime() {
+  if (g_perfp_use_tsc) {
+    const auto offsets = g_perfp_tsc_offsets;
+    if (!offsets) {
+      return __rdtsc();
+    }
+    // A processor number may be stale if the thread migrates in between, which
+    // is only possible outside the VMM and merely skews one measurement.
+    const auto processor = KeGetCurrentProcessorNumberEx(nullptr);
+    return __rdtsc() - offsets[processor];
+  }
   LARGE_INTEGER counter = KeQueryPerformanceCounter(nullptr);
   return static_cast<ULONG64>(counter.QuadPart);
 }
 
+// Copies performance data collected so far
+_Use_decl_annotations_ ULONG PerfSnapshot(void* buffer, ULONG size) {
+  if (size < sizeof(PerfSnapshotHeader)) {
+    return 0;
+  }
+
+  const auto header = static_cast<PerfSnapshotHeader*>(buffer);
+  RtlZeroMemory(header, sizeof(*header));
+  RtlCopyMemory(header->magic, kPerfSnapshotMagic, sizeof(header->magic));
+  header->version = kPerfSnapshotVersion;
+  header->header_size = sizeof(PerfSnapshotHeader);
+  header->entry_size = sizeof(PerfSnapshotEntry);
+  header->time_frequency = g_perfp_time_frequency;
+  header->timestamp = PerfGetTime();
+  if (!g_performance_collector) {
+    return sizeof(PerfSnapshotHeader);
+  }
+
+  PerfpSnapshotContext context = {
+      header, reinterpret_cast<PerfSnapshotEntry*>(header + 1),
+      static_cast<ULONG>((size - sizeof(PerfSnapshotHeader)) /
+                         sizeof(PerfSnapshotEntry))};
+  header->location_count =
+      g_performance_collector->Snapshot(PerfpSnapshotRoutine, &context);
+  header->dropped = g_performance_collector->GetDroppedCount();
+  return sizeof(PerfSnapshotHeader) +
+         header->entry_count * sizeof(PerfSnapshotEntry);
+}
+
+// Returns a VM-exit profile of a processor
+_Use_decl_annotations_ ExitProfile* PerfGetExitProfile(
+    ULONG processor_number) {
+  if (!g_perfp_exit_profiles ||
+      processor_number >= g_perfp_exit_profile_count) {
+    return nullptr;
+  }
+  return &g_perfp_exit_profiles[processor_number];
+}
+
+// Copies VM-exit profiles of all processors collected so far
+_Use_decl_annotations_ ULONG PerfExitSnapshot(void* buffer, ULONG size) {
+  if (size < sizeof(PerfSnapshotHeader)) {
+    return 0;
+  }
+
+  const auto header = static_cast<PerfSnapshotHeader*>(buffer);
+  RtlZeroMemory(header, sizeof(*header));
+  RtlCopyMemory(header->magic, kPerfSnapshotMagic, sizeof(header->magic));
+  header->version = kPerfSnapshotVersion;
+  header->header_size = sizeof(PerfSnapshotHeader);
+  header->entry_size = sizeof(PerfExitSnapshotEntry);
+  header->kind = kPerfSnapshotKindExits;
+  header->time_frequency = g_perfp_tsc_frequency;
+  header->timestamp = PerfGetTime();
+  if (!g_perfp_exit_profiles) {
+    return sizeof(PerfSnapshotHeader);
+  }
+
+  const auto entries = reinterpret_cast<PerfExitSnapshotEntry*>(header + 1);
+  const auto capacity = static_cast<ULONG>(
+      (size - sizeof(PerfSnapshotHeader)) / sizeof(PerfExitSnapshotEntry));
+  for (auto i = 0ul; i < g_perfp_exit_profile_count; ++i) {
+    PerfpMergeExitProfile(&g_perfp_exit_profiles[i], header, entries,
+                          capacity);
+  }
+  return sizeof(PerfSnapshotHeader) +
+         header->entry_count * sizeof(PerfExitSnapshotEntry);
+}
+
+// Clears VM-exit profiles collected so far
+/*_Use_decl_annotations_*/ void PerfExitReset() {
+  for (auto i = 0ul; g_perfp_exit_profiles && i < g_perfp_exit_profile_count;
+       ++i) {
+    ExitProfileReset(&g_perfp_exit_profiles[i]);
+  }
+}
+
+// Adds data of a processor to a snapshot. Keys that do not fit in it are
+// counted in location_count once per processor.
+_Use_decl_annotations_ static void PerfpMergeExitProfile(
+    const ExitProfile* profile, PerfSnapshotHeader* header,
+    PerfExitSnapshotEntry* entries, ULONG capacity) {
+  header->dropped += profile->dropped;
+  for (const auto& entry : profile->entries) {
+    const auto count = entry.total_execution_count;
+    if (!entry.key || !count) {
+      continue;
+    }
+
+    const auto reason = ExitProfileGetReason(entry.key);
+    const auto sub_key = ExitProfileGetSubKey(entry.key);
+    PerfExitSnapshotEntry* merged = nullptr;
+    for (auto i = 0ul; i < header->entry_count; ++i) {
+      if (entries[i].reason == reason && entries[i].sub_key == sub_key) {
+        merged = &entries[i];
+        break;
+      }
+    }
+    if (!merged) {
+      header->location_count++;
+      if (header->entry_count >= capacity) {
+        continue;
+      }
+      merged = &entries[header->entry_count++];
+      RtlZeroMemory(merged, sizeof(*merged));
+      merged->reason = reason;
+      merged->sub_key = sub_key;
+      merged->min_elapsed_time = entry.min_elapsed_time;
+    }
+
+    merged->total_execution_count += count;
+    merged->total_elapsed_time += entry.total_elapsed_time;
+    if (entry.min_elapsed_time < merged->min_elapsed_time) {
+      merged->min_elapsed_time = entry.min_elapsed_time;
+    }
+    if (entry.max_elapsed_time > merged->max_elapsed_time) {
+      merged->max_elapsed_time = entry.max_elapsed_time;
+    }
+  }
+}
+
+// Logs VM-exit profiles, the most expensive in total first
+_Use_decl_annotations_ static void PerfpLogExitProfiles() {
+  PAGED_CODE()
+
+  const auto snapshot = static_cast<PerfpExitSnapshot*>(ExAllocatePoolWithTag(
+      PagedPool, sizeof(PerfpExitSnapshot), kHyperPlatformCommonPoolTag));
+  if (!snapshot) {
+    return;
+  }
+  PerfExitSnapshot(snapshot, sizeof(PerfpExitSnapshot));
+
+  auto& header = snapshot->header;
+  const auto entries = snapshot->entries;
+  for (auto i = 1ul; i < header.entry_count; ++i) {
+    const auto entry = entries[i];
+    auto j = i;
+    for (; j && entries[j - 1].total_elapsed_time < entry.total_elapsed_time;
+         --j) {
+      entries[j] = entries[j - 1];
+    }
+    entries[j] = entry;
+  }
+
+  const auto frequency = header.time_frequency;
+  HYPERPLATFORM_LOG_INFO("%-12s,%-12s,%-20s,%-20s,%-12s,%-12s,%-12s",
+                         "Exit Reason", "Sub Key", "Execution Count",
+                         "Elapsed Time(ns)", "Min(ns)", "Mean(ns)", "Max(ns)");
+  for (auto i = 0ul; i < header.entry_count; ++i) {
+    const auto& entry = entries[i];
+    HYPERPLATFORM_LOG_INFO(
+        "%12u,%#12x,%20I64u,%20I64u,%12I64u,%12I64u,%12I64u", entry.reason,
+        entry.sub_key, entry.total_execution_count,
+        PerfpTicksToNanoseconds(entry.total_elapsed_time, frequency),
+        PerfpTicksToNanoseconds(entry.min_elapsed_time, frequency),
+        PerfpTicksToNanoseconds(
+            entry.total_elapsed_time / entry.total_execution_count, frequency),
+        PerfpTicksToNanoseconds(entry.max_elapsed_time, frequency));
+  }
+  if (header.location_count > header.entry_count || header.dropped) {
+    HYPERPLATFORM_LOG_WARN("Left out %u keys and dropped %I64u VM-exits.",
+                           header.location_count - header.entry_count,
+                           header.dropped);
+  }
+  ExFreePoolWithTag(snapshot, kHyperPlatformCommonPoolTag);
+}
+
+// Converts ticks of a frequency into nanoseconds without overflowing for days
+// worth of ticks
+_Use_decl_annotations_ static ULONG64 PerfpTicksToNanoseconds(
+    ULONG64 ticks, ULONG64 frequency) {
+  return ticks / frequency * 1000000000 +
+         ticks % frequency * 1000000000 / frequency;
+}
+
+// Formats call paths in the folded form, one line per path
+_Use_decl_annotations_ ULONG PerfFoldedStacks(char* buffer, ULONG size) {
+  if (!size) {
+    return 0;
+  }
+  buffer[0] = '\0';
+  if (!g_performance_collector) {
+    return 0;
+  }
+
+  PerfpFoldedStacksContext context = {buffer, size, false};
+  g_performance_collector->SnapshotPaths(PerfpFoldedStacksRoutine, &context);
+  return static_cast<ULONG>(context.end - buffer);
+}
+
+// Clears performance data collected so far
+/*_Use_decl_annotations_*/ void PerfReset() {
+  if (g_performance_collector) {
+    g_performance_collector->Reset();
+  }
+}
+
+// Returns an index of a table of the current processor
+/*_Use_decl_annotations_*/ static ULONG PerfpGetProcessorNumber() {
+  return KeGetCurrentProcessorNumberEx(nullptr);
+}
+
 _Use_decl_annotations_ static void PerfpInitialOutputRoutine(
     void* output_context) {
   UNREFERENCED_PARAMETER(output_context);
-  HYPERPLATFORM_LOG_INFO("%-45s,%-20s,%-20s", "FunctionName(Line)",
-                         "Execution Count", "Elapsed Time");
+  HYPERPLATFORM_LOG_INFO(
+      "%-45s,%-20s,%-20s,%-20s,%-12s,%-12s,%-12s,%-12s,%-12s,%-12s",
+      "FunctionName(Line)", "Execution Count", "Elapsed Time(ns)",
+      "Exclusive Time(ns)", "Min(ns)", "P50(ns)", "P90(ns)", "P99(ns)",
+      "P99.9(ns)", "Max(ns)");
 }
 
 _Use_decl_annotations_ static void PerfpOutputRoutine(
-    const char* location_name, ULONG64 total_execution_count,
-    ULONG64 total_elapsed_time, void* output_context) {
+    const char* location_name, const PerfCollector::PerfSummary* summary,
+    void* output_context) {
   UNREFERENCED_PARAMETER(output_context);
-  HYPERPLATFORM_LOG_INFO("%-45s,%20I64u,%20I64u,", location_name,
-                         total_execution_count, total_elapsed_time);
+  const auto frequency = g_perfp_time_frequency;
+  HYPERPLATFORM_LOG_INFO(
+      "%-45s,%20I64u,%20I64u,%20I64u,%12I64u,%12I64u,%12I64u,%12I64u,%12I64u,"
+      "%12I64u,",
+      location_name, summary->total_execution_count,
+      PerfpTicksToNanoseconds(summary->total_elapsed_time, frequency),
+      PerfpTicksToNanoseconds(summary->total_exclusive_time, frequency),
+      PerfpTicksToNanoseconds(summary->min_elapsed_time, frequency),
+      PerfpTicksToNanoseconds(summary->p50_elapsed_time, frequency),
+      PerfpTicksToNanoseconds(summary->p90_elapsed_time, frequency),
+      PerfpTicksToNanoseconds(summary->p99_elapsed_time, frequency),
+      PerfpTicksToNanoseconds(summary->p999_elapsed_time, frequency),
+      PerfpTicksToNanoseconds(summary->max_elapsed_time, frequency));
 }
 
 _Use_decl_annotations_ static void PerfpFinalOutputRoutine(
     void* output_context) {
   UNREFERENCED_PARAMETER(output_context);
 }
+
+// Appends performance data of a location to a snapshot
+_Use_decl_annotations_ static void PerfpSnapshotRoutine(
+    const char* location_name, const PerfCollector::PerfSummary* summary,
+    void* output_context) {
+  auto context = static_cast<PerfpSnapshotContext*>(output_context);
+  if (context->header->entry_count >= context->capacity) {
+    return;
+  }
+
+  auto& entry = context->entries[context->header->entry_count++];
+  RtlZeroMemory(entry.location, sizeof(entry.location));
+  for (auto i = 0ul; i < sizeof(entry.location) - 1 && location_name[i]; ++i) {
+    entry.location[i] = location_name[i];
+  }
+  entry.total_execution_count = summary->total_execution_count;
+  entry.total_elapsed_time = summary->total_elapsed_time;
+  entry.min_elapsed_time = summary->min_elapsed_time;
+  entry.max_elapsed_time = summary->max_elapsed_time;
+  entry.p50_elapsed_time = summary->p50_elapsed_time;
+  entry.p90_elapsed_time = summary->p90_elapsed_time;
+  entry.p99_elapsed_time = summary->p99_elapsed_time;
+  entry.p999_elapsed_time = summary->p999_elapsed_time;
+  entry.total_exclusive_time = summary->total_exclusive_time;
+}
+
+// Appends a line of a call path in the folded form, ie, locations from the
+// outermost one separated by ';', followed by exclusive time in nanoseconds
+_Use_decl_annotations_ static void PerfpFoldedStacksRoutine(
+    const char* const* location_names, ULONG depth,
+    const PerfCollector::PathSummary* summary, void* output_context) {
+  auto context = static_cast<PerfpFoldedStacksContext*>(output_context);
+  if (context->truncated) {
+    return;
+  }
+
+  // Lines are written whole or not at all
+  auto end = context->end;
+  auto remaining = context->remaining;
+  auto status = STATUS_SUCCESS;
+  for (auto i = 0ul; i < depth && NT_SUCCESS(status); ++i) {
+    status = RtlStringCchPrintfExA(end, remaining, &end, &remaining, 0, "%s%s",
+                                   (i) ? ";" : "", location_names[i]);
+  }
+  if (NT_SUCCESS(status)) {
+    status = RtlStringCchPrintfExA(
+        end, remaining, &end, &remaining, 0, " %I64u\n",
+        PerfpTicksToNanoseconds(summary->total_exclusive_time,
+                                g_perfp_time_frequency));
+  }
+  if (!NT_SUCCESS(status)) {
+    context->end[0] = '\0';
+    context->truncated = true;
+    return;
+  }
+  context->end = end;
+  context->remaining = remaining;
+}
@@ -8,7 +8,9 @@
 #ifndef HYPERPLATFORM_PERFORMANCE_H_
 #define HYPERPLATFORM_PERFORMANCE_H_
 
+#include "exit_profile.h"
 #include "perf_counter.h"
+#include "perf_snapshot_format.h"
 
 extern "C" {
 ////////////////////////////////////////////////////////////////////////////////
@@ -40,6 +42,13 @@ extern "C" {
 // types
 //
 
+/// A context of HypercallNumber::kGetPerfSnapshot
+struct PerfSnapshotRequest {
+  void* buffer;   //!< Receives a snapshot; must be nonpaged
+  ULONG size;     //!< A size of buffer in bytes
+  ULONG written;  //!< Set to a return value of PerfSnapshot()
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // prototypes
@@ -53,11 +62,65 @@ _IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS PerfInitialization();
 _IRQL_requires_max_(PASSIVE_LEVEL) void PerfTermination();
 
 /// Returns the current "time" for performance measurement.
-/// @return Current performance counter
+/// @return Current TSC adjusted to that of processor 0 if TSC is invariant
+///         and #HYPERPLATFORM_PERFORMANCE_USE_TSC is set, or the current
+///         performance counter otherwise
 ///
 /// It should only be used by #HYPERPLATFORM_PERFORMANCE_MEASURE_THIS_SCOPE().
 ULONG64 PerfGetTime();
 
+/// Returns a frequency of TSC
+/// @return A frequency of TSC in Hz, or 0 if it cannot be measured
+///
+/// TSC is calibrated against the performance counter on the first call, which
+/// takes a while, and the result is shared by every caller afterwards. This
+/// function may be called before PerfInitialization().
+_IRQL_requires_max_(PASSIVE_LEVEL) ULONG64 PerfGetTscFrequency();
+
+/// Copies performance data collected so far
+/// @param buffer   Receives a snapshot in the layout of perf_snapshot_format.h
+/// @param size   A size of \a buffer in bytes
+/// @return A number of bytes written, or 0 if \a buffer cannot hold a header
+///
+/// Locations that do not fit in \a buffer are left out. This function takes
+/// no lock and may be called wherever
+/// #HYPERPLATFORM_PERFORMANCE_MEASURE_THIS_SCOPE() may be, including from
+/// VMX-root mode.
+ULONG PerfSnapshot(_Out_writes_bytes_(size) void* buffer, _In_ ULONG size);
+
+/// Formats call paths of measured scopes for flame graphs
+/// @param buffer   Receives null-terminated text
+/// @param size   A size of \a buffer in bytes
+/// @return A number of bytes written excluding a null terminator
+///
+/// Each line is locations of nested scopes from the outermost one separated by
+/// ';', a space, and exclusive time of the innermost one in nanoseconds, which
+/// is the "folded" form that flamegraph.pl takes. Lines that do not fit in
+/// \a buffer are left out.
+_IRQL_requires_max_(PASSIVE_LEVEL) ULONG
+    PerfFoldedStacks(_Out_writes_bytes_(size) char* buffer, _In_ ULONG size);
+
+/// Clears performance data collected so far
+void PerfReset();
+
+/// Returns a VM-exit profile of a processor
+/// @param processor_number   A number of a processor
+/// @return A profile, or nullptr if the VM-exit profiler is disabled
+///
+/// @see HYPERPLATFORM_PERFORMANCE_ENABLE_EXIT_PROFILE
+ExitProfile* PerfGetExitProfile(_In_ ULONG processor_number);
+
+/// Copies VM-exit profiles of all processors collected so far
+/// @param buffer   Receives a snapshot of kPerfSnapshotKindExits
+/// @param size   A size of \a buffer in bytes
+/// @return A number of bytes written, or 0 if \a buffer cannot hold a header
+///
+/// Like PerfSnapshot(), this function takes no lock.
+ULONG PerfExitSnapshot(_Out_writes_bytes_(size) void* buffer, _In_ ULONG size);
+
+/// Clears VM-exit profiles collected so far
+void PerfExitReset();
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // variables
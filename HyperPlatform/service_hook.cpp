@@ -7,6 +7,8 @@
 #include"include/handle.h"
 #include"include/PDBSDK.h"
 #include"common.h"
+#include"syscall_sampling.h"
+#include"trace.h"
 
 extern "C"
 {
@@ -343,6 +345,25 @@ void RemoveServiceHook()
 	}
 }
 
+//
+//trace¼һdetourĵ
+//SampleddetourڴSyscallSamplingAdmit()ĽͬһεõLog()Ҳÿεֻһ
+//
+static void ServiceHookTrace(BOOLEAN Sampled, const char* Name, ULONG64 Argument)
+{
+	if (!Sampled)
+		return;
+
+	auto record = (TraceHookRecord*)TraceBegin(sizeof(TraceHookRecord));
+	if (!record)
+		return;
+	record->process_id = (ULONG64)PsGetCurrentProcessId();
+	record->thread_id = (ULONG64)PsGetCurrentThreadId();
+	record->argument = Argument;
+	strncpy(record->name, Name, sizeof(record->name));
+	TraceCommit(&record->header, kTraceRecordHook);
+}
+
 //
 //hook example
 //
@@ -354,6 +375,9 @@ NTSTATUS DetourNtOpenProcess(
 	PCLIENT_ID         ClientId
 )
 {
+	const BOOLEAN sampled = SyscallSamplingAdmit();
+	ServiceHookTrace(sampled, __func__, (ULONG64)ClientId);
+
 #ifdef DBG
 
 	static int once = 0;
@@ -379,6 +403,9 @@ NTSTATUS DetourNtCreateFile(
 	ULONG              EaLength
 )
 {
+	const BOOLEAN sampled = SyscallSamplingAdmit();
+	ServiceHookTrace(sampled, __func__, (ULONG64)ObjectAttributes);
+
 #ifdef DBG
 	static int once = 0;
 	if (!(once++))
@@ -410,6 +437,9 @@ NTSTATUS DetourNtWriteVirtualMemory(
 	OUT PSIZE_T NumberOfBytesWritten OPTIONAL
 )
 {
+	const BOOLEAN sampled = SyscallSamplingAdmit();
+	ServiceHookTrace(sampled, __func__, (ULONG64)ProcessHandle);
+
 #ifdef DBG
 	static int once = 0;
 	if (!(once++))
@@ -430,7 +460,7 @@ NTSTATUS DetourNtWriteVirtualMemory(
 	{
 		unsigned char* Image = PsGetProcessImageFileName(Process);
 
-		if (!strcmp((const char*)Image, target_process))
+		if (!strcmp((const char*)Image, target_process) && sampled)
 		{
 			Log("[%s]\nBaseAddress %llx BufferSize %llx\n",__func__, BaseAddress, BufferSize);
 		}
@@ -464,6 +494,9 @@ NTSTATUS DetourNtCreateThreadEx(
 	IN SIZE_T SizeOfStackReserve,
 	OUT PVOID lpBytesBuffer)
 {
+	const BOOLEAN sampled = SyscallSamplingAdmit();
+	ServiceHookTrace(sampled, __func__, (ULONG64)ProcessHandle);
+
 #ifdef DBG
 	static int once = 0;
 	if (!(once++))
@@ -485,7 +518,8 @@ NTSTATUS DetourNtCreateThreadEx(
 		unsigned char* Image = PsGetProcessImageFileName(Process);
 		const unsigned char* Image2 = PsGetProcessImageFileName(IoGetCurrentProcess());
 
-		if (!strcmp((const char*)Image, target_process) && strcmp((const char*)Image2, target_process))
+		if (!strcmp((const char*)Image, target_process) && strcmp((const char*)Image2, target_process) &&
+			sampled)
 		{
 			Log("[csgo]\nThreadProcedure %llx\n", lpStartAddress);
 
@@ -523,6 +557,9 @@ NTSTATUS DetourNtAllocateVirtualMemory(
 	ULONG     Protect
 )
 {
+	const BOOLEAN sampled = SyscallSamplingAdmit();
+	ServiceHookTrace(sampled, __func__, (ULONG64)ProcessHandle);
+
 #ifdef DBG
 	static int once = 0;
 	if (!(once++))
@@ -543,7 +580,8 @@ NTSTATUS DetourNtAllocateVirtualMemory(
 	{
 		unsigned char* Image = PsGetProcessImageFileName(Process);
 		const unsigned char* Image2 = PsGetProcessImageFileName(IoGetCurrentProcess());
-		if (!strcmp((const char*)Image, target_process) && strcmp((const char*)Image2, target_process))
+		if (!strcmp((const char*)Image, target_process) && strcmp((const char*)Image2, target_process) &&
+			sampled)
 		{
 			Log("[%s]\nAlloc RegionSize %p\n", __func__, *RegionSize);
 		}
@@ -577,6 +615,9 @@ NTSTATUS DetourNtCreateThread(
 	IN  BOOLEAN CreateSuspended
 )
 {
+	const BOOLEAN sampled = SyscallSamplingAdmit();
+	ServiceHookTrace(sampled, __func__, (ULONG64)ProcessHandle);
+
 #ifdef DBG
 	static int once = 0;
 	if (!(once++))
@@ -599,7 +640,8 @@ NTSTATUS DetourNtCreateThread(
 		unsigned char* Image = PsGetProcessImageFileName(Process);
 		const unsigned char* Image2 = PsGetProcessImageFileName(IoGetCurrentProcess());
 
-		if (!strcmp((const char*)Image, target_process) && strcmp((const char*)Image2, target_process))
+		if (!strcmp((const char*)Image, target_process) && strcmp((const char*)Image2, target_process) &&
+			sampled)
 		{
 			Log("[%s]\nThreadProcedure %llx\n",__func__ ,ThreadContext->Rcx);
 		}
@@ -638,6 +680,9 @@ HWND DetourNtUserFindWindowEx(  // API FindWindowA/W, FindWindowExA/W
 	IN PUNICODE_STRING pstrClassName,
 	IN PUNICODE_STRING pstrWindowName)
 {
+	const BOOLEAN sampled = SyscallSamplingAdmit();
+	ServiceHookTrace(sampled, __func__, (ULONG64)hwndParent);
+
 #if 0
 	if(pstrWindowName->Buffer)
 		Log("[%s]%ws\n", __func__, pstrWindowName->Buffer);
@@ -667,6 +712,9 @@ NTSTATUS DetourNtDeviceIoControlFile(
 	_In_ ULONG OutputBufferLength
 )
 {
+	const BOOLEAN sampled = SyscallSamplingAdmit();
+	ServiceHookTrace(sampled, __func__, (ULONG64)FileHandle);
+
 	NTSTATUS status;
 	FILE_OBJECT* FileObject;
 	status = ObReferenceObjectByHandle(FileHandle, FILE_ALL_ACCESS, *IoFileObjectType, KernelMode, (PVOID*)&FileObject, NULL);
@@ -681,7 +729,7 @@ NTSTATUS DetourNtDeviceIoControlFile(
 			POBJECT_NAME_INFORMATION p = NULL;
 			status = IoQueryFileDosDeviceName(FileObject, &p);
 
-			if (p && NT_SUCCESS(status)) {
+			if (p && NT_SUCCESS(status) && sampled) {
 
 			Log("[service]%wZ  [ioctl-code] %x\n", p->Name, IoControlCode);
 			
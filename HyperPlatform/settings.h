@@ -20,6 +20,16 @@
 //
 //#define HIDE_WINDOW
 
+//
+//traceдļ(ʽtrace_format.h)IOCTL_HYPER_TRACE_READ¼
+//
+//#define TRACE_FILE
+
+//
+//ڰܼ(CSV)׷дļʱҲIOCTL_HYPER_PERF_SNAPSHOT
+//
+//#define PERF_FILE
+
 
 
 
@@ -0,0 +1,366 @@
+// Copyright (c) 2015-2019, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements the ring shared with a user-mode consumer.
+///
+/// The header page and the data area are a single nonpaged allocation
+/// described by an MDL, which is mapped into one consumer process at a time.
+/// The consumer can write anything into the mapping, so the driver reserves
+/// records with its own copy of head and never reads back what it wrote. tail
+/// is only used to tell whether the ring is full, and a value that makes no
+/// sense is treated as a full ring.
+
+#include "shared_ring.h"
+#include <intrin.h>
+#include "common.h"
+#include "log.h"
+#include "performance.h"
+
+extern "C" {
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// A size of the data area. Must be a power of two.
+static const ULONG kSharedpDataSize = 1024 * 1024;
+
+// A size of the header page preceding the data area
+static const ULONG kSharedpHeaderSize = PAGE_SIZE;
+
+static_assert(sizeof(SharedRingHeader) <= kSharedpHeaderSize, "Size check");
+static_assert(sizeof(SharedRingRecordHeader) == sizeof(TraceRecordHeader),
+              "Size check");
+static_assert(kSharedRingRecordAlignment == kTraceRecordAlignment,
+              "Alignment check");
+static_assert(kSharedRingRecordLog == kTraceRecordLog, "Type check");
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+static ULONG SharedpAlign(_In_ ULONG size);
+
+static void SharedpPublishHead(_In_ LONG64 head);
+
+_IRQL_requires_max_(APC_LEVEL) static void SharedpUnmap();
+#if defined(ALLOC_PRAGMA)
+#pragma alloc_text(PAGE, SharedRingInitialization)
+#pragma alloc_text(PAGE, SharedRingTermination)
+#pragma alloc_text(PAGE, SharedRingMap)
+#pragma alloc_text(PAGE, SharedRingUnmap)
+#pragma alloc_text(PAGE, SharedpUnmap)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+static SharedRingHeader *g_sharedp_header;
+static UCHAR *g_sharedp_data;
+static PMDL g_sharedp_mdl;
+
+// Bytes ever reserved. The copy in the header page is only a hint for the
+// consumer.
+static volatile LONG64 g_sharedp_head;
+
+// Serializes mapping and unmapping
+static FAST_MUTEX g_sharedp_mutex;
+
+// A file object, a process and an address of the current mapping
+static PFILE_OBJECT g_sharedp_file_object;
+static PEPROCESS g_sharedp_process;
+static void *g_sharedp_user_address;
+
+static volatile LONG g_sharedp_mapped;
+
+// TRUE while mapped in kSharedRingModeExclusive. Written only while unmapped.
+static volatile LONG g_sharedp_exclusive;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Allocates the header page and the data area, and describes them with an MDL
+_Use_decl_annotations_ NTSTATUS SharedRingInitialization() {
+  PAGED_CODE()
+
+  const auto size = kSharedpHeaderSize + kSharedpDataSize;
+  const auto header = static_cast<SharedRingHeader *>(ExAllocatePoolWithTag(
+      NonPagedPool, size, kHyperPlatformCommonPoolTag));
+  if (!header) {
+    return STATUS_MEMORY_NOT_ALLOCATED;
+  }
+  RtlZeroMemory(header, size);
+
+  const auto mdl = IoAllocateMdl(header, size, FALSE, FALSE, nullptr);
+  if (!mdl) {
+    ExFreePoolWithTag(header, kHyperPlatformCommonPoolTag);
+    return STATUS_INSUFFICIENT_RESOURCES;
+  }
+  MmBuildMdlForNonPagedPool(mdl);
+
+  RtlCopyMemory(header->magic, kSharedRingMagic, sizeof(header->magic));
+  header->version = kSharedRingVersion;
+  header->header_size = kSharedpHeaderSize;
+  header->data_size = kSharedpDataSize;
+  header->tsc_frequency = PerfGetTscFrequency();
+
+  ExInitializeFastMutex(&g_sharedp_mutex);
+  g_sharedp_head = 0;
+  g_sharedp_mdl = mdl;
+  g_sharedp_data = reinterpret_cast<UCHAR *>(header) + kSharedpHeaderSize;
+  g_sharedp_header = header;
+  return STATUS_SUCCESS;
+}
+
+// Unmaps and frees the shared ring. All writers must have been stopped.
+_Use_decl_annotations_ void SharedRingTermination() {
+  PAGED_CODE()
+
+  const auto header = g_sharedp_header;
+  if (!header) {
+    return;
+  }
+
+  ExAcquireFastMutex(&g_sharedp_mutex);
+  SharedpUnmap();
+  ExReleaseFastMutex(&g_sharedp_mutex);
+
+  g_sharedp_header = nullptr;
+  g_sharedp_data = nullptr;
+  IoFreeMdl(g_sharedp_mdl);
+  g_sharedp_mdl = nullptr;
+  ExFreePoolWithTag(header, kHyperPlatformCommonPoolTag);
+}
+
+// Maps the shared ring into the current process
+_Use_decl_annotations_ NTSTATUS SharedRingMap(PFILE_OBJECT file_object,
+                                              ULONG mode,
+                                              SharedRingMapping *mapping) {
+  PAGED_CODE()
+
+  RtlZeroMemory(mapping, sizeof(*mapping));
+  if (mode != kSharedRingModeMirror && mode != kSharedRingModeExclusive) {
+    return STATUS_INVALID_PARAMETER;
+  }
+  if (!g_sharedp_header) {
+    return STATUS_DEVICE_NOT_READY;
+  }
+
+  auto status = STATUS_SUCCESS;
+  void *address = nullptr;
+  ExAcquireFastMutex(&g_sharedp_mutex);
+  if (g_sharedp_process) {
+    status = STATUS_DEVICE_BUSY;
+  } else {
+    __try {
+      // Raises an exception rather than returning nullptr for UserMode
+      address = MmMapLockedPagesSpecifyCache(
+          g_sharedp_mdl, UserMode, MmCached, nullptr, FALSE,
+          NormalPagePriority | MdlMappingNoExecute);
+    } __except (EXCEPTION_EXECUTE_HANDLER) {
+      status = GetExceptionCode();
+    }
+    if (NT_SUCCESS(status) && !address) {
+      status = STATUS_INSUFFICIENT_RESOURCES;
+    }
+    if (NT_SUCCESS(status)) {
+      g_sharedp_process = PsGetCurrentProcess();
+      ObReferenceObject(g_sharedp_process);
+      g_sharedp_file_object = file_object;
+      g_sharedp_user_address = address;
+      InterlockedExchange(&g_sharedp_exclusive,
+                          mode == kSharedRingModeExclusive);
+      InterlockedExchange(&g_sharedp_mapped, TRUE);
+
+      mapping->address = reinterpret_cast<ULONG_PTR>(address);
+      mapping->size = kSharedpHeaderSize + kSharedpDataSize;
+    }
+  }
+  ExReleaseFastMutex(&g_sharedp_mutex);
+
+  if (NT_SUCCESS(status)) {
+    HYPERPLATFORM_LOG_INFO("Mapped the shared ring at %p in process %Iu (%s).",
+                           address, PsGetCurrentProcessId(),
+                           (mode == kSharedRingModeExclusive) ? "exclusive"
+                                                              : "mirror");
+  }
+  return status;
+}
+
+// Unmaps the shared ring if it was mapped through a file object
+_Use_decl_annotations_ NTSTATUS SharedRingUnmap(PFILE_OBJECT file_object) {
+  PAGED_CODE()
+
+  if (!g_sharedp_header) {
+    return STATUS_NOT_FOUND;
+  }
+
+  auto status = STATUS_SUCCESS;
+  ExAcquireFastMutex(&g_sharedp_mutex);
+  if (!g_sharedp_process || g_sharedp_file_object != file_object) {
+    status = STATUS_NOT_FOUND;
+  } else {
+    SharedpUnmap();
+  }
+  ExReleaseFastMutex(&g_sharedp_mutex);
+  return status;
+}
+
+// Removes the current mapping. The caller holds g_sharedp_mutex. A file object
+// may be cleaned up in a process other than the one it was mapped into when
+// its handle was duplicated, so the address space of the owner is attached as
+// necessary.
+_Use_decl_annotations_ static void SharedpUnmap() {
+  PAGED_CODE()
+
+  const auto process = g_sharedp_process;
+  if (!process) {
+    return;
+  }
+
+  // Stop new writers. Ones already in the ring keep writing into the kernel
+  // view, which stays valid.
+  InterlockedExchange(&g_sharedp_mapped, FALSE);
+  InterlockedExchange(&g_sharedp_exclusive, FALSE);
+
+  if (process == PsGetCurrentProcess()) {
+    MmUnmapLockedPages(g_sharedp_user_address, g_sharedp_mdl);
+  } else {
+    KAPC_STATE apc_state = {};
+    KeStackAttachProcess(process, &apc_state);
+    MmUnmapLockedPages(g_sharedp_user_address, g_sharedp_mdl);
+    KeUnstackDetachProcess(&apc_state);
+  }
+
+  g_sharedp_user_address = nullptr;
+  g_sharedp_file_object = nullptr;
+  g_sharedp_process = nullptr;
+  ObDereferenceObject(process);
+}
+
+// Tells whether a consumer has the shared ring mapped
+bool SharedRingIsMapped() { return g_sharedp_mapped != FALSE; }
+
+// Tells whether the shared ring is mapped in kSharedRingModeExclusive
+bool SharedRingIsExclusive() {
+  return g_sharedp_mapped != FALSE && g_sharedp_exclusive != FALSE;
+}
+
+// Rounds up a size to kSharedRingRecordAlignment
+_Use_decl_annotations_ static ULONG SharedpAlign(ULONG size) {
+  return (size + kSharedRingRecordAlignment - 1) &
+         ~(kSharedRingRecordAlignment - 1);
+}
+
+// Reserves a record in the shared ring
+_Use_decl_annotations_ TraceRecordHeader *SharedRingBegin(ULONG size) {
+  const auto header = g_sharedp_header;
+  if (!header || !g_sharedp_mapped || size < sizeof(TraceRecordHeader) ||
+      size > kTraceRecordMaxSize) {
+    return nullptr;
+  }
+  size = SharedpAlign(size);
+
+  LONG64 head = 0;
+  ULONG offset = 0;
+  ULONG padding = 0;
+  for (;;) {
+    head = g_sharedp_head;
+    offset = static_cast<ULONG>(head) & (kSharedpDataSize - 1);
+
+    // A record never straddles the end of the ring; the rest is padded instead
+    padding =
+        (offset + size > kSharedpDataSize) ? kSharedpDataSize - offset : 0;
+
+    // tail is written by the consumer and may be anything
+    const auto tail = static_cast<LONG64>(header->tail);
+    if (tail > head || head + padding + size - tail > kSharedpDataSize) {
+      InterlockedIncrement64(
+          reinterpret_cast<volatile LONG64 *>(&header->dropped));
+      return nullptr;
+    }
+    if (InterlockedCompareExchange64(&g_sharedp_head, head + padding + size,
+                                     head) == head) {
+      break;
+    }
+  }
+  SharedpPublishHead(head + padding + size);
+
+  const auto processor = KeGetCurrentProcessorNumberEx(nullptr);
+  if (padding) {
+    const auto pad =
+        reinterpret_cast<TraceRecordHeader *>(g_sharedp_data + offset);
+    pad->size = static_cast<USHORT>(padding);
+    pad->processor = processor;
+    pad->tsc = 0;
+    InterlockedExchange16(reinterpret_cast<volatile SHORT *>(&pad->type),
+                          kSharedRingRecordPadding);
+    offset = 0;
+  }
+
+  const auto record =
+      reinterpret_cast<TraceRecordHeader *>(g_sharedp_data + offset);
+  record->size = static_cast<USHORT>(size);
+  record->processor = processor;
+  record->tsc = __rdtsc();
+  return record;
+}
+
+// Copies a record being committed into the shared ring. A record reserved in
+// the shared ring itself, such as one reserved in kSharedRingModeExclusive or
+// a log record, is already there.
+_Use_decl_annotations_ void SharedRingMirror(const TraceRecordHeader *record,
+                                             TraceRecordType type) {
+  const auto data = g_sharedp_data;
+  if (!data || !g_sharedp_mapped || g_sharedp_exclusive) {
+    return;
+  }
+  const auto address = reinterpret_cast<const UCHAR *>(record);
+  if (address >= data && address < data + kSharedpDataSize) {
+    return;
+  }
+
+  const auto copy = SharedRingBegin(record->size);
+  if (!copy) {
+    return;
+  }
+  RtlCopyMemory(copy + 1, record + 1, record->size - sizeof(*record));
+  copy->processor = record->processor;
+  copy->tsc = record->tsc;
+  InterlockedExchange16(reinterpret_cast<volatile SHORT *>(&copy->type),
+                        static_cast<SHORT>(type));
+}
+
+// Raises head in the header page to at least a given value. Writers finish
+// reserving out of order, so it only ever moves forward.
+_Use_decl_annotations_ static void SharedpPublishHead(LONG64 head) {
+  const auto published =
+      reinterpret_cast<volatile LONG64 *>(&g_sharedp_header->head);
+  auto current = *published;
+  while (current < head) {
+    const auto previous =
+        InterlockedCompareExchange64(published, head, current);
+    if (previous == current) {
+      break;
+    }
+    current = previous;
+  }
+}
+}  // extern "C"
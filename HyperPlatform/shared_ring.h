@@ -0,0 +1,111 @@
+// Copyright (c) 2015-2019, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Declares interfaces to the ring shared with a user-mode consumer.
+///
+/// The ring is mapped into a consumer process through
+/// IOCTL_HYPER_SHARED_RING_MAP and read there without a system call per
+/// record. Its layout is defined in shared_ring_format.h. While it is mapped,
+/// the log flush thread copies log messages into it, and trace records are
+/// written into it as the mode chosen on mapping says: TraceCommit() copies
+/// them into it in kSharedRingModeMirror, and TraceBegin() reserves them in it
+/// instead of the per-processor rings in kSharedRingModeExclusive. The ring
+/// then replaces TRACE_FILE and IOCTL_HYPER_TRACE_READ, which see no trace
+/// records until it is unmapped.
+
+#ifndef HYPERPLATFORM_SHARED_RING_H_
+#define HYPERPLATFORM_SHARED_RING_H_
+
+#include <ntddk.h>
+#include "shared_ring_format.h"
+#include "trace.h"
+
+extern "C" {
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+/// Allocates the shared ring
+/// @return STATUS_SUCCESS on success
+_IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS SharedRingInitialization();
+
+/// Unmaps and frees the shared ring
+_IRQL_requires_max_(PASSIVE_LEVEL) void SharedRingTermination();
+
+/// Maps the shared ring into the current process
+/// @param file_object   A file object the request came through
+/// @param mode   kSharedRingModeMirror or kSharedRingModeExclusive
+/// @param mapping   Receives an address and a size of the mapping
+/// @return STATUS_SUCCESS on success, STATUS_INVALID_PARAMETER for an unknown
+///         \a mode, or STATUS_DEVICE_BUSY if the ring is already mapped
+///
+/// The mapping is kept until SharedRingUnmap() is called with the same
+/// \a file_object.
+_IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS
+    SharedRingMap(_In_ PFILE_OBJECT file_object, _In_ ULONG mode,
+                  _Out_ SharedRingMapping *mapping);
+
+/// Unmaps the shared ring if it was mapped through a file object
+/// @param file_object   A file object passed to SharedRingMap()
+/// @return STATUS_SUCCESS on success, or STATUS_NOT_FOUND if the ring is not
+///         mapped through \a file_object
+_IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS
+    SharedRingUnmap(_In_ PFILE_OBJECT file_object);
+
+/// Tells whether a consumer has the shared ring mapped
+/// @return true if records written into the ring can be read out
+bool SharedRingIsMapped();
+
+/// Tells whether the shared ring is mapped in kSharedRingModeExclusive
+/// @return true if trace records must be reserved only in the shared ring
+bool SharedRingIsExclusive();
+
+/// Reserves a record in the shared ring
+/// @param size   A size of the record including TraceRecordHeader
+/// @return A reserved record, or nullptr if the ring is full or not mapped
+///
+/// Works as TraceBegin() does, and a record is published with TraceCommit().
+/// This function is lock-free and may be called at any IRQL.
+TraceRecordHeader *SharedRingBegin(_In_ ULONG size);
+
+/// Copies a record being committed into the shared ring
+/// @param record   A record reserved by TraceBegin() and filled
+/// @param type   A type of the record
+///
+/// Does nothing unless the ring is mapped in kSharedRingModeMirror, or when
+/// \a record is already in the shared ring. The copy is dropped if the ring is
+/// full. This function is lock-free and may be called at any IRQL.
+void SharedRingMirror(_In_ const TraceRecordHeader *record,
+                      _In_ TraceRecordType type);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+}  // extern "C"
+
+#endif  // HYPERPLATFORM_SHARED_RING_H_
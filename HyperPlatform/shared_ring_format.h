@@ -0,0 +1,117 @@
+// Copyright (c) 2015-2019, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Defines the layout of the ring shared with a user-mode consumer.
+///
+/// This header has no dependencies so that it is shared by the driver and the
+/// RingConsumer library.
+///
+/// IOCTL_HYPER_SHARED_RING_MAP maps a header page followed by a data area of
+/// SharedRingHeader::data_size bytes into the calling process. The data area
+/// holds records, each starting with SharedRingRecordHeader and padded to
+/// kSharedRingRecordAlignment. A record never straddles the end of the area;
+/// the rest is filled with a kSharedRingRecordPadding record instead.
+///
+/// The driver reserves space past head, fills a record and stores its type
+/// last. The consumer reads records at tail until it finds one whose type is
+/// still zero, zeroes what it consumed and only then advances tail, so that
+/// the driver always reserves zeroed memory. head and tail count bytes ever
+/// reserved and released; an offset in the data area is a count modulo
+/// data_size. head is published only as a hint and may lag.
+///
+/// The map request chooses a mode. In kSharedRingModeMirror, trace records are
+/// copied into the ring and still reach the per-processor trace rings, so
+/// TRACE_FILE and IOCTL_HYPER_TRACE_READ keep working. In
+/// kSharedRingModeExclusive, trace records are reserved only in the ring, which
+/// then replaces those sinks until it is unmapped. Log messages are copied into
+/// the ring in both modes.
+///
+/// Types other than kSharedRingRecordInvalid and kSharedRingRecordPadding are
+/// TraceRecordType values, and a payload is laid out as the corresponding
+/// record in trace.h.
+
+#ifndef HYPERPLATFORM_SHARED_RING_FORMAT_H_
+#define HYPERPLATFORM_SHARED_RING_FORMAT_H_
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+/// The first bytes of the header page
+static const char kSharedRingMagic[8] = {'H', 'P', 'R', 'I', 'N', 'G', 0, 0};
+
+/// A version of the layout. Bumped on incompatible changes.
+static const unsigned int kSharedRingVersion = 1;
+
+/// Every record starts at and is padded to this alignment
+static const unsigned int kSharedRingRecordAlignment = 16;
+
+/// A type of a record still being written
+static const unsigned short kSharedRingRecordInvalid = 0;
+
+/// A type of a record filling the end of the data area on wrap
+static const unsigned short kSharedRingRecordPadding = 1;
+
+/// A type of a record holding a null-terminated log message after the header
+static const unsigned short kSharedRingRecordLog = 8;
+
+/// Trace records are copied into the ring in addition to the other sinks
+static const unsigned int kSharedRingModeMirror = 0;
+
+/// Trace records are written only into the ring
+static const unsigned int kSharedRingModeExclusive = 1;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+/// The header page. Indexes are on their own cache lines as they are written
+/// from different sides.
+struct SharedRingHeader {
+  char magic[8];                        //!< kSharedRingMagic
+  unsigned int version;                 //!< kSharedRingVersion
+  unsigned int header_size;             //!< An offset of the data area
+  unsigned long long data_size;         //!< A power of two
+  unsigned long long tsc_frequency;     //!< TSC ticks per second; 0 if unknown
+  unsigned long long reserved1[4];
+  volatile unsigned long long head;     //!< Written by the driver
+  unsigned long long reserved2[7];
+  volatile unsigned long long tail;     //!< Written by the consumer
+  unsigned long long reserved3[7];
+  volatile unsigned long long dropped;  //!< Records lost as the ring was full
+  unsigned long long reserved4[7];
+};
+static_assert(sizeof(SharedRingHeader) == 256, "Size check");
+
+/// A header common to all records. The same layout as TraceRecordHeader.
+struct SharedRingRecordHeader {
+  volatile unsigned short type;  //!< Written last on commit
+  unsigned short size;           //!< Size of the record including this header
+  unsigned int processor;        //!< A processor number that wrote the record
+  unsigned long long tsc;        //!< A time stamp counter of the event
+};
+static_assert(sizeof(SharedRingRecordHeader) == 16, "Size check");
+
+/// An optional input of IOCTL_HYPER_SHARED_RING_MAP. kSharedRingModeMirror is
+/// used without it.
+struct SharedRingMapRequest {
+  unsigned int mode;      //!< kSharedRingModeMirror or kSharedRingModeExclusive
+  unsigned int reserved;  //!< Must be zero
+};
+
+/// An output of IOCTL_HYPER_SHARED_RING_MAP
+struct SharedRingMapping {
+  unsigned long long address;  //!< A user address of SharedRingHeader
+  unsigned long long size;     //!< A size of the mapping in bytes
+};
+
+#endif  // HYPERPLATFORM_SHARED_RING_FORMAT_H_
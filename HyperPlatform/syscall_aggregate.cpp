@@ -0,0 +1,317 @@
+#include"syscall_aggregate.h"
+#include"systemcall.h"
+
+extern "C"
+{
+NTSYSAPI const char* PsGetProcessImageFileName(PEPROCESS Process);
+}
+
+//
+//ÿcpuһſѰַıkey(λ,̲λ,index)
+//ͬһcpuϵܻ߳̿ռԸȻInterlockedcpuû
+//
+#define SYSCALL_AGGREGATE_TABLE_COUNT 0x1000
+#define SYSCALL_AGGREGATE_MERGE_COUNT 0x4000
+#define SYSCALL_AGGREGATE_PROBE 16
+#define SYSCALL_AGGREGATE_POOL_TAG 'gasH'
+
+//
+//˳ʱProcessIdSYSCALL_AGGREGATE_PROCESS_EXITEDλԱã
+//ʱӴ½ʹòͬkeyɽ̵ļ¼ڱֱã
+//ʱ㵽SYSCALL_AGGREGATE_PROCESS_OTHER
+//PID4ıλǣSYSCALL_AGGREGATE_PROCESS_CLAIMINGʾڱռ
+//
+#define SYSCALL_AGGREGATE_PROCESS_EXITED 1
+#define SYSCALL_AGGREGATE_PROCESS_CLAIMING ((HANDLE)2)
+#define SYSCALL_AGGREGATE_SLOT_SHIFT 13
+#define SYSCALL_AGGREGATE_GENERATION_SHIFT 21
+#define SYSCALL_AGGREGATE_GENERATION_MASK 0x1ff
+
+struct SyscallAggregateSlot
+{
+	volatile LONG Key;	//( << 21 | ̲λ << 13 | index) + 10ʾ
+	ULONG Reserved;
+	volatile LONG64 Count;
+	volatile LONG64 Cycles;
+};
+
+struct SyscallAggregateProcess
+{
+	HANDLE volatile ProcessId;
+	volatile LONG Generation;
+	CHAR ImageFileName[16];
+};
+
+static SyscallAggregateSlot** SyscallAggregateTables = NULL;
+static ULONG SyscallAggregateTableCount = 0;
+static SyscallAggregateProcess SyscallAggregateProcesses[SYSCALL_AGGREGATE_PROCESS_COUNT] = {};
+static volatile LONG64 SyscallAggregateOverflow = 0;
+static BOOLEAN SyscallAggregateNotifyRegistered = FALSE;
+
+static void SyscallAggregateProcessNotify(HANDLE ParentId, HANDLE ProcessId, BOOLEAN Create);
+
+NTSTATUS SyscallAggregateInitialization()
+{
+	const auto count = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	auto tables = (SyscallAggregateSlot**)ExAllocatePoolWithTag(NonPagedPool,
+		sizeof(SyscallAggregateSlot*) * count, SYSCALL_AGGREGATE_POOL_TAG);
+	if (!tables)
+		return STATUS_MEMORY_NOT_ALLOCATED;
+	RtlZeroMemory(tables, sizeof(SyscallAggregateSlot*) * count);
+
+	for (ULONG i = 0; i < count; i++)
+	{
+		tables[i] = (SyscallAggregateSlot*)ExAllocatePoolWithTag(NonPagedPool,
+			sizeof(SyscallAggregateSlot) * SYSCALL_AGGREGATE_TABLE_COUNT, SYSCALL_AGGREGATE_POOL_TAG);
+		if (!tables[i])
+		{
+			for (ULONG j = 0; j < i; j++)
+				ExFreePoolWithTag(tables[j], SYSCALL_AGGREGATE_POOL_TAG);
+			ExFreePoolWithTag(tables, SYSCALL_AGGREGATE_POOL_TAG);
+			return STATUS_MEMORY_NOT_ALLOCATED;
+		}
+		RtlZeroMemory(tables[i], sizeof(SyscallAggregateSlot) * SYSCALL_AGGREGATE_TABLE_COUNT);
+	}
+
+	SyscallAggregateTableCount = count;
+	SyscallAggregateTables = tables;
+
+	//
+	//עʧܵĻλͷţ֮Ľ̶㵽SYSCALL_AGGREGATE_PROCESS_OTHER
+	//
+	SyscallAggregateNotifyRegistered = NT_SUCCESS(
+		PsSetCreateProcessNotifyRoutine(SyscallAggregateProcessNotify, FALSE));
+	return STATUS_SUCCESS;
+}
+
+//ǰѾϵͳõhook
+void SyscallAggregateTermination()
+{
+	auto tables = SyscallAggregateTables;
+	if (!tables)
+		return;
+
+	if (SyscallAggregateNotifyRegistered)
+	{
+		PsSetCreateProcessNotifyRoutine(SyscallAggregateProcessNotify, TRUE);
+		SyscallAggregateNotifyRegistered = FALSE;
+	}
+	SyscallAggregateTables = NULL;
+	for (ULONG i = 0; i < SyscallAggregateTableCount; i++)
+		ExFreePoolWithTag(tables[i], SYSCALL_AGGREGATE_POOL_TAG);
+	ExFreePoolWithTag(tables, SYSCALL_AGGREGATE_POOL_TAG);
+}
+
+static ULONG SyscallAggregateHash(ULONG key)
+{
+	return (key * 0x9E3779B1u) >> 12;
+}
+
+//
+//˳ʱѾû̻߳ٷϵͳãֻΪ˳
+//Ȼܿļ¼ֱλĽ̸
+//
+static void SyscallAggregateProcessNotify(HANDLE ParentId, HANDLE ProcessId, BOOLEAN Create)
+{
+	UNREFERENCED_PARAMETER(ParentId);
+	if (Create)
+		return;
+
+	const auto hash = SyscallAggregateHash((ULONG)(ULONG_PTR)ProcessId);
+	for (ULONG i = 0; i < 8; i++)
+	{
+		auto& process = SyscallAggregateProcesses[(hash + i) % SYSCALL_AGGREGATE_PROCESS_OTHER];
+		if (InterlockedCompareExchangePointer(&process.ProcessId,
+			(HANDLE)((ULONG_PTR)ProcessId | SYSCALL_AGGREGATE_PROCESS_EXITED), ProcessId) == ProcessId)
+			return;
+	}
+}
+
+//
+//keyнصĲ֣ͽ̲λ
+//
+static ULONG SyscallAggregateProcessKey(ULONG slot)
+{
+	const auto generation = (ULONG)SyscallAggregateProcesses[slot].Generation & SYSCALL_AGGREGATE_GENERATION_MASK;
+	return (generation << (SYSCALL_AGGREGATE_GENERATION_SHIFT - SYSCALL_AGGREGATE_SLOT_SHIFT)) | slot;
+}
+
+//
+//PID̲λл˳Ĳλռã֮㵽SYSCALL_AGGREGATE_PROCESS_OTHER
+//ֵSYSCALL_AGGREGATE_SLOT_SHIFT֮keyнصĲ
+//
+static ULONG SyscallAggregateProcessSlot()
+{
+	const auto pid = PsGetCurrentProcessId();
+	const auto hash = SyscallAggregateHash((ULONG)(ULONG_PTR)pid);
+
+	for (ULONG i = 0; i < 8; i++)
+	{
+		const auto slot = (hash + i) % SYSCALL_AGGREGATE_PROCESS_OTHER;
+		auto& process = SyscallAggregateProcesses[slot];
+		auto current = process.ProcessId;
+		if (current == pid)
+			return SyscallAggregateProcessKey(slot);
+		if (current && !((ULONG_PTR)current & SYSCALL_AGGREGATE_PROCESS_EXITED))
+			continue;
+
+		//
+		//ȻCLAIMINGٸĴͬһ̵߳PIDд֮ǰþɴ
+		//
+		if (InterlockedCompareExchangePointer(&process.ProcessId, SYSCALL_AGGREGATE_PROCESS_CLAIMING, current) != current)
+			continue;
+		InterlockedIncrement(&process.Generation);
+		RtlZeroMemory(process.ImageFileName, sizeof(process.ImageFileName));
+		strncpy(process.ImageFileName, PsGetProcessImageFileName(PsGetCurrentProcess()),
+			sizeof(process.ImageFileName) - 1);
+		InterlockedExchangePointer(&process.ProcessId, pid);
+		return SyscallAggregateProcessKey(slot);
+	}
+	return SyscallAggregateProcessKey(SYSCALL_AGGREGATE_PROCESS_OTHER);
+}
+
+static SyscallAggregateSlot* SyscallAggregateFind(SyscallAggregateSlot* table, ULONG count, LONG key)
+{
+	const auto hash = SyscallAggregateHash(key);
+	for (ULONG i = 0; i < SYSCALL_AGGREGATE_PROBE; i++)
+	{
+		auto slot = &table[(hash + i) & (count - 1)];
+		auto current = slot->Key;
+		if (!current)
+			current = InterlockedCompareExchange(&slot->Key, key, 0);
+		if (!current || current == key)
+			return slot;
+	}
+	return NULL;
+}
+
+static SyscallAggregateSlot* SyscallAggregateCurrentSlot(ULONG index)
+{
+	auto tables = SyscallAggregateTables;
+	if (!tables)
+		return NULL;
+
+	const auto cpu = KeGetCurrentProcessorNumberEx(NULL);
+	if (cpu >= SyscallAggregateTableCount)
+		return NULL;
+
+	const LONG key = (LONG)((SyscallAggregateProcessSlot() << SYSCALL_AGGREGATE_SLOT_SHIFT) |
+		(index & SYSCALL_FILTER_INDEX_MASK)) + 1;
+	auto slot = SyscallAggregateFind(tables[cpu], SYSCALL_AGGREGATE_TABLE_COUNT, key);
+	if (!slot)
+		InterlockedIncrement64(&SyscallAggregateOverflow);
+	return slot;
+}
+
+void SyscallAggregateCount(IN ULONG index)
+{
+	auto slot = SyscallAggregateCurrentSlot(index);
+	if (slot)
+		InterlockedIncrement64(&slot->Count);
+}
+
+void SyscallAggregateAddCycles(IN ULONG index, IN ULONG64 cycles)
+{
+	auto slot = SyscallAggregateCurrentSlot(index);
+	if (slot)
+		InterlockedAdd64(&slot->Cycles, (LONG64)cycles);
+}
+
+//
+//ڽеĸûͬǰ󼸴εÿ㵽һ
+//
+void SyscallAggregateReset()
+{
+	auto tables = SyscallAggregateTables;
+	if (!tables)
+		return;
+
+	for (ULONG i = 0; i < SyscallAggregateTableCount; i++)
+		RtlZeroMemory(tables[i], sizeof(SyscallAggregateSlot) * SYSCALL_AGGREGATE_TABLE_COUNT);
+	RtlZeroMemory(SyscallAggregateProcesses, sizeof(SyscallAggregateProcesses));
+	InterlockedExchange64(&SyscallAggregateOverflow, 0);
+}
+
+//
+//ϲcpuıдֽҪܷͷн̲λ
+//
+ULONG SyscallAggregateSnapshot(OUT PVOID Buffer, IN ULONG BufferSize)
+{
+	auto tables = SyscallAggregateTables;
+	const ULONG fixed = sizeof(SYSCALL_AGGREGATE_SNAPSHOT) +
+		sizeof(SYSCALL_AGGREGATE_PROCESS) * SYSCALL_AGGREGATE_PROCESS_COUNT;
+	if (!tables || BufferSize < fixed)
+		return 0;
+
+	auto merged = (SyscallAggregateSlot*)ExAllocatePoolWithTag(NonPagedPool,
+		sizeof(SyscallAggregateSlot) * SYSCALL_AGGREGATE_MERGE_COUNT, SYSCALL_AGGREGATE_POOL_TAG);
+	if (!merged)
+		return 0;
+	RtlZeroMemory(merged, sizeof(SyscallAggregateSlot) * SYSCALL_AGGREGATE_MERGE_COUNT);
+
+	auto header = (PSYSCALL_AGGREGATE_SNAPSHOT)Buffer;
+	RtlZeroMemory(header, sizeof(*header));
+	header->Overflow = SyscallAggregateOverflow;
+
+	for (ULONG i = 0; i < SyscallAggregateTableCount; i++)
+	{
+		for (ULONG j = 0; j < SYSCALL_AGGREGATE_TABLE_COUNT; j++)
+		{
+			const auto& slot = tables[i][j];
+			if (!slot.Key)
+				continue;
+
+			//
+			//λѾ˽̵ľɼ¼ϲSYSCALL_AGGREGATE_PROCESS_OTHER
+			//ϲkey
+			//
+			const auto raw = (ULONG)slot.Key - 1;
+			auto process = (raw >> SYSCALL_AGGREGATE_SLOT_SHIFT) & (SYSCALL_AGGREGATE_PROCESS_COUNT - 1);
+			const auto generation = raw >> SYSCALL_AGGREGATE_GENERATION_SHIFT;
+			if (generation != ((ULONG)SyscallAggregateProcesses[process].Generation & SYSCALL_AGGREGATE_GENERATION_MASK))
+				process = SYSCALL_AGGREGATE_PROCESS_OTHER;
+			const LONG key = (LONG)((process << SYSCALL_AGGREGATE_SLOT_SHIFT) | (raw & SYSCALL_FILTER_INDEX_MASK)) + 1;
+
+			auto target = SyscallAggregateFind(merged, SYSCALL_AGGREGATE_MERGE_COUNT, key);
+			if (!target)
+			{
+				header->Overflow += slot.Count;
+				continue;
+			}
+			target->Count += slot.Count;
+			target->Cycles += slot.Cycles;
+		}
+	}
+
+	auto processes = (PSYSCALL_AGGREGATE_PROCESS)(header + 1);
+	for (ULONG i = 0; i < SYSCALL_AGGREGATE_PROCESS_COUNT; i++)
+	{
+		const auto pid = (ULONG_PTR)SyscallAggregateProcesses[i].ProcessId;
+		processes[i].ProcessId = (pid == (ULONG_PTR)SYSCALL_AGGREGATE_PROCESS_CLAIMING) ? 0 :
+			pid & ~(ULONG_PTR)SYSCALL_AGGREGATE_PROCESS_EXITED;
+		RtlCopyMemory(processes[i].ImageFileName, SyscallAggregateProcesses[i].ImageFileName,
+			sizeof(processes[i].ImageFileName));
+	}
+	header->ProcessCount = SYSCALL_AGGREGATE_PROCESS_COUNT;
+
+	auto entries = (PSYSCALL_AGGREGATE_ENTRY)(processes + SYSCALL_AGGREGATE_PROCESS_COUNT);
+	const ULONG capacity = (BufferSize - fixed) / sizeof(SYSCALL_AGGREGATE_ENTRY);
+	for (ULONG i = 0; i < SYSCALL_AGGREGATE_MERGE_COUNT; i++)
+	{
+		if (!merged[i].Key)
+			continue;
+		if (header->EntryCount >= capacity)
+		{
+			header->Truncated = TRUE;
+			break;
+		}
+		auto& entry = entries[header->EntryCount++];
+		entry.ProcessSlot = (ULONG)(merged[i].Key - 1) >> SYSCALL_AGGREGATE_SLOT_SHIFT;
+		entry.Index = (ULONG)(merged[i].Key - 1) & SYSCALL_FILTER_INDEX_MASK;
+		entry.Count = merged[i].Count;
+		entry.Cycles = merged[i].Cycles;
+	}
+
+	ExFreePoolWithTag(merged, SYSCALL_AGGREGATE_POOL_TAG);
+	return fixed + header->EntryCount * sizeof(SYSCALL_AGGREGATE_ENTRY);
+}
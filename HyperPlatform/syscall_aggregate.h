@@ -0,0 +1,59 @@
+#pragma once
+#include<ntddk.h>
+
+//
+//ϵͳõļ¼ʽͬʱ
+//
+#define SYSCALL_MODE_TRACE 0x1		//ÿεötrace¼
+#define SYSCALL_MODE_AGGREGATE 0x2	//ֻںﰴ(,index)ۼƴͺʱ
+#define SYSCALL_MODE_MASK (SYSCALL_MODE_TRACE | SYSCALL_MODE_AGGREGATE)
+
+//
+//̲λһλŲλ֮н̣Լλõ˳
+//˳̵Ĳλڱ֮ǰȻPIDͼ¼
+//
+#define SYSCALL_AGGREGATE_PROCESS_COUNT 256
+#define SYSCALL_AGGREGATE_PROCESS_OTHER (SYSCALL_AGGREGATE_PROCESS_COUNT - 1)
+
+inline ULONG SyscallMode = SYSCALL_MODE_TRACE;
+
+//
+//IOCTL_HYPER_SYSCALL_AGGREGATEĿոʽ
+//SYSCALL_AGGREGATE_SNAPSHOT
+//SYSCALL_AGGREGATE_PROCESS[ProcessCount]
+//SYSCALL_AGGREGATE_ENTRY[EntryCount]
+//
+typedef struct _SYSCALL_AGGREGATE_SNAPSHOT
+{
+	ULONG ProcessCount;
+	ULONG EntryCount;
+	ULONG64 Overflow;	//per-cpuûм¼ϵĴ
+	ULONG Truncated;	//EntryCountֻһ
+	ULONG Reserved;
+} SYSCALL_AGGREGATE_SNAPSHOT, * PSYSCALL_AGGREGATE_SNAPSHOT;
+
+typedef struct _SYSCALL_AGGREGATE_PROCESS
+{
+	ULONG64 ProcessId;
+	CHAR ImageFileName[16];
+} SYSCALL_AGGREGATE_PROCESS, * PSYSCALL_AGGREGATE_PROCESS;
+
+typedef struct _SYSCALL_AGGREGATE_ENTRY
+{
+	ULONG ProcessSlot;	//SYSCALL_AGGREGATE_PROCESS±
+	ULONG Index;		//SSDT index, 0x1000shadow ssdt
+	ULONG64 Count;
+	ULONG64 Cycles;		//ԳɹĵõTSC֮
+} SYSCALL_AGGREGATE_ENTRY, * PSYSCALL_AGGREGATE_ENTRY;
+
+NTSTATUS SyscallAggregateInitialization();
+
+void SyscallAggregateTermination();
+
+void SyscallAggregateCount(IN ULONG index);
+
+void SyscallAggregateAddCycles(IN ULONG index, IN ULONG64 cycles);
+
+void SyscallAggregateReset();
+
+ULONG SyscallAggregateSnapshot(OUT PVOID Buffer, IN ULONG BufferSize);
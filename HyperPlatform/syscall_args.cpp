@@ -0,0 +1,261 @@
+#include"syscall_args.h"
+#include"trace.h"
+
+//
+//ÿcpuԤȷ伸trace¼һĻ
+//ûڴ(ȱҳܱлȥ)һдtracetraceδύļ¼
+//
+#define SYSCALL_ARGS_ARENA_SLOTS 4
+#define SYSCALL_ARGS_POOL_TAG 'grAH'
+
+struct SyscallArgsArena
+{
+	volatile LONG Busy;	//ÿһλӦһSlots
+	ULONG Reserved[3];
+	UCHAR Slots[SYSCALL_ARGS_ARENA_SLOTS][kTraceRecordMaxSize];
+};
+
+static SYSCALL_ARG_SCHEMA* SyscallArgSchemas = NULL;
+static SyscallArgsArena* SyscallArgsArenas = NULL;
+static ULONG SyscallArgsArenaCount = 0;
+static volatile LONG64 SyscallArgsDropped = 0;
+
+NTSTATUS SyscallArgsInitialization()
+{
+	const auto count = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	auto schemas = (SYSCALL_ARG_SCHEMA*)ExAllocatePoolWithTag(NonPagedPool,
+		sizeof(SYSCALL_ARG_SCHEMA) * SYSCALL_FILTER_INDEX_COUNT, SYSCALL_ARGS_POOL_TAG);
+	auto arenas = (SyscallArgsArena*)ExAllocatePoolWithTag(NonPagedPool,
+		sizeof(SyscallArgsArena) * count, SYSCALL_ARGS_POOL_TAG);
+	if (!schemas || !arenas)
+	{
+		if (schemas)
+			ExFreePoolWithTag(schemas, SYSCALL_ARGS_POOL_TAG);
+		if (arenas)
+			ExFreePoolWithTag(arenas, SYSCALL_ARGS_POOL_TAG);
+		return STATUS_MEMORY_NOT_ALLOCATED;
+	}
+
+	RtlZeroMemory(schemas, sizeof(SYSCALL_ARG_SCHEMA) * SYSCALL_FILTER_INDEX_COUNT);
+	for (ULONG i = 0; i < count; i++)
+		arenas[i].Busy = 0;
+
+	SyscallArgsArenaCount = count;
+	SyscallArgsArenas = arenas;
+	SyscallArgSchemas = schemas;
+	return STATUS_SUCCESS;
+}
+
+//ǰѾϵͳõhook
+void SyscallArgsTermination()
+{
+	if (SyscallArgSchemas)
+	{
+		ExFreePoolWithTag(SyscallArgSchemas, SYSCALL_ARGS_POOL_TAG);
+		SyscallArgSchemas = NULL;
+	}
+	if (SyscallArgsArenas)
+	{
+		ExFreePoolWithTag(SyscallArgsArenas, SYSCALL_ARGS_POOL_TAG);
+		SyscallArgsArenas = NULL;
+	}
+}
+
+NTSTATUS SyscallArgsSetSchema(IN ULONG Index, IN const SYSCALL_ARG_SCHEMA* Schema)
+{
+	if (!SyscallArgSchemas)
+		return STATUS_DEVICE_NOT_READY;
+	if (Index >= SYSCALL_FILTER_INDEX_COUNT ||
+		Schema->ArgumentCount > SYSCALL_ARG_MAX_ARGUMENTS ||
+		Schema->FieldCount > SYSCALL_ARG_MAX_FIELDS)
+		return STATUS_INVALID_PARAMETER;
+
+	for (ULONG i = 0; i < Schema->FieldCount; i++)
+	{
+		const auto& field = Schema->Fields[i];
+		if (field.Argument >= Schema->ArgumentCount ||
+			field.Kind < SYSCALL_ARG_FIELD_MEMORY || field.Kind > SYSCALL_ARG_FIELD_OBJECT_ATTRIBUTES ||
+			(field.LengthArgument != SYSCALL_ARG_NO_LENGTH && field.LengthArgument >= Schema->ArgumentCount))
+			return STATUS_INVALID_PARAMETER;
+	}
+
+	//
+	//ȹصٸģдArgumentCountڲĵ࿴¾ɻϵȶ
+	//
+	auto& schema = SyscallArgSchemas[Index];
+	InterlockedExchange8((volatile CHAR*)&schema.ArgumentCount, 0);
+	schema.FieldCount = Schema->FieldCount;
+	RtlCopyMemory(schema.Fields, Schema->Fields, sizeof(schema.Fields));
+	InterlockedExchange8((volatile CHAR*)&schema.ArgumentCount, (CHAR)Schema->ArgumentCount);
+	return STATUS_SUCCESS;
+}
+
+static PUCHAR SyscallArgsClaim(SyscallArgsArena** Arena, ULONG* Slot)
+{
+	const auto cpu = KeGetCurrentProcessorNumberEx(NULL);
+	if (cpu >= SyscallArgsArenaCount)
+		return NULL;
+
+	auto arena = &SyscallArgsArenas[cpu];
+	for (ULONG i = 0; i < SYSCALL_ARGS_ARENA_SLOTS; i++)
+	{
+		if (!InterlockedBitTestAndSet(&arena->Busy, i))
+		{
+			*Arena = arena;
+			*Slot = i;
+			return arena->Slots[i];
+		}
+	}
+	return NULL;
+}
+
+static void SyscallArgsCopyField(const SYSCALL_ARG_FIELD& Field, const ULONG64* Arguments,
+	ULONG ArgumentCount, TraceSyscallArgField* Out, PUCHAR Data, ULONG Room)
+{
+	__try
+	{
+		PVOID source = (PVOID)Arguments[Field.Argument];
+		ULONG64 length = 0;
+		switch (Field.Kind)
+		{
+			case SYSCALL_ARG_FIELD_MEMORY:
+				length = Field.Limit;
+				if (Field.LengthArgument < ArgumentCount)
+					length = Arguments[Field.LengthArgument];
+				break;
+			case SYSCALL_ARG_FIELD_OBJECT_ATTRIBUTES:
+			{
+				auto attributes = (POBJECT_ATTRIBUTES)source;
+				ProbeForRead(attributes, sizeof(OBJECT_ATTRIBUTES), sizeof(ULONG));
+				source = attributes->ObjectName;
+				if (!source)
+					return;
+			}
+			//ObjectNamePUNICODE_STRINGŰַ
+			case SYSCALL_ARG_FIELD_UNICODE_STRING:
+			{
+				auto string = (PUNICODE_STRING)source;
+				ProbeForRead(string, sizeof(UNICODE_STRING), sizeof(ULONG));
+				length = string->Length;
+				source = string->Buffer;
+				break;
+			}
+			default:
+				return;
+		}
+
+		if (!source || !length)
+			return;
+
+		const ULONG limit = min(Field.Limit, Room);
+		if (length > limit)
+		{
+			length = limit;
+			Out->flags |= kTraceSyscallArgTruncated;
+		}
+		ProbeForRead(source, (SIZE_T)length, 1);
+		RtlCopyMemory(Data, source, (SIZE_T)length);
+		Out->length = (ULONG)length;
+	}
+	__except (EXCEPTION_EXECUTE_HANDLER)
+	{
+		Out->flags |= kTraceSyscallArgFaulted;
+		Out->length = 0;
+	}
+}
+
+void SyscallArgsCapture(IN KTRAP_FRAME* TrapFrame, IN ULONG SSDT_INDEX, IN PSYSTEM_CALL_REGISTERS Registers)
+{
+	auto schemas = SyscallArgSchemas;
+	if (!schemas || !SyscallArgsArenas)
+		return;
+
+	const auto index = SSDT_INDEX & SYSCALL_FILTER_INDEX_MASK;
+	const auto& schema = schemas[index];
+	const ULONG argument_count = min(schema.ArgumentCount, SYSCALL_ARG_MAX_ARGUMENTS);
+	if (!argument_count)
+		return;
+
+	//
+	//ںZwòںָ룬Ҫ¼ûڴȱҳDISPATCH_LEVEL
+	//
+	if (ExGetPreviousMode() != UserMode || KeGetCurrentIrql() > APC_LEVEL)
+		return;
+
+	SyscallArgsArena* arena = NULL;
+	ULONG slot = 0;
+	auto buffer = SyscallArgsClaim(&arena, &slot);
+	if (!buffer)
+	{
+		InterlockedIncrement64(&SyscallArgsDropped);
+		return;
+	}
+
+	auto record = (TraceSyscallArgsRecord*)buffer;
+	record->process_id = (ULONG64)PsGetCurrentProcessId();
+	record->thread_id = (ULONG64)PsGetCurrentThreadId();
+	record->index = index;
+	record->argument_count = (UCHAR)argument_count;
+	record->field_count = 0;
+	record->reserved = 0;
+
+	//ǰĸڼĴʣµûջϣصַ0x20home space
+	auto arguments = (PULONG64)(record + 1);
+	const ULONG64 registers[] = { Registers->R10, Registers->Rdx, Registers->R8, Registers->R9 };
+	for (ULONG i = 0; i < argument_count && i < 4; i++)
+		arguments[i] = registers[i];
+	if (argument_count > 4)
+	{
+		auto stack = (PULONG64)(TrapFrame->Rsp + 0x28);
+		__try
+		{
+			ProbeForRead(stack, (argument_count - 4) * sizeof(ULONG64), sizeof(ULONG64));
+			for (ULONG i = 4; i < argument_count; i++)
+				arguments[i] = stack[i - 4];
+		}
+		__except (EXCEPTION_EXECUTE_HANDLER)
+		{
+			RtlZeroMemory(&arguments[4], (argument_count - 4) * sizeof(ULONG64));
+		}
+	}
+
+	ULONG offset = sizeof(TraceSyscallArgsRecord) + argument_count * sizeof(ULONG64);
+	const ULONG field_count = min(schema.FieldCount, SYSCALL_ARG_MAX_FIELDS);
+	for (ULONG i = 0; i < field_count; i++)
+	{
+		const auto field = schema.Fields[i];
+		if (field.Argument >= argument_count)
+			continue;
+		if (offset + sizeof(TraceSyscallArgField) + sizeof(ULONG64) > kTraceRecordMaxSize)
+			break;
+
+		auto out = (TraceSyscallArgField*)(buffer + offset);
+		out->argument = field.Argument;
+		out->kind = field.Kind;
+		out->flags = 0;
+		out->length = 0;
+
+		auto data = (PUCHAR)(out + 1);
+		const ULONG room = kTraceRecordMaxSize - offset - sizeof(TraceSyscallArgField);
+		SyscallArgsCopyField(field, arguments, argument_count, out, data, room);
+
+		const ULONG padded = (out->length + 7) & ~7ul;
+		RtlZeroMemory(data + out->length, padded - out->length);
+		offset += sizeof(TraceSyscallArgField) + padded;
+		record->field_count++;
+	}
+
+	auto traced = TraceBegin(offset);
+	if (traced)
+	{
+		RtlCopyMemory(traced + 1, buffer + sizeof(TraceRecordHeader), offset - sizeof(TraceRecordHeader));
+		TraceCommit(traced, kTraceRecordSyscallArgs);
+	}
+
+	InterlockedBitTestAndReset(&arena->Busy, slot);
+}
+
+ULONG64 SyscallArgsGetDropCount()
+{
+	return SyscallArgsDropped;
+}
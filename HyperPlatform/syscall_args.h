@@ -0,0 +1,50 @@
+#pragma once
+#include<ntddk.h>
+#include"systemcall.h"
+
+//
+//ÿSSDT indexĲ֮ϵͳڰѲͲָûڴ渴Ƶtrace
+//
+
+#define SYSCALL_ARG_MAX_ARGUMENTS 16
+#define SYSCALL_ARG_MAX_FIELDS 4
+
+#define SYSCALL_ARG_FIELD_MEMORY 1				//ָڴ棬LimitLengthArgumentָĲ
+#define SYSCALL_ARG_FIELD_UNICODE_STRING 2		//PUNICODE_STRINGַָ
+#define SYSCALL_ARG_FIELD_OBJECT_ATTRIBUTES 3	//POBJECT_ATTRIBUTESObjectName
+
+#define SYSCALL_ARG_NO_LENGTH 0xff
+
+typedef struct _SYSCALL_ARG_FIELD
+{
+	UCHAR Argument;			//ڼ0ʼ
+	UCHAR Kind;				//SYSCALL_ARG_FIELD_*
+	UCHAR LengthArgument;	//SYSCALL_ARG_FIELD_MEMORYʱڵĲûеĻSYSCALL_ARG_NO_LENGTH
+	UCHAR Reserved;
+	ULONG Limit;			//ิƵֽ
+} SYSCALL_ARG_FIELD, * PSYSCALL_ARG_FIELD;
+
+typedef struct _SYSCALL_ARG_SCHEMA
+{
+	UCHAR ArgumentCount;	//0ʾ
+	UCHAR FieldCount;
+	USHORT Reserved;
+	SYSCALL_ARG_FIELD Fields[SYSCALL_ARG_MAX_FIELDS];
+} SYSCALL_ARG_SCHEMA, * PSYSCALL_ARG_SCHEMA;
+
+//IOCTL_HYPER_SYSCALL_ARGS
+typedef struct _SYSCALL_ARG_SCHEMA_REQUEST
+{
+	ULONG Index;
+	SYSCALL_ARG_SCHEMA Schema;
+} SYSCALL_ARG_SCHEMA_REQUEST, * PSYSCALL_ARG_SCHEMA_REQUEST;
+
+NTSTATUS SyscallArgsInitialization();
+
+void SyscallArgsTermination();
+
+NTSTATUS SyscallArgsSetSchema(IN ULONG Index, IN const SYSCALL_ARG_SCHEMA* Schema);
+
+void SyscallArgsCapture(IN KTRAP_FRAME* TrapFrame, IN ULONG SSDT_INDEX, IN PSYSTEM_CALL_REGISTERS Registers);
+
+ULONG64 SyscallArgsGetDropCount();
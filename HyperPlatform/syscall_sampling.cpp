@@ -0,0 +1,170 @@
+#include"syscall_sampling.h"
+#include"syscall_args.h"
+#include"trace.h"
+
+//
+//ÿcpuһ״̬ͬһcpuϵܻ߳̿ռֻǽֵӰȷ
+//
+#define SYSCALL_SAMPLING_CHECK_INTERVAL 256		//ÿٸ¼һringռ
+#define SYSCALL_SAMPLING_REPORT_INTERVAL 10000000	//״̬¼С100nsΪλ
+#define SYSCALL_SAMPLING_TOKEN 10000000			//һƣֵ棬ʡ
+#define SYSCALL_SAMPLING_POOL_TAG 'pmSH'
+
+struct SyscallSamplingState
+{
+	ULONG Counter;
+	ULONG Backoff;			//ЧNRate << Backoff
+	ULONG64 Tokens;
+	ULONG64 LastRefill;		//KeQueryInterruptTime
+	ULONG64 LastReport;
+	ULONG64 SampledOut;		//1/Nȥ¼
+	ULONG64 Throttled;		//Ʋȥ¼
+};
+
+static SyscallSamplingState* SyscallSamplingStates = NULL;
+static ULONG SyscallSamplingStateCount = 0;
+static SYSCALL_SAMPLING_CONFIG SyscallSamplingConfig = { 1, 0, 0, 75, 25, 8 };
+
+NTSTATUS SyscallSamplingInitialization()
+{
+	const auto count = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	auto states = (SyscallSamplingState*)ExAllocatePoolWithTag(NonPagedPool,
+		sizeof(SyscallSamplingState) * count, SYSCALL_SAMPLING_POOL_TAG);
+	if (!states)
+		return STATUS_MEMORY_NOT_ALLOCATED;
+	RtlZeroMemory(states, sizeof(SyscallSamplingState) * count);
+
+	SyscallSamplingStateCount = count;
+	SyscallSamplingStates = states;
+	return STATUS_SUCCESS;
+}
+
+//ǰѾϵͳúservicehook
+void SyscallSamplingTermination()
+{
+	if (SyscallSamplingStates)
+	{
+		ExFreePoolWithTag(SyscallSamplingStates, SYSCALL_SAMPLING_POOL_TAG);
+		SyscallSamplingStates = NULL;
+	}
+}
+
+NTSTATUS SyscallSamplingSetConfig(IN const SYSCALL_SAMPLING_CONFIG* Config)
+{
+	if (Config->MaxBackoff > SYSCALL_SAMPLING_MAX_BACKOFF ||
+		Config->HighWatermark > 100 ||
+		Config->LowWatermark > Config->HighWatermark)
+		return STATUS_INVALID_PARAMETER;
+
+	//
+	//òԭӸµģµ˲¼õ¾ɻϵֵ
+	//
+	SyscallSamplingConfig = *Config;
+
+	auto states = SyscallSamplingStates;
+	if (states)
+	{
+		for (ULONG i = 0; i < SyscallSamplingStateCount; i++)
+		{
+			states[i].Backoff = min(states[i].Backoff, Config->MaxBackoff);
+			states[i].LastReport = 0;	//һ¼ͱµ״̬
+		}
+	}
+	return STATUS_SUCCESS;
+}
+
+void SyscallSamplingGetConfig(OUT PSYSCALL_SAMPLING_CONFIG Config)
+{
+	*Config = SyscallSamplingConfig;
+}
+
+static void SyscallSamplingReport(SyscallSamplingState& State, ULONG64 EffectiveRate)
+{
+	auto record = (TraceSamplingStateRecord*)TraceBegin(sizeof(TraceSamplingStateRecord));
+	if (!record)
+		return;
+	record->rate = SyscallSamplingConfig.Rate;
+	record->effective_rate = EffectiveRate;
+	record->events_per_second = SyscallSamplingConfig.EventsPerSecond;
+	record->ring_fill = TraceGetFill();
+	record->sampled_out = State.SampledOut;
+	record->throttled = State.Throttled;
+	record->ring_dropped = TraceGetDropCount();
+	record->args_dropped = SyscallArgsGetDropCount();
+	TraceCommit(&record->header, kTraceRecordSamplingState);
+}
+
+//
+//ǰcputrace ringռõ˱ܣ˱ܱ仯߸㹻þдһ״̬¼
+//
+static void SyscallSamplingUpdate(SyscallSamplingState& State, ULONG64 Now)
+{
+	const auto& config = SyscallSamplingConfig;
+	const auto fill = TraceGetFill();
+	const auto backoff = State.Backoff;
+
+	if (fill >= config.HighWatermark && State.Backoff < config.MaxBackoff)
+		State.Backoff++;
+	else if (fill <= config.LowWatermark && State.Backoff)
+		State.Backoff--;
+
+	if (State.Backoff != backoff || Now - State.LastReport >= SYSCALL_SAMPLING_REPORT_INTERVAL)
+	{
+		State.LastReport = Now;
+		SyscallSamplingReport(State, (ULONG64)max(config.Rate, 1ul) << State.Backoff);
+	}
+}
+
+//
+//TRUEʾ¼Ӧдtrace
+//
+BOOLEAN SyscallSamplingAdmit()
+{
+	auto states = SyscallSamplingStates;
+	if (!states)
+		return TRUE;
+
+	const auto cpu = KeGetCurrentProcessorNumberEx(NULL);
+	if (cpu >= SyscallSamplingStateCount)
+		return TRUE;
+
+	auto& state = states[cpu];
+	const auto& config = SyscallSamplingConfig;
+	const auto count = ++state.Counter;
+
+	ULONG64 now = 0;
+	if (!(count & (SYSCALL_SAMPLING_CHECK_INTERVAL - 1)))
+	{
+		now = KeQueryInterruptTime();
+		SyscallSamplingUpdate(state, now);
+	}
+
+	const ULONG64 rate = (ULONG64)max(config.Rate, 1ul) << state.Backoff;
+	if (rate > 1 && count % rate)
+	{
+		state.SampledOut++;
+		return FALSE;
+	}
+
+	const ULONG64 events_per_second = config.EventsPerSecond;
+	if (!events_per_second)
+		return TRUE;
+
+	if (!now)
+		now = KeQueryInterruptTime();
+	const ULONG64 capacity = (config.Burst ? config.Burst : events_per_second) * SYSCALL_SAMPLING_TOKEN;
+	const auto elapsed = now - state.LastRefill;
+	state.LastRefill = now;
+	if (elapsed >= capacity / events_per_second)
+		state.Tokens = capacity;	//Ҳܾû¼ʱ˷
+	else
+		state.Tokens = min(state.Tokens + elapsed * events_per_second, capacity);
+
+	if (state.Tokens < SYSCALL_SAMPLING_TOKEN)
+	{
+		state.Throttled++;
+		return FALSE;
+	}
+	state.Tokens -= SYSCALL_SAMPLING_TOKEN;
+	return TRUE;
+}
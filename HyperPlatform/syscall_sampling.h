@@ -0,0 +1,28 @@
+#pragma once
+#include<ntddk.h>
+
+//
+//traceĲƣϵͳúservice hook
+//Ȱ1/N̶ٹÿcpuͰǰcputrace ringˮλʱNÿηڵˮλʱ𼶻ָ
+//
+#define SYSCALL_SAMPLING_MAX_BACKOFF 16
+
+typedef struct _SYSCALL_SAMPLING_CONFIG
+{
+	ULONG Rate;				//ÿN¼¼һ01ʾȫ¼
+	ULONG EventsPerSecond;	//ÿcpuÿ¼¼0ʾ
+	ULONG Burst;			//Ͱ0ʾEventsPerSecond
+	ULONG HighWatermark;	//ringռõİٷֱȣʱ˱
+	ULONG LowWatermark;		//ringռõİٷֱȣʱָ
+	ULONG MaxBackoff;		//෭ĴSYSCALL_SAMPLING_MAX_BACKOFF0ʾ˱
+} SYSCALL_SAMPLING_CONFIG, * PSYSCALL_SAMPLING_CONFIG;
+
+NTSTATUS SyscallSamplingInitialization();
+
+void SyscallSamplingTermination();
+
+NTSTATUS SyscallSamplingSetConfig(IN const SYSCALL_SAMPLING_CONFIG* Config);
+
+void SyscallSamplingGetConfig(OUT PSYSCALL_SAMPLING_CONFIG Config);
+
+BOOLEAN SyscallSamplingAdmit();
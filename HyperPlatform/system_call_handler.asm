@@ -1,5 +1,17 @@
 extern SystemCallHandler:proc
 extern OriKiSystemServiceStart:proc
+extern SyscallFilterBitmap:dword
+extern SyscallFilterProcess:qword
+extern SystemCallExitHandler:proc
+extern OriKiSystemServiceExit:proc
+extern SyscallExitCaptureEnabled:byte
+
+;KTHREAD.ApcState.Process (17763)
+KTHREAD_PROCESS equ 0B8h
+;KTHREAD.SystemCallNumber (17763), stored by KiSystemCall64
+KTHREAD_SYSTEM_CALL_NUMBER equ 080h
+;KPCR.Prcb.CurrentThread
+KPCR_CURRENT_THREAD equ 188h
 
 .code
 
@@ -42,16 +54,37 @@ endm
 DetourKiSystemServiceStart proc
 	
 	;int 3
+	;
+	;r15 is still on the stack, use it as scratch for the filter
+	;rbx = KTHREAD, eax = service number (bit 12 = shadow table)
+	;
+	mov r15d,eax
+	and r15d,1FFFh
+	bt SyscallFilterBitmap,r15d
+	jnc SkipHandler
+	mov r15,SyscallFilterProcess
+	test r15,r15
+	jz CallHandler
+	cmp r15,[rbx+KTHREAD_PROCESS]
+	jne SkipHandler
+
+CallHandler:
 	pop r15
 	SAVE
 	sub rsp,28h
 	mov rcx,rsp
 	add rcx,160;A0h
 	mov edx,eax
+	lea r8,[rsp+28h]
 	call SystemCallHandler
 	add rsp,28h
 	RESTOR
+	jmp CallOriginal
 
+SkipHandler:
+	pop r15
+
+CallOriginal:
 	mov [rbx+90h],rsp
 	mov     edi, eax
 	shr     edi, 7
@@ -61,5 +94,50 @@ DetourKiSystemServiceStart proc
 
 DetourKiSystemServiceStart endp
 
+DetourKiSystemServiceExit proc
+
+	;
+	;rax = NTSTATUS, rbp = trap frame + 80h
+	;r15 is still on the stack, use it as scratch for the same filter as
+	;DetourKiSystemServiceStart so filtered syscalls return without SAVE
+	;
+	cmp SyscallExitCaptureEnabled,0
+	je SkipExitHandler
+	mov r15,gs:[KPCR_CURRENT_THREAD]
+	mov r15d,[r15+KTHREAD_SYSTEM_CALL_NUMBER]
+	and r15d,1FFFh
+	bt SyscallFilterBitmap,r15d
+	jnc SkipExitHandler
+	mov r15,SyscallFilterProcess
+	test r15,r15
+	jz CallExitHandler
+	push rax
+	mov rax,gs:[KPCR_CURRENT_THREAD]
+	cmp r15,[rax+KTHREAD_PROCESS]
+	pop rax
+	jne SkipExitHandler
+
+CallExitHandler:
+	pop r15
+	SAVE
+	sub rsp,28h
+	lea rcx,[rbp-80h]
+	mov edx,eax
+	call SystemCallExitHandler
+	add rsp,28h
+	RESTOR
+	jmp CallOriginalExit
+
+SkipExitHandler:
+	pop r15
+
+CallOriginalExit:
+	mov rbx,[rbp+0C0h]
+	mov rdi,[rbp+0C8h]
+	mov rsi,[rbp+0D0h]
+	jmp qword ptr[OriKiSystemServiceExit]
+
+DetourKiSystemServiceExit endp
+
 
 end
\ No newline at end of file
@@ -3,11 +3,18 @@
 #include"systemcall.h"
 #include"include/write_protect.h"
 #include "settings.h"
+#include "trace.h"
+#include "syscall_aggregate.h"
+#include "syscall_args.h"
+#include "syscall_sampling.h"
+#include <intrin.h>
+#include <ntimage.h>
 
 extern "C"
 {
 #include"kernel-hook/khook/khook/hk.h"
 extern "C" void DetourKiSystemServiceStart();
+extern "C" void DetourKiSystemServiceExit();
 NTSYSAPI const char* PsGetProcessImageFileName(PEPROCESS Process);
 }
 
@@ -15,8 +22,37 @@ NTSYSAPI const char* PsGetProcessImageFileName(PEPROCESS Process);
 fpSystemCall SystemCallFake;
 
 char SystemCallRecoverCode[15] = {};
+char SystemCallExitRecoverCode[15] = {};
 NTSTATUS HookStatus = STATUS_UNSUCCESSFUL;
 
+//
+//ڽеϵͳãtrap frameΪkeyڷʱ
+//trap frameϵͳڼΨһģͬһ߳Ƕ׵ZwҲԼtrap frame
+//
+struct SyscallInFlight
+{
+	PVOID volatile TrapFrame;
+	PETHREAD Thread;
+	ULONG64 Tsc;
+	ULONG Index;
+	BOOLEAN Sampled;	//ڱʱҲдtrace
+};
+
+#define SYSCALL_INFLIGHT_COUNT 0x1000
+#define SYSCALL_INFLIGHT_PROBE 8
+#define SYSCALL_POOL_TAG 'cysH'
+
+static SyscallInFlight* SyscallInFlightTable = NULL;
+
+//[SYSCALL_FILTER_INDEX_COUNT][SYSCALL_LATENCY_BUCKETS]
+static LONG* SyscallLatencyHistogram = NULL;
+
+//
+//ntoskrnlSyscallServiceCount[0]Ȼwin32kSyscallServiceCount[1]
+//
+static PSYSCALL_SERVICE_ENTRY SyscallServiceTable = NULL;
+static ULONG SyscallServiceCount[2] = {};
+
 
 const char* GetSyscallProcess()
 {
@@ -51,6 +87,171 @@ PKLDR_DATA_TABLE_ENTRY GetSystemModule(IN PUNICODE_STRING pName, IN PVOID pAddre
 }
 
 
+static PSYSCALL_SERVICE_ENTRY SyscallServiceSlot(PSYSCALL_SERVICE_ENTRY Table, ULONG index)
+{
+	const ULONG table = (index >> 12) & 1;
+	const ULONG number = index & 0xfff;
+	if (!Table || number >= SyscallServiceCount[table])
+		return NULL;
+	return &Table[(table ? SyscallServiceCount[0] : 0) + number];
+}
+
+//
+//Nt*stub
+//mov r10,rcx
+//mov eax,index
+//ntdllindexntoskrnlģwin32u0x1000ϵwin32k
+//
+static void SyscallServiceParseExports(PSYSCALL_SERVICE_ENTRY Table, PUCHAR Base, SIZE_T Size)
+{
+	auto dos = (PIMAGE_DOS_HEADER)Base;
+	if (Size < sizeof(IMAGE_DOS_HEADER) || dos->e_magic != IMAGE_DOS_SIGNATURE ||
+		(SIZE_T)dos->e_lfanew + sizeof(IMAGE_NT_HEADERS64) > Size)
+		return;
+
+	auto nt = (PIMAGE_NT_HEADERS64)(Base + dos->e_lfanew);
+	if (nt->Signature != IMAGE_NT_SIGNATURE)
+		return;
+
+	const auto& dir = nt->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT];
+	if (!dir.VirtualAddress || (SIZE_T)dir.VirtualAddress + sizeof(IMAGE_EXPORT_DIRECTORY) > Size)
+		return;
+
+	auto exports = (PIMAGE_EXPORT_DIRECTORY)(Base + dir.VirtualAddress);
+	auto names = (PULONG)(Base + exports->AddressOfNames);
+	auto ordinals = (PUSHORT)(Base + exports->AddressOfNameOrdinals);
+	auto functions = (PULONG)(Base + exports->AddressOfFunctions);
+
+	for (ULONG i = 0; i < exports->NumberOfNames; i++)
+	{
+		if (names[i] + sizeof(SYSCALL_SERVICE_ENTRY::Name) > Size)
+			continue;
+		auto name = (const char*)(Base + names[i]);
+		if (name[0] != 'N' || name[1] != 't')
+			continue;
+
+		const auto ordinal = ordinals[i];
+		if (ordinal >= exports->NumberOfFunctions || functions[ordinal] + 8 > Size)
+			continue;
+
+		auto stub = Base + functions[ordinal];
+		if (stub[0] != 0x4c || stub[1] != 0x8b || stub[2] != 0xd1 || stub[3] != 0xb8)
+			continue;
+
+		auto entry = SyscallServiceSlot(Table, *(PULONG)(stub + 4));
+		if (entry)
+			strncpy(entry->Name, name, sizeof(entry->Name) - 1);
+	}
+}
+
+//
+//System32µdllimageӳ䵽ǰ(DriverEntrySystem)ֻ
+//
+static void SyscallServiceParseImage(PSYSCALL_SERVICE_ENTRY Table, PCWSTR Path)
+{
+	UNICODE_STRING name;
+	RtlInitUnicodeString(&name, Path);
+	OBJECT_ATTRIBUTES oa;
+	InitializeObjectAttributes(&oa, &name, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
+
+	HANDLE file = NULL;
+	IO_STATUS_BLOCK iosb = {};
+	auto status = ZwOpenFile(&file, GENERIC_READ, &oa, &iosb, FILE_SHARE_READ, FILE_SYNCHRONOUS_IO_NONALERT);
+	if (!NT_SUCCESS(status))
+		return;
+
+	HANDLE section = NULL;
+	InitializeObjectAttributes(&oa, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+	status = ZwCreateSection(&section, SECTION_MAP_READ, &oa, NULL, PAGE_READONLY, SEC_IMAGE, file);
+	ZwClose(file);
+	if (!NT_SUCCESS(status))
+		return;
+
+	PVOID base = NULL;
+	SIZE_T size = 0;
+	status = ZwMapViewOfSection(section, ZwCurrentProcess(), &base, 0, 0, NULL, &size, ViewUnmap, 0, PAGE_READONLY);
+	if (NT_SUCCESS(status))
+	{
+		__try
+		{
+			SyscallServiceParseExports(Table, (PUCHAR)base, size);
+		}
+		__except (EXCEPTION_EXECUTE_HANDLER)
+		{
+		}
+		ZwUnmapViewOfSection(ZwCurrentProcess(), base);
+	}
+	ZwClose(section);
+}
+
+//
+//W32pServiceTablesessionռ䣬ҪҿһsessionĽ̲ܶ
+//
+static PEPROCESS SyscallFindSessionProcess()
+{
+	for (ULONG pid = 8; pid < 0x10000; pid += 4)
+	{
+		PEPROCESS process = NULL;
+		if (!NT_SUCCESS(PsLookupProcessByProcessId((HANDLE)(ULONG_PTR)pid, &process)))
+			continue;
+		if (!strcmp(PsGetProcessImageFileName(process), "csrss.exe"))
+			return process;
+		ObDereferenceObject(process);
+	}
+	return NULL;
+}
+
+static void BuildSyscallServiceTable()
+{
+	auto ssdt = aSYSTEM_SERVICE_DESCRIPTOR_TABLE;
+	auto shadow = &aSYSTEM_SERVICE_DESCRIPTOR_TABLE_SHADOW[1];
+	SyscallServiceCount[0] = (ULONG)min(ssdt->NumberOfServices, 0x1000);
+	SyscallServiceCount[1] = (ULONG)min(shadow->NumberOfServices, 0x1000);
+
+	const auto count = SyscallServiceCount[0] + SyscallServiceCount[1];
+	auto table = (PSYSCALL_SERVICE_ENTRY)ExAllocatePoolWithTag(NonPagedPool,
+		sizeof(SYSCALL_SERVICE_ENTRY) * count, SYSCALL_POOL_TAG);
+	if (!table)
+		return;
+	RtlZeroMemory(table, sizeof(SYSCALL_SERVICE_ENTRY) * count);
+
+	for (ULONG i = 0; i < SyscallServiceCount[0]; i++)
+	{
+		table[i].Index = i;
+		table[i].Target = (ULONG64)ssdt->ServiceTableBase + (((PLONG)ssdt->ServiceTableBase)[i] >> 4);
+	}
+
+	auto process = SyscallFindSessionProcess();
+	if (process)
+	{
+		KAPC_STATE apc;
+		KeStackAttachProcess(process, &apc);
+		for (ULONG i = 0; i < SyscallServiceCount[1]; i++)
+		{
+			auto entry = &table[SyscallServiceCount[0] + i];
+			entry->Index = 0x1000 + i;
+			if (MmIsAddressValid(&((PLONG)shadow->ServiceTableBase)[i]))
+				entry->Target = (ULONG64)shadow->ServiceTableBase + (((PLONG)shadow->ServiceTableBase)[i] >> 4);
+		}
+		KeUnstackDetachProcess(&apc);
+		ObDereferenceObject(process);
+	}
+	else
+	{
+		for (ULONG i = 0; i < SyscallServiceCount[1]; i++)
+			table[SyscallServiceCount[0] + i].Index = 0x1000 + i;
+	}
+
+	SyscallServiceParseImage(table, L"\\SystemRoot\\System32\\ntdll.dll");
+	SyscallServiceParseImage(table, L"\\SystemRoot\\System32\\win32u.dll");
+
+#ifdef DBG
+	Log("[SyscallServiceTable]%d ntoskrnl, %d win32k services\n", SyscallServiceCount[0], SyscallServiceCount[1]);
+#endif // DBG
+
+	SyscallServiceTable = table;
+}
+
 NTSTATUS InitSystemVar()
 {
 	/*
@@ -116,11 +317,27 @@ NTSTATUS InitSystemVar()
 	//KiSystemServiceCopyStart = OffsetKiSystemServiceCopyStart + KernelBase;
 	KiSystemServiceStart = OffsetKiSystemServiceStart + KernelBase;
 
+	PtrKiSystemServiceExit = (ULONG_PTR)&DetourKiSystemServiceExit;
+	KiSystemServiceExit = OffsetKiSystemServiceExit + KernelBase;
+
 	aSYSTEM_SERVICE_DESCRIPTOR_TABLE = 
 	(SYSTEM_SERVICE_DESCRIPTOR_TABLE*)(OffsetKeServiceDescriptorTable + KernelBase);
 
+	aSYSTEM_SERVICE_DESCRIPTOR_TABLE_SHADOW =
+	(SYSTEM_SERVICE_DESCRIPTOR_TABLE*)(OffsetKeServiceDescriptorTableShadow + KernelBase);
+
 	PspCidTable = *(ULONG_PTR*)(KernelBase + OffsetPspCidTable);
 
+	//
+	//ʧܵĻGetSSDTEntry˻صֻntoskrnlSSDT
+	//
+	BuildSyscallServiceTable();
+
+	//
+	//ĬϵͳöSystemCallHandlerԭΪ
+	//
+	SyscallFilterSelectAll();
+
 #ifdef HOOK_SYSCALL
 
 	SystemCallFake.Construct();
@@ -149,19 +366,40 @@ void DoSystemCallHook()
 	memcpy((PVOID)KiSystemServiceStart, hook, sizeof(hook));
 	WPONx64(irql);
 
+	//
+	//KiSystemServiceExitͷ
+	//mov rbx,[rbp+0C0h]
+	//mov rdi,[rbp+0C8h]
+	//mov rsi,[rbp+0D0h]
+	//һ0x15ֽڣDetourKiSystemServiceExitطָ
+	//
+	OriKiSystemServiceExit = (PVOID)((ULONG_PTR)KiSystemServiceExit + 0x15);
+	memcpy(SystemCallExitRecoverCode, (PVOID)KiSystemServiceExit, sizeof(SystemCallExitRecoverCode));
+	memcpy(hook + 4, &PtrKiSystemServiceExit, sizeof(PtrKiSystemServiceExit));
+	irql = WPOFFx64();
+	memcpy((PVOID)KiSystemServiceExit, hook, sizeof(hook));
+	WPONx64(irql);
+
+	SyscallExitCaptureEnabled = SyscallInFlightTable != NULL;
+
 	ExclReleaseExclusivity(exclusivity);
 }
 
-//ֻSSDTShadowSSDT
+//SSDTShadowSSDTԣShadowSSDTĵַsessionռ
 PVOID GetSSDTEntry(IN ULONG index)
 {
+	auto entry = SyscallServiceSlot(SyscallServiceTable, index);
+	if (entry)
+		return (PVOID)entry->Target;
+
+	//ûõʱֻܽSSDT
 	PSYSTEM_SERVICE_DESCRIPTOR_TABLE pSSDT = aSYSTEM_SERVICE_DESCRIPTOR_TABLE;
 	PVOID pBase = (PVOID)KernelBase;
 
 	if (pSSDT && pBase)
 	{
 		// Index range check shadowssdtĻ0
-		if (index > pSSDT->NumberOfServices)
+		if (index >= pSSDT->NumberOfServices)
 			return NULL;
 
 		return (PUCHAR)pSSDT->ServiceTableBase + (((PLONG)pSSDT->ServiceTableBase)[index] >> 4);
@@ -170,13 +408,241 @@ PVOID GetSSDTEntry(IN ULONG index)
 	return NULL;
 }
 
+//Ҳؿմ᷵NULL
+const char* GetSSDTName(IN ULONG index)
+{
+	auto entry = SyscallServiceSlot(SyscallServiceTable, index);
+	return entry ? entry->Name : "";
+}
+
+const SYSCALL_SERVICE_ENTRY* GetSyscallService(IN ULONG index)
+{
+	return SyscallServiceSlot(SyscallServiceTable, index);
+}
+
+ULONG SyscallServiceRead(IN ULONG FirstEntry, OUT PVOID Buffer, IN ULONG BufferSize)
+{
+	const auto table = SyscallServiceTable;
+	const auto total = SyscallServiceCount[0] + SyscallServiceCount[1];
+	if (!table || FirstEntry >= total)
+		return 0;
+
+	const ULONG count = min(BufferSize / (ULONG)sizeof(SYSCALL_SERVICE_ENTRY), total - FirstEntry);
+	RtlCopyMemory(Buffer, table + FirstEntry, count * sizeof(SYSCALL_SERVICE_ENTRY));
+	return count * sizeof(SYSCALL_SERVICE_ENTRY);
+}
+
+//ǰѾϵͳõhookÿָͷţGetSSDTEntry֮˻صֻSSDT
+void SyscallServiceTermination()
+{
+	auto table = (PSYSCALL_SERVICE_ENTRY)InterlockedExchangePointer((PVOID*)&SyscallServiceTable, NULL);
+	if (table)
+		ExFreePoolWithTag(table, SYSCALL_POOL_TAG);
+}
+
+void SyscallFilterSelectAll()
+{
+	RtlFillMemory(SyscallFilterBitmap, sizeof(SyscallFilterBitmap), 0xff);
+}
+
+void SyscallFilterClearAll()
+{
+	RtlZeroMemory(SyscallFilterBitmap, sizeof(SyscallFilterBitmap));
+}
+
+void SyscallFilterSelect(IN ULONG index, IN bool selected)
+{
+	index &= SYSCALL_FILTER_INDEX_MASK;
+	if (selected)
+		InterlockedBitTestAndSet(&SyscallFilterBitmap[index / 32], index % 32);
+	else
+		InterlockedBitTestAndReset(&SyscallFilterBitmap[index / 32], index % 32);
+}
+
+NTSTATUS SyscallFilterSetProcess(IN HANDLE ProcessId)
+{
+	PEPROCESS process = NULL;
+	if (ProcessId)
+	{
+		auto status = PsLookupProcessByProcessId(ProcessId, &process);
+		if (!NT_SUCCESS(status))
+			return status;
+	}
+
+	//
+	//EPROCESSãֹ˳ַöƥ
+	//stubֻȽָ룬ãֱͷžɵ
+	//
+	auto old = (PEPROCESS)InterlockedExchangePointer((PVOID*)&SyscallFilterProcess, process);
+	if (old)
+		ObDereferenceObject(old);
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS SyscallLatencyInitialization()
+{
+	SyscallInFlightTable = (SyscallInFlight*)ExAllocatePoolWithTag(NonPagedPool,
+		sizeof(SyscallInFlight) * SYSCALL_INFLIGHT_COUNT, SYSCALL_POOL_TAG);
+	SyscallLatencyHistogram = (LONG*)ExAllocatePoolWithTag(NonPagedPool,
+		sizeof(LONG) * SYSCALL_FILTER_INDEX_COUNT * SYSCALL_LATENCY_BUCKETS, SYSCALL_POOL_TAG);
+	if (!SyscallInFlightTable || !SyscallLatencyHistogram)
+	{
+		SyscallLatencyTermination();
+		return STATUS_MEMORY_NOT_ALLOCATED;
+	}
+
+	RtlZeroMemory(SyscallInFlightTable, sizeof(SyscallInFlight) * SYSCALL_INFLIGHT_COUNT);
+	RtlZeroMemory(SyscallLatencyHistogram, sizeof(LONG) * SYSCALL_FILTER_INDEX_COUNT * SYSCALL_LATENCY_BUCKETS);
+	return STATUS_SUCCESS;
+}
+
+//ǰѾKiSystemServiceExithook
+void SyscallLatencyTermination()
+{
+	SyscallExitCaptureEnabled = FALSE;
+	if (SyscallInFlightTable)
+	{
+		ExFreePoolWithTag(SyscallInFlightTable, SYSCALL_POOL_TAG);
+		SyscallInFlightTable = NULL;
+	}
+	if (SyscallLatencyHistogram)
+	{
+		ExFreePoolWithTag(SyscallLatencyHistogram, SYSCALL_POOL_TAG);
+		SyscallLatencyHistogram = NULL;
+	}
+}
+
+ULONG SyscallLatencyRead(IN ULONG FirstIndex, OUT PVOID Buffer, IN ULONG BufferSize)
+{
+	const ULONG row = sizeof(LONG) * SYSCALL_LATENCY_BUCKETS;
+	if (!SyscallLatencyHistogram || FirstIndex >= SYSCALL_FILTER_INDEX_COUNT)
+		return 0;
+
+	ULONG count = min(BufferSize / row, SYSCALL_FILTER_INDEX_COUNT - FirstIndex);
+	RtlCopyMemory(Buffer, SyscallLatencyHistogram + FirstIndex * SYSCALL_LATENCY_BUCKETS, count * row);
+	return count * row;
+}
+
+static ULONG SyscallInFlightHash(PVOID TrapFrame)
+{
+	return (ULONG)((((ULONG_PTR)TrapFrame >> 4) * 0x9E3779B97F4A7C15ull) >> 52) & (SYSCALL_INFLIGHT_COUNT - 1);
+}
+
+static void SyscallRecordEntry(KTRAP_FRAME* TrapFrame, ULONG SSDT_INDEX, ULONG64 Tsc, BOOLEAN Sampled)
+{
+	const auto hash = SyscallInFlightHash(TrapFrame);
+	SyscallInFlight* entry = NULL;
+	SyscallInFlight* oldest = NULL;
+
+	for (ULONG i = 0; i < SYSCALL_INFLIGHT_PROBE; i++)
+	{
+		auto slot = &SyscallInFlightTable[(hash + i) & (SYSCALL_INFLIGHT_COUNT - 1)];
+		auto key = slot->TrapFrame;
+
+		//ͬһtrap frameľɼ¼˵һûз(ֹ̱߳)ֱӸ
+		if (key == TrapFrame ||
+			(!key && !InterlockedCompareExchangePointer(&slot->TrapFrame, TrapFrame, NULL)))
+		{
+			entry = slot;
+			break;
+		}
+		if (!oldest || slot->Tsc < oldest->Tsc)
+			oldest = slot;
+	}
+
+	//
+	//̽ⷶΧڶռˣռɵһķؽ޷
+	//
+	if (!entry)
+	{
+		auto key = oldest->TrapFrame;
+		if (InterlockedCompareExchangePointer(&oldest->TrapFrame, TrapFrame, key) != key)
+			return;
+		entry = oldest;
+	}
+
+	entry->Thread = PsGetCurrentThread();
+	entry->Tsc = Tsc;
+	entry->Index = SSDT_INDEX & SYSCALL_FILTER_INDEX_MASK;
+	entry->Sampled = Sampled;
+}
+
+void SystemCallExitHandler(KTRAP_FRAME* TrapFrame, NTSTATUS Status)
+{
+	const auto tsc = __rdtsc();
+	if (!SyscallInFlightTable)
+		return;
+
+	const auto hash = SyscallInFlightHash(TrapFrame);
+	for (ULONG i = 0; i < SYSCALL_INFLIGHT_PROBE; i++)
+	{
+		auto slot = &SyscallInFlightTable[(hash + i) & (SYSCALL_INFLIGHT_COUNT - 1)];
+		if (slot->TrapFrame != TrapFrame)
+			continue;
+
+		const auto thread = slot->Thread;
+		const auto entry_tsc = slot->Tsc;
+		const auto index = slot->Index;
+		const auto sampled = slot->Sampled;
+
+		//
+		//ȶͷţڼ䱻ռCASʧܣ
+		//
+		if (InterlockedCompareExchangePointer(&slot->TrapFrame, NULL, TrapFrame) != TrapFrame)
+			return;
+		if (thread != PsGetCurrentThread())
+			return;
+
+		const auto duration = tsc - entry_tsc;
+		ULONG bucket = 0;
+		unsigned long msb = 0;
+		if (_BitScanReverse64(&msb, duration))
+			bucket = min((ULONG)msb + 1, (ULONG)SYSCALL_LATENCY_BUCKETS - 1);
+		InterlockedIncrement(&SyscallLatencyHistogram[index * SYSCALL_LATENCY_BUCKETS + bucket]);
+
+		if (SyscallMode & SYSCALL_MODE_AGGREGATE)
+			SyscallAggregateAddCycles(index, duration);
+
+		if (!(SyscallMode & SYSCALL_MODE_TRACE) || !sampled)
+			return;
+
+		auto record = (TraceSyscallExitRecord*)TraceBegin(sizeof(TraceSyscallExitRecord));
+		if (record)
+		{
+			record->process_id = (ULONG64)PsGetCurrentProcessId();
+			record->thread_id = (ULONG64)PsGetCurrentThreadId();
+			record->index = index;
+			record->status = Status;
+			record->duration = duration;
+			TraceCommit(&record->header, kTraceRecordSyscallExit);
+		}
+		return;
+	}
+}
+
 void InitUserSystemCallHandler(decltype(&SystemCallHandler) UserHandler)
 {
 	UserSystemCallHandler = UserHandler;
 }
 
-void SystemCallHandler(KTRAP_FRAME * TrapFrame,ULONG SSDT_INDEX)
+void SystemCallHandler(KTRAP_FRAME * TrapFrame,ULONG SSDT_INDEX, PSYSTEM_CALL_REGISTERS Registers)
 {
+	const auto tsc = __rdtsc();
+
+	//
+	//ۺϺӳֱͼֻдtraceںͷؼ¼
+	//
+	const BOOLEAN sampled = (SyscallMode & SYSCALL_MODE_TRACE) && SyscallSamplingAdmit();
+
+	if (SyscallExitCaptureEnabled)
+		SyscallRecordEntry(TrapFrame, SSDT_INDEX, tsc, sampled);
+
+	if (SyscallMode & SYSCALL_MODE_AGGREGATE)
+		SyscallAggregateCount(SSDT_INDEX);
+
+	if (sampled)
+		SyscallArgsCapture(TrapFrame, SSDT_INDEX, Registers);
 
 #ifdef DBG
 	//¼˶ٴϵͳãdebugֻеһεʱ
@@ -192,27 +658,22 @@ void SystemCallHandler(KTRAP_FRAME * TrapFrame,ULONG SSDT_INDEX)
 
 	if (UserSystemCallHandler)
 	{
-		UserSystemCallHandler(TrapFrame, SSDT_INDEX);
+		UserSystemCallHandler(TrapFrame, SSDT_INDEX, Registers);
 	}
 }
 
-void SystemCallLog(KTRAP_FRAME* TrapFrame, ULONG SSDT_INDEX)
+void SystemCallLog(KTRAP_FRAME* TrapFrame, ULONG SSDT_INDEX, PSYSTEM_CALL_REGISTERS Registers)
 {
 	const char* syscall_name = GetSyscallProcess();
 #if 0
 	Log("%s\n", syscall_name);
 #endif
-	//
-	//Ҫshadow ssdt
-	//
-
 	//
 	//ConsoleApplication3.vmp.exe
 	//ΪEPROCESS.ImageFileName[16]Ҫض16ֽ(ĩβַ)
 	//exeĿĿ¼
 	//
 	if (!strcmp(syscall_name, "ConsoleApplica")) {
-		if (SSDT_INDEX < 0x1000)
-			Log("[%s]Syscall rip %p SSDT Index %p\n", syscall_name,TrapFrame->Rip - 2, SSDT_INDEX);
+		Log("[%s]Syscall rip %p SSDT Index %p %s\n", syscall_name, TrapFrame->Rip - 2, SSDT_INDEX, GetSSDTName(SSDT_INDEX));
 	}
 }
\ No newline at end of file
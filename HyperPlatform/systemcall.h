@@ -1,3 +1,4 @@
+#pragma once
 #include"log.h"
 #include"FakePage.h"
 #include<ntdef.h>
@@ -6,6 +7,18 @@
 
 #define NO_MEMORY_BUGCHECK_CODE 0x444444
 
+//
+//syscall filter bitmap, one bit per (eax & 0x1fff)
+//bit 12 selects the shadow ssdt, so 0x1000-0x1fff are win32k services
+//
+#define SYSCALL_FILTER_INDEX_COUNT 0x2000
+#define SYSCALL_FILTER_INDEX_MASK (SYSCALL_FILTER_INDEX_COUNT - 1)
+
+//
+//ÿindexӳֱͼnͰ[2^(n-1), 2^n)TSCڣһͰ
+//
+#define SYSCALL_LATENCY_BUCKETS 24
+
 typedef struct _SYSTEM_SERVICE_DESCRIPTOR_TABLE
 {
 	PULONG_PTR ServiceTableBase;
@@ -51,6 +64,40 @@ typedef struct _KLDR_DATA_TABLE_ENTRY
 } KLDR_DATA_TABLE_ENTRY, * PKLDR_DATA_TABLE_ENTRY;
 
 
+//
+//DetourKiSystemServiceStartSAVEѹջļĴ˳SAVE෴
+//syscallָrcx˷صַԵһr10
+//
+typedef struct _SYSTEM_CALL_REGISTERS
+{
+	ULONG64 Rbp;
+	ULONG64 Rbx;
+	ULONG64 Rsi;
+	ULONG64 Rdi;
+	ULONG64 R15;
+	ULONG64 R14;
+	ULONG64 R13;
+	ULONG64 R12;
+	ULONG64 R11;
+	ULONG64 R10;
+	ULONG64 R9;
+	ULONG64 R8;
+	ULONG64 Rdx;
+	ULONG64 Rcx;
+	ULONG64 Rax;
+} SYSTEM_CALL_REGISTERS, * PSYSTEM_CALL_REGISTERS;
+
+//
+//InitSystemVarｨõindex->֮޸
+//
+typedef struct _SYSCALL_SERVICE_ENTRY
+{
+	ULONG Index;		//SSDT index, 0x1000shadow ssdt
+	ULONG Reserved;
+	ULONG64 Target;		//ַshadow ssdtsessionռ
+	CHAR Name[64];		//ntdll.dll/win32u.dllĵõҲǿմ
+} SYSCALL_SERVICE_ENTRY, * PSYSCALL_SERVICE_ENTRY;
+
 //Ҫasmļʹ
 extern "C"
 {
@@ -67,11 +114,31 @@ extern "C"
 	inline ULONG_PTR KiSystemServiceStart = NULL;
 	inline ULONG_PTR PtrKiSystemServiceStart = NULL;
 	inline PVOID OriKiSystemServiceStart = NULL;
+	inline ULONG_PTR KiSystemServiceExit = NULL;
+	inline ULONG_PTR PtrKiSystemServiceExit = NULL;
+	inline PVOID OriKiSystemServiceExit = NULL;
+
+	//
+	//DetourKiSystemServiceExitֻΪTRUEʱŵSystemCallExitHandler
+	//
+	inline BOOLEAN SyscallExitCaptureEnabled = FALSE;
+
 	inline PSYSTEM_SERVICE_DESCRIPTOR_TABLE aSYSTEM_SERVICE_DESCRIPTOR_TABLE = NULL;
+	//[0]aSYSTEM_SERVICE_DESCRIPTOR_TABLEһ[1]win32k
+	inline PSYSTEM_SERVICE_DESCRIPTOR_TABLE aSYSTEM_SERVICE_DESCRIPTOR_TABLE_SHADOW = NULL;
+
+	//
+	//DetourKiSystemServiceStart tests these before SAVE, unselected syscalls
+	//go straight to OriKiSystemServiceStart without calling SystemCallHandler
+	//SyscallFilterProcess == NULL means every process
+	//
+	inline LONG SyscallFilterBitmap[SYSCALL_FILTER_INDEX_COUNT / 32] = {};
+	inline PEPROCESS SyscallFilterProcess = NULL;
 
 	//inline LdrpKrnGetDataTableEntryType LdrpKrnGetDataTableEntry = NULL;
 
-	void SystemCallHandler(KTRAP_FRAME* TrapFrame, ULONG SSDT_INDEX);
+	void SystemCallHandler(KTRAP_FRAME* TrapFrame, ULONG SSDT_INDEX, PSYSTEM_CALL_REGISTERS Registers);
+	void SystemCallExitHandler(KTRAP_FRAME* TrapFrame, NTSTATUS Status);
 	ULONG_PTR GetKernelBase();
 	const char* GetSyscallProcess();
 
@@ -91,6 +158,28 @@ void DoSystemCallHook();
 
 PVOID GetSSDTEntry(IN ULONG index);
 
+const char* GetSSDTName(IN ULONG index);
+
+const SYSCALL_SERVICE_ENTRY* GetSyscallService(IN ULONG index);
+
+ULONG SyscallServiceRead(IN ULONG FirstEntry, OUT PVOID Buffer, IN ULONG BufferSize);
+
+void SyscallServiceTermination();
+
+void SyscallFilterSelectAll();
+
+void SyscallFilterClearAll();
+
+void SyscallFilterSelect(IN ULONG index, IN bool selected);
+
+NTSTATUS SyscallFilterSetProcess(IN HANDLE ProcessId);
+
+NTSTATUS SyscallLatencyInitialization();
+
+void SyscallLatencyTermination();
+
+ULONG SyscallLatencyRead(IN ULONG FirstIndex, OUT PVOID Buffer, IN ULONG BufferSize);
+
 struct fpSystemCall :public ICFakePage
 {
 	virtual void Construct() override
@@ -114,4 +203,4 @@ struct fpSystemCall :public ICFakePage
 
 };
 
-void SystemCallLog(KTRAP_FRAME* TrapFrame, ULONG SSDT_INDEX);
\ No newline at end of file
+void SystemCallLog(KTRAP_FRAME* TrapFrame, ULONG SSDT_INDEX, PSYSTEM_CALL_REGISTERS Registers);
\ No newline at end of file
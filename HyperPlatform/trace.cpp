@@ -0,0 +1,251 @@
+// Copyright (c) 2015-2019, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements the binary event trace.
+///
+/// Each processor owns a ring. A writer reserves space by advancing head with
+/// a compare-exchange, fills the record and stores its type last. The reader
+/// stops at the first record whose type is still zero, zeroes what it consumed
+/// and only then advances tail, so a writer always reserves zeroed memory.
+
+#include "trace.h"
+#include <intrin.h>
+#include "common.h"
+#include "shared_ring.h"
+
+extern "C" {
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// A size of a ring for each processor. Must be a power of two.
+static const ULONG kTracepRingSize = 128 * 1024;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+struct TracepRing {
+  volatile LONG64 head;  // Bytes ever reserved
+  volatile LONG64 tail;  // Bytes ever released by the reader
+  volatile LONG64 dropped;
+  UCHAR *buffer;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+static ULONG TracepAlign(_In_ ULONG size);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+static TracepRing *g_tracep_rings;
+static ULONG g_tracep_ring_count;
+static FAST_MUTEX g_tracep_reader_mutex;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Allocates per-processor trace rings
+_Use_decl_annotations_ NTSTATUS TraceInitialization() {
+  PAGED_CODE()
+
+  const auto count = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+  const auto rings = static_cast<TracepRing *>(ExAllocatePoolWithTag(
+      NonPagedPool, sizeof(TracepRing) * count, kHyperPlatformCommonPoolTag));
+  if (!rings) {
+    return STATUS_MEMORY_NOT_ALLOCATED;
+  }
+  RtlZeroMemory(rings, sizeof(TracepRing) * count);
+
+  for (auto i = 0ul; i < count; ++i) {
+    rings[i].buffer = static_cast<UCHAR *>(ExAllocatePoolWithTag(
+        NonPagedPool, kTracepRingSize, kHyperPlatformCommonPoolTag));
+    if (!rings[i].buffer) {
+      for (auto j = 0ul; j < i; ++j) {
+        ExFreePoolWithTag(rings[j].buffer, kHyperPlatformCommonPoolTag);
+      }
+      ExFreePoolWithTag(rings, kHyperPlatformCommonPoolTag);
+      return STATUS_MEMORY_NOT_ALLOCATED;
+    }
+    RtlZeroMemory(rings[i].buffer, kTracepRingSize);
+  }
+
+  ExInitializeFastMutex(&g_tracep_reader_mutex);
+  g_tracep_ring_count = count;
+  g_tracep_rings = rings;
+  return STATUS_SUCCESS;
+}
+
+// Frees per-processor trace rings
+_Use_decl_annotations_ void TraceTermination() {
+  PAGED_CODE()
+
+  const auto rings = g_tracep_rings;
+  if (!rings) {
+    return;
+  }
+  g_tracep_rings = nullptr;
+  for (auto i = 0ul; i < g_tracep_ring_count; ++i) {
+    ExFreePoolWithTag(rings[i].buffer, kHyperPlatformCommonPoolTag);
+  }
+  ExFreePoolWithTag(rings, kHyperPlatformCommonPoolTag);
+}
+
+// Rounds up a size to kTraceRecordAlignment
+_Use_decl_annotations_ static ULONG TracepAlign(ULONG size) {
+  return (size + kTraceRecordAlignment - 1) & ~(kTraceRecordAlignment - 1);
+}
+
+// Reserves a record in a ring of the current processor
+_Use_decl_annotations_ TraceRecordHeader *TraceBegin(ULONG size) {
+  if (SharedRingIsExclusive()) {
+    return SharedRingBegin(size);
+  }
+
+  const auto rings = g_tracep_rings;
+  if (!rings || size < sizeof(TraceRecordHeader) ||
+      size > kTraceRecordMaxSize) {
+    return nullptr;
+  }
+
+  const auto processor = KeGetCurrentProcessorNumberEx(nullptr);
+  if (processor >= g_tracep_ring_count) {
+    return nullptr;
+  }
+  auto &ring = rings[processor];
+  size = TracepAlign(size);
+
+  LONG64 head = 0;
+  ULONG offset = 0;
+  ULONG padding = 0;
+  for (;;) {
+    head = ring.head;
+    offset = static_cast<ULONG>(head) & (kTracepRingSize - 1);
+
+    // A record never straddles the end of a ring; the rest is padded instead
+    padding = (offset + size > kTracepRingSize) ? kTracepRingSize - offset : 0;
+    if (head + padding + size - ring.tail > kTracepRingSize) {
+      InterlockedIncrement64(&ring.dropped);
+      return nullptr;
+    }
+    if (InterlockedCompareExchange64(&ring.head, head + padding + size,
+                                     head) == head) {
+      break;
+    }
+  }
+
+  if (padding) {
+    const auto pad = reinterpret_cast<TraceRecordHeader *>(ring.buffer + offset);
+    pad->size = static_cast<USHORT>(padding);
+    pad->processor = processor;
+    pad->tsc = 0;
+    InterlockedExchange16(reinterpret_cast<volatile SHORT *>(&pad->type),
+                          kTraceRecordPadding);
+    offset = 0;
+  }
+
+  const auto record = reinterpret_cast<TraceRecordHeader *>(ring.buffer + offset);
+  record->size = static_cast<USHORT>(size);
+  record->processor = processor;
+  record->tsc = __rdtsc();
+  return record;
+}
+
+// Publishes a record reserved by TraceBegin()
+_Use_decl_annotations_ void TraceCommit(TraceRecordHeader *record,
+                                        TraceRecordType type) {
+  // Copied first since a reader may release the record once it is published
+  SharedRingMirror(record, type);
+  InterlockedExchange16(reinterpret_cast<volatile SHORT *>(&record->type),
+                        type);
+}
+
+// Copies committed records into a buffer and releases them from the rings
+_Use_decl_annotations_ ULONG TraceRead(void *buffer, ULONG buffer_size) {
+  PAGED_CODE()
+
+  const auto rings = g_tracep_rings;
+  if (!rings) {
+    return 0;
+  }
+
+  auto out = static_cast<UCHAR *>(buffer);
+  ULONG copied = 0;
+
+  ExAcquireFastMutex(&g_tracep_reader_mutex);
+  for (auto i = 0ul; i < g_tracep_ring_count; ++i) {
+    auto &ring = rings[i];
+    auto tail = ring.tail;
+    while (tail != ring.head) {
+      const auto offset = static_cast<ULONG>(tail) & (kTracepRingSize - 1);
+      const auto record =
+          reinterpret_cast<TraceRecordHeader *>(ring.buffer + offset);
+      const auto type = record->type;
+      if (type == kTraceRecordInvalid) {
+        break;  // Still being written
+      }
+      const ULONG size = record->size;
+      if (type != kTraceRecordPadding) {
+        if (copied + size > buffer_size) {
+          break;
+        }
+        RtlCopyMemory(out + copied, record, size);
+        copied += size;
+      }
+      RtlZeroMemory(record, size);
+      tail += size;
+      InterlockedExchange64(&ring.tail, tail);
+    }
+    if (copied + sizeof(TraceRecordHeader) > buffer_size) {
+      break;
+    }
+  }
+  ExReleaseFastMutex(&g_tracep_reader_mutex);
+  return copied;
+}
+
+// Returns a number of records dropped because rings were full
+ULONG64 TraceGetDropCount() {
+  const auto rings = g_tracep_rings;
+  if (!rings) {
+    return 0;
+  }
+  ULONG64 dropped = 0;
+  for (auto i = 0ul; i < g_tracep_ring_count; ++i) {
+    dropped += rings[i].dropped;
+  }
+  return dropped;
+}
+
+// Returns how full a ring of the current processor is
+ULONG TraceGetFill() {
+  const auto rings = g_tracep_rings;
+  if (!rings) {
+    return 0;
+  }
+  const auto processor = KeGetCurrentProcessorNumberEx(nullptr);
+  if (processor >= g_tracep_ring_count) {
+    return 0;
+  }
+  const auto &ring = rings[processor];
+  return static_cast<ULONG>((ring.head - ring.tail) * 100 / kTracepRingSize);
+}
+
+}  // extern "C"
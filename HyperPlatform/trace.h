@@ -0,0 +1,207 @@
+// Copyright (c) 2015-2019, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Declares interfaces to the binary event trace.
+///
+/// Events are written into per-processor rings without taking locks, and read
+/// out by a single consumer through IOCTL_HYPER_TRACE_READ. While the shared
+/// ring is mapped, they are written into it instead; see shared_ring.h.
+
+#ifndef HYPERPLATFORM_TRACE_H_
+#define HYPERPLATFORM_TRACE_H_
+
+#include <ntddk.h>
+
+extern "C" {
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+/// Every record starts at and is padded to this alignment
+static const ULONG kTraceRecordAlignment = 16;
+
+/// The largest size of a single record including its header
+static const ULONG kTraceRecordMaxSize = 0x1000;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+/// Types of trace records. Zero is reserved for records still being written.
+enum TraceRecordType : USHORT {
+  kTraceRecordInvalid = 0,
+  kTraceRecordPadding,        //!< Fills the end of a ring on wrap; never read
+  kTraceRecordSyscallExit,    //!< TraceSyscallExitRecord
+  kTraceRecordSyscallArgs,    //!< TraceSyscallArgsRecord
+  kTraceRecordSamplingState,  //!< TraceSamplingStateRecord
+  kTraceRecordHook,           //!< TraceHookRecord
+  kTraceRecordVmExit,         //!< TraceVmExitRecord
+  kTraceRecordEptViolation,   //!< TraceEptViolationRecord
+  kTraceRecordLog,            //!< TraceLogRecord; only in the shared ring
+};
+
+/// Flags of TraceSyscallArgField
+enum TraceSyscallArgFlags : USHORT {
+  kTraceSyscallArgTruncated = 0x1,  //!< Data was cut at the field limit
+  kTraceSyscallArgFaulted = 0x2,    //!< User memory could not be read
+};
+
+/// A header common to all trace records
+struct TraceRecordHeader {
+  volatile USHORT type;  //!< TraceRecordType; written last on commit
+  USHORT size;           //!< Size of the record including this header
+  ULONG processor;       //!< A processor number that wrote the record
+  ULONG64 tsc;           //!< A time stamp counter when the record was begun
+};
+static_assert(sizeof(TraceRecordHeader) == 16, "Size check");
+
+/// Emitted when a syscall returns and the entry was paired
+struct TraceSyscallExitRecord {
+  TraceRecordHeader header;
+  ULONG64 process_id;
+  ULONG64 thread_id;
+  ULONG index;       //!< SSDT index; bit 12 selects the shadow SSDT
+  NTSTATUS status;   //!< A return value of the service
+  ULONG64 duration;  //!< TSC cycles between entry and exit
+};
+
+/// Emitted at syscall entry for indexes with an argument schema. Followed by
+/// ULONG64 arguments[argument_count] and then field_count fields, each a
+/// TraceSyscallArgField followed by its data padded to 8 bytes.
+struct TraceSyscallArgsRecord {
+  TraceRecordHeader header;
+  ULONG64 process_id;
+  ULONG64 thread_id;
+  ULONG index;           //!< SSDT index; bit 12 selects the shadow SSDT
+  UCHAR argument_count;  //!< A number of raw argument values that follow
+  UCHAR field_count;     //!< A number of captured fields that follow
+  USHORT reserved;
+};
+static_assert(sizeof(TraceSyscallArgsRecord) % 8 == 0, "Size check");
+
+/// A user-memory field captured for TraceSyscallArgsRecord
+struct TraceSyscallArgField {
+  UCHAR argument;  //!< An argument the field was read through
+  UCHAR kind;      //!< SYSCALL_ARG_FIELD_* of the schema
+  USHORT flags;    //!< TraceSyscallArgFlags
+  ULONG length;    //!< A size of data that follows, without padding
+};
+
+/// Emitted by the sampling controller when its back-off changes and at most
+/// once a second otherwise. Counters of the sampler are of the processor in the
+/// header; drop counters are totals of all processors.
+struct TraceSamplingStateRecord {
+  TraceRecordHeader header;
+  ULONG rate;               //!< A configured 1-in-N rate
+  ULONG events_per_second;  //!< A configured token bucket rate; 0 if unlimited
+  ULONG64 effective_rate;   //!< The rate after back-off
+  ULONG ring_fill;          //!< Fill of the processor's ring in percent
+  ULONG reserved;
+  ULONG64 sampled_out;      //!< Events skipped by the 1-in-N rate
+  ULONG64 throttled;        //!< Events skipped for lack of tokens
+  ULONG64 ring_dropped;     //!< TraceGetDropCount()
+  ULONG64 args_dropped;     //!< Argument captures dropped for lack of buffers
+};
+static_assert(sizeof(TraceSamplingStateRecord) % 8 == 0, "Size check");
+
+/// Emitted by a service hook detour when it is entered
+struct TraceHookRecord {
+  TraceRecordHeader header;
+  ULONG64 process_id;
+  ULONG64 thread_id;
+  ULONG64 argument;  //!< An argument naming a target of the call, eg a handle
+  char name[32];     //!< A name of the detour; may not be null-terminated
+};
+static_assert(sizeof(TraceHookRecord) % 8 == 0, "Size check");
+
+/// Emitted at VM-exit when kVmmpEnableTraceVmExit is set
+struct TraceVmExitRecord {
+  TraceRecordHeader header;
+  ULONG64 guest_ip;
+  ULONG64 exit_qualification;
+  ULONG reason;  //!< VmxExitReason
+  ULONG reserved;
+};
+
+/// Emitted on EPT violation when kEptpEnableTraceViolation is set
+struct TraceEptViolationRecord {
+  TraceRecordHeader header;
+  ULONG64 guest_ip;
+  ULONG64 physical_address;
+  ULONG64 linear_address;  //!< Zero if not valid
+  ULONG64 exit_qualification;
+};
+
+/// Emitted into the shared ring for each message written into the log file
+struct TraceLogRecord {
+  TraceRecordHeader header;
+  char message[1];  //!< A null-terminated message; the rest of the record
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+/// Allocates per-processor trace rings
+/// @return STATUS_SUCCESS on success
+_IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS TraceInitialization();
+
+/// Frees per-processor trace rings
+_IRQL_requires_max_(PASSIVE_LEVEL) void TraceTermination();
+
+/// Reserves a record in a ring of the current processor
+/// @param size   A size of the record including TraceRecordHeader
+/// @return A reserved record, or nullptr if the ring is full
+///
+/// The header is filled except for its type. A caller fills the rest of the
+/// record and publishes it with TraceCommit(). This function is lock-free and
+/// may be called at any IRQL. While the shared ring is mapped in
+/// kSharedRingModeExclusive, the record is reserved in it instead.
+TraceRecordHeader *TraceBegin(_In_ ULONG size);
+
+/// Publishes a record reserved by TraceBegin()
+/// @param record   A record returned by TraceBegin()
+/// @param type   A type of the record
+///
+/// While the shared ring is mapped in kSharedRingModeMirror, the record is also
+/// copied into it.
+void TraceCommit(_In_ TraceRecordHeader *record, _In_ TraceRecordType type);
+
+/// Copies committed records into a buffer and releases them from the rings
+/// @param buffer   A buffer to receive records
+/// @param buffer_size   A size of \a buffer in bytes
+/// @return A number of bytes copied into \a buffer
+_IRQL_requires_max_(PASSIVE_LEVEL) ULONG
+    TraceRead(_Out_writes_bytes_(buffer_size) void *buffer,
+              _In_ ULONG buffer_size);
+
+/// Returns a number of records dropped because rings were full
+ULONG64 TraceGetDropCount();
+
+/// Returns how full a ring of the current processor is
+/// @return A percentage of the ring holding records not yet read out
+ULONG TraceGetFill();
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+}  // extern "C"
+
+#endif  // HYPERPLATFORM_TRACE_H_
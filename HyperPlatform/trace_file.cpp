@@ -0,0 +1,674 @@
+// Copyright (c) 2015-2019, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements the trace file writer.
+///
+/// Records are read out of the rings in batches. Every run of records of the
+/// same processor becomes one kTraceChunkEvents chunk, and each record is
+/// encoded field by field according to a table that is also written to the
+/// file as kTraceChunkSchema.
+
+#include "trace_file.h"
+#include <intrin.h>
+#include "common.h"
+#include "trace.h"
+#include "trace_format.h"
+#include "systemcall.h"
+#include "performance.h"
+
+extern "C" {
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+/// Describes a field of a trace record
+#define TRACE_FILEP_FIELD(record, field, kind)                      \
+  {                                                                 \
+    #field, kind, static_cast<USHORT>(FIELD_OFFSET(record, field)), \
+        static_cast<USHORT>(RTL_FIELD_SIZE(record, field))          \
+  }
+
+/// Describes data following a fixed part of a trace record
+#define TRACE_FILEP_TRAILER(record, name) \
+  { #name, kTraceFieldBytes, static_cast<USHORT>(sizeof(record)), 0 }
+
+/// Describes a schema of a trace record type
+#define TRACE_FILEP_SCHEMA(type, name, fields) \
+  { type, name, fields, RTL_NUMBER_OF(fields) }
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// An interval to drain the rings into a file
+static const auto kTraceFilepFlushIntervalMsec = 100;
+
+// A size of records read out of the rings at once
+static const ULONG kTraceFilepReadBufferSize = 64 * 1024;
+
+// A size of an encoding buffer. An encoded record never exceeds 1.25 times of
+// its raw size plus a chunk header, so twice of the read buffer is enough.
+static const ULONG kTraceFilepEncodeBufferSize = kTraceFilepReadBufferSize * 2;
+
+// A number of kTraceChunkSyscallNames entries written in one chunk
+static const ULONG kTraceFilepNamesPerChunk = 256;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+struct TraceFilepField {
+  const char *name;
+  TraceFieldKind kind;
+  USHORT offset;
+  USHORT size;  // Zero for kTraceFieldBytes to the end of a record
+};
+
+struct TraceFilepSchema {
+  TraceRecordType type;
+  const char *name;
+  const TraceFilepField *fields;
+  ULONG field_count;
+};
+
+struct TraceFilepBuffer {
+  UCHAR *data;
+  ULONG size;
+  ULONG used;
+  bool overflowed;
+};
+
+struct TraceFilepInfo {
+  HANDLE file_handle;
+  HANDLE thread_handle;
+  volatile bool thread_should_be_alive;
+  volatile bool thread_started;
+  bool names_written;
+  UCHAR *read_buffer;
+  TraceFilepBuffer chunk;  // A payload being encoded
+  TraceFilepBuffer file;   // Chunks to be written into the file
+  ULONG chunk_events;      // A number of events in the chunk
+  ULONG64 chunk_tsc;       // TSC of the first event in the chunk
+  ULONG64 dropped_events;  // Events in chunks replaced with kTraceChunkDropped
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+static KSTART_ROUTINE TraceFilepThreadRoutine;
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void TraceFilepFinalizeInfo(
+    _Inout_ TraceFilepInfo *info);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    TraceFilepWriteHeader(_Inout_ TraceFilepInfo *info);
+
+static void TraceFilepEncodeSchema(_Inout_ TraceFilepInfo *info);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void TraceFilepEncodeSyscallNames(
+    _Inout_ TraceFilepInfo *info);
+
+static void TraceFilepEncodeEvents(_Inout_ TraceFilepInfo *info,
+                                   _In_ const UCHAR *records,
+                                   _In_ ULONG size);
+
+static void TraceFilepEncodeRecord(_Inout_ TraceFilepBuffer *chunk,
+                                   _In_ const TraceFilepSchema &schema,
+                                   _In_ const TraceRecordHeader *record);
+
+static const TraceFilepSchema *TraceFilepFindSchema(_In_ ULONG type);
+
+static void TraceFilepBeginChunk(_Inout_ TraceFilepInfo *info);
+
+static void TraceFilepEndChunk(_Inout_ TraceFilepInfo *info,
+                               _In_ TraceChunkType type, _In_ ULONG processor);
+
+static bool TraceFilepAppendChunk(_Inout_ TraceFilepBuffer *file,
+                                  _In_ TraceChunkType type,
+                                  _In_ ULONG processor,
+                                  _In_reads_bytes_(size) const void *payload,
+                                  _In_ ULONG size);
+
+static void TraceFilepPutVarint(_Inout_ TraceFilepBuffer *buffer,
+                                _In_ ULONG64 value);
+
+static void TraceFilepPutBytes(_Inout_ TraceFilepBuffer *buffer,
+                               _In_reads_bytes_(size) const void *data,
+                               _In_ ULONG size);
+
+static void TraceFilepPutString(_Inout_ TraceFilepBuffer *buffer,
+                                _In_reads_(max_length) const char *string,
+                                _In_ ULONG max_length);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    TraceFilepFlush(_Inout_ TraceFilepInfo *info);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    TraceFilepWriteFile(_Inout_ TraceFilepInfo *info);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    TraceFilepSleep(_In_ LONG millisecond);
+
+#if defined(ALLOC_PRAGMA)
+#pragma alloc_text(PAGE, TraceFileInitialization)
+#pragma alloc_text(PAGE, TraceFileTermination)
+#pragma alloc_text(PAGE, TraceFilepThreadRoutine)
+#pragma alloc_text(PAGE, TraceFilepFinalizeInfo)
+#pragma alloc_text(PAGE, TraceFilepWriteHeader)
+#pragma alloc_text(PAGE, TraceFilepEncodeSyscallNames)
+#pragma alloc_text(PAGE, TraceFilepFlush)
+#pragma alloc_text(PAGE, TraceFilepWriteFile)
+#pragma alloc_text(PAGE, TraceFilepSleep)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+static const TraceFilepField kTraceFilepSyscallExitFields[] = {
+    TRACE_FILEP_FIELD(TraceSyscallExitRecord, process_id, kTraceFieldUnsigned),
+    TRACE_FILEP_FIELD(TraceSyscallExitRecord, thread_id, kTraceFieldUnsigned),
+    TRACE_FILEP_FIELD(TraceSyscallExitRecord, index, kTraceFieldUnsigned),
+    TRACE_FILEP_FIELD(TraceSyscallExitRecord, status, kTraceFieldHex),
+    TRACE_FILEP_FIELD(TraceSyscallExitRecord, duration, kTraceFieldUnsigned),
+};
+
+static const TraceFilepField kTraceFilepSyscallArgsFields[] = {
+    TRACE_FILEP_FIELD(TraceSyscallArgsRecord, process_id, kTraceFieldUnsigned),
+    TRACE_FILEP_FIELD(TraceSyscallArgsRecord, thread_id, kTraceFieldUnsigned),
+    TRACE_FILEP_FIELD(TraceSyscallArgsRecord, index, kTraceFieldUnsigned),
+    TRACE_FILEP_FIELD(TraceSyscallArgsRecord, argument_count,
+                      kTraceFieldUnsigned),
+    TRACE_FILEP_FIELD(TraceSyscallArgsRecord, field_count, kTraceFieldUnsigned),
+    TRACE_FILEP_TRAILER(TraceSyscallArgsRecord, data),
+};
+
+static const TraceFilepField kTraceFilepSamplingStateFields[] = {
+    TRACE_FILEP_FIELD(TraceSamplingStateRecord, rate, kTraceFieldUnsigned),
+    TRACE_FILEP_FIELD(TraceSamplingStateRecord, events_per_second,
+                      kTraceFieldUnsigned),
+    TRACE_FILEP_FIELD(TraceSamplingStateRecord, effective_rate,
+                      kTraceFieldUnsigned),
+    TRACE_FILEP_FIELD(TraceSamplingStateRecord, ring_fill, kTraceFieldUnsigned),
+    TRACE_FILEP_FIELD(TraceSamplingStateRecord, sampled_out,
+                      kTraceFieldUnsigned),
+    TRACE_FILEP_FIELD(TraceSamplingStateRecord, throttled, kTraceFieldUnsigned),
+    TRACE_FILEP_FIELD(TraceSamplingStateRecord, ring_dropped,
+                      kTraceFieldUnsigned),
+    TRACE_FILEP_FIELD(TraceSamplingStateRecord, args_dropped,
+                      kTraceFieldUnsigned),
+};
+
+static const TraceFilepField kTraceFilepHookFields[] = {
+    TRACE_FILEP_FIELD(TraceHookRecord, process_id, kTraceFieldUnsigned),
+    TRACE_FILEP_FIELD(TraceHookRecord, thread_id, kTraceFieldUnsigned),
+    TRACE_FILEP_FIELD(TraceHookRecord, argument, kTraceFieldHex),
+    TRACE_FILEP_FIELD(TraceHookRecord, name, kTraceFieldString),
+};
+
+static const TraceFilepField kTraceFilepVmExitFields[] = {
+    TRACE_FILEP_FIELD(TraceVmExitRecord, reason, kTraceFieldUnsigned),
+    TRACE_FILEP_FIELD(TraceVmExitRecord, guest_ip, kTraceFieldHex),
+    TRACE_FILEP_FIELD(TraceVmExitRecord, exit_qualification, kTraceFieldHex),
+};
+
+static const TraceFilepField kTraceFilepEptViolationFields[] = {
+    TRACE_FILEP_FIELD(TraceEptViolationRecord, guest_ip, kTraceFieldHex),
+    TRACE_FILEP_FIELD(TraceEptViolationRecord, physical_address,
+                      kTraceFieldHex),
+    TRACE_FILEP_FIELD(TraceEptViolationRecord, linear_address, kTraceFieldHex),
+    TRACE_FILEP_FIELD(TraceEptViolationRecord, exit_qualification,
+                      kTraceFieldHex),
+};
+
+static const TraceFilepSchema kTraceFilepSchemas[] = {
+    TRACE_FILEP_SCHEMA(kTraceRecordSyscallExit, "syscall_exit",
+                       kTraceFilepSyscallExitFields),
+    TRACE_FILEP_SCHEMA(kTraceRecordSyscallArgs, "syscall_args",
+                       kTraceFilepSyscallArgsFields),
+    TRACE_FILEP_SCHEMA(kTraceRecordSamplingState, "sampling_state",
+                       kTraceFilepSamplingStateFields),
+    TRACE_FILEP_SCHEMA(kTraceRecordHook, "hook", kTraceFilepHookFields),
+    TRACE_FILEP_SCHEMA(kTraceRecordVmExit, "vm_exit", kTraceFilepVmExitFields),
+    TRACE_FILEP_SCHEMA(kTraceRecordEptViolation, "ept_violation",
+                       kTraceFilepEptViolationFields),
+};
+
+static TraceFilepInfo g_tracefilep_info;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Creates a trace file and starts a thread writing records into it
+_Use_decl_annotations_ NTSTATUS
+TraceFileInitialization(const wchar_t *trace_file_path) {
+  PAGED_CODE()
+
+  auto &info = g_tracefilep_info;
+  info.read_buffer = static_cast<UCHAR *>(ExAllocatePoolWithTag(
+      PagedPool, kTraceFilepReadBufferSize, kHyperPlatformCommonPoolTag));
+  info.chunk.data = static_cast<UCHAR *>(ExAllocatePoolWithTag(
+      PagedPool, kTraceFilepEncodeBufferSize, kHyperPlatformCommonPoolTag));
+  info.file.data = static_cast<UCHAR *>(ExAllocatePoolWithTag(
+      PagedPool, kTraceFilepEncodeBufferSize, kHyperPlatformCommonPoolTag));
+  if (!info.read_buffer || !info.chunk.data || !info.file.data) {
+    TraceFilepFinalizeInfo(&info);
+    return STATUS_INSUFFICIENT_RESOURCES;
+  }
+  info.chunk.size = kTraceFilepEncodeBufferSize;
+  info.file.size = kTraceFilepEncodeBufferSize;
+
+  UNICODE_STRING trace_file_path_u = {};
+  RtlInitUnicodeString(&trace_file_path_u, trace_file_path);
+
+  OBJECT_ATTRIBUTES oa = {};
+  InitializeObjectAttributes(&oa, &trace_file_path_u,
+                             OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, nullptr,
+                             nullptr)
+
+  IO_STATUS_BLOCK io_status = {};
+  auto status = ZwCreateFile(
+      &info.file_handle, FILE_APPEND_DATA | SYNCHRONIZE, &oa, &io_status,
+      nullptr, FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ, FILE_OVERWRITE_IF,
+      FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE, nullptr, 0);
+  if (!NT_SUCCESS(status)) {
+    info.file_handle = nullptr;
+    TraceFilepFinalizeInfo(&info);
+    return status;
+  }
+
+  status = TraceFilepWriteHeader(&info);
+  if (!NT_SUCCESS(status)) {
+    TraceFilepFinalizeInfo(&info);
+    return status;
+  }
+
+  info.thread_should_be_alive = true;
+  status = PsCreateSystemThread(&info.thread_handle, GENERIC_ALL, nullptr,
+                                nullptr, nullptr, TraceFilepThreadRoutine,
+                                &info);
+  if (!NT_SUCCESS(status)) {
+    info.thread_handle = nullptr;
+    info.thread_should_be_alive = false;
+    TraceFilepFinalizeInfo(&info);
+    return status;
+  }
+
+  // Wait until the thread has started
+  while (!info.thread_started) {
+    TraceFilepSleep(10);
+  }
+  return status;
+}
+
+// Writes remaining records, stops the thread and closes the trace file
+_Use_decl_annotations_ void TraceFileTermination() {
+  PAGED_CODE()
+
+  TraceFilepFinalizeInfo(&g_tracefilep_info);
+}
+
+// Stops the thread and frees resources
+_Use_decl_annotations_ static void TraceFilepFinalizeInfo(
+    TraceFilepInfo *info) {
+  PAGED_CODE()
+
+  if (info->thread_handle) {
+    info->thread_should_be_alive = false;
+    ZwWaitForSingleObject(info->thread_handle, FALSE, nullptr);
+    ZwClose(info->thread_handle);
+    info->thread_handle = nullptr;
+  }
+  if (info->file_handle) {
+    ZwClose(info->file_handle);
+    info->file_handle = nullptr;
+  }
+  if (info->file.data) {
+    ExFreePoolWithTag(info->file.data, kHyperPlatformCommonPoolTag);
+    info->file.data = nullptr;
+  }
+  if (info->chunk.data) {
+    ExFreePoolWithTag(info->chunk.data, kHyperPlatformCommonPoolTag);
+    info->chunk.data = nullptr;
+  }
+  if (info->read_buffer) {
+    ExFreePoolWithTag(info->read_buffer, kHyperPlatformCommonPoolTag);
+    info->read_buffer = nullptr;
+  }
+}
+
+// Drains the rings periodically until the driver is unloaded
+_Use_decl_annotations_ static VOID TraceFilepThreadRoutine(
+    void *start_context) {
+  PAGED_CODE()
+
+  auto info = static_cast<TraceFilepInfo *>(start_context);
+  info->thread_started = true;
+  while (info->thread_should_be_alive) {
+    TraceFilepSleep(kTraceFilepFlushIntervalMsec);
+    TraceFilepFlush(info);
+  }
+  TraceFilepFlush(info);
+  PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+// Writes a file header and a schema chunk
+_Use_decl_annotations_ static NTSTATUS TraceFilepWriteHeader(
+    TraceFilepInfo *info) {
+  PAGED_CODE()
+
+  TraceFileHeader header = {};
+  RtlCopyMemory(header.magic, kTraceFileMagic, sizeof(header.magic));
+  header.version = kTraceFileVersion;
+  header.header_size = sizeof(header);
+  header.processor_count =
+      KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+  header.tsc_frequency = PerfGetTscFrequency();
+  LARGE_INTEGER system_time = {};
+  KeQuerySystemTime(&system_time);
+  header.start_time = system_time.QuadPart;
+  header.start_tsc = __rdtsc();
+
+  TraceFilepPutBytes(&info->file, &header, sizeof(header));
+  TraceFilepEncodeSchema(info);
+  return TraceFilepFlush(info);
+}
+
+// Encodes kTraceChunkSchema from kTraceFilepSchemas
+_Use_decl_annotations_ static void TraceFilepEncodeSchema(
+    TraceFilepInfo *info) {
+  TraceFilepBeginChunk(info);
+  TraceFilepPutVarint(&info->chunk, RTL_NUMBER_OF(kTraceFilepSchemas));
+  for (const auto &schema : kTraceFilepSchemas) {
+    TraceFilepPutVarint(&info->chunk, schema.type);
+    TraceFilepPutString(&info->chunk, schema.name, MAXULONG);
+    TraceFilepPutVarint(&info->chunk, schema.field_count);
+    for (auto i = 0ul; i < schema.field_count; ++i) {
+      TraceFilepPutString(&info->chunk, schema.fields[i].name, MAXULONG);
+      TraceFilepPutVarint(&info->chunk, schema.fields[i].kind);
+    }
+  }
+  TraceFilepEndChunk(info, kTraceChunkSchema, 0);
+}
+
+// Encodes kTraceChunkSyscallNames once the service table has been built
+_Use_decl_annotations_ static void TraceFilepEncodeSyscallNames(
+    TraceFilepInfo *info) {
+  PAGED_CODE()
+
+  static_assert(kTraceFilepNamesPerChunk * sizeof(SYSCALL_SERVICE_ENTRY) <=
+                    kTraceFilepReadBufferSize,
+                "Size check");
+  const auto entries =
+      reinterpret_cast<SYSCALL_SERVICE_ENTRY *>(info->read_buffer);
+  for (auto first = 0ul;; first += kTraceFilepNamesPerChunk) {
+    const auto count =
+        SyscallServiceRead(first, entries,
+                           kTraceFilepNamesPerChunk *
+                               sizeof(SYSCALL_SERVICE_ENTRY)) /
+        sizeof(SYSCALL_SERVICE_ENTRY);
+    if (!count) {
+      break;
+    }
+
+    TraceFilepBeginChunk(info);
+    TraceFilepPutVarint(&info->chunk, count);
+    for (auto i = 0ul; i < count; ++i) {
+      TraceFilepPutVarint(&info->chunk, entries[i].Index);
+      TraceFilepPutString(&info->chunk, entries[i].Name,
+                          sizeof(entries[i].Name));
+    }
+    TraceFilepEndChunk(info, kTraceChunkSyscallNames, 0);
+    info->names_written = true;
+  }
+}
+
+// Encodes records read out of the rings into kTraceChunkEvents chunks
+_Use_decl_annotations_ static void TraceFilepEncodeEvents(
+    TraceFilepInfo *info, const UCHAR *records, ULONG size) {
+  ULONG processor = MAXULONG;
+  ULONG64 previous_tsc = 0;
+  for (auto offset = 0ul; offset < size;) {
+    const auto record =
+        reinterpret_cast<const TraceRecordHeader *>(records + offset);
+    offset += record->size;
+
+    // TraceRead() copies a ring after another, so a new chunk starts only when
+    // a processor changes
+    if (record->processor != processor) {
+      if (processor != MAXULONG) {
+        TraceFilepEndChunk(info, kTraceChunkEvents, processor);
+      }
+      processor = record->processor;
+      previous_tsc = record->tsc;
+      TraceFilepBeginChunk(info);
+      TraceFilepPutVarint(&info->chunk, previous_tsc);
+      info->chunk_tsc = previous_tsc;
+    }
+
+    const auto schema = TraceFilepFindSchema(record->type);
+    if (!schema) {
+      continue;
+    }
+    ++info->chunk_events;
+
+    // A delta may be negative; see trace_format.h
+    const auto delta = static_cast<LONG64>(record->tsc - previous_tsc);
+    previous_tsc = record->tsc;
+    TraceFilepPutVarint(&info->chunk, record->type);
+    TraceFilepPutVarint(&info->chunk, (static_cast<ULONG64>(delta) << 1) ^
+                                          static_cast<ULONG64>(delta >> 63));
+    TraceFilepEncodeRecord(&info->chunk, *schema, record);
+  }
+  if (processor != MAXULONG) {
+    TraceFilepEndChunk(info, kTraceChunkEvents, processor);
+  }
+}
+
+// Encodes fields of a record according to its schema
+_Use_decl_annotations_ static void TraceFilepEncodeRecord(
+    TraceFilepBuffer *chunk, const TraceFilepSchema &schema,
+    const TraceRecordHeader *record) {
+  const auto base = reinterpret_cast<const UCHAR *>(record);
+  for (auto i = 0ul; i < schema.field_count; ++i) {
+    const auto &field = schema.fields[i];
+    const auto data = base + field.offset;
+    switch (field.kind) {
+      case kTraceFieldString:
+        TraceFilepPutString(chunk, reinterpret_cast<const char *>(data),
+                            field.size);
+        break;
+      case kTraceFieldBytes: {
+        const ULONG length =
+            (field.offset < record->size) ? record->size - field.offset : 0;
+        TraceFilepPutVarint(chunk, length);
+        TraceFilepPutBytes(chunk, data, length);
+        break;
+      }
+      default: {
+        ULONG64 value = 0;
+        RtlCopyMemory(&value, data, field.size);
+        if (field.kind == kTraceFieldSigned) {
+          // Sign-extends and zigzag-encodes
+          const auto shift = 64 - field.size * 8;
+          const auto signed_value =
+              static_cast<LONG64>(value << shift) >> shift;
+          value = (static_cast<ULONG64>(signed_value) << 1) ^
+                  static_cast<ULONG64>(signed_value >> 63);
+        }
+        TraceFilepPutVarint(chunk, value);
+        break;
+      }
+    }
+  }
+}
+
+// Returns a schema of a record type, or nullptr if none
+_Use_decl_annotations_ static const TraceFilepSchema *TraceFilepFindSchema(
+    ULONG type) {
+  for (const auto &schema : kTraceFilepSchemas) {
+    if (schema.type == type) {
+      return &schema;
+    }
+  }
+  return nullptr;
+}
+
+// Starts encoding a chunk payload
+_Use_decl_annotations_ static void TraceFilepBeginChunk(TraceFilepInfo *info) {
+  info->chunk.used = 0;
+  info->chunk.overflowed = false;
+  info->chunk_events = 0;
+  info->chunk_tsc = 0;
+}
+
+// Appends an encoded chunk to the file buffer. When the chunk does not fit,
+// writes the file buffer out and retries, and if it still cannot be stored,
+// appends kTraceChunkDropped in place of it.
+_Use_decl_annotations_ static void TraceFilepEndChunk(TraceFilepInfo *info,
+                                                      TraceChunkType type,
+                                                      ULONG processor) {
+  if (!info->chunk.overflowed) {
+    if (TraceFilepAppendChunk(&info->file, type, processor, info->chunk.data,
+                              info->chunk.used)) {
+      return;
+    }
+    TraceFilepWriteFile(info);
+    if (TraceFilepAppendChunk(&info->file, type, processor, info->chunk.data,
+                              info->chunk.used)) {
+      return;
+    }
+  }
+
+  info->dropped_events += info->chunk_events;
+  UCHAR payload[kTraceFileMaxVarintSize * 3];
+  TraceFilepBuffer dropped = {payload, sizeof(payload), 0, false};
+  TraceFilepPutVarint(&dropped, type);
+  TraceFilepPutVarint(&dropped, info->chunk_events);
+  TraceFilepPutVarint(&dropped, info->chunk_tsc);
+  if (!TraceFilepAppendChunk(&info->file, kTraceChunkDropped, processor,
+                             dropped.data, dropped.used)) {
+    // Always fits in the emptied buffer
+    TraceFilepWriteFile(info);
+    TraceFilepAppendChunk(&info->file, kTraceChunkDropped, processor,
+                          dropped.data, dropped.used);
+  }
+}
+
+// Appends a chunk to a buffer as a whole, or leaves the buffer unchanged and
+// returns false if it does not fit
+_Use_decl_annotations_ static bool TraceFilepAppendChunk(
+    TraceFilepBuffer *file, TraceChunkType type, ULONG processor,
+    const void *payload, ULONG size) {
+  const auto used = file->used;
+  TraceFilepPutVarint(file, type);
+  TraceFilepPutVarint(file, processor);
+  TraceFilepPutVarint(file, size);
+  TraceFilepPutBytes(file, payload, size);
+  if (file->overflowed) {
+    file->used = used;
+    file->overflowed = false;
+    return false;
+  }
+  return true;
+}
+
+// Appends an unsigned LEB128 varint
+_Use_decl_annotations_ static void TraceFilepPutVarint(TraceFilepBuffer *buffer,
+                                                       ULONG64 value) {
+  UCHAR encoded[kTraceFileMaxVarintSize];
+  auto length = 0ul;
+  do {
+    encoded[length] = static_cast<UCHAR>(value & 0x7f);
+    value >>= 7;
+    if (value) {
+      encoded[length] |= 0x80;
+    }
+    ++length;
+  } while (value);
+  TraceFilepPutBytes(buffer, encoded, length);
+}
+
+// Appends raw bytes
+_Use_decl_annotations_ static void TraceFilepPutBytes(TraceFilepBuffer *buffer,
+                                                      const void *data,
+                                                      ULONG size) {
+  if (buffer->overflowed || buffer->used + size > buffer->size) {
+    buffer->overflowed = true;
+    return;
+  }
+  RtlCopyMemory(buffer->data + buffer->used, data, size);
+  buffer->used += size;
+}
+
+// Appends a string that is either null-terminated or max_length long
+_Use_decl_annotations_ static void TraceFilepPutString(TraceFilepBuffer *buffer,
+                                                       const char *string,
+                                                       ULONG max_length) {
+  auto length = 0ul;
+  while (length < max_length && string[length]) {
+    ++length;
+  }
+  TraceFilepPutVarint(buffer, length);
+  TraceFilepPutBytes(buffer, string, length);
+}
+
+// Reads records out of the rings, encodes and writes them into the file
+_Use_decl_annotations_ static NTSTATUS TraceFilepFlush(TraceFilepInfo *info) {
+  PAGED_CODE()
+
+  if (!info->names_written) {
+    TraceFilepEncodeSyscallNames(info);
+  }
+  auto status = TraceFilepWriteFile(info);
+
+  for (;;) {
+    const auto size = TraceRead(info->read_buffer, kTraceFilepReadBufferSize);
+    TraceFilepEncodeEvents(info, info->read_buffer, size);
+    status = TraceFilepWriteFile(info);
+
+    // Stop when the rings have been drained
+    if (size + kTraceRecordMaxSize <= kTraceFilepReadBufferSize) {
+      break;
+    }
+  }
+  return status;
+}
+
+// Writes encoded chunks into the file
+_Use_decl_annotations_ static NTSTATUS TraceFilepWriteFile(
+    TraceFilepInfo *info) {
+  PAGED_CODE()
+
+  if (!info->file.used) {
+    return STATUS_SUCCESS;
+  }
+  IO_STATUS_BLOCK io_status = {};
+  const auto status =
+      ZwWriteFile(info->file_handle, nullptr, nullptr, nullptr, &io_status,
+                  info->file.data, info->file.used, nullptr, nullptr);
+  info->file.used = 0;
+  info->file.overflowed = false;
+  return status;
+}
+
+// Sleep the current thread's execution for milliseconds.
+_Use_decl_annotations_ static NTSTATUS TraceFilepSleep(LONG millisecond) {
+  PAGED_CODE()
+
+  LARGE_INTEGER interval = {};
+  interval.QuadPart = -(10000ll * millisecond);  // msec
+  return KeDelayExecutionThread(KernelMode, FALSE, &interval);
+}
+
+}  // extern "C"
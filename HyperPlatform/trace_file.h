@@ -0,0 +1,61 @@
+// Copyright (c) 2015-2019, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Declares interfaces to the trace file writer.
+///
+/// The writer drains the trace rings on a system thread and stores records in
+/// the format defined in trace_format.h. While it runs, it is the only reader
+/// of the rings and IOCTL_HYPER_TRACE_READ returns nothing. While the shared
+/// ring is mapped in kSharedRingModeExclusive, the rings and so the file get no
+/// records.
+
+#ifndef HYPERPLATFORM_TRACE_FILE_H_
+#define HYPERPLATFORM_TRACE_FILE_H_
+
+#include <ntddk.h>
+
+extern "C" {
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+/// Creates a trace file and starts a thread writing records into it
+/// @param trace_file_path   A path to the trace file; overwritten if exists
+/// @return STATUS_SUCCESS on success
+_IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS
+    TraceFileInitialization(_In_ const wchar_t *trace_file_path);
+
+/// Writes remaining records, stops the thread and closes the trace file
+_IRQL_requires_max_(PASSIVE_LEVEL) void TraceFileTermination();
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+}  // extern "C"
+
+#endif  // HYPERPLATFORM_TRACE_FILE_H_
@@ -0,0 +1,110 @@
+// Copyright (c) 2015-2019, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Defines the binary trace file format.
+///
+/// This header has no dependencies so that it is shared by the driver and the
+/// TraceDecoder tool.
+///
+/// A file starts with TraceFileHeader and is followed by chunks until the end
+/// of the file. Every chunk is encoded as:
+/// @code
+/// varint chunk_type, varint processor, varint payload_size, payload
+/// @endcode
+/// A decoder skips chunks of types it does not know by payload_size.
+///
+/// All integers in payloads are unsigned LEB128 varints, and signed ones are
+/// zigzag encoded before that. A string is a varint length followed by bytes.
+///
+/// kTraceChunkSchema describes every event type:
+/// @code
+/// varint type_count
+///   varint event_type, string name, varint field_count
+///     string field_name, varint TraceFieldKind
+/// @endcode
+///
+/// kTraceChunkEvents holds events of a single processor in reservation order:
+/// @code
+/// varint base_tsc
+///   varint event_type, zigzag varint tsc_delta, fields as described by the
+///   schema
+/// @endcode
+/// tsc_delta is from the previous event of the chunk, or from base_tsc for the
+/// first one. It can be negative because a writer may be preempted between
+/// reserving a record and reading TSC.
+///
+/// kTraceChunkSyscallNames maps SSDT indexes to service names:
+/// @code
+/// varint count
+///   varint index, string name
+/// @endcode
+///
+/// kTraceChunkDropped replaces a chunk the writer could not store:
+/// @code
+/// varint chunk_type, varint event_count, varint base_tsc
+/// @endcode
+/// chunk_type is a type of the lost chunk, and event_count and base_tsc are a
+/// number of events in it and TSC of the first one, or zero if it was not
+/// kTraceChunkEvents. The chunk's processor is that of the lost chunk.
+
+#ifndef HYPERPLATFORM_TRACE_FORMAT_H_
+#define HYPERPLATFORM_TRACE_FORMAT_H_
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+/// The first bytes of a trace file
+static const char kTraceFileMagic[8] = {'H', 'P', 'T', 'R', 'A', 'C', 'E', 0};
+
+/// A version of the format. Bumped on incompatible changes.
+static const unsigned short kTraceFileVersion = 1;
+
+/// The largest possible encoding of a 64-bit varint
+static const unsigned int kTraceFileMaxVarintSize = 10;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+/// Types of chunks
+enum TraceChunkType : unsigned int {
+  kTraceChunkSchema = 1,        //!< Field names of event types
+  kTraceChunkEvents = 2,        //!< Events of a single processor
+  kTraceChunkSyscallNames = 3,  //!< SSDT index to name table
+  kTraceChunkDropped = 4,       //!< A chunk lost by the writer
+};
+
+/// Kinds of fields in kTraceChunkSchema
+enum TraceFieldKind : unsigned int {
+  kTraceFieldUnsigned = 1,  //!< varint
+  kTraceFieldSigned = 2,    //!< zigzag varint
+  kTraceFieldHex = 3,       //!< varint shown in hex
+  kTraceFieldString = 4,    //!< string
+  kTraceFieldBytes = 5,     //!< varint length followed by raw bytes
+};
+
+/// The header of a trace file. All fields are little endian.
+#pragma pack(push, 1)
+struct TraceFileHeader {
+  char magic[8];                     //!< kTraceFileMagic
+  unsigned short version;            //!< kTraceFileVersion
+  unsigned short header_size;        //!< sizeof(TraceFileHeader)
+  unsigned int processor_count;      //!< A number of processors traced
+  unsigned long long tsc_frequency;  //!< TSC ticks per second; 0 if unknown
+  unsigned long long start_time;     //!< System time when tracing started
+  unsigned long long start_tsc;      //!< TSC when tracing started
+};
+#pragma pack(pop)
+static_assert(sizeof(TraceFileHeader) == 40, "Size check");
+
+#endif  // HYPERPLATFORM_TRACE_FORMAT_H_
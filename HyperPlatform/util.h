@@ -70,7 +70,9 @@ enum class HypercallNumber : unsigned __int32 {
   kTerminateVmm = kMinimumHypercallNumber,  //!< Terminates VMM
   kPingVmm,                                 //!< Sends ping to the VMM
   kGetSharedProcessorData,                  //!< Returns shared processor data
-  kMaximumHypercallNumber = kGetSharedProcessorData,
+  kGetPerfSnapshot,                         //!< Copies performance data
+  kUpdateExitingControls,                   //!< Changes exiting controls
+  kMaximumHypercallNumber = kUpdateExitingControls,
 };
 
 ////////////////////////////////////////////////////////////////////////////////
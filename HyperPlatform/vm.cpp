@@ -12,6 +12,8 @@
 #include "common.h"
 #include "ept.h"
 #include "log.h"
+#include "msr_policy.h"
+#include "performance.h"
 #include "util.h"
 #include "vmm.h"
 #include "settings.h"
@@ -27,6 +29,16 @@ extern "C" {
 // constants and macros
 //
 
+// VM-exit reasons AsmVmmFastEntryPoint handles without VmmVmExitHandler().
+// Those VM-exits are not measured, traced nor recorded. Set 0 to handle all
+// VM-exits in VmmVmExitHandler().
+static const ULONG64 kVmpFastExitReasons =
+    1ull << static_cast<ULONG>(VmxExitReason::kCpuid) |
+    1ull << static_cast<ULONG>(VmxExitReason::kRdtsc) |
+    1ull << static_cast<ULONG>(VmxExitReason::kVmcall) |
+    1ull << static_cast<ULONG>(VmxExitReason::kRdtscp) |
+    1ull << static_cast<ULONG>(VmxExitReason::kXsetbv);
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // types
@@ -97,6 +109,20 @@ _IRQL_requires_max_(PASSIVE_LEVEL) static void VmpFreeSharedData(
 
 _IRQL_requires_max_(PASSIVE_LEVEL) static bool VmpIsHyperPlatformInstalled();
 
+_IRQL_requires_max_(PASSIVE_LEVEL) static VmExitingControls
+    VmpGetRequestedExitingControls();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static VmExitingControls
+    VmpGetSwitchableExitingControls();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static VmExitingControls
+    VmpAdjustExitingControls(_In_ const VmExitingControls &controls);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS VmpApplyExitingControls();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    VmpUpdateExitingControlsCallback(_In_opt_ void *context);
+
 #if defined(ALLOC_PRAGMA)
 #pragma alloc_text(PAGE, VmInitialization)
 #pragma alloc_text(PAGE, VmTermination)
@@ -121,6 +147,15 @@ _IRQL_requires_max_(PASSIVE_LEVEL) static bool VmpIsHyperPlatformInstalled();
 #pragma alloc_text(PAGE, VmpFreeSharedData)
 #pragma alloc_text(PAGE, VmpIsHyperPlatformInstalled)
 #pragma alloc_text(PAGE, VmHotplugCallback)
+#pragma alloc_text(PAGE, VmSubscribeCr3LoadExiting)
+#pragma alloc_text(PAGE, VmUnsubscribeCr3LoadExiting)
+#pragma alloc_text(PAGE, VmGetExitingControls)
+#pragma alloc_text(PAGE, VmUpdateExitingControls)
+#pragma alloc_text(PAGE, VmpGetRequestedExitingControls)
+#pragma alloc_text(PAGE, VmpGetSwitchableExitingControls)
+#pragma alloc_text(PAGE, VmpAdjustExitingControls)
+#pragma alloc_text(PAGE, VmpApplyExitingControls)
+#pragma alloc_text(PAGE, VmpUpdateExitingControlsCallback)
 #endif
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -128,6 +163,15 @@ _IRQL_requires_max_(PASSIVE_LEVEL) static bool VmpIsHyperPlatformInstalled();
 // variables
 //
 
+// Serializes changes of exiting controls
+static FAST_MUTEX g_vmp_exiting_controls_mutex;
+
+// Exiting controls requested through VmUpdateExitingControls()
+static VmExitingControls g_vmp_exiting_controls;
+
+// A number of consumers of CR3-load exiting
+static ULONG g_vmp_cr3_load_exiting_subscribers;
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // implementations
@@ -152,6 +196,15 @@ _Use_decl_annotations_ NTSTATUS VmInitialization() {
     return STATUS_HV_FEATURE_UNAVAILABLE;
   }
 
+  // Default exiting controls; VmUpdateExitingControls() changes them later
+  ExInitializeFastMutex(&g_vmp_exiting_controls_mutex);
+  VmxProcessorBasedControls vm_procctl = {};
+  vm_procctl.fields.mov_dr_exiting = true; //读写dr寄存器 vm-exit
+  VmxSecondaryProcessorBasedControls vm_procctl2 = {};
+  vm_procctl2.fields.descriptor_table_exiting = true;
+  g_vmp_exiting_controls = {vm_procctl.all, vm_procctl2.all, 0};
+  g_vmp_cr3_load_exiting_subscribers = 0;
+
   //
   //初始化所有核心共用的data
   //
@@ -282,36 +335,8 @@ _Use_decl_annotations_ static void *VmpBuildMsrBitmap() {
   }
   RtlZeroMemory(msr_bitmap, PAGE_SIZE);
 
-  // Activate VM-exit for RDMSR against all MSRs
-  const auto bitmap_read_low = static_cast<UCHAR *>(msr_bitmap);
-  const auto bitmap_read_high = bitmap_read_low + 1024;
-  RtlFillMemory(bitmap_read_low, 1024, 0xff);   // read        0 -     1fff
-  RtlFillMemory(bitmap_read_high, 1024, 0xff);  // read c0000000 - c0001fff
-
-  // Ignore IA32_MPERF (000000e7) and IA32_APERF (000000e8)
-  RTL_BITMAP bitmap_read_low_header = {};
-  RtlInitializeBitMap(&bitmap_read_low_header,
-                      reinterpret_cast<PULONG>(bitmap_read_low), 1024 * 8);
-  RtlClearBits(&bitmap_read_low_header, 0xe7, 2);
-
-  // Checks MSRs that cause #GP from 0 to 0xfff, and ignore all of them
-  for (auto msr = 0ul; msr < 0x1000; ++msr) {
-    __try {
-      UtilReadMsr(static_cast<Msr>(msr));
-
-#pragma prefast(suppress : __WARNING_EXCEPTIONEXECUTEHANDLER, "Catch all.");
-    } __except (EXCEPTION_EXECUTE_HANDLER) {
-      RtlClearBits(&bitmap_read_low_header, msr, 1);
-    }
-  }
-
-  // Ignore IA32_GS_BASE (c0000101) and IA32_KERNEL_GS_BASE (c0000102)
-  RTL_BITMAP bitmap_read_high_header = {};
-  RtlInitializeBitMap(&bitmap_read_high_header,
-                      reinterpret_cast<PULONG>(bitmap_read_high),
-                      1024 * CHAR_BIT);
-  RtlClearBits(&bitmap_read_high_header, 0x101, 2);
-
+  // Activate VM-exit only for MSRs the policy table traps
+  MsrPolicyBuildBitmap(msr_bitmap);
   return msr_bitmap;
 }
 
@@ -428,6 +453,14 @@ _Use_decl_annotations_ static void VmpInitializeVm(
   }
   RtlZeroMemory(processor_data->vmxon_region, kVmxMaxVmcsSize);
 
+  // Let AsmVmmEntryPoint and VmmVmExitHandler() profile VM-exits if enabled
+  processor_data->exit_profile =
+      PerfGetExitProfile(KeGetCurrentProcessorNumberEx(nullptr));
+
+  // Leave all VM-exits to VmmVmExitHandler() while they are profiled
+  processor_data->fast_exit_reasons =
+      (processor_data->exit_profile) ? 0 : kVmpFastExitReasons;
+
   //将processor_data放在vmmstack的开始处，这样vm-exit的时候可以直接获取
   // Initialize stack memory for VMM looks like this:
   //
@@ -656,10 +689,10 @@ _Use_decl_annotations_ static bool VmpSetupVmcs(
                                             : Msr::kIa32VmxPinbasedCtls,
                             vm_pinctl_requested.all)};
 
-  VmxProcessorBasedControls vm_procctl_requested = {};
-  vm_procctl_requested.fields.rdtsc_exiting = false;//接管rdtsc?
-  vm_procctl_requested.fields.cr3_load_exiting = true; //mov cr3,x vm-exit
-  vm_procctl_requested.fields.mov_dr_exiting = true; //读写dr寄存器 vm-exit
+  // rdtsc, mov cr3 and mov dr exiting etc are switched at runtime
+  const auto exiting_controls = VmpGetRequestedExitingControls();
+
+  VmxProcessorBasedControls vm_procctl_requested = {exiting_controls.procctl};
   vm_procctl_requested.fields.use_io_bitmaps = true; //默认使用io bitmap
   vm_procctl_requested.fields.use_msr_bitmaps = true;//默认使用msr bitmap
   vm_procctl_requested.fields.activate_secondary_control = true;
@@ -668,9 +701,9 @@ _Use_decl_annotations_ static bool VmpSetupVmcs(
                                             : Msr::kIa32VmxProcBasedCtls,
                             vm_procctl_requested.all)};
 
-  VmxSecondaryProcessorBasedControls vm_procctl2_requested = {};
+  VmxSecondaryProcessorBasedControls vm_procctl2_requested = {
+      exiting_controls.procctl2};
   vm_procctl2_requested.fields.enable_ept = true; //开启EPT
-  vm_procctl2_requested.fields.descriptor_table_exiting = true; 
   vm_procctl2_requested.fields.enable_rdtscp = true; 
   vm_procctl2_requested.fields.enable_vpid = true; 
   vm_procctl2_requested.fields.enable_invpcid = true;
@@ -689,12 +722,8 @@ _Use_decl_annotations_ static bool VmpSetupVmcs(
   HYPERPLATFORM_LOG_DEBUG("SecondaryProcessorBasedControls  = %08x",
                           vm_procctl2.all);
 
-  // NOTE: Comment in any of those as needed
-  const auto exception_bitmap =
-      //1 << InterruptionVector::kBreakpointException |
-      // 1 << InterruptionVector::kGeneralProtectionException |
-      // 1 << InterruptionVector::kPageFaultException |
-      0;
+  // NOTE: #BP, #GP and #PF can be enabled with VmUpdateExitingControls()
+  const auto exception_bitmap = exiting_controls.exception_bitmap;
 
   // Set up CR0 and CR4 bitmaps
   // - Where a bit is     masked, the shadow bit appears
@@ -848,7 +877,7 @@ _Use_decl_annotations_ static bool VmpSetupVmcs(
   error |= UtilVmWrite(VmcsField::kHostIa32SysenterEsp, UtilReadMsr(Msr::kIa32SysenterEsp));
   error |= UtilVmWrite(VmcsField::kHostIa32SysenterEip, UtilReadMsr(Msr::kIa32SysenterEip));
   error |= UtilVmWrite(VmcsField::kHostRsp, vmm_stack_pointer);
-  error |= UtilVmWrite(VmcsField::kHostRip, reinterpret_cast<ULONG_PTR>(AsmVmmEntryPoint));
+  error |= UtilVmWrite(VmcsField::kHostRip, reinterpret_cast<ULONG_PTR>(AsmVmmFastEntryPoint));
   // clang-format on
 
   const auto vmx_status = static_cast<VmxStatus>(error);
@@ -1108,4 +1137,178 @@ VmHotplugCallback(const PROCESSOR_NUMBER &proc_num) {
   return status;
 }
 
+// Enables CR3-load exiting on all processors for the first consumer
+_Use_decl_annotations_ NTSTATUS VmSubscribeCr3LoadExiting() {
+  PAGED_CODE()
+
+  auto status = STATUS_SUCCESS;
+  ExAcquireFastMutex(&g_vmp_exiting_controls_mutex);
+  g_vmp_cr3_load_exiting_subscribers++;
+  if (g_vmp_cr3_load_exiting_subscribers == 1) {
+    status = VmpApplyExitingControls();
+    if (!NT_SUCCESS(status)) {
+      g_vmp_cr3_load_exiting_subscribers--;
+      VmpApplyExitingControls();
+    }
+  }
+  ExReleaseFastMutex(&g_vmp_exiting_controls_mutex);
+  return status;
+}
+
+// Disables CR3-load exiting on all processors after the last consumer
+_Use_decl_annotations_ void VmUnsubscribeCr3LoadExiting() {
+  PAGED_CODE()
+
+  ExAcquireFastMutex(&g_vmp_exiting_controls_mutex);
+  NT_ASSERT(g_vmp_cr3_load_exiting_subscribers);
+  g_vmp_cr3_load_exiting_subscribers--;
+  if (g_vmp_cr3_load_exiting_subscribers == 0) {
+    VmpApplyExitingControls();
+  }
+  ExReleaseFastMutex(&g_vmp_exiting_controls_mutex);
+}
+
+// Returns exiting controls that can be changed and those in effect
+_Use_decl_annotations_ void VmGetExitingControls(
+    VmExitingControls *switchable, VmExitingControls *current) {
+  PAGED_CODE()
+
+  const auto mask = VmpGetSwitchableExitingControls();
+  if (switchable) {
+    *switchable = mask;
+  }
+  if (current) {
+    ExAcquireFastMutex(&g_vmp_exiting_controls_mutex);
+    const auto controls =
+        VmpAdjustExitingControls(VmpGetRequestedExitingControls());
+    ExReleaseFastMutex(&g_vmp_exiting_controls_mutex);
+    current->procctl = controls.procctl & mask.procctl;
+    current->procctl2 = controls.procctl2 & mask.procctl2;
+    current->exception_bitmap =
+        controls.exception_bitmap & mask.exception_bitmap;
+  }
+}
+
+// Changes exiting controls on all processors
+_Use_decl_annotations_ NTSTATUS
+VmUpdateExitingControls(const VmExitingControlsUpdate *update) {
+  PAGED_CODE()
+
+  const auto mask = VmpGetSwitchableExitingControls();
+  if (((update->set.procctl | update->clear.procctl) & ~mask.procctl) ||
+      ((update->set.procctl2 | update->clear.procctl2) & ~mask.procctl2) ||
+      ((update->set.exception_bitmap | update->clear.exception_bitmap) &
+       ~mask.exception_bitmap)) {
+    return STATUS_INVALID_PARAMETER;
+  }
+
+  ExAcquireFastMutex(&g_vmp_exiting_controls_mutex);
+  const auto previous = g_vmp_exiting_controls;
+  auto requested = previous;
+  requested.procctl |= update->set.procctl;
+  requested.procctl &= ~update->clear.procctl;
+  requested.procctl2 |= update->set.procctl2;
+  requested.procctl2 &= ~update->clear.procctl2;
+  requested.exception_bitmap |= update->set.exception_bitmap;
+  requested.exception_bitmap &= ~update->clear.exception_bitmap;
+
+  // Reject a change the processor forces back
+  auto status = STATUS_SUCCESS;
+  const auto adjusted = VmpAdjustExitingControls(requested);
+  if (((adjusted.procctl ^ requested.procctl) & mask.procctl) ||
+      ((adjusted.procctl2 ^ requested.procctl2) & mask.procctl2)) {
+    status = STATUS_NOT_SUPPORTED;
+  } else {
+    g_vmp_exiting_controls = requested;
+    status = VmpApplyExitingControls();
+    if (!NT_SUCCESS(status)) {
+      g_vmp_exiting_controls = previous;
+      VmpApplyExitingControls();
+    }
+  }
+  ExReleaseFastMutex(&g_vmp_exiting_controls_mutex);
+  return status;
+}
+
+// Returns exiting controls requested through VmUpdateExitingControls() and
+// subscriptions of CR3-load exiting
+_Use_decl_annotations_ static VmExitingControls
+VmpGetRequestedExitingControls() {
+  PAGED_CODE()
+
+  auto controls = g_vmp_exiting_controls;
+  if (g_vmp_cr3_load_exiting_subscribers) {
+    VmxProcessorBasedControls vm_procctl = {controls.procctl};
+    vm_procctl.fields.cr3_load_exiting = true;
+    controls.procctl = vm_procctl.all;
+  }
+  return controls;
+}
+
+// Returns exiting controls whose VM-exits the VMM handles
+_Use_decl_annotations_ static VmExitingControls
+VmpGetSwitchableExitingControls() {
+  PAGED_CODE()
+
+  VmxProcessorBasedControls vm_procctl = {};
+  vm_procctl.fields.invlpg_exiting = true;
+  vm_procctl.fields.rdtsc_exiting = true;
+  vm_procctl.fields.cr3_load_exiting = true;
+  vm_procctl.fields.cr3_store_exiting = true;
+  vm_procctl.fields.cr8_load_exiting = true;
+  vm_procctl.fields.cr8_store_exiting = true;
+  vm_procctl.fields.mov_dr_exiting = true;
+
+  VmxSecondaryProcessorBasedControls vm_procctl2 = {};
+  vm_procctl2.fields.descriptor_table_exiting = true;
+
+  // Exceptions VmmpHandleException() handles
+  const auto exception_bitmap =
+      1ul << static_cast<ULONG>(InterruptionVector::kBreakpointException) |
+      1ul << static_cast<ULONG>(
+          InterruptionVector::kGeneralProtectionException) |
+      1ul << static_cast<ULONG>(InterruptionVector::kPageFaultException);
+  return {vm_procctl.all, vm_procctl2.all, exception_bitmap};
+}
+
+// Applies capabilities of the processor to exiting controls
+_Use_decl_annotations_ static VmExitingControls VmpAdjustExitingControls(
+    const VmExitingControls &controls) {
+  PAGED_CODE()
+
+  // See: Algorithms for Determining VMX Capabilities
+  const auto use_true_msrs = Ia32VmxBasicMsr{UtilReadMsr64(Msr::kIa32VmxBasic)}
+                                 .fields.vmx_capability_hint;
+  return {
+      VmpAdjustControlValue((use_true_msrs) ? Msr::kIa32VmxTrueProcBasedCtls
+                                            : Msr::kIa32VmxProcBasedCtls,
+                            controls.procctl),
+      VmpAdjustControlValue(Msr::kIa32VmxProcBasedCtls2, controls.procctl2),
+      controls.exception_bitmap};
+}
+
+// Applies requested exiting controls to all processors
+_Use_decl_annotations_ static NTSTATUS VmpApplyExitingControls() {
+  PAGED_CODE()
+
+  const auto mask = VmpGetSwitchableExitingControls();
+  const auto controls =
+      VmpAdjustExitingControls(VmpGetRequestedExitingControls());
+  VmExitingControlsUpdate update = {
+      {controls.procctl & mask.procctl, controls.procctl2 & mask.procctl2,
+       controls.exception_bitmap & mask.exception_bitmap},
+      {~controls.procctl & mask.procctl, ~controls.procctl2 & mask.procctl2,
+       ~controls.exception_bitmap & mask.exception_bitmap},
+  };
+  return UtilForEachProcessor(VmpUpdateExitingControlsCallback, &update);
+}
+
+// Changes exiting controls of the current processor through a hypercall
+_Use_decl_annotations_ static NTSTATUS VmpUpdateExitingControlsCallback(
+    void *context) {
+  PAGED_CODE()
+
+  return UtilVmCall(HypercallNumber::kUpdateExitingControls, context);
+}
+
 }  // extern "C"
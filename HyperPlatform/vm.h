@@ -26,6 +26,20 @@ extern "C" {
 // types
 //
 
+/// VM-execution controls that can be changed while the VMM runs
+struct VmExitingControls {
+  ULONG32 procctl;           //!< VmxProcessorBasedControls
+  ULONG32 procctl2;          //!< VmxSecondaryProcessorBasedControls
+  ULONG32 exception_bitmap;  //!< A bit per InterruptionVector
+};
+
+/// A change of VM-execution controls; also a context of
+/// HypercallNumber::kUpdateExitingControls
+struct VmExitingControlsUpdate {
+  VmExitingControls set;    //!< Bits to set
+  VmExitingControls clear;  //!< Bits to clear
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // prototypes
@@ -51,6 +65,36 @@ _IRQL_requires_max_(PASSIVE_LEVEL) void VmTermination();
 _IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS
     VmHotplugCallback(const PROCESSOR_NUMBER& proc_num);
 
+/// Enables VM-exit on MOV to CR3 on all processors
+/// @return STATUS_SUCCESS on success
+///
+/// CR3-load exiting is off unless at least one consumer subscribes to it, as
+/// it costs a VM-exit on every context switch between processes. Each
+/// successful call must be paired with VmUnsubscribeCr3LoadExiting().
+_IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS VmSubscribeCr3LoadExiting();
+
+/// Disables VM-exit on MOV to CR3 once the last consumer unsubscribes
+_IRQL_requires_max_(PASSIVE_LEVEL) void VmUnsubscribeCr3LoadExiting();
+
+/// Returns VM-execution controls that VmUpdateExitingControls() can change
+/// @param switchable   Receives bits that can be changed
+/// @param current   Receives bits currently in effect on processors
+_IRQL_requires_max_(PASSIVE_LEVEL) void VmGetExitingControls(
+    _Out_opt_ VmExitingControls *switchable,
+    _Out_opt_ VmExitingControls *current);
+
+/// Changes VM-execution controls on all processors
+/// @param update   Bits to set and clear
+/// @return STATUS_SUCCESS on success
+///
+/// Only exiting controls the VMM handles can be changed: INVLPG, RDTSC, CR3
+/// and CR8 load and store, and MOV-DR exiting, descriptor-table exiting, and
+/// #BP, #GP and #PF of the exception bitmap. Fails with STATUS_NOT_SUPPORTED
+/// when the processor does not allow the change. CR3-load exiting also stays
+/// on while consumers subscribe to it.
+_IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS
+    VmUpdateExitingControls(_In_ const VmExitingControlsUpdate *update);
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // variables
@@ -11,9 +11,12 @@
 #include "common.h"
 #include "ept.h"
 #include "log.h"
+#include "msr_policy.h"
 #include "util.h"
 #include "performance.h"
 #include "settings.h"
+#include "trace.h"
+#include "vm.h"
 
 #define MAX_SUPPORT_PROCESS 100
 
@@ -40,6 +43,9 @@ NTSYSAPI const char *PsGetProcessImageFileName(PEPROCESS Process);
 // Whether VM-exit recording is enabled
 static const bool kVmmpEnableRecordVmExit = false;
 
+// Whether VM-exits are emitted into the trace as TraceVmExitRecord
+static const bool kVmmpEnableTraceVmExit = false;
+
 // How many events should be recorded per a processor
 static const long kVmmpNumberOfRecords = 100;
 
@@ -57,6 +63,21 @@ struct VmmInitialStack {
   KtrapFrame trap_frame;
   ProcessorData *processor_data;
 };
+#if defined(_AMD64_) && !defined(__clang__)
+// AsmVmmEntryPoint reads processor_data->exit_profile->resume_tsc with them
+static_assert(FIELD_OFFSET(VmmInitialStack, processor_data) == 0x210,
+              "Offset check");
+static_assert(FIELD_OFFSET(ProcessorData, exit_profile) == 0x28,
+              "Offset check");
+// AsmVmmFastEntryPoint reads processor_data->fast_exit_reasons with them
+static_assert(FIELD_OFFSET(VmmInitialStack, processor_data) -
+                      sizeof(GpRegisters) -
+                      (sizeof(KtrapFrame) - sizeof(MachineFrame)) ==
+                  0x28,
+              "Offset check");
+static_assert(FIELD_OFFSET(ProcessorData, fast_exit_reasons) == 0x30,
+              "Offset check");
+#endif
 
 // Things need to be read and written by each VM-exit handler
 struct GuestContext {
@@ -95,13 +116,17 @@ struct VmExitHistory {
 //
 const char* GetVmExitProcess();
 
-bool __stdcall VmmVmExitHandler(_Inout_ VmmInitialStack *stack);
+bool __stdcall VmmVmExitHandler(_Inout_ VmmInitialStack *stack,
+                                _In_ ULONG64 entry_tsc);
 
 DECLSPEC_NORETURN void __stdcall VmmVmxFailureHandler(
     _Inout_ AllRegisters *all_regs);
 
 static void VmmpHandleVmExit(_Inout_ GuestContext *guest_context);
 
+static ULONG VmmpGetExitProfileSubKey(_In_ GuestContext *guest_context,
+                                      _In_ VmxExitReason reason);
+
 DECLSPEC_NORETURN static void VmmpHandleTripleFault(
     _Inout_ GuestContext *guest_context);
 
@@ -170,6 +195,9 @@ static void VmmpIndicateUnsuccessfulVmcall(_In_ GuestContext *guest_context);
 static void VmmpHandleVmCallTermination(_In_ GuestContext *guest_context,
                                         _Inout_ void *context);
 
+static void VmmpUpdateExitingControls(
+    _In_ const VmExitingControlsUpdate *update);
+
 static UCHAR VmmpGetGuestCpl();
 
 static void VmmpInjectInterruption(_In_ InterruptionType interruption_type,
@@ -205,7 +233,14 @@ const char* GetVmExitProcess()
 // Return true for vmresume, or return false for vmxoff.
 #pragma warning(push)
 #pragma warning(disable : 28167)
-_Use_decl_annotations_ bool __stdcall VmmVmExitHandler(VmmInitialStack *stack) {
+_Use_decl_annotations_ bool __stdcall VmmVmExitHandler(VmmInitialStack *stack,
+                                                       ULONG64 entry_tsc) {
+  // Count the previous VM-exit on this processor before anything else
+  const auto exit_profile = stack->processor_data->exit_profile;
+  if (exit_profile) {
+    ExitProfileEnter(exit_profile, entry_tsc);
+  }
+
   // Save guest's context and raise IRQL as quick as possible
   //
   //CR8是不在host state、guest state里的
@@ -325,6 +360,14 @@ _Use_decl_annotations_ static void VmmpHandleVmExit(
   const VmExitInformation exit_reason = {
       static_cast<ULONG32>(UtilVmRead(VmcsField::kVmExitReason))};
 
+  const auto exit_profile = guest_context->stack->processor_data->exit_profile;
+  if (exit_profile) {
+    // Get a sub-key before handlers update registers
+    ExitProfileSetKey(
+        exit_profile, static_cast<ULONG>(exit_reason.fields.reason),
+        VmmpGetExitProfileSubKey(guest_context, exit_reason.fields.reason));
+  }
+
   if (kVmmpEnableRecordVmExit) {
     // Save them for ease of trouble shooting
     const auto processor = KeGetCurrentProcessorNumberEx(nullptr);
@@ -341,6 +384,18 @@ _Use_decl_annotations_ static void VmmpHandleVmExit(
     }
   }
 
+  if (kVmmpEnableTraceVmExit) {
+    const auto record = reinterpret_cast<TraceVmExitRecord *>(
+        TraceBegin(sizeof(TraceVmExitRecord)));
+    if (record) {
+      record->guest_ip = guest_context->ip;
+      record->exit_qualification = UtilVmRead(VmcsField::kExitQualification);
+      record->reason = static_cast<ULONG>(exit_reason.fields.reason);
+      record->reserved = 0;
+      TraceCommit(&record->header, kTraceRecordVmExit);
+    }
+  }
+
   switch (exit_reason.fields.reason) {
     case VmxExitReason::kExceptionOrNmi:
       VmmpHandleException(guest_context);
@@ -418,6 +473,25 @@ _Use_decl_annotations_ static void VmmpHandleVmExit(
   }
 }
 
+// Returns what distinguishes VM-exits of the same reason for the profiler
+_Use_decl_annotations_ static ULONG VmmpGetExitProfileSubKey(
+    GuestContext *guest_context, VmxExitReason reason) {
+  switch (reason) {
+    case VmxExitReason::kCrAccess: {
+      const MovCrQualification exit_qualification = {
+          UtilVmRead(VmcsField::kExitQualification)};
+      return static_cast<ULONG>(exit_qualification.fields.control_register);
+    }
+    case VmxExitReason::kMsrRead:
+    case VmxExitReason::kMsrWrite:
+      return static_cast<ULONG>(guest_context->gp_regs->cx);
+    case VmxExitReason::kCpuid:
+      return static_cast<ULONG>(guest_context->gp_regs->ax);
+    default:
+      return 0;
+  }
+}
+
 // Triple fault VM-exit. Fatal error.
 _Use_decl_annotations_ static void VmmpHandleTripleFault(
     GuestContext *guest_context) {
@@ -688,66 +762,67 @@ _Use_decl_annotations_ static void VmmpHandleMsrAccess(
   //对正常的msr提供服务
   //
 
-  bool transfer_to_vmcs = false;
-  VmcsField vmcs_field = {};
-  switch (msr) {
-    case Msr::kIa32SysenterCs:
-      vmcs_field = VmcsField::kGuestSysenterCs;
-      transfer_to_vmcs = true;
-      break;
-    case Msr::kIa32SysenterEsp:
-      vmcs_field = VmcsField::kGuestSysenterEsp;
-      transfer_to_vmcs = true;
-      break;
-    case Msr::kIa32SysenterEip:
-      vmcs_field = VmcsField::kGuestSysenterEip;
-      transfer_to_vmcs = true;
-      break;
-    case Msr::kIa32Debugctl:
-      vmcs_field = VmcsField::kGuestIa32Debugctl;
-      transfer_to_vmcs = true;
-      break;
-    case Msr::kIa32GsBase:
-      vmcs_field = VmcsField::kGuestGsBase;
-      transfer_to_vmcs = true;
+  // MSRs not listed in the policy table reach here only when they are out of
+  // the ranges the MSR bitmap covers. Execute them on the processor.
+  const auto policy = MsrPolicyFind(msr);
+  const auto action = MsrPolicyGetAction(policy, read_access);
+
+  LARGE_INTEGER msr_value = {};
+  if (!read_access) {
+    msr_value.LowPart = static_cast<ULONG>(guest_context->gp_regs->ax);
+    msr_value.HighPart = static_cast<ULONG>(guest_context->gp_regs->dx);
+  }
+
+  switch (action) {
+    case MsrAction::kVmcs: {
+      const auto is_64bit_vmcs =
+          UtilIsInBounds(policy->vmcs_field, VmcsField::kIoBitmapA,
+                         VmcsField::kHostIa32PerfGlobalCtrlHigh);
+      if (read_access) {
+        msr_value.QuadPart = (is_64bit_vmcs)
+                                 ? UtilVmRead64(policy->vmcs_field)
+                                 : UtilVmRead(policy->vmcs_field);
+      } else if (is_64bit_vmcs) {
+        UtilVmWrite64(policy->vmcs_field, msr_value.QuadPart);
+      } else {
+        UtilVmWrite(policy->vmcs_field,
+                    static_cast<ULONG_PTR>(msr_value.QuadPart));
+      }
       break;
-    case Msr::kIa32FsBase:
-      vmcs_field = VmcsField::kGuestFsBase;
-      transfer_to_vmcs = true;
+    }
+
+    case MsrAction::kEmulate: {
+      auto value = static_cast<ULONG64>(msr_value.QuadPart);
+      if (!policy->emulation_routine(msr, read_access, &value)) {
+        VmmpInjectInterruption(InterruptionType::kHardwareException,
+                               InterruptionVector::kGeneralProtectionException,
+                               true, 0);
+        return;
+      }
+      msr_value.QuadPart = value;
       break;
+    }
+
+    case MsrAction::kLog:
+      HYPERPLATFORM_LOG_INFO_SAFE("%s MSR %08x (%08x%08x)",
+                                  (read_access) ? "RDMSR" : "WRMSR",
+                                  static_cast<ULONG>(msr),
+                                  msr_value.HighPart, msr_value.LowPart);
+      // Fall through to execute it
+
+    case MsrAction::kPassThrough:
     default:
+      if (read_access) {
+        msr_value.QuadPart = UtilReadMsr64(msr);
+      } else {
+        UtilWriteMsr64(msr, msr_value.QuadPart);
+      }
       break;
   }
 
-  const auto is_64bit_vmcs =
-      UtilIsInBounds(vmcs_field, VmcsField::kIoBitmapA,
-                     VmcsField::kHostIa32PerfGlobalCtrlHigh);
-
-  LARGE_INTEGER msr_value = {};
   if (read_access) {
-    if (transfer_to_vmcs) {
-      if (is_64bit_vmcs) {
-        msr_value.QuadPart = UtilVmRead64(vmcs_field);
-      } else {
-        msr_value.QuadPart = UtilVmRead(vmcs_field);
-      }
-    } else {
-      msr_value.QuadPart = UtilReadMsr64(msr);
-    }
     guest_context->gp_regs->ax = msr_value.LowPart;
     guest_context->gp_regs->dx = msr_value.HighPart;
-  } else {//写msr
-    msr_value.LowPart = static_cast<ULONG>(guest_context->gp_regs->ax);
-    msr_value.HighPart = static_cast<ULONG>(guest_context->gp_regs->dx);
-    if (transfer_to_vmcs) {
-      if (is_64bit_vmcs) {
-        UtilVmWrite64(vmcs_field, static_cast<ULONG_PTR>(msr_value.QuadPart));
-      } else {
-        UtilVmWrite(vmcs_field, static_cast<ULONG_PTR>(msr_value.QuadPart));
-      }
-    } else {
-      UtilWriteMsr64(msr, msr_value.QuadPart);
-    }
   }
 
   VmmpAdjustGuestInstructionPointer(guest_context);
@@ -1292,12 +1367,18 @@ _Use_decl_annotations_ static void VmmpHandleCrAccess(
           if (UtilIsX86Pae()) {
             UtilLoadPdptes(VmmpGetKernelCr3());
           }
-          // Under some circumstances MOV to CR3 is not *required* to flush TLB
-          // entries, but also NOT prohibited to do so. Therefore, we flush it
-          // all time.
+          // With CR4.PCIDE=1, MOV to CR3 with the bit 63 set is not required
+          // to flush TLB entries. Otherwise, it invalidates non-global entries
+          // for the new PCID; since INVVPID cannot select a PCID, flush those
+          // for all PCIDs of this VPID, which is also permitted.
           // See: Operations that Invalidate TLBs and Paging-Structure Caches
-          UtilInvvpidSingleContextExceptGlobal(
-              static_cast<USHORT>(KeGetCurrentProcessorNumberEx(nullptr) + 1));
+          const Cr4 guest_cr4 = {UtilVmRead(VmcsField::kGuestCr4)};
+          const auto no_flush = guest_cr4.fields.pcide &&
+                                (static_cast<ULONG64>(*register_used) >> 63);
+          if (!no_flush) {
+            UtilInvvpidSingleContextExceptGlobal(static_cast<USHORT>(
+                KeGetCurrentProcessorNumberEx(nullptr) + 1));
+          }
 
           // The MOV to CR3 does not modify the bit63 of CR3. Emulate this
           // behavior.
@@ -1421,6 +1502,27 @@ _Use_decl_annotations_ static void VmmpHandleVmCall(
           guest_context->stack->processor_data->shared_data;
       VmmpIndicateSuccessfulVmcall(guest_context);
       break;
+    case HypercallNumber::kGetPerfSnapshot:
+      // Takes PerfSnapshotRequest, which is a kernel address; hence CPL=0 only
+      if (VmmpGetGuestCpl() == 0) {
+        const auto request = static_cast<PerfSnapshotRequest *>(context);
+        request->written = PerfSnapshot(request->buffer, request->size);
+        VmmpIndicateSuccessfulVmcall(guest_context);
+      } else {
+        VmmpIndicateUnsuccessfulVmcall(guest_context);
+      }
+      break;
+    case HypercallNumber::kUpdateExitingControls:
+      // Takes VmExitingControlsUpdate, which is a kernel address; hence CPL=0
+      // only
+      if (VmmpGetGuestCpl() == 0) {
+        VmmpUpdateExitingControls(
+            static_cast<const VmExitingControlsUpdate *>(context));
+        VmmpIndicateSuccessfulVmcall(guest_context);
+      } else {
+        VmmpIndicateUnsuccessfulVmcall(guest_context);
+      }
+      break;
   }
 }
 
@@ -1672,6 +1774,27 @@ _Use_decl_annotations_ static void VmmpHandleVmCallTermination(
   guest_context->vm_continue = false;
 }
 
+// Changes VM-execution controls of the current processor. The caller has
+// validated the change against capabilities of the processor.
+_Use_decl_annotations_ static void VmmpUpdateExitingControls(
+    const VmExitingControlsUpdate *update) {
+  const auto procctl =
+      static_cast<ULONG32>(UtilVmRead(VmcsField::kCpuBasedVmExecControl));
+  UtilVmWrite(VmcsField::kCpuBasedVmExecControl,
+              (procctl | update->set.procctl) & ~update->clear.procctl);
+
+  const auto procctl2 =
+      static_cast<ULONG32>(UtilVmRead(VmcsField::kSecondaryVmExecControl));
+  UtilVmWrite(VmcsField::kSecondaryVmExecControl,
+              (procctl2 | update->set.procctl2) & ~update->clear.procctl2);
+
+  const auto exception_bitmap =
+      static_cast<ULONG32>(UtilVmRead(VmcsField::kExceptionBitmap));
+  UtilVmWrite(VmcsField::kExceptionBitmap,
+              (exception_bitmap | update->set.exception_bitmap) &
+                  ~update->clear.exception_bitmap);
+}
+
 // Returns guest's CPL
 /*_Use_decl_annotations_*/ static UCHAR VmmpGetGuestCpl() {
   VmxRegmentDescriptorAccessRight ar = {
@@ -40,6 +40,8 @@ struct ProcessorData {
   struct VmControlStructure* vmxon_region;  //!< VA of a VMXON region
   struct VmControlStructure* vmcs_region;   //!< VA of a VMCS region
   struct EptData* ept_data;                 //!< A pointer to EPT related data
+  struct ExitProfile* exit_profile;         //!< VM-exit profile, or nullptr
+  ULONG64 fast_exit_reasons;  //!< Reasons AsmVmmFastEntryPoint handles
 };
 
 /// nt!_KTRAP_FRAME on x86
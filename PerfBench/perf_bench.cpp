@@ -0,0 +1,404 @@
+// Copyright (c) 2015-2019, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements a benchmark of HYPERPLATFORM_PERFCOUNTER_MEASURE_TIME.
+///
+/// It first checks that PerfCollector aggregates data and call paths
+/// correctly and fails if not, then measures a cost of a measured scope over
+/// an empty one with 1 to N threads. Each thread acts as a processor of its
+/// own, as a processor runs one VM-exit handler at a time in the driver.
+///
+/// Scopes are measured with clocks PerfGetTime() may use: plain TSC when it
+/// is synchronized across processors, TSC minus an offset of the current
+/// processor otherwise, and a steady clock standing in for
+/// KeQueryPerformanceCounter().
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <functional>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "perf_counter.h"
+
+#define PERF_BENCH_NOINLINE __attribute__((noinline))
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// Reports a failed check and returns false from the enclosing check
+#define PERF_BENCH_EXPECT(condition)                                    \
+  do {                                                                  \
+    if (!(condition)) {                                                 \
+      std::fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, \
+                   #condition);                                         \
+      return false;                                                     \
+    }                                                                   \
+  } while (0)
+
+static const unsigned kDefaultIterations = 2000000;
+
+// Enough for a number of threads the benchmark runs with
+static const ULONG kMaxThreads = 256;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+using Summary = PerfCollector::PerfSummary;
+using Summaries = std::map<std::string, Summary>;
+using PathSummaries = std::map<std::string, PerfCollector::PathSummary>;
+
+// A collector and tables for as many processors as threads
+class Collector {
+ public:
+  explicit Collector(ULONG processor_count)
+      : processors_(new PerfCollector::ProcessorData[processor_count]) {
+    collector_.Initialize(Collect, processors_.get(), processor_count,
+                          GetProcessorNumber);
+  }
+
+  PerfCollector *get() { return &collector_; }
+
+  // Returns summaries keyed on locations
+  Summaries Snapshot() const {
+    Summaries summaries;
+    collector_.Snapshot(Collect, &summaries);
+    return summaries;
+  }
+
+  // Returns summaries keyed on call paths in the folded form
+  PathSummaries SnapshotPaths() const {
+    PathSummaries summaries;
+    collector_.SnapshotPaths(CollectPath, &summaries);
+    return summaries;
+  }
+
+  // Makes the current thread act as a processor
+  static void SetProcessorNumber(ULONG number) { processor_number_ = number; }
+
+  // Returns a number of a processor the current thread acts as
+  static ULONG GetProcessorNumber() { return processor_number_; }
+
+ private:
+  static void Collect(const char *location_name, const Summary *summary,
+                      void *output_context) {
+    (*static_cast<Summaries *>(output_context))[location_name] = *summary;
+  }
+
+  static void CollectPath(const char *const *location_names, ULONG depth,
+                          const PerfCollector::PathSummary *summary,
+                          void *output_context) {
+    std::string path;
+    for (auto i = 0u; i < depth; ++i) {
+      path += (i) ? ";" : "";
+      path += location_names[i];
+    }
+    (*static_cast<PathSummaries *>(output_context))[path] = *summary;
+  }
+
+  static thread_local ULONG processor_number_;
+  std::unique_ptr<PerfCollector::ProcessorData[]> processors_;
+  PerfCollector collector_;
+};
+
+thread_local ULONG Collector::processor_number_;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+// TSC offsets of processors as PerfGetTime() subtracts when TSC is not
+// synchronized. Values do not matter for the cost.
+static LONG64 g_tsc_offsets[kMaxThreads];
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Counts and totals of each location are sums of all processors
+static bool CheckCounts() {
+  static const ULONG kThreads = 4;
+  static const unsigned kPerThread = 100000;
+  static const char *const kLocations[] = {"a", "b", "c"};
+
+  Collector collector(kThreads);
+  std::vector<std::thread> threads;
+  for (auto i = 0u; i < kThreads; ++i) {
+    threads.emplace_back([&collector, i] {
+      Collector::SetProcessorNumber(i);
+      for (auto j = 0u; j < kPerThread; ++j) {
+        collector.get()->AddData(kLocations[j % 3], j % 1000);
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  const auto summaries = collector.Snapshot();
+  PERF_BENCH_EXPECT(summaries.size() == 3);
+  ULONG64 count = 0, total = 0;
+  for (const auto &summary : summaries) {
+    count += summary.second.total_execution_count;
+    total += summary.second.total_elapsed_time;
+    PERF_BENCH_EXPECT(summary.second.min_elapsed_time == 0);
+    PERF_BENCH_EXPECT(summary.second.max_elapsed_time == 999);
+  }
+  PERF_BENCH_EXPECT(count == kThreads * kPerThread);
+  PERF_BENCH_EXPECT(total == kThreads * (kPerThread / 1000) * (999 * 1000 / 2));
+  PERF_BENCH_EXPECT(collector.get()->GetDroppedCount() == 0);
+  return true;
+}
+
+// Data of locations that do not fit in a table are counted as dropped
+static bool CheckDropped() {
+  static const ULONG kLocations = PerfCollector::kMaxNumberOfDataEntries + 36;
+
+  Collector collector(1);
+  std::vector<std::string> names(kLocations);
+  for (auto i = 0u; i < kLocations; ++i) {
+    names[i] = "location" + std::to_string(i);
+    collector.get()->AddData(names[i].c_str(), 1);
+  }
+
+  PERF_BENCH_EXPECT(collector.Snapshot().size() ==
+                    PerfCollector::kMaxNumberOfDataEntries);
+  PERF_BENCH_EXPECT(collector.get()->GetDroppedCount() == 36);
+  return true;
+}
+
+// Percentiles are within a sub-bucket above exact ones
+static bool CheckPercentiles() {
+  static const ULONG kThreads = 2;
+
+  std::vector<ULONG64> values;
+  std::mt19937_64 random(1);
+  std::exponential_distribution<double> distribution(1.0 / 2000);
+  for (auto i = 0; i < 200000; ++i) {
+    values.push_back(static_cast<ULONG64>(distribution(random)) +
+                     ((i % 5000) ? 0 : 5000000));
+  }
+
+  Collector collector(kThreads);
+  for (auto i = 0u; i < values.size(); ++i) {
+    Collector::SetProcessorNumber(i % kThreads);
+    collector.get()->AddData("a", values[i]);
+  }
+
+  std::sort(values.begin(), values.end());
+  const auto summary = collector.Snapshot()["a"];
+  PERF_BENCH_EXPECT(summary.min_elapsed_time == values.front());
+  PERF_BENCH_EXPECT(summary.max_elapsed_time == values.back());
+
+  const std::pair<ULONG64, unsigned> percentiles[] = {
+      {summary.p50_elapsed_time, 5000},
+      {summary.p90_elapsed_time, 9000},
+      {summary.p99_elapsed_time, 9900},
+      {summary.p999_elapsed_time, 9990}};
+  for (const auto &percentile : percentiles) {
+    const auto rank = (values.size() * percentile.second + 9999) / 10000;
+    const auto exact = values[rank - 1];
+    PERF_BENCH_EXPECT(percentile.first >= exact);
+    PERF_BENCH_EXPECT(percentile.first <=
+                      exact + exact / PerfCollector::kHistogramSubBucketCount);
+  }
+  return true;
+}
+
+// Reset clears data but keeps locations
+static bool CheckReset() {
+  Collector collector(2);
+  for (auto i = 0u; i < 2; ++i) {
+    Collector::SetProcessorNumber(i);
+    collector.get()->AddData("a", 100);
+  }
+  collector.get()->Reset();
+  auto summary = collector.Snapshot()["a"];
+  PERF_BENCH_EXPECT(summary.total_execution_count == 0);
+  PERF_BENCH_EXPECT(summary.max_elapsed_time == 0);
+
+  collector.get()->AddData("a", 7);
+  summary = collector.Snapshot()["a"];
+  PERF_BENCH_EXPECT(summary.total_execution_count == 1);
+  PERF_BENCH_EXPECT(summary.min_elapsed_time == 7);
+  PERF_BENCH_EXPECT(summary.p50_elapsed_time == 7);
+  PERF_BENCH_EXPECT(summary.max_elapsed_time == 7);
+  return true;
+}
+
+// Nested scopes get exclusive times and call paths
+static bool CheckScopes() {
+  Collector collector(2);
+  const auto collector_ptr = collector.get();
+  const auto scope = [collector_ptr](const char *location, ULONG64 elapsed,
+                                     std::function<void()> inner) {
+    const auto token = collector_ptr->EnterScope(location);
+    inner();
+    collector_ptr->LeaveScope(location, elapsed, token);
+  };
+
+  // a(100) { b(30) { c(10) } c(5) } on both processors
+  for (auto i = 0u; i < 2; ++i) {
+    Collector::SetProcessorNumber(i);
+    scope("a", 100, [&scope] {
+      scope("b", 30, [&scope] { scope("c", 10, [] {}); });
+      scope("c", 5, [] {});
+    });
+  }
+
+  auto summaries = collector.Snapshot();
+  PERF_BENCH_EXPECT(summaries["a"].total_elapsed_time == 200);
+  PERF_BENCH_EXPECT(summaries["a"].total_exclusive_time == 130);
+  PERF_BENCH_EXPECT(summaries["b"].total_exclusive_time == 40);
+  PERF_BENCH_EXPECT(summaries["c"].total_execution_count == 4);
+  PERF_BENCH_EXPECT(summaries["c"].total_exclusive_time == 30);
+
+  const auto paths = collector.SnapshotPaths();
+  PERF_BENCH_EXPECT(paths.size() == 4);
+  PERF_BENCH_EXPECT(paths.at("a").total_exclusive_time == 130);
+  PERF_BENCH_EXPECT(paths.at("a;b").total_exclusive_time == 40);
+  PERF_BENCH_EXPECT(paths.at("a;b;c").total_exclusive_time == 20);
+  PERF_BENCH_EXPECT(paths.at("a;c").total_execution_count == 2);
+  PERF_BENCH_EXPECT(paths.at("a;c").total_exclusive_time == 10);
+
+  // A scope that never left is discarded by its parent
+  Collector::SetProcessorNumber(0);
+  const auto token = collector.get()->EnterScope("a");
+  collector.get()->EnterScope("b");
+  collector.get()->LeaveScope("a", 50, token);
+  collector.get()->AddData("d", 1);
+  summaries = collector.Snapshot();
+  PERF_BENCH_EXPECT(summaries["a"].total_exclusive_time == 180);
+  PERF_BENCH_EXPECT(collector.SnapshotPaths().at("a").total_exclusive_time ==
+                    180);
+  return true;
+}
+
+static ULONG64 QuerySteadyClock() {
+  return std::chrono::steady_clock::now().time_since_epoch().count();
+}
+
+// Reads TSC as PerfGetTime() does when TSC is not synchronized
+static ULONG64 QueryTscWithOffset() {
+  const volatile LONG64 *offsets = g_tsc_offsets;
+  return __rdtsc() - offsets[Collector::GetProcessorNumber()];
+}
+
+PERF_BENCH_NOINLINE static void EmptyScope(volatile unsigned *sink) {
+  *sink = *sink + 1;
+}
+
+PERF_BENCH_NOINLINE static void MeasuredScope(PerfCollector *collector,
+                                              volatile unsigned *sink) {
+  HYPERPLATFORM_PERFCOUNTER_MEASURE_TIME(collector, nullptr);
+  *sink = *sink + 1;
+}
+
+PERF_BENCH_NOINLINE static void MeasuredScopeTscWithOffset(
+    PerfCollector *collector, volatile unsigned *sink) {
+  HYPERPLATFORM_PERFCOUNTER_MEASURE_TIME(collector, QueryTscWithOffset);
+  *sink = *sink + 1;
+}
+
+PERF_BENCH_NOINLINE static void MeasuredScopeSteadyClock(
+    PerfCollector *collector, volatile unsigned *sink) {
+  HYPERPLATFORM_PERFCOUNTER_MEASURE_TIME(collector, QuerySteadyClock);
+  *sink = *sink + 1;
+}
+
+// Returns CPU time of the current thread in nanoseconds. Unlike wall time, it
+// does not grow when there are more threads than processors.
+static double GetThreadCpuNanoseconds() {
+  timespec time = {};
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+  return time.tv_sec * 1e9 + time.tv_nsec;
+}
+
+// Runs a function on threads and returns nanoseconds of CPU time a call
+// takes, averaged over threads
+template <typename Function>
+static double MeasureNanoseconds(ULONG thread_count, unsigned iterations,
+                                 Function function) {
+  std::vector<double> elapsed(thread_count);
+  std::vector<std::thread> threads;
+  for (auto i = 0u; i < thread_count; ++i) {
+    threads.emplace_back([&elapsed, &function, i, iterations] {
+      Collector::SetProcessorNumber(i);
+      volatile unsigned sink = 0;
+      const auto begin = GetThreadCpuNanoseconds();
+      for (auto j = 0u; j < iterations; ++j) {
+        function(&sink);
+      }
+      elapsed[i] = GetThreadCpuNanoseconds() - begin;
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  double total = 0;
+  for (const auto value : elapsed) {
+    total += value;
+  }
+  return total / thread_count / iterations;
+}
+
+// Prints nanoseconds a measured scope adds to an empty one
+static void Benchmark(ULONG max_threads, unsigned iterations) {
+  std::printf("%-8s,%-12s,%-12s,%-14s,%-12s\n", "Threads", "Empty(ns)",
+              "Tsc(ns)", "TscOffset(ns)", "Steady(ns)");
+  for (auto threads = 1u; threads <= max_threads; ++threads) {
+    Collector collector(threads);
+    const auto empty = MeasureNanoseconds(threads, iterations, EmptyScope);
+    const auto tsc = MeasureNanoseconds(
+        threads, iterations, [&collector](volatile unsigned *sink) {
+          MeasuredScope(collector.get(), sink);
+        });
+    const auto tsc_offset = MeasureNanoseconds(
+        threads, iterations, [&collector](volatile unsigned *sink) {
+          MeasuredScopeTscWithOffset(collector.get(), sink);
+        });
+    const auto steady = MeasureNanoseconds(
+        threads, iterations, [&collector](volatile unsigned *sink) {
+          MeasuredScopeSteadyClock(collector.get(), sink);
+        });
+    std::printf("%-8u,%12.2f,%12.2f,%14.2f,%12.2f\n", threads, empty,
+                tsc - empty, tsc_offset - empty, steady - empty);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  const auto hardware_threads = std::thread::hardware_concurrency();
+  const auto max_threads = static_cast<ULONG>(
+      (argc > 1) ? std::strtoul(argv[1], nullptr, 0)
+                 : std::max(hardware_threads, 1u));
+  const auto iterations = static_cast<unsigned>(
+      (argc > 2) ? std::strtoul(argv[2], nullptr, 0) : kDefaultIterations);
+  if (!max_threads || max_threads > kMaxThreads || !iterations) {
+    std::fprintf(stderr, "Usage: %s [max_threads] [iterations]\n", argv[0]);
+    return 1;
+  }
+
+  if (!CheckCounts() || !CheckDropped() || !CheckPercentiles() ||
+      !CheckReset() || !CheckScopes()) {
+    return 1;
+  }
+  std::printf("Aggregation checks passed.\n");
+
+  Benchmark(max_threads, iterations);
+  return 0;
+}
@@ -0,0 +1,109 @@
+// Copyright (c) 2015-2019, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Provides the part of the WDK that HyperPlatform/perf_counter.h uses, so
+/// that the header builds in user mode on a host.
+///
+/// Only GCC and Clang are supported. Types keep the sizes they have in the
+/// kernel so that tables have the same footprint.
+
+#ifndef PERF_BENCH_SHIM_NTDDK_H_
+#define PERF_BENCH_SHIM_NTDDK_H_
+
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+#define _In_
+#define _In_opt_
+#define _Out_
+#define _Inout_
+#define _In_reads_(n)
+#define _Out_writes_(n)
+
+#define UNREFERENCED_PARAMETER(p) ((void)(p))
+#define RTL_NUMBER_OF(a) (sizeof(a) / sizeof((a)[0]))
+
+// GCC and Clang have no string literal version of __FUNCTION__, which
+// HYPERPLATFORM_PERFCOUNTER_MEASURE_TIME concatenates with a line number. A
+// file name identifies a location as well.
+#define __FUNCTION__ __FILE__
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+#define SYSTEM_CACHE_ALIGNMENT_SIZE 64
+#define MAXULONG 0xffffffffu
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+typedef int LONG;
+typedef unsigned int ULONG;
+typedef long long LONG64;
+typedef unsigned long long ULONG64;
+typedef unsigned long long ULONG_PTR;
+static_assert(sizeof(ULONG_PTR) == sizeof(void *), "Size check");
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+inline LONG InterlockedIncrement(volatile LONG *addend) {
+  return __atomic_add_fetch(addend, 1, __ATOMIC_SEQ_CST);
+}
+
+inline LONG64 InterlockedIncrement64(volatile LONG64 *addend) {
+  return __atomic_add_fetch(addend, 1, __ATOMIC_SEQ_CST);
+}
+
+inline LONG64 InterlockedExchangeAdd64(volatile LONG64 *addend,
+                                       LONG64 value) {
+  return __atomic_fetch_add(addend, value, __ATOMIC_SEQ_CST);
+}
+
+inline LONG64 InterlockedCompareExchange64(volatile LONG64 *destination,
+                                           LONG64 exchange, LONG64 comparand) {
+  __atomic_compare_exchange_n(destination, &comparand, exchange, false,
+                              __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  return comparand;
+}
+
+inline void *InterlockedCompareExchangePointer(void *volatile *destination,
+                                               void *exchange,
+                                               void *comparand) {
+  __atomic_compare_exchange_n(destination, &comparand, exchange, false,
+                              __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  return comparand;
+}
+
+inline unsigned char _BitScanReverse64(ULONG *index, ULONG64 mask) {
+  if (!mask) {
+    return 0;
+  }
+  *index = 63 - __builtin_clzll(mask);
+  return 1;
+}
+
+#if !defined(__x86_64__) && !defined(__i386__)
+inline ULONG64 __rdtsc() {
+  return std::chrono::steady_clock::now().time_since_epoch().count();
+}
+#endif
+
+#endif  // PERF_BENCH_SHIM_NTDDK_H_
@@ -0,0 +1,197 @@
+// Copyright (c) 2015-2019, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements reading of the ring shared by the driver.
+
+#include "ring_consumer.h"
+#include <cstring>
+#if defined(_WIN32)
+#include <windows.h>
+#include <winioctl.h>
+#endif
+
+namespace ring_consumer {
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// Used when the ring does not know its TSC frequency; shows ticks as ns
+static const double kDefaultTscFrequency = 1e9;
+
+#if defined(_WIN32)
+// IOCTL_HYPER_SHARED_RING_MAP and IOCTL_HYPER_SHARED_RING_UNMAP in
+// HyperPlatform/device.h
+static const DWORD kIoctlSharedRingMap =
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80E + 9, METHOD_BUFFERED,
+             FILE_READ_ACCESS | FILE_WRITE_ACCESS);
+static const DWORD kIoctlSharedRingUnmap = CTL_CODE(
+    FILE_DEVICE_UNKNOWN, 0x80E + 10, METHOD_BUFFERED, FILE_READ_ACCESS);
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// The driver stores a type last with a locked instruction, and fields of a
+// record are only read after its type is seen. tail is stored after a record
+// is zeroed so that the driver never reserves dirty memory.
+#if defined(_MSC_VER)
+static std::uint16_t LoadAcquire(const volatile unsigned short *value) {
+  const auto result = *value;
+  _ReadWriteBarrier();
+  return result;
+}
+
+static void StoreRelease(volatile unsigned long long *value,
+                         unsigned long long data) {
+  _ReadWriteBarrier();
+  *value = data;
+}
+#else
+static std::uint16_t LoadAcquire(const volatile unsigned short *value) {
+  return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+}
+
+static void StoreRelease(volatile unsigned long long *value,
+                         unsigned long long data) {
+  __atomic_store_n(value, data, __ATOMIC_RELEASE);
+}
+#endif
+
+Consumer::Consumer()
+    : header_(nullptr), data_(nullptr), data_size_(0), broken_(false) {}
+
+bool Consumer::Attach(void *base, std::size_t size, std::string *error) {
+  const auto header = static_cast<SharedRingHeader *>(base);
+  if (!base || size < sizeof(SharedRingHeader) ||
+      std::memcmp(header->magic, kSharedRingMagic, sizeof(header->magic))) {
+    *error = "not a shared ring";
+    return false;
+  }
+  if (header->version != kSharedRingVersion) {
+    *error = "unsupported version " + std::to_string(header->version);
+    return false;
+  }
+  const std::uint64_t data_size = header->data_size;
+  if (header->header_size < sizeof(SharedRingHeader) ||
+      header->header_size % kSharedRingRecordAlignment || !data_size ||
+      (data_size & (data_size - 1)) ||
+      data_size > size - header->header_size) {
+    *error = "broken header";
+    return false;
+  }
+
+  header_ = header;
+  data_ = static_cast<std::uint8_t *>(base) + header->header_size;
+  data_size_ = data_size;
+  broken_ = false;
+  return true;
+}
+
+std::size_t Consumer::Poll(
+    const std::function<void(const Record &)> &callback,
+    std::size_t max_records) {
+  if (!header_ || broken_) {
+    return 0;
+  }
+
+  std::size_t count = 0;
+  auto tail = header_->tail;
+  while (count < max_records) {
+    const auto offset = tail & (data_size_ - 1);
+    const auto record =
+        reinterpret_cast<SharedRingRecordHeader *>(data_ + offset);
+    const auto type = LoadAcquire(&record->type);
+    if (type == kSharedRingRecordInvalid) {
+      break;  // Still being written
+    }
+
+    const std::size_t size = record->size;
+    if (size < sizeof(SharedRingRecordHeader) ||
+        size % kSharedRingRecordAlignment || offset + size > data_size_) {
+      broken_ = true;
+      break;
+    }
+    if (type != kSharedRingRecordPadding) {
+      const Record out = {type,
+                          record->processor,
+                          record->tsc,
+                          reinterpret_cast<const std::uint8_t *>(record),
+                          size};
+      callback(out);
+      ++count;
+    }
+
+    std::memset(record, 0, size);
+    tail += size;
+    StoreRelease(&header_->tail, tail);
+  }
+  return count;
+}
+
+std::uint64_t Consumer::Dropped() const {
+  return header_ ? header_->dropped : 0;
+}
+
+std::uint64_t Consumer::Pending() const {
+  if (!header_) {
+    return 0;
+  }
+  const std::uint64_t head = header_->head;
+  const std::uint64_t tail = header_->tail;
+  return (head > tail) ? head - tail : 0;
+}
+
+std::string LogMessage(const Record &record) {
+  if (record.type != kSharedRingRecordLog) {
+    return std::string();
+  }
+  const auto message = reinterpret_cast<const char *>(record.data) +
+                       sizeof(SharedRingRecordHeader);
+  const auto max_length = record.size - sizeof(SharedRingRecordHeader);
+  const auto end =
+      static_cast<const char *>(std::memchr(message, 0, max_length));
+  return std::string(message, end ? end - message : max_length);
+}
+
+double TicksToMicroseconds(const SharedRingHeader &header,
+                           std::int64_t ticks) {
+  const auto frequency = header.tsc_frequency
+                             ? static_cast<double>(header.tsc_frequency)
+                             : kDefaultTscFrequency;
+  return ticks * 1e6 / frequency;
+}
+
+#if defined(_WIN32)
+bool MapDeviceRing(void *device, unsigned int mode,
+                   SharedRingMapping *mapping) {
+  // Input and output share a buffer with METHOD_BUFFERED
+  union {
+    SharedRingMapRequest request;
+    SharedRingMapping mapping;
+  } buffer = {};
+  buffer.request.mode = mode;
+  DWORD returned = 0;
+  if (!DeviceIoControl(device, kIoctlSharedRingMap, &buffer,
+                       sizeof(buffer.request), &buffer, sizeof(buffer.mapping),
+                       &returned, nullptr) ||
+      returned != sizeof(buffer.mapping)) {
+    return false;
+  }
+  *mapping = buffer.mapping;
+  return true;
+}
+
+bool UnmapDeviceRing(void *device) {
+  DWORD returned = 0;
+  return DeviceIoControl(device, kIoctlSharedRingUnmap, nullptr, 0, nullptr, 0,
+                         &returned, nullptr) != FALSE;
+}
+#endif
+
+}  // namespace ring_consumer
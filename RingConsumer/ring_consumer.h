@@ -0,0 +1,107 @@
+// Copyright (c) 2015-2019, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Declares interfaces to read the ring shared by the driver.
+///
+/// The layout is defined in HyperPlatform/shared_ring_format.h. Records are
+/// read straight out of the mapping, so polling takes no system call. Only one
+/// Consumer may read a ring at a time.
+
+#ifndef RING_CONSUMER_RING_CONSUMER_H_
+#define RING_CONSUMER_RING_CONSUMER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include "shared_ring_format.h"
+
+namespace ring_consumer {
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+/// A record read out of the ring. It is valid only during a callback.
+struct Record {
+  std::uint16_t type;        //!< TraceRecordType
+  std::uint32_t processor;   //!< A processor number that wrote the record
+  std::uint64_t tsc;         //!< A time stamp counter of the event
+  const std::uint8_t *data;  //!< The record including its header
+  std::size_t size;          //!< A size of \a data, including padding
+};
+
+/// Reads records out of a mapping of the ring
+class Consumer {
+ public:
+  Consumer();
+
+  /// Starts reading a mapping
+  /// @param base   An address of the mapping
+  /// @param size   A size of the mapping in bytes
+  /// @param error   A reason of failure
+  /// @return true if the mapping holds a ring of a known version
+  bool Attach(void *base, std::size_t size, std::string *error);
+
+  /// Passes committed records to a callback and releases them
+  /// @param callback   Called with each record in order
+  /// @param max_records   A number of records to read at most
+  /// @return A number of records passed to \a callback
+  ///
+  /// Stops at the first record still being written. A record that cannot be
+  /// valid stops reading for good; see IsBroken().
+  std::size_t Poll(const std::function<void(const Record &)> &callback,
+                   std::size_t max_records = SIZE_MAX);
+
+  /// Returns a number of records the driver lost as the ring was full
+  std::uint64_t Dropped() const;
+
+  /// Returns an estimate of bytes written but not yet read
+  std::uint64_t Pending() const;
+
+  /// Tells whether a broken record was found
+  bool IsBroken() const { return broken_; }
+
+ private:
+  SharedRingHeader *header_;
+  std::uint8_t *data_;
+  std::uint64_t data_size_;
+  bool broken_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+/// Returns a message of a kSharedRingRecordLog record
+std::string LogMessage(const Record &record);
+
+/// Converts TSC ticks into microseconds
+/// @param header   A header page of the ring
+/// @param ticks   TSC ticks
+/// @return Microseconds, or ticks as nanoseconds if the frequency is unknown
+double TicksToMicroseconds(const SharedRingHeader &header, std::int64_t ticks);
+
+#if defined(_WIN32)
+/// Maps the ring into the current process through a handle of the device
+/// @param device   A handle of \\\\.\\HyperTool opened with write access
+/// @param mode   kSharedRingModeMirror or kSharedRingModeExclusive
+/// @param mapping   Receives an address and a size of the mapping
+/// @return true on success
+bool MapDeviceRing(void *device, unsigned int mode,
+                   SharedRingMapping *mapping);
+
+/// Unmaps the ring mapped through a handle of the device. Closing the handle
+/// also does it.
+/// @param device   A handle passed to MapDeviceRing()
+/// @return true on success
+bool UnmapDeviceRing(void *device);
+#endif
+
+}  // namespace ring_consumer
+
+#endif  // RING_CONSUMER_RING_CONSUMER_H_
@@ -0,0 +1,482 @@
+// Copyright (c) 2015-2019, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Reads a synthetic ring with Consumer and checks wrap-around, padding, a full
+/// ring and that tail is advanced only after a record is zeroed. Exits with
+/// non-zero on failure.
+///
+/// Records are reserved the same way as HyperPlatform/shared_ring.cpp does,
+/// in a data area small enough to wrap after a few records. The last test runs
+/// a producer on another thread, which checks that everything it reserves is
+/// already zeroed as the driver expects.
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ring_consumer.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+#define CHECK(expression)                                                   \
+  do {                                                                      \
+    if (!(expression)) {                                                    \
+      std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, \
+                   #expression);                                            \
+      ++g_failures;                                                         \
+    }                                                                       \
+  } while (false)
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// A type as TraceRecordType of the driver
+static const std::uint16_t kHook = 5;
+
+static const std::uint32_t kHeaderSize = sizeof(SharedRingHeader);
+static const std::uint32_t kDataSize = 256;
+
+// A record with a sequence number; 32 bytes after alignment
+static const std::uint32_t kRecordSize = 24;
+
+// A number of records written by the producer thread
+static const std::uint64_t kConcurrentRecords = 20000;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// A mapping of the ring and the driver side of it
+class Ring {
+ public:
+  Ring() : memory_(kHeaderSize + kDataSize), head_(0) {
+    std::memcpy(Header()->magic, kSharedRingMagic, sizeof(Header()->magic));
+    Header()->version = kSharedRingVersion;
+    Header()->header_size = kHeaderSize;
+    Header()->data_size = kDataSize;
+    Header()->tsc_frequency = 2000000;
+  }
+
+  SharedRingHeader *Header() {
+    return reinterpret_cast<SharedRingHeader *>(memory_.data());
+  }
+
+  std::uint8_t *Data() { return memory_.data() + kHeaderSize; }
+
+  void *Base() { return memory_.data(); }
+
+  std::size_t Size() const { return memory_.size(); }
+
+  // Reserves a record as SharedRingBegin() does. Sets dirty when the space
+  // reserved is not zeroed.
+  SharedRingRecordHeader *Begin(std::uint32_t size, bool *dirty = nullptr) {
+    size = (size + kSharedRingRecordAlignment - 1) &
+           ~(kSharedRingRecordAlignment - 1);
+    const auto offset = static_cast<std::uint32_t>(head_ & (kDataSize - 1));
+    const auto padding =
+        (offset + size > kDataSize) ? kDataSize - offset : 0;
+    const std::uint64_t tail = Header()->tail;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (tail > head_ || head_ + padding + size - tail > kDataSize) {
+      ++Header()->dropped;
+      return nullptr;
+    }
+    if (dirty) {
+      *dirty = !IsZero(offset, padding ? padding : size) ||
+               (padding && !IsZero(0, size));
+    }
+    head_ += padding + size;
+    Header()->head = head_;
+
+    if (padding) {
+      const auto pad =
+          reinterpret_cast<SharedRingRecordHeader *>(Data() + offset);
+      pad->size = static_cast<std::uint16_t>(padding);
+      std::atomic_thread_fence(std::memory_order_release);
+      pad->type = kSharedRingRecordPadding;
+    }
+    const auto record = reinterpret_cast<SharedRingRecordHeader *>(
+        Data() + (padding ? 0 : offset));
+    record->size = static_cast<std::uint16_t>(size);
+    record->processor = 1;
+    record->tsc = head_;
+    return record;
+  }
+
+  // Writes a committed record holding a sequence number
+  bool Write(std::uint64_t sequence) {
+    const auto record = Begin(kRecordSize);
+    if (!record) {
+      return false;
+    }
+    std::memcpy(record + 1, &sequence, sizeof(sequence));
+    record->type = kHook;
+    return true;
+  }
+
+  // Writes a committed record of a given size holding a sequence number, and
+  // tells whether it was written into zeroed space
+  bool Write(std::uint64_t sequence, std::uint32_t size, bool *dirty) {
+    const auto record = Begin(size, dirty);
+    if (!record) {
+      return false;
+    }
+    std::memcpy(record + 1, &sequence, sizeof(sequence));
+    std::atomic_thread_fence(std::memory_order_release);
+    record->type = kHook;
+    return true;
+  }
+
+  // Tells whether a range of the data area is all zero
+  bool IsZero(std::uint32_t offset, std::uint32_t size) {
+    for (auto i = offset; i < offset + size; ++i) {
+      if (Data()[i]) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+ private:
+  std::vector<std::uint8_t> memory_;
+  std::uint64_t head_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+static int g_failures = 0;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Returns a sequence number written by Ring::Write()
+static std::uint64_t Sequence(const ring_consumer::Record &record) {
+  std::uint64_t sequence = 0;
+  std::memcpy(&sequence, record.data + sizeof(SharedRingRecordHeader),
+              sizeof(sequence));
+  return sequence;
+}
+
+// Checks that a mapping holding no valid header is rejected
+static void TestAttach() {
+  std::string error;
+  {
+    Ring ring;
+    ring_consumer::Consumer consumer;
+    CHECK(consumer.Attach(ring.Base(), ring.Size(), &error));
+    CHECK(!consumer.Attach(ring.Base(), sizeof(SharedRingHeader) - 1, &error));
+  }
+  {
+    Ring ring;
+    ring.Header()->magic[0] = 'X';
+    ring_consumer::Consumer consumer;
+    CHECK(!consumer.Attach(ring.Base(), ring.Size(), &error));
+    CHECK(error == "not a shared ring");
+  }
+  {
+    Ring ring;
+    ring.Header()->version = kSharedRingVersion + 1;
+    ring_consumer::Consumer consumer;
+    CHECK(!consumer.Attach(ring.Base(), ring.Size(), &error));
+  }
+  {
+    Ring ring;
+    ring.Header()->data_size = kDataSize - kSharedRingRecordAlignment;
+    ring_consumer::Consumer consumer;
+    CHECK(!consumer.Attach(ring.Base(), ring.Size(), &error));
+    CHECK(error == "broken header");
+  }
+  {
+    Ring ring;
+    ring.Header()->data_size = kDataSize * 2;
+    ring_consumer::Consumer consumer;
+    CHECK(!consumer.Attach(ring.Base(), ring.Size(), &error));
+  }
+  {
+    ring_consumer::Consumer consumer;
+    CHECK(consumer.Poll([](const ring_consumer::Record &) {}) == 0);
+    CHECK(consumer.Dropped() == 0);
+    CHECK(consumer.Pending() == 0);
+  }
+}
+
+// Checks records are read in order and a record is zeroed before tail moves
+// past it
+static void TestReadAndRelease() {
+  Ring ring;
+  ring_consumer::Consumer consumer;
+  std::string error;
+  CHECK(consumer.Attach(ring.Base(), ring.Size(), &error));
+
+  for (std::uint64_t i = 0; i < 3; ++i) {
+    CHECK(ring.Write(i));
+  }
+  CHECK(consumer.Pending() == 3 * 32);
+
+  std::vector<std::uint64_t> sequences;
+  std::uint64_t expected_tail = 0;
+  const auto read = consumer.Poll([&](const ring_consumer::Record &record) {
+    // tail still covers the record being read, and earlier ones are zeroed
+    CHECK(ring.Header()->tail == expected_tail);
+    CHECK(ring.IsZero(0, static_cast<std::uint32_t>(expected_tail)));
+    CHECK(record.type == kHook);
+    CHECK(record.processor == 1);
+    CHECK(record.size == 32);
+    CHECK(record.data == ring.Data() + expected_tail);
+    sequences.push_back(Sequence(record));
+    expected_tail += record.size;
+  });
+  CHECK(read == 3);
+  CHECK((sequences == std::vector<std::uint64_t>{0, 1, 2}));
+  CHECK(ring.Header()->tail == 3 * 32);
+  CHECK(ring.IsZero(0, kDataSize));
+  CHECK(consumer.Pending() == 0);
+  CHECK(!consumer.IsBroken());
+
+  // max_records leaves the rest in the ring
+  CHECK(ring.Write(3));
+  CHECK(ring.Write(4));
+  CHECK(consumer.Poll([](const ring_consumer::Record &) {}, 1) == 1);
+  CHECK(ring.Header()->tail == 4 * 32);
+  CHECK(!ring.IsZero(4 * 32, 32));
+  CHECK(consumer.Poll([](const ring_consumer::Record &) {}) == 1);
+}
+
+// Checks reading stops at a record whose type is not stored yet
+static void TestUncommitted() {
+  Ring ring;
+  ring_consumer::Consumer consumer;
+  std::string error;
+  CHECK(consumer.Attach(ring.Base(), ring.Size(), &error));
+
+  CHECK(ring.Write(0));
+  const auto record = ring.Begin(kRecordSize);
+  CHECK(record != nullptr);
+  CHECK(ring.Write(2));
+
+  auto read = consumer.Poll([](const ring_consumer::Record &) {});
+  CHECK(read == 1);
+  CHECK(ring.Header()->tail == 32);
+  CHECK(!ring.IsZero(32, 64));
+
+  record->type = kHook;
+  read = consumer.Poll([](const ring_consumer::Record &) {});
+  CHECK(read == 2);
+  CHECK(ring.Header()->tail == 3 * 32);
+}
+
+// Checks a record that does not fit at the end of the data area follows a
+// padding record, which is skipped and released
+static void TestWrapAround() {
+  Ring ring;
+  ring_consumer::Consumer consumer;
+  std::string error;
+  CHECK(consumer.Attach(ring.Base(), ring.Size(), &error));
+
+  // 80 bytes each, leaving 16 bytes at the end after three records
+  const std::uint32_t size = 80;
+  for (auto i = 0; i < 3; ++i) {
+    const auto record = ring.Begin(size);
+    CHECK(record != nullptr);
+    record->type = kHook;
+  }
+  CHECK(consumer.Poll([](const ring_consumer::Record &) {}) == 3);
+  CHECK(ring.Header()->tail == 3 * size);
+
+  const auto record = ring.Begin(size);
+  CHECK(record != nullptr);
+  CHECK(reinterpret_cast<std::uint8_t *>(record) == ring.Data());
+  const auto pad =
+      reinterpret_cast<SharedRingRecordHeader *>(ring.Data() + 3 * size);
+  CHECK(pad->type == kSharedRingRecordPadding);
+  CHECK(pad->size == kDataSize - 3 * size);
+  CHECK(ring.Header()->head == kDataSize + size);
+
+  // The padding record is not passed to a callback even before the record
+  // after it is committed
+  auto read = consumer.Poll([](const ring_consumer::Record &) {});
+  CHECK(read == 0);
+  CHECK(ring.Header()->tail == kDataSize);
+  CHECK(ring.IsZero(3 * size, kDataSize - 3 * size));
+
+  record->type = kHook;
+  std::vector<const std::uint8_t *> addresses;
+  read = consumer.Poll([&](const ring_consumer::Record &record) {
+    CHECK(record.type == kHook);
+    addresses.push_back(record.data);
+  });
+  CHECK(read == 1);
+  CHECK(addresses.size() == 1 && addresses[0] == ring.Data());
+  CHECK(ring.Header()->tail == kDataSize + size);
+  CHECK(ring.IsZero(0, kDataSize));
+}
+
+// Checks the driver drops records once the ring is full and resumes after
+// the consumer releases records
+static void TestFull() {
+  Ring ring;
+  ring_consumer::Consumer consumer;
+  std::string error;
+  CHECK(consumer.Attach(ring.Base(), ring.Size(), &error));
+
+  std::uint64_t written = 0;
+  while (ring.Write(written)) {
+    ++written;
+  }
+  CHECK(written == kDataSize / 32);
+  CHECK(!ring.Write(written));
+  CHECK(consumer.Dropped() == 2);
+  CHECK(consumer.Pending() == kDataSize);
+
+  // One record released makes room for exactly one
+  CHECK(consumer.Poll([](const ring_consumer::Record &) {}, 1) == 1);
+  CHECK(ring.Write(written++));
+  CHECK(!ring.Write(written));
+  CHECK(consumer.Dropped() == 3);
+
+  std::vector<std::uint64_t> sequences;
+  const auto read = consumer.Poll([&](const ring_consumer::Record &record) {
+    sequences.push_back(Sequence(record));
+  });
+  CHECK(read == kDataSize / 32);
+  CHECK(sequences.size() == kDataSize / 32 && sequences.front() == 1 &&
+        sequences.back() == written - 1);
+  CHECK(ring.IsZero(0, kDataSize));
+
+  // A tail past head makes no sense and is treated as a full ring
+  ring.Header()->tail = ring.Header()->head + 32;
+  CHECK(!ring.Write(written));
+  CHECK(consumer.Dropped() == 4);
+}
+
+// Checks a record with an impossible size stops reading for good
+static void TestBroken() {
+  Ring ring;
+  ring_consumer::Consumer consumer;
+  std::string error;
+  CHECK(consumer.Attach(ring.Base(), ring.Size(), &error));
+
+  CHECK(ring.Write(0));
+  const auto record = ring.Begin(kRecordSize);
+  record->size = 40;  // Not aligned
+  record->type = kHook;
+  CHECK(ring.Write(2));
+
+  CHECK(consumer.Poll([](const ring_consumer::Record &) {}) == 1);
+  CHECK(consumer.IsBroken());
+  CHECK(ring.Header()->tail == 32);
+  CHECK(consumer.Poll([](const ring_consumer::Record &) {}) == 0);
+}
+
+// Checks a log message is read up to its terminator or the end of the record
+static void TestLogMessage() {
+  Ring ring;
+  ring_consumer::Consumer consumer;
+  std::string error;
+  CHECK(consumer.Attach(ring.Base(), ring.Size(), &error));
+
+  const char message[] = "hello\n";
+  auto record = ring.Begin(sizeof(SharedRingRecordHeader) + sizeof(message));
+  std::memcpy(record + 1, message, sizeof(message));
+  record->type = kSharedRingRecordLog;
+
+  // Not terminated; fills the record
+  record = ring.Begin(sizeof(SharedRingRecordHeader) + 16);
+  std::memset(record + 1, 'a', 16);
+  record->type = kSharedRingRecordLog;
+
+  std::vector<std::string> messages;
+  consumer.Poll([&](const ring_consumer::Record &record) {
+    messages.push_back(ring_consumer::LogMessage(record));
+  });
+  CHECK((messages == std::vector<std::string>{"hello\n", std::string(16, 'a')}));
+
+  CHECK(ring_consumer::TicksToMicroseconds(*ring.Header(), 3000) == 1500.0);
+  ring.Header()->tsc_frequency = 0;
+  CHECK(ring_consumer::TicksToMicroseconds(*ring.Header(), 3000) == 3.0);
+}
+
+// Checks a producer writing concurrently only ever reserves zeroed space and
+// every record is read once in order
+static void TestConcurrent() {
+  Ring ring;
+  ring_consumer::Consumer consumer;
+  std::string error;
+  CHECK(consumer.Attach(ring.Base(), ring.Size(), &error));
+
+  std::atomic<std::uint64_t> dirty_records(0);
+  std::atomic<bool> stop(false);
+  std::thread producer([&] {
+    for (std::uint64_t i = 0; i < kConcurrentRecords; ++i) {
+      // Sizes from 32 to 112 bytes, so records wrap at varying offsets
+      const auto size = 32 + static_cast<std::uint32_t>(i % 6) * 16;
+      bool dirty = false;
+      while (!ring.Write(i, size, &dirty)) {
+        if (stop) {
+          return;  // The consumer gave up
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(1));
+      }
+      if (dirty) {
+        ++dirty_records;
+      }
+    }
+  });
+
+  std::uint64_t next = 0;
+  std::uint64_t out_of_order = 0;
+  while (next < kConcurrentRecords && !consumer.IsBroken()) {
+    const auto read = consumer.Poll([&](const ring_consumer::Record &record) {
+      if (Sequence(record) != next) {
+        ++out_of_order;
+      }
+      ++next;
+    });
+    if (!read) {
+      std::this_thread::sleep_for(std::chrono::microseconds(1));
+    }
+  }
+  stop = true;
+  producer.join();
+
+  CHECK(next == kConcurrentRecords);
+  CHECK(out_of_order == 0);
+  CHECK(dirty_records == 0);
+  CHECK(!consumer.IsBroken());
+  CHECK(ring.IsZero(0, kDataSize));
+}
+
+int main() {
+  TestAttach();
+  TestReadAndRelease();
+  TestUncommitted();
+  TestWrapAround();
+  TestFull();
+  TestBroken();
+  TestLogMessage();
+  TestConcurrent();
+
+  if (g_failures) {
+    std::fprintf(stderr, "%d check(s) failed\n", g_failures);
+    return 1;
+  }
+  std::printf("All checks passed\n");
+  return 0;
+}
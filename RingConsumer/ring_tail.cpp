@@ -0,0 +1,77 @@
+// Copyright (c) 2015-2019, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements a command line tool printing what the driver writes into the
+/// shared ring until Ctrl+C is pressed. With --exclusive, the ring is mapped in
+/// kSharedRingModeExclusive.
+
+#include <windows.h>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include "ring_consumer.h"
+
+static volatile bool g_stop;
+
+static BOOL WINAPI ConsoleHandler(DWORD) {
+  g_stop = true;
+  return TRUE;
+}
+
+int main(int argc, char *argv[]) {
+  const auto mode = (argc > 1 && !std::strcmp(argv[1], "--exclusive"))
+                        ? kSharedRingModeExclusive
+                        : kSharedRingModeMirror;
+  const auto device =
+      CreateFileW(L"\\\\.\\HyperTool", GENERIC_READ | GENERIC_WRITE, 0,
+                  nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (device == INVALID_HANDLE_VALUE) {
+    std::fprintf(stderr, "Cannot open the device (%lu)\n", GetLastError());
+    return 1;
+  }
+
+  SharedRingMapping mapping = {};
+  if (!ring_consumer::MapDeviceRing(device, mode, &mapping)) {
+    std::fprintf(stderr, "Cannot map the ring (%lu)\n", GetLastError());
+    CloseHandle(device);
+    return 1;
+  }
+
+  ring_consumer::Consumer consumer;
+  std::string error;
+  if (!consumer.Attach(reinterpret_cast<void *>(mapping.address),
+                       static_cast<std::size_t>(mapping.size), &error)) {
+    std::fprintf(stderr, "%s\n", error.c_str());
+    CloseHandle(device);
+    return 1;
+  }
+
+  SetConsoleCtrlHandler(ConsoleHandler, TRUE);
+  std::map<std::uint16_t, std::uint64_t> counts;
+  while (!g_stop && !consumer.IsBroken()) {
+    const auto read = consumer.Poll([&](const ring_consumer::Record &record) {
+      if (record.type == kSharedRingRecordLog) {
+        std::fputs(ring_consumer::LogMessage(record).c_str(), stdout);
+      }
+      ++counts[record.type];
+    });
+    if (!read) {
+      Sleep(10);
+    }
+  }
+
+  for (const auto &count : counts) {
+    std::printf("type %u: %" PRIu64 " records\n", count.first, count.second);
+  }
+  std::printf("dropped: %" PRIu64 " records\n", consumer.Dropped());
+  if (consumer.IsBroken()) {
+    std::fprintf(stderr, "Found a broken record\n");
+  }
+
+  // Closing the handle unmaps the ring
+  CloseHandle(device);
+  return consumer.IsBroken() ? 1 : 0;
+}
@@ -0,0 +1,68 @@
+// Copyright (c) 2015-2019, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements a command line tool converting trace files.
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include "trace_decoder.h"
+
+static void Usage(const char *program) {
+  std::fprintf(stderr,
+               "Usage: %s <csv|chrome|summary> <HyperPlatform.trace> "
+               "[output]\n"
+               "  csv       one row per event\n"
+               "  chrome    Chrome trace event JSON; opens in Perfetto too\n"
+               "  summary   event counts and per-syscall latency\n",
+               program);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    Usage(argv[0]);
+    return 1;
+  }
+
+  std::ifstream input(argv[2], std::ios::binary);
+  if (!input) {
+    std::fprintf(stderr, "Cannot open %s\n", argv[2]);
+    return 1;
+  }
+  const std::vector<std::uint8_t> data(
+      (std::istreambuf_iterator<char>(input)),
+      std::istreambuf_iterator<char>());
+
+  trace_decoder::Trace trace;
+  std::string error;
+  if (!trace_decoder::Decode(data, &trace, &error)) {
+    std::fprintf(stderr, "%s: %s\n", argv[2], error.c_str());
+    return 1;
+  }
+
+  std::ofstream file;
+  if (argc > 3) {
+    file.open(argv[3], std::ios::binary);
+    if (!file) {
+      std::fprintf(stderr, "Cannot create %s\n", argv[3]);
+      return 1;
+    }
+  }
+  auto &out = (argc > 3) ? static_cast<std::ostream &>(file) : std::cout;
+
+  if (!std::strcmp(argv[1], "csv")) {
+    trace_decoder::WriteCsv(trace, out);
+  } else if (!std::strcmp(argv[1], "chrome")) {
+    trace_decoder::WriteChromeTrace(trace, out);
+  } else if (!std::strcmp(argv[1], "summary")) {
+    trace_decoder::WriteSummary(trace, out);
+  } else {
+    Usage(argv[0]);
+    return 1;
+  }
+  return 0;
+}
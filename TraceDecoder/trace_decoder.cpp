@@ -0,0 +1,494 @@
+// Copyright (c) 2015-2019, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements decoding and conversion of trace files.
+
+#include "trace_decoder.h"
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+namespace trace_decoder {
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// Used when a trace does not know its TSC frequency; shows ticks as ns
+static const double kDefaultTscFrequency = 1e9;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// Reads varints and strings out of a chunk payload
+class Reader {
+ public:
+  Reader(const std::uint8_t *data, std::size_t size)
+      : data_(data), size_(size), offset_(0), failed_(false) {}
+
+  std::uint64_t Varint() {
+    std::uint64_t value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+      if (offset_ >= size_) {
+        failed_ = true;
+        return 0;
+      }
+      const auto byte = data_[offset_++];
+      value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) {
+        return value;
+      }
+    }
+    failed_ = true;
+    return 0;
+  }
+
+  std::int64_t Zigzag() {
+    const auto value = Varint();
+    return static_cast<std::int64_t>(value >> 1) ^
+           -static_cast<std::int64_t>(value & 1);
+  }
+
+  std::string Bytes() {
+    const auto length = Varint();
+    if (failed_ || length > size_ - offset_) {
+      failed_ = true;
+      return std::string();
+    }
+    std::string bytes(reinterpret_cast<const char *>(data_ + offset_),
+                      static_cast<std::size_t>(length));
+    offset_ += static_cast<std::size_t>(length);
+    return bytes;
+  }
+
+  bool AtEnd() const { return offset_ >= size_; }
+  bool Failed() const { return failed_; }
+
+ private:
+  const std::uint8_t *data_;
+  std::size_t size_;
+  std::size_t offset_;
+  bool failed_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+static bool DecodeSchema(Reader *reader, Trace *trace);
+
+static bool DecodeSyscallNames(Reader *reader, Trace *trace);
+
+static bool DecodeEvents(Reader *reader, std::uint32_t processor,
+                         Trace *trace);
+
+static bool DecodeDropped(Reader *reader, std::uint32_t processor,
+                          Trace *trace);
+
+static std::string FormatValue(const Field &field, const Value &value);
+
+static void WriteJsonString(const std::string &string, std::ostream &out);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+bool Decode(const std::vector<std::uint8_t> &data, Trace *trace,
+            std::string *error) {
+  *trace = Trace();
+  if (data.size() < sizeof(TraceFileHeader)) {
+    *error = "The file is too small";
+    return false;
+  }
+  std::memcpy(&trace->header, data.data(), sizeof(TraceFileHeader));
+  if (std::memcmp(trace->header.magic, kTraceFileMagic,
+                  sizeof(kTraceFileMagic))) {
+    *error = "Not a trace file";
+    return false;
+  }
+  if (trace->header.version != kTraceFileVersion) {
+    *error = "Unsupported version " + std::to_string(trace->header.version);
+    return false;
+  }
+  if (trace->header.header_size < sizeof(TraceFileHeader) ||
+      trace->header.header_size > data.size()) {
+    *error = "A broken header";
+    return false;
+  }
+
+  Reader file(data.data() + trace->header.header_size,
+              data.size() - trace->header.header_size);
+  while (!file.AtEnd()) {
+    const auto type = file.Varint();
+    const auto processor = static_cast<std::uint32_t>(file.Varint());
+    const auto payload = file.Bytes();
+    if (file.Failed()) {
+      // A file cut while being written; keep what has been decoded
+      ++trace->skipped_chunks;
+      break;
+    }
+
+    Reader reader(reinterpret_cast<const std::uint8_t *>(payload.data()),
+                  payload.size());
+    bool decoded = true;
+    switch (type) {
+      case kTraceChunkSchema:
+        decoded = DecodeSchema(&reader, trace);
+        break;
+      case kTraceChunkEvents:
+        decoded = DecodeEvents(&reader, processor, trace);
+        break;
+      case kTraceChunkSyscallNames:
+        decoded = DecodeSyscallNames(&reader, trace);
+        break;
+      case kTraceChunkDropped:
+        decoded = DecodeDropped(&reader, processor, trace);
+        break;
+      default:
+        decoded = false;
+        break;
+    }
+    if (!decoded) {
+      ++trace->skipped_chunks;
+    }
+  }
+
+  std::stable_sort(trace->events.begin(), trace->events.end(),
+                   [](const Event &lhs, const Event &rhs) {
+                     return lhs.tsc < rhs.tsc;
+                   });
+  return true;
+}
+
+// Decodes kTraceChunkSchema
+static bool DecodeSchema(Reader *reader, Trace *trace) {
+  const auto count = reader->Varint();
+  for (std::uint64_t i = 0; i < count && !reader->Failed(); ++i) {
+    const auto type = static_cast<std::uint32_t>(reader->Varint());
+    EventType event_type;
+    event_type.name = reader->Bytes();
+    const auto field_count = reader->Varint();
+    for (std::uint64_t j = 0; j < field_count && !reader->Failed(); ++j) {
+      Field field;
+      field.name = reader->Bytes();
+      field.kind = static_cast<TraceFieldKind>(reader->Varint());
+      event_type.fields.push_back(field);
+    }
+    trace->types[type] = event_type;
+  }
+  return !reader->Failed();
+}
+
+// Decodes kTraceChunkSyscallNames
+static bool DecodeSyscallNames(Reader *reader, Trace *trace) {
+  const auto count = reader->Varint();
+  for (std::uint64_t i = 0; i < count && !reader->Failed(); ++i) {
+    const auto index = static_cast<std::uint32_t>(reader->Varint());
+    auto name = reader->Bytes();
+    if (!name.empty()) {
+      trace->syscall_names[index] = name;
+    }
+  }
+  return !reader->Failed();
+}
+
+// Decodes kTraceChunkEvents. Events before an unknown type are kept.
+static bool DecodeEvents(Reader *reader, std::uint32_t processor,
+                         Trace *trace) {
+  auto tsc = reader->Varint();
+  while (!reader->AtEnd() && !reader->Failed()) {
+    Event event = {};
+    event.type = static_cast<std::uint32_t>(reader->Varint());
+    tsc += static_cast<std::uint64_t>(reader->Zigzag());
+    event.tsc = tsc;
+    event.processor = processor;
+
+    const auto type = trace->types.find(event.type);
+    if (type == trace->types.end()) {
+      return false;  // Cannot know where the next event starts
+    }
+    for (const auto &field : type->second.fields) {
+      Value value = {};
+      switch (field.kind) {
+        case kTraceFieldUnsigned:
+        case kTraceFieldHex:
+          value.number = reader->Varint();
+          break;
+        case kTraceFieldSigned:
+          value.number = static_cast<std::uint64_t>(reader->Zigzag());
+          break;
+        case kTraceFieldString:
+        case kTraceFieldBytes:
+          value.bytes = reader->Bytes();
+          break;
+        default:
+          return false;
+      }
+      event.values.push_back(value);
+    }
+    if (reader->Failed()) {
+      return false;
+    }
+    trace->events.push_back(event);
+  }
+  return !reader->Failed();
+}
+
+// Decodes kTraceChunkDropped
+static bool DecodeDropped(Reader *reader, std::uint32_t processor,
+                          Trace *trace) {
+  Drop drop = {};
+  drop.chunk_type = static_cast<std::uint32_t>(reader->Varint());
+  drop.processor = processor;
+  drop.event_count = reader->Varint();
+  drop.tsc = reader->Varint();
+  if (reader->Failed()) {
+    return false;
+  }
+  trace->drops.push_back(drop);
+  return true;
+}
+
+int FindField(const Trace &trace, const Event &event, const char *name) {
+  const auto type = trace.types.find(event.type);
+  if (type == trace.types.end()) {
+    return -1;
+  }
+  const auto &fields = type->second.fields;
+  for (std::size_t i = 0; i < fields.size(); ++i) {
+    if (fields[i].name == name) {
+      return static_cast<int>(i);
+    }
+  }
+  return -1;
+}
+
+std::string SyscallName(const Trace &trace, const Event &event) {
+  const auto field = FindField(trace, event, "index");
+  if (field < 0) {
+    return std::string();
+  }
+  const auto index = static_cast<std::uint32_t>(event.values[field].number);
+  const auto name = trace.syscall_names.find(index);
+  if (name != trace.syscall_names.end()) {
+    return name->second;
+  }
+  char buffer[32];
+  std::snprintf(buffer, sizeof(buffer), "#%x", index);
+  return buffer;
+}
+
+double TicksToMicroseconds(const Trace &trace, std::int64_t ticks) {
+  const auto frequency = trace.header.tsc_frequency
+                             ? static_cast<double>(trace.header.tsc_frequency)
+                             : kDefaultTscFrequency;
+  return static_cast<double>(ticks) * 1e6 / frequency;
+}
+
+// Formats a value for CSV and JSON arguments
+static std::string FormatValue(const Field &field, const Value &value) {
+  char buffer[32];
+  switch (field.kind) {
+    case kTraceFieldUnsigned:
+      std::snprintf(buffer, sizeof(buffer), "%" PRIu64, value.number);
+      return buffer;
+    case kTraceFieldSigned:
+      std::snprintf(buffer, sizeof(buffer), "%" PRId64,
+                    static_cast<std::int64_t>(value.number));
+      return buffer;
+    case kTraceFieldHex:
+      std::snprintf(buffer, sizeof(buffer), "0x%" PRIx64, value.number);
+      return buffer;
+    case kTraceFieldString:
+      return value.bytes;
+    case kTraceFieldBytes: {
+      std::string hex;
+      for (const auto byte : value.bytes) {
+        std::snprintf(buffer, sizeof(buffer), "%02x",
+                      static_cast<std::uint8_t>(byte));
+        hex += buffer;
+      }
+      return hex;
+    }
+  }
+  return std::string();
+}
+
+void WriteCsv(const Trace &trace, std::ostream &out) {
+  out << "time_us,processor,event,syscall,fields\n";
+  for (const auto &event : trace.events) {
+    const auto &type = trace.types.at(event.type);
+    char time[32];
+    std::snprintf(time, sizeof(time), "%.3f",
+                  TicksToMicroseconds(trace, static_cast<std::int64_t>(
+                                                 event.tsc -
+                                                 trace.header.start_tsc)));
+    out << time << ',' << event.processor << ',' << type.name << ','
+        << SyscallName(trace, event) << ",\"";
+    for (std::size_t i = 0; i < type.fields.size(); ++i) {
+      // Values are hex, decimal or identifiers; quotes are the only escape
+      auto value = FormatValue(type.fields[i], event.values[i]);
+      std::replace(value.begin(), value.end(), '"', '\'');
+      out << (i ? " " : "") << type.fields[i].name << '=' << value;
+    }
+    out << "\"\n";
+  }
+}
+
+// Writes a string as a JSON string literal
+static void WriteJsonString(const std::string &string, std::ostream &out) {
+  out << '"';
+  for (const auto c : string) {
+    if (c == '"' || c == '\\') {
+      out << '\\' << c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char buffer[8];
+      std::snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+      out << buffer;
+    } else {
+      out << c;
+    }
+  }
+  out << '"';
+}
+
+void WriteChromeTrace(const Trace &trace, std::ostream &out) {
+  out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+  bool first = true;
+  for (const auto &event : trace.events) {
+    const auto &type = trace.types.at(event.type);
+    const auto process_id = FindField(trace, event, "process_id");
+    const auto thread_id = FindField(trace, event, "thread_id");
+    const auto duration = FindField(trace, event, "duration");
+
+    // A syscall exit becomes a complete event spanning from its entry, others
+    // are instant events. Events without a thread go to a per-CPU track.
+    auto start = static_cast<std::int64_t>(event.tsc - trace.header.start_tsc);
+    if (duration >= 0) {
+      start -= static_cast<std::int64_t>(event.values[duration].number);
+    }
+    auto name = SyscallName(trace, event);
+    if (name.empty()) {
+      name = type.name;
+    }
+
+    out << (first ? "\n" : ",\n") << "{\"name\":";
+    first = false;
+    WriteJsonString(name, out);
+    out << ",\"cat\":";
+    WriteJsonString(type.name, out);
+    if (duration >= 0) {
+      out << ",\"ph\":\"X\",\"dur\":"
+          << TicksToMicroseconds(trace, static_cast<std::int64_t>(
+                                            event.values[duration].number));
+    } else {
+      out << ",\"ph\":\"i\",\"s\":\"t\"";
+    }
+    out << ",\"ts\":" << TicksToMicroseconds(trace, start);
+    if (process_id >= 0 && thread_id >= 0) {
+      out << ",\"pid\":" << event.values[process_id].number
+          << ",\"tid\":" << event.values[thread_id].number;
+    } else {
+      out << ",\"pid\":0,\"tid\":" << event.processor;
+    }
+    out << ",\"args\":{\"cpu\":" << event.processor;
+    for (std::size_t i = 0; i < type.fields.size(); ++i) {
+      out << ',';
+      WriteJsonString(type.fields[i].name, out);
+      out << ':';
+      WriteJsonString(FormatValue(type.fields[i], event.values[i]), out);
+    }
+    out << "}}";
+  }
+  for (const auto &drop : trace.drops) {
+    if (!drop.tsc) {
+      continue;
+    }
+    out << (first ? "\n" : ",\n")
+        << "{\"name\":\"dropped\",\"cat\":\"dropped\",\"ph\":\"i\","
+           "\"s\":\"t\",\"ts\":"
+        << TicksToMicroseconds(trace, static_cast<std::int64_t>(
+                                          drop.tsc - trace.header.start_tsc))
+        << ",\"pid\":0,\"tid\":" << drop.processor
+        << ",\"args\":{\"cpu\":" << drop.processor
+        << ",\"events\":" << drop.event_count << "}}";
+    first = false;
+  }
+  out << "\n]}\n";
+}
+
+void WriteSummary(const Trace &trace, std::ostream &out) {
+  struct Latency {
+    std::uint64_t count;
+    std::uint64_t total;
+    std::uint64_t max;
+  };
+  std::map<std::uint32_t, std::uint64_t> counts;
+  std::map<std::string, Latency> latencies;
+  for (const auto &event : trace.events) {
+    ++counts[event.type];
+    const auto duration = FindField(trace, event, "duration");
+    if (duration < 0) {
+      continue;
+    }
+    auto &latency = latencies[SyscallName(trace, event)];
+    const auto ticks = event.values[duration].number;
+    ++latency.count;
+    latency.total += ticks;
+    latency.max = std::max(latency.max, ticks);
+  }
+
+  std::uint64_t dropped_events = 0;
+  for (const auto &drop : trace.drops) {
+    dropped_events += drop.event_count;
+  }
+
+  char line[160];
+  std::snprintf(line, sizeof(line),
+                "processors %u, TSC %" PRIu64 " Hz, skipped chunks %" PRIu64
+                "\ndropped chunks %zu, dropped events %" PRIu64 "\n\n",
+                trace.header.processor_count,
+                static_cast<std::uint64_t>(trace.header.tsc_frequency),
+                trace.skipped_chunks, trace.drops.size(), dropped_events);
+  out << line;
+  for (const auto &count : counts) {
+    std::snprintf(line, sizeof(line), "%-24s %12" PRIu64 "\n",
+                  trace.types.at(count.first).name.c_str(), count.second);
+    out << line;
+  }
+  if (latencies.empty()) {
+    return;
+  }
+
+  std::vector<std::pair<std::string, Latency>> sorted(latencies.begin(),
+                                                      latencies.end());
+  std::sort(sorted.begin(), sorted.end(),
+            [](const std::pair<std::string, Latency> &lhs,
+               const std::pair<std::string, Latency> &rhs) {
+              return lhs.second.total > rhs.second.total;
+            });
+  std::snprintf(line, sizeof(line), "\n%-48s %10s %12s %12s %12s\n", "syscall",
+                "count", "total(us)", "avg(us)", "max(us)");
+  out << line;
+  for (const auto &entry : sorted) {
+    const auto &latency = entry.second;
+    std::snprintf(
+        line, sizeof(line), "%-48s %10" PRIu64 " %12.1f %12.3f %12.3f\n",
+        entry.first.c_str(), latency.count,
+        TicksToMicroseconds(trace, static_cast<std::int64_t>(latency.total)),
+        TicksToMicroseconds(trace, static_cast<std::int64_t>(latency.total)) /
+            static_cast<double>(latency.count),
+        TicksToMicroseconds(trace, static_cast<std::int64_t>(latency.max)));
+    out << line;
+  }
+}
+
+}  // namespace trace_decoder
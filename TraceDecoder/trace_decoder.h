@@ -0,0 +1,107 @@
+// Copyright (c) 2015-2019, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Declares interfaces to decode trace files written by the driver.
+///
+/// The format is defined in HyperPlatform/trace_format.h.
+
+#ifndef TRACE_DECODER_TRACE_DECODER_H_
+#define TRACE_DECODER_TRACE_DECODER_H_
+
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "trace_format.h"
+
+namespace trace_decoder {
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+/// A field of an event type as described by kTraceChunkSchema
+struct Field {
+  std::string name;
+  TraceFieldKind kind;
+};
+
+/// An event type as described by kTraceChunkSchema
+struct EventType {
+  std::string name;
+  std::vector<Field> fields;
+};
+
+/// A decoded value of a field
+struct Value {
+  std::uint64_t number;  //!< Integer kinds; zigzag already decoded
+  std::string bytes;     //!< kTraceFieldString and kTraceFieldBytes
+};
+
+/// A decoded event
+struct Event {
+  std::uint32_t type;
+  std::uint32_t processor;
+  std::uint64_t tsc;
+  std::vector<Value> values;  //!< In order of EventType::fields
+};
+
+/// A chunk the driver could not store, as described by kTraceChunkDropped
+struct Drop {
+  std::uint32_t chunk_type;
+  std::uint32_t processor;
+  std::uint64_t event_count;
+  std::uint64_t tsc;  //!< TSC of the first lost event; 0 if unknown
+};
+
+/// A decoded trace file
+struct Trace {
+  TraceFileHeader header;
+  std::map<std::uint32_t, EventType> types;
+  std::map<std::uint32_t, std::string> syscall_names;
+  std::vector<Event> events;  //!< Sorted by TSC across processors
+  std::vector<Drop> drops;    //!< In order of the file
+  std::uint64_t skipped_chunks;  //!< Chunks that could not be decoded
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+/// Decodes a trace file image
+/// @param data   Contents of a trace file
+/// @param trace   A decoded trace
+/// @param error   A reason of failure
+/// @return true if the header is valid. Broken chunks are counted in
+///         Trace::skipped_chunks rather than failing the whole file.
+bool Decode(const std::vector<std::uint8_t> &data, Trace *trace,
+            std::string *error);
+
+/// Returns an index of a named field of an event, or -1 if none
+int FindField(const Trace &trace, const Event &event, const char *name);
+
+/// Returns a name of a syscall of an event, or an empty string if none
+std::string SyscallName(const Trace &trace, const Event &event);
+
+/// Converts TSC ticks relative to the start of the trace into microseconds
+double TicksToMicroseconds(const Trace &trace, std::int64_t ticks);
+
+/// Writes events as CSV, one row per event
+void WriteCsv(const Trace &trace, std::ostream &out);
+
+/// Writes events in the Chrome trace event format that Perfetto also reads.
+/// Lost chunks with a known TSC become "dropped" instant events.
+void WriteChromeTrace(const Trace &trace, std::ostream &out);
+
+/// Writes counts of events and lost events, and per-syscall latency
+/// statistics
+void WriteSummary(const Trace &trace, std::ostream &out);
+
+}  // namespace trace_decoder
+
+#endif  // TRACE_DECODER_TRACE_DECODER_H_
@@ -0,0 +1,415 @@
+// Copyright (c) 2015-2019, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Decodes a synthetic trace file and checks the decoded values and the CSV,
+/// summary and Chrome trace output. Exits with non-zero on failure.
+///
+/// The file is encoded the same way as HyperPlatform/trace_file.cpp does, with
+/// schemas of the driver's hook, syscall exit, VM-exit and EPT violation
+/// records and an extra type holding varint and zigzag edge values.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "trace_decoder.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+#define CHECK(expression)                                                   \
+  do {                                                                      \
+    if (!(expression)) {                                                    \
+      std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, \
+                   #expression);                                            \
+      ++g_failures;                                                         \
+    }                                                                       \
+  } while (false)
+
+#define CHECK_TEXT(actual, expected)                                       \
+  do {                                                                     \
+    const std::string actual_text = (actual);                              \
+    const std::string expected_text = (expected);                          \
+    if (actual_text != expected_text) {                                    \
+      std::fprintf(stderr, "%s:%d: unexpected output\n--- expected\n%s\n"  \
+                   "--- actual\n%s\n", __FILE__, __LINE__,                 \
+                   expected_text.c_str(), actual_text.c_str());            \
+      ++g_failures;                                                        \
+    }                                                                      \
+  } while (false)
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// Types as TraceRecordType of the driver, plus one only for the test
+static const std::uint32_t kSyscallExit = 2;
+static const std::uint32_t kHook = 5;
+static const std::uint32_t kVmExit = 6;
+static const std::uint32_t kEptViolation = 7;
+static const std::uint32_t kEdge = 100;
+
+static const std::uint64_t kStartTsc = 1000;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// Builds a payload or a file in the trace file encoding
+class Writer {
+ public:
+  void Varint(std::uint64_t value) {
+    do {
+      auto byte = static_cast<std::uint8_t>(value & 0x7f);
+      value >>= 7;
+      if (value) {
+        byte |= 0x80;
+      }
+      data_.push_back(byte);
+    } while (value);
+  }
+
+  void Zigzag(std::int64_t value) {
+    Varint((static_cast<std::uint64_t>(value) << 1) ^
+           static_cast<std::uint64_t>(value >> 63));
+  }
+
+  void String(const std::string &string) {
+    Varint(string.size());
+    Raw(string.data(), string.size());
+  }
+
+  void Raw(const void *data, std::size_t size) {
+    const auto bytes = static_cast<const std::uint8_t *>(data);
+    data_.insert(data_.end(), bytes, bytes + size);
+  }
+
+  void Chunk(TraceChunkType type, std::uint32_t processor,
+             const Writer &payload) {
+    Varint(type);
+    Varint(processor);
+    Varint(payload.data_.size());
+    Raw(payload.data_.data(), payload.data_.size());
+  }
+
+  const std::vector<std::uint8_t> &Data() const { return data_; }
+
+ private:
+  std::vector<std::uint8_t> data_;
+};
+
+struct FieldSpec {
+  const char *name;
+  TraceFieldKind kind;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+static int g_failures = 0;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Appends an event type to a schema payload
+template <std::size_t N>
+static void PutType(Writer *schema, std::uint32_t type, const char *name,
+                    const FieldSpec (&fields)[N]) {
+  schema->Varint(type);
+  schema->String(name);
+  schema->Varint(N);
+  for (const auto &field : fields) {
+    schema->String(field.name);
+    schema->Varint(field.kind);
+  }
+}
+
+// Encodes a trace with known events on two processors and a lost chunk
+static std::vector<std::uint8_t> BuildTrace() {
+  TraceFileHeader header = {};
+  std::memcpy(header.magic, kTraceFileMagic, sizeof(header.magic));
+  header.version = kTraceFileVersion;
+  header.header_size = sizeof(header);
+  header.processor_count = 2;
+  header.tsc_frequency = 1000000000;  // A tick is a nanosecond
+  header.start_tsc = kStartTsc;
+
+  Writer file;
+  file.Raw(&header, sizeof(header));
+
+  static const FieldSpec kSyscallExitFields[] = {
+      {"process_id", kTraceFieldUnsigned}, {"thread_id", kTraceFieldUnsigned},
+      {"index", kTraceFieldUnsigned},      {"status", kTraceFieldHex},
+      {"duration", kTraceFieldUnsigned},
+  };
+  static const FieldSpec kHookFields[] = {
+      {"process_id", kTraceFieldUnsigned},
+      {"thread_id", kTraceFieldUnsigned},
+      {"argument", kTraceFieldHex},
+      {"name", kTraceFieldString},
+  };
+  static const FieldSpec kVmExitFields[] = {
+      {"reason", kTraceFieldUnsigned},
+      {"guest_ip", kTraceFieldHex},
+      {"exit_qualification", kTraceFieldHex},
+  };
+  static const FieldSpec kEptViolationFields[] = {
+      {"guest_ip", kTraceFieldHex},
+      {"physical_address", kTraceFieldHex},
+      {"linear_address", kTraceFieldHex},
+      {"exit_qualification", kTraceFieldHex},
+  };
+  static const FieldSpec kEdgeFields[] = {
+      {"u0", kTraceFieldUnsigned},   {"u127", kTraceFieldUnsigned},
+      {"u128", kTraceFieldUnsigned}, {"umax", kTraceFieldUnsigned},
+      {"s0", kTraceFieldSigned},     {"smin", kTraceFieldSigned},
+      {"smax", kTraceFieldSigned},   {"data", kTraceFieldBytes},
+  };
+  Writer schema;
+  schema.Varint(5);
+  PutType(&schema, kSyscallExit, "syscall_exit", kSyscallExitFields);
+  PutType(&schema, kHook, "hook", kHookFields);
+  PutType(&schema, kVmExit, "vm_exit", kVmExitFields);
+  PutType(&schema, kEptViolation, "ept_violation", kEptViolationFields);
+  PutType(&schema, kEdge, "edge", kEdgeFields);
+  file.Chunk(kTraceChunkSchema, 0, schema);
+
+  Writer names;
+  names.Varint(1);
+  names.Varint(0x55);
+  names.String("NtCreateFile");
+  file.Chunk(kTraceChunkSyscallNames, 0, names);
+
+  // A hook entered at 3000 and the syscall returning at 5000
+  Writer cpu0;
+  cpu0.Varint(3000);
+  cpu0.Varint(kHook);
+  cpu0.Zigzag(0);
+  cpu0.Varint(4);
+  cpu0.Varint(8);
+  cpu0.Varint(0x1c);
+  cpu0.String("NtOpenProcess");
+  cpu0.Varint(kSyscallExit);
+  cpu0.Zigzag(2000);
+  cpu0.Varint(4);
+  cpu0.Varint(8);
+  cpu0.Varint(0x55);
+  cpu0.Varint(0xc0000022);
+  cpu0.Varint(1500);
+  file.Chunk(kTraceChunkEvents, 0, cpu0);
+
+  // A VM-exit at 4500, an EPT violation reserved earlier at 4400 and the edge
+  // values at 4600
+  Writer cpu1;
+  cpu1.Varint(4500);
+  cpu1.Varint(kVmExit);
+  cpu1.Zigzag(0);
+  cpu1.Varint(10);
+  cpu1.Varint(0xfffff80012345678);
+  cpu1.Varint(0);
+  cpu1.Varint(kEptViolation);
+  cpu1.Zigzag(-100);
+  cpu1.Varint(0xfffff80012345680);
+  cpu1.Varint(0x1000);
+  cpu1.Varint(0);
+  cpu1.Varint(0x181);
+  cpu1.Varint(kEdge);
+  cpu1.Zigzag(200);
+  cpu1.Varint(0);
+  cpu1.Varint(127);
+  cpu1.Varint(128);
+  cpu1.Varint(std::numeric_limits<std::uint64_t>::max());
+  cpu1.Zigzag(0);
+  cpu1.Zigzag(std::numeric_limits<std::int64_t>::min());
+  cpu1.Zigzag(std::numeric_limits<std::int64_t>::max());
+  cpu1.String(std::string("\x00\x7f\x80\xff", 4));
+  file.Chunk(kTraceChunkEvents, 1, cpu1);
+
+  // Three events lost from processor 1 from 6000
+  Writer dropped;
+  dropped.Varint(kTraceChunkEvents);
+  dropped.Varint(3);
+  dropped.Varint(6000);
+  file.Chunk(kTraceChunkDropped, 1, dropped);
+  return file.Data();
+}
+
+// Checks varint boundaries are encoded as the driver does
+static void TestVarintEncoding() {
+  Writer writer;
+  writer.Varint(0);
+  writer.Varint(127);
+  writer.Varint(128);
+  writer.Zigzag(-1);
+  writer.Zigzag(std::numeric_limits<std::int64_t>::min());
+  const std::vector<std::uint8_t> expected = {
+      0x00,                                            // 0
+      0x7f,                                            // 127
+      0x80, 0x01,                                      // 128
+      0x01,                                            // zigzag(-1)
+      0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,  // zigzag(INT64_MIN)
+      0xff, 0x01,
+  };
+  CHECK(writer.Data() == expected);
+}
+
+// Checks decoded events and values
+static void TestDecode(const trace_decoder::Trace &trace) {
+  CHECK(trace.skipped_chunks == 0);
+  CHECK(trace.types.size() == 5);
+  CHECK(trace.syscall_names.at(0x55) == "NtCreateFile");
+  CHECK(trace.events.size() == 5);
+  if (trace.events.size() != 5) {
+    return;
+  }
+
+  // Sorted by TSC across processors
+  const std::uint32_t types[] = {kHook, kEptViolation, kVmExit, kEdge,
+                                 kSyscallExit};
+  const std::uint64_t tscs[] = {3000, 4400, 4500, 4600, 5000};
+  for (std::size_t i = 0; i < trace.events.size(); ++i) {
+    CHECK(trace.events[i].type == types[i]);
+    CHECK(trace.events[i].tsc == tscs[i]);
+  }
+
+  const auto &edge = trace.events[3].values;
+  CHECK(edge.size() == 8);
+  if (edge.size() == 8) {
+    CHECK(edge[0].number == 0);
+    CHECK(edge[1].number == 127);
+    CHECK(edge[2].number == 128);
+    CHECK(edge[3].number == std::numeric_limits<std::uint64_t>::max());
+    CHECK(edge[4].number == 0);
+    CHECK(static_cast<std::int64_t>(edge[5].number) ==
+          std::numeric_limits<std::int64_t>::min());
+    CHECK(static_cast<std::int64_t>(edge[6].number) ==
+          std::numeric_limits<std::int64_t>::max());
+    CHECK(edge[7].bytes == std::string("\x00\x7f\x80\xff", 4));
+  }
+
+  CHECK(trace.drops.size() == 1);
+  if (trace.drops.size() == 1) {
+    CHECK(trace.drops[0].chunk_type == kTraceChunkEvents);
+    CHECK(trace.drops[0].processor == 1);
+    CHECK(trace.drops[0].event_count == 3);
+    CHECK(trace.drops[0].tsc == 6000);
+  }
+}
+
+// Checks CSV output
+static void TestCsv(const trace_decoder::Trace &trace) {
+  std::ostringstream out;
+  trace_decoder::WriteCsv(trace, out);
+  CHECK_TEXT(
+      out.str(),
+      "time_us,processor,event,syscall,fields\n"
+      "2.000,0,hook,,\"process_id=4 thread_id=8 argument=0x1c "
+      "name=NtOpenProcess\"\n"
+      "3.400,1,ept_violation,,\"guest_ip=0xfffff80012345680 "
+      "physical_address=0x1000 linear_address=0x0 exit_qualification=0x181\"\n"
+      "3.500,1,vm_exit,,\"reason=10 guest_ip=0xfffff80012345678 "
+      "exit_qualification=0x0\"\n"
+      "3.600,1,edge,,\"u0=0 u127=127 u128=128 umax=18446744073709551615 "
+      "s0=0 smin=-9223372036854775808 smax=9223372036854775807 "
+      "data=007f80ff\"\n"
+      "4.000,0,syscall_exit,NtCreateFile,\"process_id=4 thread_id=8 index=85 "
+      "status=0xc0000022 duration=1500\"\n");
+}
+
+// Checks summary output
+static void TestSummary(const trace_decoder::Trace &trace) {
+  std::ostringstream out;
+  trace_decoder::WriteSummary(trace, out);
+  CHECK_TEXT(
+      out.str(),
+      "processors 2, TSC 1000000000 Hz, skipped chunks 0\n"
+      "dropped chunks 1, dropped events 3\n"
+      "\n"
+      "syscall_exit                        1\n"
+      "hook                                1\n"
+      "vm_exit                             1\n"
+      "ept_violation                       1\n"
+      "edge                                1\n"
+      "\n"
+      "syscall                                               count    "
+      "total(us)      avg(us)      max(us)\n"
+      "NtCreateFile                                              1"
+      "          1.5        1.500        1.500\n");
+}
+
+// Checks Chrome trace output
+static void TestChromeTrace(const trace_decoder::Trace &trace) {
+  std::ostringstream out;
+  trace_decoder::WriteChromeTrace(trace, out);
+  CHECK_TEXT(
+      out.str(),
+      "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+      "{\"name\":\"hook\",\"cat\":\"hook\",\"ph\":\"i\",\"s\":\"t\","
+      "\"ts\":2,\"pid\":4,\"tid\":8,\"args\":{\"cpu\":0,"
+      "\"process_id\":\"4\",\"thread_id\":\"8\",\"argument\":\"0x1c\","
+      "\"name\":\"NtOpenProcess\"}},\n"
+      "{\"name\":\"ept_violation\",\"cat\":\"ept_violation\",\"ph\":\"i\","
+      "\"s\":\"t\",\"ts\":3.4,\"pid\":0,\"tid\":1,\"args\":{\"cpu\":1,"
+      "\"guest_ip\":\"0xfffff80012345680\",\"physical_address\":\"0x1000\","
+      "\"linear_address\":\"0x0\",\"exit_qualification\":\"0x181\"}},\n"
+      "{\"name\":\"vm_exit\",\"cat\":\"vm_exit\",\"ph\":\"i\",\"s\":\"t\","
+      "\"ts\":3.5,\"pid\":0,\"tid\":1,\"args\":{\"cpu\":1,\"reason\":\"10\","
+      "\"guest_ip\":\"0xfffff80012345678\",\"exit_qualification\":\"0x0\"}},\n"
+      "{\"name\":\"edge\",\"cat\":\"edge\",\"ph\":\"i\",\"s\":\"t\","
+      "\"ts\":3.6,\"pid\":0,\"tid\":1,\"args\":{\"cpu\":1,\"u0\":\"0\","
+      "\"u127\":\"127\",\"u128\":\"128\",\"umax\":\"18446744073709551615\","
+      "\"s0\":\"0\",\"smin\":\"-9223372036854775808\","
+      "\"smax\":\"9223372036854775807\",\"data\":\"007f80ff\"}},\n"
+      "{\"name\":\"NtCreateFile\",\"cat\":\"syscall_exit\",\"ph\":\"X\","
+      "\"dur\":1.5,\"ts\":2.5,\"pid\":4,\"tid\":8,\"args\":{\"cpu\":0,"
+      "\"process_id\":\"4\",\"thread_id\":\"8\",\"index\":\"85\","
+      "\"status\":\"0xc0000022\",\"duration\":\"1500\"}},\n"
+      "{\"name\":\"dropped\",\"cat\":\"dropped\",\"ph\":\"i\",\"s\":\"t\","
+      "\"ts\":5,\"pid\":0,\"tid\":1,\"args\":{\"cpu\":1,\"events\":3}}\n"
+      "]}\n");
+}
+
+// Checks a file cut in the middle of a chunk keeps earlier chunks
+static void TestTruncated(const std::vector<std::uint8_t> &data) {
+  const std::vector<std::uint8_t> cut(data.begin(), data.end() - 2);
+  trace_decoder::Trace trace;
+  std::string error;
+  CHECK(trace_decoder::Decode(cut, &trace, &error));
+  CHECK(trace.events.size() == 5);
+  CHECK(trace.drops.empty());
+  CHECK(trace.skipped_chunks == 1);
+}
+
+int main() {
+  TestVarintEncoding();
+
+  const auto data = BuildTrace();
+  trace_decoder::Trace trace;
+  std::string error;
+  CHECK(trace_decoder::Decode(data, &trace, &error));
+  TestDecode(trace);
+  TestCsv(trace);
+  TestSummary(trace);
+  TestChromeTrace(trace);
+  TestTruncated(data);
+
+  if (g_failures) {
+    std::fprintf(stderr, "%d check(s) failed\n", g_failures);
+    return 1;
+  }
+  std::printf("All checks passed\n");
+  return 0;
+}